@@ -37,7 +37,10 @@
 #include "spectrum.h"
 #include "scene.h"
 #include "film.h"
+#include "imageio.h"
+#include "lightdistrib.h"
 #include "medium.h"
+#include "memory.h"
 #include "stats.h"
 
 // API Additional Headers
@@ -58,7 +61,9 @@
 #include "integrators/ao.h"
 #include "integrators/path.h"
 #include "integrators/sppm.h"
+#include "integrators/vcm.h"
 #include "integrators/volpath.h"
+#include "integrators/vpl.h"
 #include "integrators/whitted.h"
 #include "lights/diffuse.h"
 #include "lights/distant.h"
@@ -178,6 +183,7 @@ struct RenderOptions {
     std::vector<std::shared_ptr<Primitive>> primitives;
     std::map<std::string, std::vector<std::shared_ptr<Primitive>>> instances;
     std::vector<std::shared_ptr<Primitive>> *currentInstance = nullptr;
+    int nextObjectID = 0;
     bool haveScatteringMedia = false;
 };
 
@@ -560,28 +566,43 @@ std::shared_ptr<Medium> MakeMedium(const std::string &name,
     if (name == "homogeneous") {
         m = new HomogeneousMedium(sig_a, sig_s, g);
     } else if (name == "heterogeneous") {
-        int nitems;
-        const Float *data = paramSet.FindFloat("density", &nitems);
-        if (!data) {
-            Error("No \"density\" values provided for heterogeneous medium?");
-            return NULL;
-        }
-        int nx = paramSet.FindOneInt("nx", 1);
-        int ny = paramSet.FindOneInt("ny", 1);
-        int nz = paramSet.FindOneInt("nz", 1);
         Point3f p0 = paramSet.FindOnePoint3f("p0", Point3f(0.f, 0.f, 0.f));
         Point3f p1 = paramSet.FindOnePoint3f("p1", Point3f(1.f, 1.f, 1.f));
-        if (nitems != nx * ny * nz) {
-            Error(
-                "GridDensityMedium has %d density values; expected nx*ny*nz = "
-                "%d",
-                nitems, nx * ny * nz);
-            return NULL;
-        }
+        int majorantRes = paramSet.FindOneInt("majorantres", 16);
         Transform data2Medium = Translate(Vector3f(p0)) *
                                 Scale(p1.x - p0.x, p1.y - p0.y, p1.z - p0.z);
-        m = new GridDensityMedium(sig_a, sig_s, g, nx, ny, nz,
-                                  medium2world * data2Medium, data);
+        std::string densityFile = paramSet.FindOneFilename("densityfile", "");
+        if (!densityFile.empty()) {
+            // Use sparse density data from _densityFile_
+            std::unique_ptr<const SparseVolume> volume =
+                SparseVolume::Read(densityFile);
+            if (!volume) return NULL;
+            m = new GridDensityMedium(sig_a, sig_s, g, std::move(volume),
+                                      medium2world * data2Medium,
+                                      std::max(1, majorantRes));
+        } else {
+            int nitems;
+            const Float *data = paramSet.FindFloat("density", &nitems);
+            if (!data) {
+                Error(
+                    "No \"density\" values provided for heterogeneous "
+                    "medium?");
+                return NULL;
+            }
+            int nx = paramSet.FindOneInt("nx", 1);
+            int ny = paramSet.FindOneInt("ny", 1);
+            int nz = paramSet.FindOneInt("nz", 1);
+            if (nitems != nx * ny * nz) {
+                Error(
+                    "GridDensityMedium has %d density values; expected "
+                    "nx*ny*nz = %d",
+                    nitems, nx * ny * nz);
+                return NULL;
+            }
+            m = new GridDensityMedium(sig_a, sig_s, g, nx, ny, nz,
+                                      medium2world * data2Medium, data,
+                                      std::max(1, majorantRes));
+        }
     } else
         Warning("Medium \"%s\" unknown.", name.c_str());
     paramSet.ReportUnused();
@@ -784,6 +805,7 @@ void pbrtInit(const Options &opt) {
     SampledSpectrum::Init();
     ParallelInit();  // Threads must be launched before the profiler is
                      // initialized.
+    ArenaPoolInit(PbrtOptions.hugePages);
     InitProfiler();
 }
 
@@ -794,7 +816,10 @@ void pbrtCleanup() {
     else if (currentApiState == APIState::WorldBlock)
         Error("pbrtCleanup() called while inside world block.");
     currentApiState = APIState::Uninitialized;
+    FlushImageWrites();
     ParallelCleanup();
+    ArenaPoolCleanup();
+    ClearLightSampleDistributionCache();
     renderOptions.reset(nullptr);
     CleanupProfiler();
 }
@@ -1231,6 +1256,7 @@ void pbrtShape(const std::string &name, const ParamSet &params) {
         std::shared_ptr<Material> mtl = graphicsState.CreateMaterial(params);
         params.ReportUnused();
         MediumInterface mi = graphicsState.CreateMediumInterface();
+        int objectID = renderOptions->nextObjectID++;
         for (auto s : shapes) {
             // Possibly create area light for shape
             std::shared_ptr<AreaLight> area;
@@ -1239,8 +1265,8 @@ void pbrtShape(const std::string &name, const ParamSet &params) {
                                      mi, graphicsState.areaLightParams, s);
                 if (area) areaLights.push_back(area);
             }
-            prims.push_back(
-                std::make_shared<GeometricPrimitive>(s, mtl, area, mi));
+            prims.push_back(std::make_shared<GeometricPrimitive>(
+                s, mtl, area, mi, objectID));
         }
     } else {
         // Initialize _prims_ and _areaLights_ for animated shape
@@ -1260,9 +1286,10 @@ void pbrtShape(const std::string &name, const ParamSet &params) {
         std::shared_ptr<Material> mtl = graphicsState.CreateMaterial(params);
         params.ReportUnused();
         MediumInterface mi = graphicsState.CreateMediumInterface();
+        int objectID = renderOptions->nextObjectID++;
         for (auto s : shapes)
-            prims.push_back(
-                std::make_shared<GeometricPrimitive>(s, mtl, nullptr, mi));
+            prims.push_back(std::make_shared<GeometricPrimitive>(
+                s, mtl, nullptr, mi, objectID));
 
         // Create single _TransformedPrimitive_ for _prims_
 
@@ -1512,13 +1539,17 @@ Integrator *RenderOptions::MakeIntegrator() const {
         integrator = CreateAOIntegrator(IntegratorParams, sampler, camera);
     } else if (IntegratorName == "sppm") {
         integrator = CreateSPPMIntegrator(IntegratorParams, camera);
+    } else if (IntegratorName == "vpl") {
+        integrator = CreateVPLIntegrator(IntegratorParams, sampler, camera);
+    } else if (IntegratorName == "vcm") {
+        integrator = CreateVCMIntegrator(IntegratorParams, sampler, camera);
     } else {
         Error("Integrator \"%s\" unknown.", IntegratorName.c_str());
         return nullptr;
     }
-
     if (renderOptions->haveScatteringMedia && IntegratorName != "volpath" &&
-        IntegratorName != "bdpt" && IntegratorName != "mlt") {
+        IntegratorName != "bdpt" && IntegratorName != "mlt" &&
+        IntegratorName != "vcm") {
         Warning(
             "Scene has scattering media but \"%s\" integrator doesn't support "
             "volume scattering. Consider using \"volpath\", \"bdpt\", or "
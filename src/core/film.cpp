@@ -35,22 +35,32 @@
 #include "film.h"
 #include "paramset.h"
 #include "imageio.h"
+#include "fileutil.h"
 #include "stats.h"
 
 namespace pbrt {
 
 STAT_MEMORY_COUNTER("Memory/Film pixels", filmPixelMemory);
+STAT_COUNTER("Film/Half pixel values clamped", halfPixelValuesClamped);
 
 // Film Method Definitions
 Film::Film(const Point2i &resolution, const Bounds2f &cropWindow,
            std::unique_ptr<Filter> filt, Float diagonal,
-           const std::string &filename, Float scale, Float maxSampleLuminance)
+           const std::string &filename, Float scale, Float maxSampleLuminance,
+           bool perThreadAccumulation, ImageCompression compression,
+           bool asyncWrite, int aovs, bool halfStorage)
     : fullResolution(resolution),
       diagonal(diagonal * .001),
       filter(std::move(filt)),
       filename(filename),
+      halfStorage(halfStorage),
+      splatXYZ(nullptr),
+      aovs(aovs),
       scale(scale),
-      maxSampleLuminance(maxSampleLuminance) {
+      maxSampleLuminance(maxSampleLuminance),
+      perThreadAccumulation(perThreadAccumulation),
+      compression(compression),
+      asyncWrite(asyncWrite) {
     // Compute film image bounds
     croppedPixelBounds =
         Bounds2i(Point2i(std::ceil(fullResolution.x * cropWindow.pMin.x),
@@ -62,8 +72,21 @@ Film::Film(const Point2i &resolution, const Bounds2f &cropWindow,
         croppedPixelBounds;
 
     // Allocate film image storage
-    pixels = std::unique_ptr<Pixel[]>(new Pixel[croppedPixelBounds.Area()]);
-    filmPixelMemory += croppedPixelBounds.Area() * sizeof(Pixel);
+    if (halfStorage) {
+        halfPixels.reset(new HalfPixel[croppedPixelBounds.Area()]);
+        filmPixelMemory += croppedPixelBounds.Area() * sizeof(HalfPixel);
+    } else {
+        pixels.reset(new Pixel[croppedPixelBounds.Area()]);
+        filmPixelMemory += croppedPixelBounds.Area() * sizeof(Pixel);
+    }
+    if (aovs) {
+        aovPixels.reset(new AOVPixel[croppedPixelBounds.Area()]);
+        filmPixelMemory += croppedPixelBounds.Area() * sizeof(AOVPixel);
+    }
+    if (perThreadAccumulation) {
+        threadTiles.resize(MaxThreadIndex());
+        threadSplatXYZ.resize(MaxThreadIndex());
+    }
 
     // Precompute filter weight table
     int offset = 0;
@@ -77,6 +100,17 @@ Film::Film(const Point2i &resolution, const Bounds2f &cropWindow,
     }
 }
 
+Film::~Film() { delete[] splatXYZ.load(); }
+
+uint16_t Film::ToHalfPixel(float v) {
+    const float maxHalf = 65504.f;
+    if (std::abs(v) > maxHalf) {
+        ++halfPixelValuesClamped;
+        v = Clamp(v, -maxHalf, maxHalf);
+    }
+    return FloatToHalf(v);
+}
+
 Bounds2i Film::GetSampleBounds() const {
     Bounds2f floatBounds(Floor(Point2f(croppedPixelBounds.pMin) +
                                Vector2f(0.5f, 0.5f) - filter->radius),
@@ -106,107 +140,409 @@ std::unique_ptr<FilmTile> Film::GetFilmTile(const Bounds2i &sampleBounds) {
 }
 
 void Film::Clear() {
-    for (Point2i p : croppedPixelBounds) {
-        Pixel &pixel = GetPixel(p);
-        for (int c = 0; c < 3; ++c)
-            pixel.splatXYZ[c] = pixel.xyz[c] = 0;
-        pixel.filterWeightSum = 0;
+    for (auto &tiles : threadTiles) tiles.clear();
+    for (auto &splats : threadSplatXYZ) splats.reset();
+    int nPixels = croppedPixelBounds.Area();
+    for (int i = 0; i < nPixels; ++i) {
+        if (halfStorage)
+            halfPixels[i] = HalfPixel();
+        else
+            pixels[i] = Pixel();
+    }
+    if (AtomicFloat *splats = splatXYZ.load())
+        for (int i = 0; i < 3 * nPixels; ++i) splats[i] = 0;
+    if (aovs) {
+        for (int i = 0; i < croppedPixelBounds.Area(); ++i)
+            aovPixels[i] = AOVPixel();
     }
 }
 
 void Film::MergeFilmTile(std::unique_ptr<FilmTile> tile) {
     ProfilePhase p(Prof::MergeFilmTile);
     VLOG(1) << "Merging film tile " << tile->pixelBounds;
+    if (perThreadAccumulation) {
+        // Defer the merge; each thread only touches its own tile list
+        threadTiles[ThreadIndex].push_back(std::move(tile));
+        return;
+    }
     std::lock_guard<std::mutex> lock(mutex);
     for (Point2i pixel : tile->GetPixelBounds()) {
         // Merge _pixel_ into _Film::pixels_
         const FilmTilePixel &tilePixel = tile->GetPixel(pixel);
-        Pixel &mergePixel = GetPixel(pixel);
         Float xyz[3];
         tilePixel.contribSum.ToXYZ(xyz);
-        for (int i = 0; i < 3; ++i) mergePixel.xyz[i] += xyz[i];
-        mergePixel.filterWeightSum += tilePixel.filterWeightSum;
+        AddToPixel(PixelOffset(pixel), xyz, tilePixel.filterWeightSum);
     }
 }
 
 void Film::SetImage(const Spectrum *img) const {
     int nPixels = croppedPixelBounds.Area();
+    AtomicFloat *splats = splatXYZ.load();
     for (int i = 0; i < nPixels; ++i) {
-        Pixel &p = pixels[i];
-        img[i].ToXYZ(p.xyz);
-        p.filterWeightSum = 1;
-        p.splatXYZ[0] = p.splatXYZ[1] = p.splatXYZ[2] = 0;
+        if (halfStorage) {
+            Float xyz[3];
+            img[i].ToXYZ(xyz);
+            for (int c = 0; c < 3; ++c)
+                halfPixels[i].xyz[c] = ToHalfPixel(xyz[c]);
+            halfPixels[i].filterWeightSum = 1;
+        } else {
+            img[i].ToXYZ(pixels[i].xyz);
+            pixels[i].filterWeightSum = 1;
+        }
+        if (splats) splats[3 * i] = splats[3 * i + 1] = splats[3 * i + 2] = 0;
     }
 }
 
-void Film::AddSplat(const Point2f &p, Spectrum v) {
-    ProfilePhase pp(Prof::SplatFilm);
+AtomicFloat *Film::GetSplatBuffer() {
+    AtomicFloat *splats = splatXYZ.load(std::memory_order_acquire);
+    if (!splats) {
+        std::lock_guard<std::mutex> lock(mutex);
+        splats = splatXYZ.load(std::memory_order_relaxed);
+        if (!splats) {
+            int nPixels = croppedPixelBounds.Area();
+            splats = new AtomicFloat[3 * nPixels];
+            filmPixelMemory += 3 * nPixels * sizeof(AtomicFloat);
+            splatXYZ.store(splats, std::memory_order_release);
+        }
+    }
+    return splats;
+}
 
+bool Film::SplatToXYZ(const Point2f &p, Spectrum v, Float xyz[3]) const {
     if (v.HasNaNs()) {
         LOG(ERROR) << StringPrintf("Ignoring splatted spectrum with NaN values "
                                    "at (%f, %f)", p.x, p.y);
-        return;
+        return false;
     } else if (v.y() < 0.) {
         LOG(ERROR) << StringPrintf("Ignoring splatted spectrum with negative "
                                    "luminance %f at (%f, %f)", v.y(), p.x, p.y);
-        return;
+        return false;
     } else if (std::isinf(v.y())) {
         LOG(ERROR) << StringPrintf("Ignoring splatted spectrum with infinite "
                                    "luminance at (%f, %f)", p.x, p.y);
-        return;
+        return false;
     }
 
-    if (!InsideExclusive((Point2i)p, croppedPixelBounds)) return;
+    if (!InsideExclusive((Point2i)p, croppedPixelBounds)) return false;
     if (v.y() > maxSampleLuminance)
         v *= maxSampleLuminance / v.y();
-    Float xyz[3];
     v.ToXYZ(xyz);
-    Pixel &pixel = GetPixel((Point2i)p);
-    for (int i = 0; i < 3; ++i) pixel.splatXYZ[i].Add(xyz[i]);
+    return true;
+}
+
+// Per-thread splat sums are kept with 32 fractional bits; values are
+// clamped so that the sum of many of them can't overflow.
+static PBRT_CONSTEXPR Float SplatFixedPointScale = 4294967296.f;
+
+static int64_t SplatToFixedPoint(Float v) {
+    const Float maxValue = 4611686018427387904.f;  // 2^62
+    return (int64_t)std::llround(
+        Clamp(v * SplatFixedPointScale, -maxValue, maxValue));
+}
+
+void Film::AccumulateSplat(int offset, const Float xyz[3]) {
+    if (perThreadAccumulation) {
+        // Accumulate into this thread's splat buffer without atomics
+        std::unique_ptr<int64_t[]> &splatXYZ = threadSplatXYZ[ThreadIndex];
+        if (!splatXYZ) {
+            int nPixels = croppedPixelBounds.Area();
+            splatXYZ.reset(new int64_t[3 * nPixels]());
+            filmPixelMemory += 3 * nPixels * sizeof(int64_t);
+        }
+        for (int i = 0; i < 3; ++i)
+            splatXYZ[3 * offset + i] += SplatToFixedPoint(xyz[i]);
+        return;
+    }
+    AtomicFloat *splats = GetSplatBuffer() + 3 * offset;
+    for (int i = 0; i < 3; ++i) splats[i].Add(xyz[i]);
+}
+
+void Film::AddSplat(const Point2f &p, Spectrum v) {
+    ProfilePhase pp(Prof::SplatFilm);
+    Float xyz[3];
+    if (!SplatToXYZ(p, v, xyz)) return;
+    AccumulateSplat(PixelOffset((Point2i)p), xyz);
+}
+
+void Film::AddSplats(std::vector<FilmSplat> &splats) {
+    ProfilePhase pp(Prof::SplatFilm);
+    // Sort the batch's splats by pixel and sum them, so that each pixel
+    // it touches is only updated once
+    struct PixelSplat {
+        int offset;
+        Float xyz[3];
+    };
+    std::vector<PixelSplat> pixelSplats;
+    pixelSplats.reserve(splats.size());
+    for (const FilmSplat &splat : splats) {
+        PixelSplat ps;
+        if (!SplatToXYZ(splat.p, splat.v, ps.xyz)) continue;
+        ps.offset = PixelOffset((Point2i)splat.p);
+        pixelSplats.push_back(ps);
+    }
+    splats.clear();
+    std::stable_sort(pixelSplats.begin(), pixelSplats.end(),
+                     [](const PixelSplat &a, const PixelSplat &b) {
+                         return a.offset < b.offset;
+                     });
+    for (size_t i = 0; i < pixelSplats.size();) {
+        Float xyz[3] = {0, 0, 0};
+        size_t j = i;
+        for (; j < pixelSplats.size() &&
+               pixelSplats[j].offset == pixelSplats[i].offset;
+             ++j)
+            for (int c = 0; c < 3; ++c) xyz[c] += pixelSplats[j].xyz[c];
+        AccumulateSplat(pixelSplats[i].offset, xyz);
+        i = j;
+    }
+}
+
+std::vector<Float> Film::GetSplatXYZ() {
+    if (perThreadAccumulation) ResolvePerThreadBuffers();
+    std::vector<Float> xyz(3 * croppedPixelBounds.Area(), Float(0));
+    if (AtomicFloat *splats = splatXYZ.load())
+        for (size_t i = 0; i < xyz.size(); ++i) xyz[i] = splats[i];
+    return xyz;
+}
+
+void Film::SetSplatXYZ(const std::vector<Float> &xyz) {
+    CHECK_EQ(xyz.size(), 3 * croppedPixelBounds.Area());
+    for (auto &splats : threadSplatXYZ) splats.reset();
+    AtomicFloat *splats = GetSplatBuffer();
+    for (size_t i = 0; i < xyz.size(); ++i) splats[i] = xyz[i];
+}
+
+void Film::MergeDeferredTiles() {
+    if (!perThreadAccumulation) return;
+    ProfilePhase p(Prof::MergeFilmTile);
+    // Gather the deferred tiles and sort them into the order in which a
+    // single thread would have rendered them; merging each pixel's
+    // contributions in that order makes the result independent of the
+    // number of threads and of how tiles were scheduled.  Callers merge
+    // after every pass, so the tiles of different passes never mix.
+    std::vector<std::unique_ptr<FilmTile>> tiles;
+    for (auto &threadTileList : threadTiles) {
+        for (auto &tile : threadTileList) tiles.push_back(std::move(tile));
+        threadTileList.clear();
+    }
+    if (tiles.empty()) return;
+    auto rowMajor = [](const Point2i &a, const Point2i &b) {
+        return a.y < b.y || (a.y == b.y && a.x < b.x);
+    };
+    std::sort(tiles.begin(), tiles.end(),
+              [&](const std::unique_ptr<FilmTile> &a,
+                  const std::unique_ptr<FilmTile> &b) {
+                  const Bounds2i &ba = a->pixelBounds, &bb = b->pixelBounds;
+                  if (ba.pMin != bb.pMin) return rowMajor(ba.pMin, bb.pMin);
+                  return rowMajor(ba.pMax, bb.pMax);
+              });
+
+    // Find the tiles that overlap each row of the image
+    int y0 = croppedPixelBounds.pMin.y;
+    int nRows = croppedPixelBounds.pMax.y - y0;
+    std::vector<std::vector<const FilmTile *>> rowTiles(std::max(0, nRows));
+    for (const auto &tile : tiles)
+        for (int y = tile->pixelBounds.pMin.y; y < tile->pixelBounds.pMax.y;
+             ++y)
+            rowTiles[y - y0].push_back(tile.get());
+
+    // Merge rows in parallel; each pixel is only written by one thread
+    ParallelFor([&](int64_t row) {
+        int y = y0 + (int)row;
+        for (const FilmTile *tile : rowTiles[row]) {
+            for (int x = tile->pixelBounds.pMin.x; x < tile->pixelBounds.pMax.x;
+                 ++x) {
+                Point2i pixel(x, y);
+                const FilmTilePixel &tilePixel = tile->GetPixel(pixel);
+                Float xyz[3];
+                tilePixel.contribSum.ToXYZ(xyz);
+                AddToPixel(PixelOffset(pixel), xyz,
+                           tilePixel.filterWeightSum);
+            }
+        }
+    }, nRows, 16);
+}
+
+void Film::ResolvePerThreadBuffers() {
+    MergeDeferredTiles();
+    AtomicFloat *splats = nullptr;
+    for (const auto &threadSplats : threadSplatXYZ)
+        if (threadSplats) splats = GetSplatBuffer();
+    if (!splats) return;
+
+    // Sum the threads' fixed-point splats, which is exact and thus
+    // independent of their order, and add the total to _splatXYZ_
+    ProfilePhase p(Prof::MergeFilmTile);
+    int nPixels = croppedPixelBounds.Area();
+    ParallelFor([&](int64_t offset) {
+        for (int i = 0; i < 3; ++i) {
+            int64_t sum = 0;
+            for (const auto &threadSplats : threadSplatXYZ)
+                if (threadSplats) sum += threadSplats[3 * offset + i];
+            if (sum != 0)
+                splats[3 * offset + i] = splats[3 * offset + i] +
+                                         Float(sum) / SplatFixedPointScale;
+        }
+    }, nPixels, 4096);
+    for (auto &threadSplats : threadSplatXYZ) threadSplats.reset();
+}
+
+void Film::AddAOVSample(const Point2i &pPixel, const AOVSample &aov) {
+    if (!InsideExclusive(pPixel, croppedPixelBounds)) return;
+    int width = croppedPixelBounds.pMax.x - croppedPixelBounds.pMin.x;
+    AOVPixel &pixel = aovPixels[(pPixel.x - croppedPixelBounds.pMin.x) +
+                                (pPixel.y - croppedPixelBounds.pMin.y) * width];
+    // The object ID can't be averaged; keep the one seen by the first sample
+    if (pixel.nSamples++ == 0) pixel.objectID = aov.objectID;
+    pixel.depthSum += aov.depth;
+    Float albedoRGB[3];
+    aov.albedo.ToRGB(albedoRGB);
+    for (int c = 0; c < 3; ++c) {
+        pixel.nSum[c] += aov.n[c];
+        pixel.albedoSum[c] += albedoRGB[c];
+        pixel.pSum[c] += aov.p[c];
+    }
+}
+
+void Film::EnableErrorEstimate() {
+    errorPixels.reset(new ErrorPixel[croppedPixelBounds.Area()]);
+}
+
+void Film::AddErrorSample(const Point2i &pPixel, const Spectrum &L) {
+    if (!InsideExclusive(pPixel, croppedPixelBounds)) return;
+    ErrorPixel &pixel = errorPixels[PixelOffset(pPixel)];
+    Float y = L.y();
+    Float delta = y - pixel.mean;
+    pixel.mean += delta / ++pixel.nSamples;
+    pixel.m2 += delta * (y - pixel.mean);
+}
+
+// Returns the standard error of the pixel's mean luminance relative to
+// the mean itself.  Means below 0.01 are clamped so that dark pixels can
+// converge too.  Pixels in the filter margin outside the image report the
+// error of the closest image pixel.
+Float Film::RelativeError(const Point2i &pPixel) const {
+    Point2i p(Clamp(pPixel.x, croppedPixelBounds.pMin.x,
+                    croppedPixelBounds.pMax.x - 1),
+              Clamp(pPixel.y, croppedPixelBounds.pMin.y,
+                    croppedPixelBounds.pMax.y - 1));
+    const ErrorPixel &pixel = errorPixels[PixelOffset(p)];
+    if (pixel.nSamples < 2) return Infinity;
+    Float variance = pixel.m2 / (pixel.nSamples - 1);
+    return std::sqrt(variance / pixel.nSamples) /
+           std::max(pixel.mean, (Float)0.01);
+}
+
+std::unique_ptr<Float[]> Film::InterleaveAOVs(
+    const Float *rgb, std::vector<std::string> *channelNames) const {
+    // Channels are written in _AOVType_ order after the beauty image
+    *channelNames = {"R", "G", "B"};
+    if (HasAOV(AOVType::Depth)) channelNames->push_back("Z");
+    if (HasAOV(AOVType::Normal))
+        for (const char *c : {"N.X", "N.Y", "N.Z"}) channelNames->push_back(c);
+    if (HasAOV(AOVType::Albedo))
+        for (const char *c : {"albedo.R", "albedo.G", "albedo.B"})
+            channelNames->push_back(c);
+    if (HasAOV(AOVType::Position))
+        for (const char *c : {"P.X", "P.Y", "P.Z"}) channelNames->push_back(c);
+    if (HasAOV(AOVType::ObjectID)) channelNames->push_back("objectID");
+
+    int nChannels = channelNames->size(), nPixels = croppedPixelBounds.Area();
+    std::unique_ptr<Float[]> data(new Float[nChannels * nPixels]);
+    for (int i = 0; i < nPixels; ++i) {
+        const AOVPixel &pixel = aovPixels[i];
+        Float invSamples = pixel.nSamples > 0 ? Float(1) / pixel.nSamples : 0;
+        Float *out = &data[nChannels * i];
+        for (int c = 0; c < 3; ++c) *out++ = rgb[3 * i + c];
+        if (HasAOV(AOVType::Depth)) *out++ = pixel.depthSum * invSamples;
+        if (HasAOV(AOVType::Normal)) {
+            Vector3f n(pixel.nSum[0], pixel.nSum[1], pixel.nSum[2]);
+            if (n.LengthSquared() > 0) n = Normalize(n);
+            for (int c = 0; c < 3; ++c) *out++ = n[c];
+        }
+        if (HasAOV(AOVType::Albedo))
+            for (int c = 0; c < 3; ++c)
+                *out++ = pixel.albedoSum[c] * invSamples;
+        if (HasAOV(AOVType::Position))
+            for (int c = 0; c < 3; ++c) *out++ = pixel.pSum[c] * invSamples;
+        if (HasAOV(AOVType::ObjectID)) *out++ = pixel.objectID;
+    }
+    return data;
+}
+
+void Film::GetPixelRGB(int offset, Float rgb[3]) const {
+    Float xyz[3], filterWeightSum;
+    if (halfStorage) {
+        // Half pixels are already normalized
+        const HalfPixel &pixel = halfPixels[offset];
+        for (int i = 0; i < 3; ++i) xyz[i] = HalfToFloat(pixel.xyz[i]);
+        filterWeightSum = pixel.filterWeightSum;
+        XYZToRGB(xyz, rgb);
+        if (filterWeightSum != 0)
+            for (int i = 0; i < 3; ++i) rgb[i] = std::max((Float)0, rgb[i]);
+        return;
+    }
+    const Pixel &pixel = pixels[offset];
+    XYZToRGB(pixel.xyz, rgb);
+
+    // Normalize pixel with weight sum
+    filterWeightSum = pixel.filterWeightSum;
+    if (filterWeightSum != 0) {
+        Float invWt = (Float)1 / filterWeightSum;
+        rgb[0] = std::max((Float)0, rgb[0] * invWt);
+        rgb[1] = std::max((Float)0, rgb[1] * invWt);
+        rgb[2] = std::max((Float)0, rgb[2] * invWt);
+    }
 }
 
 void Film::WriteImage(Float splatScale) {
+    if (perThreadAccumulation) ResolvePerThreadBuffers();
     // Convert image to RGB and compute final pixel values
     LOG(INFO) <<
         "Converting image to RGB and computing final weighted pixel values";
     std::unique_ptr<Float[]> rgb(new Float[3 * croppedPixelBounds.Area()]);
-    int offset = 0;
-    for (Point2i p : croppedPixelBounds) {
-        // Convert pixel XYZ color to RGB
-        Pixel &pixel = GetPixel(p);
-        XYZToRGB(pixel.xyz, &rgb[3 * offset]);
-
-        // Normalize pixel with weight sum
-        Float filterWeightSum = pixel.filterWeightSum;
-        if (filterWeightSum != 0) {
-            Float invWt = (Float)1 / filterWeightSum;
-            rgb[3 * offset] = std::max((Float)0, rgb[3 * offset] * invWt);
-            rgb[3 * offset + 1] =
-                std::max((Float)0, rgb[3 * offset + 1] * invWt);
-            rgb[3 * offset + 2] =
-                std::max((Float)0, rgb[3 * offset + 2] * invWt);
-        }
+    const AtomicFloat *splats = splatXYZ.load();
+    for (int offset = 0; offset < croppedPixelBounds.Area(); ++offset) {
+        // Convert pixel XYZ color to normalized RGB
+        GetPixelRGB(offset, &rgb[3 * offset]);
 
         // Add splat value at pixel
-        Float splatRGB[3];
-        Float splatXYZ[3] = {pixel.splatXYZ[0], pixel.splatXYZ[1],
-                             pixel.splatXYZ[2]};
-        XYZToRGB(splatXYZ, splatRGB);
-        rgb[3 * offset] += splatScale * splatRGB[0];
-        rgb[3 * offset + 1] += splatScale * splatRGB[1];
-        rgb[3 * offset + 2] += splatScale * splatRGB[2];
+        if (splats) {
+            Float splatRGB[3];
+            Float xyz[3] = {splats[3 * offset], splats[3 * offset + 1],
+                            splats[3 * offset + 2]};
+            XYZToRGB(xyz, splatRGB);
+            rgb[3 * offset] += splatScale * splatRGB[0];
+            rgb[3 * offset + 1] += splatScale * splatRGB[1];
+            rgb[3 * offset + 2] += splatScale * splatRGB[2];
+        }
 
         // Scale pixel value by _scale_
         rgb[3 * offset] *= scale;
         rgb[3 * offset + 1] *= scale;
         rgb[3 * offset + 2] *= scale;
-        ++offset;
     }
 
     // Write RGB image
     LOG(INFO) << "Writing image " << filename << " with bounds " <<
         croppedPixelBounds;
-    pbrt::WriteImage(filename, &rgb[0], croppedPixelBounds, fullResolution);
+    if (aovs) {
+        std::vector<std::string> channelNames;
+        std::unique_ptr<Float[]> data = InterleaveAOVs(rgb.get(), &channelNames);
+        if (asyncWrite)
+            pbrt::WriteImageAsync(filename, std::move(data),
+                                  croppedPixelBounds, fullResolution,
+                                  compression, std::move(channelNames));
+        else
+            pbrt::WriteImageChannels(filename, data.get(), channelNames,
+                                     croppedPixelBounds, fullResolution,
+                                     compression);
+    } else if (asyncWrite)
+        pbrt::WriteImageAsync(filename, std::move(rgb), croppedPixelBounds,
+                              fullResolution, compression);
+    else
+        pbrt::WriteImage(filename, &rgb[0], croppedPixelBounds, fullResolution,
+                         compression);
 }
 
 Film *CreateFilm(const ParamSet &params, std::unique_ptr<Filter> filter) {
@@ -244,8 +580,70 @@ Film *CreateFilm(const ParamSet &params, std::unique_ptr<Filter> filter) {
     Float diagonal = params.FindOneFloat("diagonal", 35.);
     Float maxSampleLuminance = params.FindOneFloat("maxsampleluminance",
                                                    Infinity);
+    std::string accumulation = params.FindOneString("accumulation", "shared");
+    if (accumulation != "shared" && accumulation != "perthread") {
+        Error("Film accumulation mode \"%s\" unknown. Using \"shared\".",
+              accumulation.c_str());
+        accumulation = "shared";
+    }
+    std::string compressionName = params.FindOneString("compression", "zip");
+    ImageCompression compression;
+    if (!ParseImageCompression(compressionName, &compression)) {
+        Error("Film compression \"%s\" unknown. Using \"zip\".",
+              compressionName.c_str());
+        compression = ImageCompression::ZIP;
+    }
+    bool asyncWrite = params.FindOneBool("asyncwrite", false);
+    std::string storage = params.FindOneString("storage", "float");
+    if (storage != "float" && storage != "half") {
+        Error("Film storage \"%s\" unknown. Using \"float\".",
+              storage.c_str());
+        storage = "float";
+    }
+    if (storage == "half") {
+        // Half pixels store a running weighted mean, which is unstable when
+        // filter weights can be negative and a pixel's weight sum
+        // approaches zero; check the points the filter table is built from
+        bool negativeLobes = false;
+        for (int y = 0; y < 16; ++y)
+            for (int x = 0; x < 16; ++x) {
+                Point2f p((x + 0.5f) * filter->radius.x / 16,
+                          (y + 0.5f) * filter->radius.y / 16);
+                if (filter->Evaluate(p) < 0) negativeLobes = true;
+            }
+        if (negativeLobes) {
+            Warning("Film storage \"half\" doesn't support filters with "
+                    "negative lobes. Using \"float\".");
+            storage = "float";
+        }
+    }
+
+    // Parse the auxiliary output channels requested for the film
+    int aovs = 0, nAOVs = 0;
+    const std::string *aovNames = params.FindString("aovs", &nAOVs);
+    for (int i = 0; i < nAOVs; ++i) {
+        if (aovNames[i] == "depth")
+            aovs |= AOVBit(AOVType::Depth);
+        else if (aovNames[i] == "normal")
+            aovs |= AOVBit(AOVType::Normal);
+        else if (aovNames[i] == "albedo")
+            aovs |= AOVBit(AOVType::Albedo);
+        else if (aovNames[i] == "position")
+            aovs |= AOVBit(AOVType::Position);
+        else if (aovNames[i] == "objectid")
+            aovs |= AOVBit(AOVType::ObjectID);
+        else
+            Error("Film AOV \"%s\" unknown. Ignoring.", aovNames[i].c_str());
+    }
+    if (aovs && !HasExtension(filename, ".exr")) {
+        Warning("AOVs can only be written to OpenEXR files; ignoring them "
+                "for \"%s\".", filename.c_str());
+        aovs = 0;
+    }
     return new Film(Point2i(xres, yres), crop, std::move(filter), diagonal,
-                    filename, scale, maxSampleLuminance);
+                    filename, scale, maxSampleLuminance,
+                    accumulation == "perthread", compression, asyncWrite,
+                    aovs, storage == "half");
 }
 
 }  // namespace pbrt
@@ -45,6 +45,7 @@
 #include "filter.h"
 #include "stats.h"
 #include "parallel.h"
+#include "imageio.h"
 
 namespace pbrt {
 
@@ -54,6 +55,26 @@ struct FilmTilePixel {
     Float filterWeightSum = 0.f;
 };
 
+// AOV Declarations
+enum class AOVType { Depth, Normal, Albedo, Position, ObjectID };
+inline int AOVBit(AOVType type) { return 1 << int(type); }
+
+// Auxiliary per-sample values recorded at the first camera ray hit
+struct AOVSample {
+    Float depth = 0;
+    Normal3f n;
+    Spectrum albedo = 0.f;
+    Point3f p;
+    int objectID = -1;
+};
+
+// Splat buffered by the caller and added to the film with a batch of
+// others by Film::AddSplats()
+struct FilmSplat {
+    Point2f p;
+    Spectrum v;
+};
+
 // Film Declarations
 class Film {
   public:
@@ -61,13 +82,27 @@ class Film {
     Film(const Point2i &resolution, const Bounds2f &cropWindow,
          std::unique_ptr<Filter> filter, Float diagonal,
          const std::string &filename, Float scale,
-         Float maxSampleLuminance = Infinity);
+         Float maxSampleLuminance = Infinity,
+         bool perThreadAccumulation = false,
+         ImageCompression compression = ImageCompression::ZIP,
+         bool asyncWrite = false, int aovs = 0, bool halfStorage = false);
+    ~Film();
     Bounds2i GetSampleBounds() const;
     Bounds2f GetPhysicalExtent() const;
     std::unique_ptr<FilmTile> GetFilmTile(const Bounds2i &sampleBounds);
     void MergeFilmTile(std::unique_ptr<FilmTile> tile);
+    void MergeDeferredTiles();
     void SetImage(const Spectrum *img) const;
     void AddSplat(const Point2f &p, Spectrum v);
+    void AddSplats(std::vector<FilmSplat> &splats);
+    std::vector<Float> GetSplatXYZ();
+    void SetSplatXYZ(const std::vector<Float> &xyz);
+    bool HasAOV(AOVType type) const { return (aovs & AOVBit(type)) != 0; }
+    bool HasAOVs() const { return aovs != 0; }
+    void AddAOVSample(const Point2i &pPixel, const AOVSample &aov);
+    void EnableErrorEstimate();
+    void AddErrorSample(const Point2i &pPixel, const Spectrum &L);
+    Float RelativeError(const Point2i &pPixel) const;
     void WriteImage(Float splatScale = 1);
     void Clear();
 
@@ -84,24 +119,97 @@ class Film {
         Pixel() { xyz[0] = xyz[1] = xyz[2] = filterWeightSum = 0; }
         Float xyz[3];
         Float filterWeightSum;
-        AtomicFloat splatXYZ[3];
-        Float pad;
     };
+    // Half-precision pixels store the filter-weighted mean rather than the
+    // weighted sum, which keeps values within the range of a half; tiles
+    // are still accumulated in full precision. CreateFilm() only uses them
+    // with filters that have no negative lobes.  Means are clamped to the
+    // largest finite half, 65504, so very bright pixels saturate rather
+    // than becoming infinite.  Since the mean only has 11 significant
+    // bits, a tile whose filter weight is less than about 1/2048 of the
+    // pixel's accumulated weight no longer changes it: half storage suits
+    // renders that merge up to a few hundred tiles into each pixel.
+    struct HalfPixel {
+        uint16_t xyz[3] = {0, 0, 0};
+        float filterWeightSum = 0;
+    };
+    const bool halfStorage;
     std::unique_ptr<Pixel[]> pixels;
+    std::unique_ptr<HalfPixel[]> halfPixels;
+    // Most integrators never splat, so splat storage (three _AtomicFloat_s
+    // per pixel) is only allocated by the first AddSplat() call.
+    std::atomic<AtomicFloat *> splatXYZ;
+    // AOVs are box filtered: each sample only contributes to the pixel it
+    // was taken in, so a pixel's entry is only ever updated by the thread
+    // rendering that pixel and needs no synchronization.
+    struct AOVPixel {
+        Float depthSum = 0;
+        Float nSum[3] = {0, 0, 0};
+        Float albedoSum[3] = {0, 0, 0};
+        Float pSum[3] = {0, 0, 0};
+        int nSamples = 0;
+        int objectID = -1;
+    };
+    const int aovs;
+    std::unique_ptr<AOVPixel[]> aovPixels;
+    // Integrators that stop at a target error keep the running mean and
+    // variance of each pixel's sample luminance here, using Welford's
+    // algorithm; as with AOVs, entries are updated without locking.
+    struct ErrorPixel {
+        Float mean = 0;
+        Float m2 = 0;
+        int nSamples = 0;
+    };
+    std::unique_ptr<ErrorPixel[]> errorPixels;
     static PBRT_CONSTEXPR int filterTableWidth = 16;
     Float filterTable[filterTableWidth * filterTableWidth];
     std::mutex mutex;
     const Float scale;
     const Float maxSampleLuminance;
+    // With per-thread accumulation, finished tiles and splats are kept in
+    // storage owned by the thread that produced them.  Tiles are merged
+    // into _pixels_ by MergeDeferredTiles(), which integrators call after
+    // each pass over the image, and splats by ResolvePerThreadBuffers().
+    // Splats are summed in 32.32 fixed point, so that their totals don't
+    // depend on which thread added them or in what order.
+    const bool perThreadAccumulation;
+    std::vector<std::vector<std::unique_ptr<FilmTile>>> threadTiles;
+    std::vector<std::unique_ptr<int64_t[]>> threadSplatXYZ;
+    const ImageCompression compression;
+    const bool asyncWrite;
 
     // Film Private Methods
-    Pixel &GetPixel(const Point2i &p) {
+    void ResolvePerThreadBuffers();
+    int PixelOffset(const Point2i &p) const {
         CHECK(InsideExclusive(p, croppedPixelBounds));
         int width = croppedPixelBounds.pMax.x - croppedPixelBounds.pMin.x;
-        int offset = (p.x - croppedPixelBounds.pMin.x) +
-                     (p.y - croppedPixelBounds.pMin.y) * width;
-        return pixels[offset];
+        return (p.x - croppedPixelBounds.pMin.x) +
+               (p.y - croppedPixelBounds.pMin.y) * width;
+    }
+    void AddToPixel(int offset, const Float xyz[3], Float filterWeightSum) {
+        if (!halfStorage) {
+            Pixel &pixel = pixels[offset];
+            for (int i = 0; i < 3; ++i) pixel.xyz[i] += xyz[i];
+            pixel.filterWeightSum += filterWeightSum;
+            return;
+        }
+        HalfPixel &pixel = halfPixels[offset];
+        float oldWeight = pixel.filterWeightSum;
+        float newWeight = oldWeight + filterWeightSum;
+        for (int i = 0; i < 3; ++i) {
+            float mean = HalfToFloat(pixel.xyz[i]);
+            float sum = mean * oldWeight + xyz[i];
+            pixel.xyz[i] = ToHalfPixel(newWeight != 0 ? sum / newWeight : 0);
+        }
+        pixel.filterWeightSum = newWeight;
     }
+    static uint16_t ToHalfPixel(float v);
+    void GetPixelRGB(int offset, Float rgb[3]) const;
+    AtomicFloat *GetSplatBuffer();
+    bool SplatToXYZ(const Point2f &p, Spectrum v, Float xyz[3]) const;
+    void AccumulateSplat(int offset, const Float xyz[3]);
+    std::unique_ptr<Float[]> InterleaveAOVs(
+        const Float *rgb, std::vector<std::string> *channelNames) const;
 };
 
 class FilmTile {
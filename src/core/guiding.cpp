@@ -0,0 +1,347 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+
+// core/guiding.cpp*
+#include "guiding.h"
+#include "camera.h"
+#include "film.h"
+#include "integrator.h"
+#include "interaction.h"
+#include "progressreporter.h"
+#include "rng.h"
+#include "stats.h"
+#include "samplers/random.h"
+
+namespace pbrt {
+
+STAT_INT_DISTRIBUTION("Path guiding/Directional tree nodes per leaf",
+                      directionalNodes);
+STAT_COUNTER("Path guiding/Spatial tree leaves", spatialLeaves);
+
+// Path Guiding Utility Functions
+static Point2f DirectionToCanonical(const Vector3f &w) {
+    Float cosTheta = Clamp(w.z, -1, 1);
+    Float phi = std::atan2(w.y, w.x);
+    if (phi < 0) phi += 2 * Pi;
+    return Point2f(std::min((cosTheta + 1) / 2, OneMinusEpsilon),
+                   std::min(phi * Inv2Pi, OneMinusEpsilon));
+}
+
+static Vector3f CanonicalToDirection(const Point2f &p) {
+    Float cosTheta = 2 * p.x - 1, phi = 2 * Pi * p.y;
+    Float sinTheta = std::sqrt(std::max((Float)0, 1 - cosTheta * cosTheta));
+    return Vector3f(sinTheta * std::cos(phi), sinTheta * std::sin(phi),
+                    cosTheta);
+}
+
+// Returns the quadrant of _p_ and maps _p_ to the quadrant's [0,1]^2
+static int ChildQuadrant(Point2f *p) {
+    int qx = p->x >= .5f, qy = p->y >= .5f;
+    *p = Point2f(std::min(2 * p->x - qx, OneMinusEpsilon),
+                 std::min(2 * p->y - qy, OneMinusEpsilon));
+    return qx + 2 * qy;
+}
+
+// DirectionalTree Method Definitions
+DirectionalTree::DirectionalTree(const DirectionalTree &t)
+    : nodes(t.nodes), nSamples(int(t.nSamples)) {}
+
+DirectionalTree &DirectionalTree::operator=(const DirectionalTree &t) {
+    nodes = t.nodes;
+    nSamples = int(t.nSamples);
+    return *this;
+}
+
+void DirectionalTree::Record(const Vector3f &w, Float radiance) {
+    ++nSamples;
+    if (!(radiance > 0)) return;
+    Point2f p = DirectionToCanonical(w);
+    int index = 0;
+    while (true) {
+        Node &node = nodes[index];
+        int q = ChildQuadrant(&p);
+        node.sum[q].Add(radiance);
+        if (!node.child[q]) return;
+        index = node.child[q];
+    }
+}
+
+Vector3f DirectionalTree::Sample(Point2f u) const {
+    Point2f origin(0, 0);
+    Float size = 1;
+    int index = 0;
+    while (true) {
+        const Node &node = nodes[index];
+        Float sum[4];
+        for (int q = 0; q < 4; ++q) sum[q] = node.sum[q];
+        Float left = sum[0] + sum[2], right = sum[1] + sum[3];
+        if (!(left + right > 0)) break;
+        // Choose a column of quadrants and then a quadrant within it,
+        // remapping _u_ for reuse; quadrants without radiance are never
+        // chosen, even with round-off error
+        int qx = (right == 0 || (left > 0 && u.x * (left + right) < left))
+                     ? 0 : 1;
+        u.x = qx == 0 ? u.x * (left + right) / left
+                      : (u.x * (left + right) - left) / right;
+        Float bottom = sum[qx], top = sum[qx + 2];
+        int qy = (top == 0 || (bottom > 0 && u.y * (bottom + top) < bottom))
+                     ? 0 : 1;
+        u.y = qy == 0 ? u.y * (bottom + top) / bottom
+                      : (u.y * (bottom + top) - bottom) / top;
+        u = Point2f(Clamp(u.x, 0, OneMinusEpsilon),
+                    Clamp(u.y, 0, OneMinusEpsilon));
+
+        size /= 2;
+        origin += Vector2f(qx * size, qy * size);
+        int q = qx + 2 * qy;
+        if (!node.child[q]) break;
+        index = node.child[q];
+    }
+    return CanonicalToDirection(origin + Vector2f(size * u.x, size * u.y));
+}
+
+Float DirectionalTree::Pdf(const Vector3f &w) const {
+    Point2f p = DirectionToCanonical(w);
+    // The parameterization is equal-area, so densities over [0,1]^2 are
+    // converted to solid angle by dividing by the sphere's area
+    Float pdf = Inv4Pi;
+    int index = 0;
+    while (true) {
+        const Node &node = nodes[index];
+        Float total = node.Total();
+        if (!(total > 0)) break;
+        int q = ChildQuadrant(&p);
+        pdf *= 4 * node.sum[q] / total;
+        if (!node.child[q]) break;
+        index = node.child[q];
+    }
+    return pdf;
+}
+
+void DirectionalTree::Refine(Float threshold, int maxDepth) {
+    Float total = nodes[0].Total();
+    if (total > 0) {
+        std::vector<Node> refined(1);
+        Float flux[4];
+        for (int q = 0; q < 4; ++q) flux[q] = nodes[0].sum[q];
+        Subdivide(0, &nodes[0], flux, total, threshold, 1, maxDepth,
+                  &refined);
+        nodes.swap(refined);
+    } else
+        // Nothing was recorded; keep the current structure
+        for (Node &node : nodes)
+            for (int q = 0; q < 4; ++q) node.sum[q] = 0;
+    nSamples = 0;
+}
+
+// Adds children to node _index_ of _refined_ for the quadrants that
+// received more than _threshold_ of the _total_ radiance; _old_ is the
+// node covering the same region in the current tree, if there is one.
+void DirectionalTree::Subdivide(int index, const Node *old,
+                                const Float flux[4], Float total,
+                                Float threshold, int depth, int maxDepth,
+                                std::vector<Node> *refined) const {
+    if (depth >= maxDepth) return;
+    for (int q = 0; q < 4; ++q) {
+        if (flux[q] <= threshold * total) continue;
+        // Distribute the quadrant's radiance over its children, evenly if
+        // the current tree has no finer records
+        const Node *oldChild =
+            (old && old->child[q]) ? &nodes[old->child[q]] : nullptr;
+        Float childFlux[4];
+        for (int c = 0; c < 4; ++c)
+            childFlux[c] = oldChild ? Float(oldChild->sum[c]) : flux[q] / 4;
+        int child = refined->size();
+        refined->push_back(Node());
+        (*refined)[index].child[q] = child;
+        Subdivide(child, oldChild, childFlux, total, threshold, depth + 1,
+                  maxDepth, refined);
+    }
+}
+
+// PathGuide Method Definitions
+PathGuide::PathGuide(const Bounds3f &b, Float bsdfSamplingFraction)
+    : bsdfSamplingFraction(bsdfSamplingFraction), nodes(1) {
+    // Use a cube around the scene, so that the spatial tree's cells stay
+    // close to cubical as they are halved along each axis in turn
+    Vector3f d = b.Diagonal();
+    Float size = std::max(d.x, std::max(d.y, d.z));
+    bounds = Bounds3f(b.pMin, b.pMin + Vector3f(size, size, size));
+}
+
+int PathGuide::Lookup(const Point3f &pWorld) const {
+    Vector3f p = bounds.Offset(pWorld);
+    int index = 0;
+    while (nodes[index].children) {
+        int axis = nodes[index].axis;
+        if (p[axis] < .5f) {
+            p[axis] = 2 * p[axis];
+            index = nodes[index].children;
+        } else {
+            p[axis] = 2 * p[axis] - 1;
+            index = nodes[index].children + 1;
+        }
+    }
+    return index;
+}
+
+void PathGuide::Record(const Point3f &p, const Vector3f &wi, Float radiance) {
+    nodes[Lookup(p)].building.Record(wi, radiance);
+}
+
+void PathGuide::EndPass() {
+    recording = false;
+    // Split the spatial leaves that received enough samples; the number
+    // needed grows with the square root of each pass's sample count,
+    // which doubles every pass
+    int splitThreshold = int(12000 * std::sqrt(Float(1 << nPasses)));
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (nodes[i].children ||
+            nodes[i].building.NumSamples() <= splitThreshold)
+            continue;
+        // Children are visited later in this loop, so they are split
+        // further if they still hold too many samples
+        SpatialNode child;
+        child.axis = (nodes[i].axis + 1) % 3;
+        child.building = nodes[i].building;
+        child.building.ScaleNumSamples(.5f);
+        nodes[i].children = nodes.size();
+        nodes[i].sampling = nodes[i].building = DirectionalTree();
+        nodes.push_back(child);
+        nodes.push_back(child);
+    }
+
+    // Sample from this pass's records and refine the directional trees
+    // for the next pass
+    std::vector<int> leaves;
+    for (size_t i = 0; i < nodes.size(); ++i)
+        if (!nodes[i].children) leaves.push_back(i);
+    ParallelFor([&](int64_t i) {
+        SpatialNode &node = nodes[leaves[i]];
+        node.sampling = node.building;
+        node.building.Refine(.01f, 20);
+        ReportValue(directionalNodes, node.sampling.NumNodes());
+    }, leaves.size());
+    spatialLeaves += leaves.size();
+    ++nPasses;
+}
+
+Spectrum PathGuide::Sample_f(const SurfaceInteraction &isect,
+                             const Vector3f &wo, Vector3f *wi, Point2f u,
+                             Float *pdf, BxDFType *sampledType) const {
+    const BSDF &bsdf = *isect.bsdf;
+    if (nPasses == 0 ||
+        bsdf.NumComponents(BxDFType(BSDF_SPECULAR | BSDF_REFLECTION |
+                                    BSDF_TRANSMISSION)) > 0)
+        return bsdf.Sample_f(wo, wi, u, pdf, BSDF_ALL, sampledType);
+
+    // Pick a strategy with _u[0]_, then reuse it for sampling
+    const DirectionalTree &tree = nodes[Lookup(isect.p)].sampling;
+    Spectrum f;
+    if (u[0] < bsdfSamplingFraction) {
+        u[0] = std::min(u[0] / bsdfSamplingFraction, OneMinusEpsilon);
+        f = bsdf.Sample_f(wo, wi, u, pdf, BSDF_ALL, sampledType);
+        if (f.IsBlack() || *pdf == 0) return f;
+    } else {
+        u[0] = std::min((u[0] - bsdfSamplingFraction) /
+                            (1 - bsdfSamplingFraction),
+                        OneMinusEpsilon);
+        *wi = tree.Sample(u);
+        f = bsdf.f(wo, *wi);
+        *pdf = bsdf.Pdf(wo, *wi);
+        bool reflect = Dot(*wi, isect.n) * Dot(wo, isect.n) > 0;
+        *sampledType = BxDFType(
+            BSDF_GLOSSY | (reflect ? BSDF_REFLECTION : BSDF_TRANSMISSION));
+    }
+    // Return the pdf of the one-sample mixture of both strategies
+    *pdf = bsdfSamplingFraction * *pdf +
+           (1 - bsdfSamplingFraction) * tree.Pdf(*wi);
+    return f;
+}
+
+// GuidedPathRecorder Method Definitions
+void GuidedPathRecorder::Finish(const Spectrum &L) {
+    for (int i = 0; i < nVertices; ++i) {
+        // Estimate the radiance that arrived along the vertex's outgoing
+        // direction from the radiance gathered after it
+        const Vertex &v = vertices[i];
+        Spectrum Li(0.f);
+        for (int c = 0; c < Spectrum::nSamples; ++c)
+            if (v.beta[c] > 0) Li[c] = (L[c] - v.L[c]) / v.beta[c];
+        guide->Record(v.p, v.wi, Li.y() / v.pdf);
+    }
+}
+
+// Path Guiding Function Definitions
+void TrainPathGuide(const SamplerIntegrator &integrator, const Scene &scene,
+                    const Camera &camera, PathGuide *guide, int nPasses) {
+    Bounds2i sampleBounds = camera.film->GetSampleBounds();
+    Vector2i sampleExtent = sampleBounds.Diagonal();
+    const int tileSize = 16;
+    Point2i nTiles((sampleExtent.x + tileSize - 1) / tileSize,
+                   (sampleExtent.y + tileSize - 1) / tileSize);
+    ProgressReporter reporter(nPasses * nTiles.x * nTiles.y,
+                              "Training path guide");
+    for (int pass = 0; pass < nPasses; ++pass) {
+        guide->BeginPass();
+        int spp = 1 << pass;
+        ParallelFor2D([&](Point2i tile) {
+            // Trace the tile's training paths with an independent sampler
+            MemoryArena &arena = ThreadArena(ArenaCategory::Render);
+            int seed = (pass * nTiles.y + tile.y) * nTiles.x + tile.x;
+            RandomSampler sampler(spp, seed);
+            int x0 = sampleBounds.pMin.x + tile.x * tileSize;
+            int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
+            int y0 = sampleBounds.pMin.y + tile.y * tileSize;
+            int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
+            for (Point2i pixel : Bounds2i(Point2i(x0, y0), Point2i(x1, y1))) {
+                sampler.StartPixel(pixel);
+                do {
+                    CameraSample cameraSample = sampler.GetCameraSample(pixel);
+                    RayDifferential ray;
+                    Float rayWeight =
+                        camera.GenerateRayDifferential(cameraSample, &ray);
+                    ray.ScaleDifferentials(1 / std::sqrt((Float)spp));
+                    if (rayWeight > 0)
+                        integrator.Li(ray, scene, sampler, arena);
+                    arena.Reset();
+                } while (sampler.StartNextSample());
+            }
+            reporter.Update();
+        }, nTiles);
+        guide->EndPass();
+    }
+    reporter.Done();
+}
+
+}  // namespace pbrt
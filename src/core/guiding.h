@@ -0,0 +1,179 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_CORE_GUIDING_H
+#define PBRT_CORE_GUIDING_H
+
+// core/guiding.h*
+#include "pbrt.h"
+#include "geometry.h"
+#include "parallel.h"
+#include "reflection.h"
+#include "spectrum.h"
+#include <atomic>
+#include <vector>
+
+namespace pbrt {
+
+// Path guiding learns the distribution of incident radiance in the scene
+// while rendering a few training passes, and then samples path directions
+// from a mixture of the BSDF and the learned distribution.  The
+// distribution is stored in an "SD-tree": a binary tree that subdivides
+// space, with a quadtree over the sphere of directions at each leaf (see
+// Muller et al., "Practical Path Guiding for Efficient Light-Transport
+// Simulation", 2017).
+
+// DirectionalTree Declarations
+// A quadtree over [0,1]^2, which maps to the sphere of directions with the
+// equal-area (cos theta, phi) parameterization.  Each node stores the
+// radiance recorded in each of its four quadrants.
+class DirectionalTree {
+  public:
+    // DirectionalTree Public Methods
+    DirectionalTree() : nodes(1) {}
+    DirectionalTree(const DirectionalTree &t);
+    DirectionalTree &operator=(const DirectionalTree &t);
+    void Record(const Vector3f &w, Float radiance);
+    Vector3f Sample(Point2f u) const;
+    Float Pdf(const Vector3f &w) const;
+    // Subdivides the quadrants that received more than _threshold_ of the
+    // recorded radiance, collapses the others, and clears the records.
+    void Refine(Float threshold, int maxDepth);
+    int NumSamples() const { return nSamples; }
+    void ScaleNumSamples(Float s) { nSamples = int(nSamples * s); }
+    int NumNodes() const { return nodes.size(); }
+
+  private:
+    // DirectionalTree Private Data
+    struct Node {
+        Node() {
+            for (int i = 0; i < 4; ++i) child[i] = 0;
+        }
+        Node(const Node &n) { *this = n; }
+        Node &operator=(const Node &n) {
+            for (int i = 0; i < 4; ++i) {
+                sum[i] = Float(n.sum[i]);
+                child[i] = n.child[i];
+            }
+            return *this;
+        }
+        Float Total() const { return sum[0] + sum[1] + sum[2] + sum[3]; }
+        AtomicFloat sum[4];
+        // Index of the child node of each quadrant, or zero for leaves
+        int child[4];
+    };
+    void Subdivide(int index, const Node *old, const Float flux[4],
+                   Float total, Float threshold, int depth, int maxDepth,
+                   std::vector<Node> *refined) const;
+    std::vector<Node> nodes;
+    std::atomic<int> nSamples{0};
+};
+
+// PathGuide Declarations
+class PathGuide {
+  public:
+    // PathGuide Public Methods
+    PathGuide(const Bounds3f &bounds, Float bsdfSamplingFraction);
+    // Samples a direction from the mixture of the BSDF at _isect_ and the
+    // learned distribution at its position and returns the BSDF value and
+    // the mixture's pdf; BSDFs with specular components are sampled as
+    // usual.
+    Spectrum Sample_f(const SurfaceInteraction &isect, const Vector3f &wo,
+                      Vector3f *wi, Point2f u, Float *pdf,
+                      BxDFType *sampledType) const;
+    bool Recording() const { return recording; }
+    void Record(const Point3f &p, const Vector3f &wi, Float radiance);
+    // A training pass records radiance into the trees; at its end, the
+    // records are used for sampling and the trees are refined for the
+    // next pass.
+    void BeginPass() { recording = true; }
+    void EndPass();
+
+  private:
+    // PathGuide Private Data
+    struct SpatialNode {
+        int axis = 0;
+        // Index of the first of two children, or zero for leaves
+        int children = 0;
+        DirectionalTree sampling, building;
+    };
+    int Lookup(const Point3f &p) const;
+    Bounds3f bounds;
+    const Float bsdfSamplingFraction;
+    std::vector<SpatialNode> nodes;
+    int nPasses = 0;
+    bool recording = false;
+};
+
+// GuidedPathRecorder keeps the vertices of a training path until the path
+// is finished, and then records the radiance that arrived at each one.
+class GuidedPathRecorder {
+  public:
+    GuidedPathRecorder(PathGuide *guide)
+        : guide((guide && guide->Recording()) ? guide : nullptr) {}
+    // Adds the vertex at _p_ whose path continues in direction _wi_,
+    // sampled with probability density _pdf_; _beta_ is the path
+    // throughput after scattering and _L_ the radiance gathered so far.
+    void AddVertex(const Point3f &p, const Vector3f &wi, const Spectrum &beta,
+                   Float pdf, const Spectrum &L) {
+        if (!guide || nVertices == MaxVertices || pdf == 0) return;
+        vertices[nVertices++] = {p, wi, beta, L, pdf};
+    }
+    void Finish(const Spectrum &L);
+
+  private:
+    struct Vertex {
+        Point3f p;
+        Vector3f wi;
+        Spectrum beta, L;
+        Float pdf;
+    };
+    static PBRT_CONSTEXPR int MaxVertices = 32;
+    PathGuide *guide;
+    Vertex vertices[MaxVertices];
+    int nVertices = 0;
+};
+
+// Renders _nPasses_ training passes for _guide_ with _integrator_'s Li(),
+// each with twice the samples per pixel of the last.  The images are
+// discarded.
+void TrainPathGuide(const SamplerIntegrator &integrator, const Scene &scene,
+                    const Camera &camera, PathGuide *guide, int nPasses);
+
+}  // namespace pbrt
+
+#endif  // PBRT_CORE_GUIDING_H
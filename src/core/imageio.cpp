@@ -37,15 +37,23 @@
 #include "fileutil.h"
 #include "spectrum.h"
 
+#include <ImfChannelList.h>
+#include <ImfFrameBuffer.h>
+#include <ImfOutputFile.h>
 #include <ImfRgba.h>
 #include <ImfRgbaFile.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 
 namespace pbrt {
 
 // ImageIO Local Declarations
 static void WriteImageEXR(const std::string &name, const Float *pixels,
                           int xRes, int yRes, int totalXRes, int totalYRes,
-                          int xOffset, int yOffset);
+                          int xOffset, int yOffset,
+                          ImageCompression compression);
 static void WriteImageTGA(const std::string &name, const uint8_t *pixels,
                           int xRes, int yRes, int totalXRes, int totalYRes,
                           int xOffset, int yOffset);
@@ -55,8 +63,42 @@ static bool WriteImagePFM(const std::string &filename, const Float *rgb,
                           int xres, int yres);
 static RGBSpectrum *ReadImagePFM(const std::string &filename, int *xres,
                                  int *yres);
+static Imf::Compression ToEXRCompression(ImageCompression compression);
+struct ImageWriteRequest {
+    std::string name;
+    std::unique_ptr<Float[]> data;
+    Bounds2i outputBounds;
+    Point2i totalResolution;
+    ImageCompression compression;
+    std::vector<std::string> channelNames;
+};
+
+// ImageIO Local Data
+static std::mutex imageWriteMutex;
+static std::condition_variable imageWriteCondition;
+static std::deque<ImageWriteRequest> imageWriteQueue;
+static std::thread imageWriteThread;
+static bool imageWriteShutdown = false;
+// Bounds the number of snapshots held in memory; producers block until
+// the writer thread catches up.
+static const size_t MaxPendingImageWrites = 2;
 
 // ImageIO Function Definitions
+bool ParseImageCompression(const std::string &name,
+                           ImageCompression *compression) {
+    if (name == "none")
+        *compression = ImageCompression::None;
+    else if (name == "zip")
+        *compression = ImageCompression::ZIP;
+    else if (name == "piz")
+        *compression = ImageCompression::PIZ;
+    else if (name == "dwaa")
+        *compression = ImageCompression::DWAA;
+    else
+        return false;
+    return true;
+}
+
 std::unique_ptr<RGBSpectrum[]> ReadImage(const std::string &name,
                                          Point2i *resolution) {
     if (HasExtension(name, ".exr"))
@@ -79,12 +121,13 @@ std::unique_ptr<RGBSpectrum[]> ReadImage(const std::string &name,
 }
 
 void WriteImage(const std::string &name, const Float *rgb,
-                const Bounds2i &outputBounds, const Point2i &totalResolution) {
+                const Bounds2i &outputBounds, const Point2i &totalResolution,
+                ImageCompression compression) {
     Vector2i resolution = outputBounds.Diagonal();
     if (HasExtension(name, ".exr")) {
         WriteImageEXR(name, rgb, resolution.x, resolution.y, totalResolution.x,
                       totalResolution.y, outputBounds.pMin.x,
-                      outputBounds.pMin.y);
+                      outputBounds.pMin.y, compression);
     } else if (HasExtension(name, ".pfm")) {
         WriteImagePFM(name, rgb, resolution.x, resolution.y);
     } else if (HasExtension(name, ".tga") || HasExtension(name, ".png")) {
@@ -121,6 +164,73 @@ void WriteImage(const std::string &name, const Float *rgb,
     }
 }
 
+static void ImageWriterLoop() {
+    std::unique_lock<std::mutex> lock(imageWriteMutex);
+    while (true) {
+        imageWriteCondition.wait(lock, [] {
+            return !imageWriteQueue.empty() || imageWriteShutdown;
+        });
+        // Only exit once everything submitted before the flush is written
+        if (imageWriteQueue.empty()) return;
+        ImageWriteRequest request = std::move(imageWriteQueue.front());
+        imageWriteQueue.pop_front();
+        imageWriteCondition.notify_all();
+
+        lock.unlock();
+        if (request.channelNames.empty())
+            WriteImage(request.name, request.data.get(), request.outputBounds,
+                       request.totalResolution, request.compression);
+        else
+            WriteImageChannels(request.name, request.data.get(),
+                               request.channelNames, request.outputBounds,
+                               request.totalResolution, request.compression);
+        lock.lock();
+    }
+}
+
+void WriteImageAsync(const std::string &name, std::unique_ptr<Float[]> data,
+                     const Bounds2i &outputBounds,
+                     const Point2i &totalResolution,
+                     ImageCompression compression,
+                     std::vector<std::string> channelNames) {
+    std::unique_lock<std::mutex> lock(imageWriteMutex);
+    if (!imageWriteThread.joinable()) {
+        imageWriteShutdown = false;
+        imageWriteThread = std::thread(ImageWriterLoop);
+    }
+
+    // Replace a queued write to the same file that hasn't started yet;
+    // the older image would be overwritten immediately anyway.
+    for (ImageWriteRequest &request : imageWriteQueue) {
+        if (request.name == name) {
+            request.data = std::move(data);
+            request.outputBounds = outputBounds;
+            request.totalResolution = totalResolution;
+            request.compression = compression;
+            request.channelNames = std::move(channelNames);
+            return;
+        }
+    }
+
+    imageWriteCondition.wait(lock, [] {
+        return imageWriteQueue.size() < MaxPendingImageWrites;
+    });
+    imageWriteQueue.push_back(
+        ImageWriteRequest{name, std::move(data), outputBounds, totalResolution,
+                          compression, std::move(channelNames)});
+    imageWriteCondition.notify_all();
+}
+
+void FlushImageWrites() {
+    {
+        std::lock_guard<std::mutex> lock(imageWriteMutex);
+        if (!imageWriteThread.joinable()) return;
+        imageWriteShutdown = true;
+        imageWriteCondition.notify_all();
+    }
+    imageWriteThread.join();
+}
+
 RGBSpectrum *ReadImageEXR(const std::string &name, int *width, int *height,
                           Bounds2i *dataWindow, Bounds2i *displayWindow) {
     using namespace Imf;
@@ -163,7 +273,8 @@ RGBSpectrum *ReadImageEXR(const std::string &name, int *width, int *height,
 
 static void WriteImageEXR(const std::string &name, const Float *pixels,
                           int xRes, int yRes, int totalXRes, int totalYRes,
-                          int xOffset, int yOffset) {
+                          int xOffset, int yOffset,
+                          ImageCompression compression) {
     using namespace Imf;
     using namespace Imath;
 
@@ -178,7 +289,8 @@ static void WriteImageEXR(const std::string &name, const Float *pixels,
 
     try {
         RgbaOutputFile file(name.c_str(), displayWindow, dataWindow,
-                            WRITE_RGBA);
+                            WRITE_RGBA, 1.f, V2f(0, 0), 1.f, INCREASING_Y,
+                            ToEXRCompression(compression));
         file.setFrameBuffer(hrgba - xOffset - yOffset * xRes, 1, xRes);
         file.writePixels(yRes);
     } catch (const std::exception &exc) {
@@ -188,6 +300,67 @@ static void WriteImageEXR(const std::string &name, const Float *pixels,
     delete[] hrgba;
 }
 
+static Imf::Compression ToEXRCompression(ImageCompression compression) {
+    switch (compression) {
+    case ImageCompression::None:
+        return Imf::NO_COMPRESSION;
+    case ImageCompression::PIZ:
+        return Imf::PIZ_COMPRESSION;
+    case ImageCompression::DWAA:
+        return Imf::DWAA_COMPRESSION;
+    default:
+        return Imf::ZIP_COMPRESSION;
+    }
+}
+
+void WriteImageChannels(const std::string &name, const Float *data,
+                        const std::vector<std::string> &channelNames,
+                        const Bounds2i &outputBounds,
+                        const Point2i &totalResolution,
+                        ImageCompression compression) {
+    using namespace Imf;
+    using namespace Imath;
+
+    if (!HasExtension(name, ".exr")) {
+        Error("Can't write %d-channel image \"%s\": only OpenEXR supports "
+              "arbitrary channels.", (int)channelNames.size(), name.c_str());
+        return;
+    }
+    Vector2i resolution = outputBounds.Diagonal();
+    int nChannels = channelNames.size();
+    int xRes = resolution.x, yRes = resolution.y;
+    int xOffset = outputBounds.pMin.x, yOffset = outputBounds.pMin.y;
+
+    // OpenEXR wants single precision, whatever _Float_ is
+    std::unique_ptr<float[]> pixels(new float[nChannels * xRes * yRes]);
+    for (int i = 0; i < nChannels * xRes * yRes; ++i) pixels[i] = data[i];
+
+    // OpenEXR uses inclusive pixel bounds.
+    Box2i displayWindow(V2i(0, 0),
+                        V2i(totalResolution.x - 1, totalResolution.y - 1));
+    Box2i dataWindow(V2i(xOffset, yOffset),
+                     V2i(xOffset + xRes - 1, yOffset + yRes - 1));
+    Header header(displayWindow, dataWindow, 1.f, V2f(0, 0), 1.f,
+                  INCREASING_Y, ToEXRCompression(compression));
+    FrameBuffer frameBuffer;
+    size_t xStride = nChannels * sizeof(float), yStride = xRes * xStride;
+    for (int c = 0; c < nChannels; ++c) {
+        header.channels().insert(channelNames[c].c_str(), Channel(FLOAT));
+        char *base = (char *)(pixels.get() + c) - xOffset * xStride -
+                     yOffset * yStride;
+        frameBuffer.insert(channelNames[c].c_str(),
+                           Slice(FLOAT, base, xStride, yStride));
+    }
+
+    try {
+        OutputFile file(name.c_str(), header);
+        file.setFrameBuffer(frameBuffer);
+        file.writePixels(yRes);
+    } catch (const std::exception &exc) {
+        Error("Error writing \"%s\": %s", name.c_str(), exc.what());
+    }
+}
+
 // TGA Function Definitions
 void WriteImageTGA(const std::string &name, const uint8_t *pixels, int xRes,
                    int yRes, int totalXRes, int totalYRes, int xOffset,
@@ -42,10 +42,15 @@
 #include "pbrt.h"
 #include "geometry.h"
 #include <cctype>
+#include <vector>
 
 namespace pbrt {
 
 // ImageIO Declarations
+enum class ImageCompression { None, ZIP, PIZ, DWAA };
+bool ParseImageCompression(const std::string &name,
+                           ImageCompression *compression);
+
 std::unique_ptr<RGBSpectrum[]> ReadImage(const std::string &name,
                                          Point2i *resolution);
 RGBSpectrum *ReadImageEXR(const std::string &name, int *width,
@@ -53,7 +58,29 @@ RGBSpectrum *ReadImageEXR(const std::string &name, int *width,
                           Bounds2i *displayWindow = nullptr);
 
 void WriteImage(const std::string &name, const Float *rgb,
-                const Bounds2i &outputBounds, const Point2i &totalResolution);
+                const Bounds2i &outputBounds, const Point2i &totalResolution,
+                ImageCompression compression = ImageCompression::ZIP);
+// Writes an image with an arbitrary set of named channels, stored
+// interleaved in _data_; only supported for OpenEXR files.
+void WriteImageChannels(const std::string &name, const Float *data,
+                        const std::vector<std::string> &channelNames,
+                        const Bounds2i &outputBounds,
+                        const Point2i &totalResolution,
+                        ImageCompression compression = ImageCompression::ZIP);
+
+// Hands the image to a background writer thread and returns immediately;
+// the caller gives up ownership of the pixel buffer.  Writes are performed
+// in submission order, and a still-pending write to the same file is
+// replaced by the newer image.  If _channelNames_ is empty, _data_ holds
+// RGB triples; otherwise it is written with WriteImageChannels().
+// FlushImageWrites() blocks until all
+// outstanding images are on disk.
+void WriteImageAsync(const std::string &name, std::unique_ptr<Float[]> data,
+                     const Bounds2i &outputBounds,
+                     const Point2i &totalResolution,
+                     ImageCompression compression = ImageCompression::ZIP,
+                     std::vector<std::string> channelNames = {});
+void FlushImageWrites();
 
 }  // namespace pbrt
 
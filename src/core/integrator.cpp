@@ -39,8 +39,10 @@
 #include "film.h"
 #include "sampler.h"
 #include "integrator.h"
+#include "lightdistrib.h"
 #include "progressreporter.h"
 #include "camera.h"
+#include "paramset.h"
 #include "stats.h"
 
 namespace pbrt {
@@ -105,6 +107,25 @@ Spectrum UniformSampleOneLight(const Interaction &it, const Scene &scene,
                           scene, sampler, arena, handleMedia) / lightPdf;
 }
 
+// Chooses the light with _lightDistrib_'s sampling method for the point
+// _it.p_, which lets point-dependent strategies like light trees avoid
+// building a distribution over all lights.
+Spectrum UniformSampleOneLight(const Interaction &it, const Scene &scene,
+                               MemoryArena &arena, Sampler &sampler,
+                               bool handleMedia,
+                               const LightDistribution &lightDistrib) {
+    ProfilePhase p(Prof::DirectLighting);
+    if (scene.lights.empty()) return Spectrum(0.f);
+    Float lightPdf;
+    int lightNum = lightDistrib.Sample(it.p, sampler.Get1D(), &lightPdf);
+    if (lightNum < 0 || lightPdf == 0) return Spectrum(0.f);
+    const std::shared_ptr<Light> &light = scene.lights[lightNum];
+    Point2f uLight = sampler.Get2D();
+    Point2f uScattering = sampler.Get2D();
+    return EstimateDirect(it, uScattering, *light, uLight,
+                          scene, sampler, arena, handleMedia) / lightPdf;
+}
+
 Spectrum EstimateDirect(const Interaction &it, const Point2f &uScattering,
                         const Light &light, const Point2f &uLight,
                         const Scene &scene, Sampler &sampler,
@@ -224,7 +245,45 @@ std::unique_ptr<Distribution1D> ComputeLightPowerDistribution(
         new Distribution1D(&lightPower[0], lightPower.size()));
 }
 
+// The auxiliary film channels of the camera sample that the calling
+// thread is evaluating and its camera ray's origin; _pendingAOV_ is reset
+// once they have been recorded
+static PBRT_THREAD_LOCAL AOVSample *pendingAOV;
+static PBRT_THREAD_LOCAL const Point3f *pendingAOVCamera;
+
+AOVSample ComputeAOVSample(const SurfaceInteraction &isect,
+                           const Point3f &pCamera, bool computeAlbedo) {
+    AOVSample aov;
+    aov.depth = Distance(pCamera, isect.p);
+    aov.n = isect.shading.n;
+    aov.p = isect.p;
+    if (isect.primitive) aov.objectID = isect.primitive->GetObjectID();
+    if (computeAlbedo && isect.bsdf) {
+        // Estimate reflectance with a fixed stratified pattern, leaving the
+        // sampler's sample sequence untouched
+        PBRT_CONSTEXPR int nSamples = 16;
+        Point2f u[nSamples];
+        for (int i = 0; i < nSamples; ++i)
+            u[i] = Point2f((i % 4 + 0.5f) / 4, (i / 4 + 0.5f) / 4);
+        aov.albedo = isect.bsdf->rho(isect.wo, nSamples, u);
+    }
+    return aov;
+}
+
+void SamplerIntegrator::RecordAOVSample(
+    const SurfaceInteraction &isect) const {
+    if (!pendingAOV) return;
+    *pendingAOV = ComputeAOVSample(isect, *pendingAOVCamera,
+                                   camera->film->HasAOV(AOVType::Albedo));
+    pendingAOV = nullptr;
+}
+
 // SamplerIntegrator Method Definitions
+void SamplerIntegrator::SetRenderBudget(const ParamSet &params) {
+    SetRenderBudget(std::max((Float)0, params.FindOneFloat("maxseconds", 0)),
+                    std::max((Float)0, params.FindOneFloat("targeterror", 0)));
+}
+
 void SamplerIntegrator::Render(const Scene &scene) {
     Preprocess(scene, *sampler);
     // Render image tiles in parallel
@@ -235,16 +294,37 @@ void SamplerIntegrator::Render(const Scene &scene) {
     const int tileSize = 16;
     Point2i nTiles((sampleExtent.x + tileSize - 1) / tileSize,
                    (sampleExtent.y + tileSize - 1) / tileSize);
-    ProgressReporter reporter(nTiles.x * nTiles.y, "Rendering");
-    {
+
+    // With a time or error budget, the pixel samples are taken in several
+    // passes over the image so that rendering can stop between them
+    const int64_t spp = sampler->samplesPerPixel;
+    bool budgeted = maxSeconds > 0 || targetError > 0;
+    int64_t passSamples =
+        budgeted ? std::min(spp, std::max((int64_t)8, spp / 16)) : spp;
+    int nPasses = (int)((spp + passSamples - 1) / passSamples);
+    if (targetError > 0) camera->film->EnableErrorEstimate();
+    auto pixelConverged = [&](const Point2i &pixel) {
+        return targetError > 0 &&
+               camera->film->RelativeError(pixel) <= targetError;
+    };
+    ProgressReporter reporter(nTiles.x * nTiles.y * nPasses, "Rendering");
+    std::atomic<bool> outOfTime(false);
+    for (int pass = 0; pass < nPasses; ++pass) {
+        int64_t firstSample = pass * passSamples;
+        int64_t endSample = std::min(spp, firstSample + passSamples);
         ParallelFor2D([&](Point2i tile) {
-            // Render section of image corresponding to _tile_
+            // Render section of image corresponding to _tile_; the first
+            // pass always covers the whole image
+            if (outOfTime && pass > 0) {
+                reporter.Update();
+                return;
+            }
 
-            // Allocate _MemoryArena_ for tile
-            MemoryArena arena;
+            // Get this thread's pooled _MemoryArena_ for the tile
+            MemoryArena &arena = ThreadArena(ArenaCategory::Render);
 
             // Get sampler instance for tile
-            int seed = tile.y * nTiles.x + tile.x;
+            int seed = (pass * nTiles.y + tile.y) * nTiles.x + tile.x;
             std::unique_ptr<Sampler> tileSampler = sampler->Clone(seed);
 
             // Compute sample bounds for tile
@@ -264,6 +344,8 @@ void SamplerIntegrator::Render(const Scene &scene) {
                 {
                     ProfilePhase pp(Prof::StartPixel);
                     tileSampler->StartPixel(pixel);
+                    if (firstSample > 0)
+                        tileSampler->SetSampleNumber(firstSample);
                 }
 
                 // Do this check after the StartPixel() call; this keeps
@@ -272,6 +354,7 @@ void SamplerIntegrator::Render(const Scene &scene) {
                 // debugging.
                 if (!InsideExclusive(pixel, pixelBounds))
                     continue;
+                if (pixelConverged(pixel)) continue;
 
                 do {
                     // Initialize _CameraSample_ for current sample
@@ -286,7 +369,14 @@ void SamplerIntegrator::Render(const Scene &scene) {
                         1 / std::sqrt((Float)tileSampler->samplesPerPixel));
                     ++nCameraRays;
 
-                    // Evaluate radiance along camera ray
+                    // Evaluate radiance along camera ray, letting _Li()_
+                    // record auxiliary film channels at its first
+                    // intersection
+                    AOVSample aov;
+                    if (rayWeight > 0 && camera->film->HasAOVs()) {
+                        pendingAOV = &aov;
+                        pendingAOVCamera = &ray.o;
+                    }
                     Spectrum L(0.f);
                     if (rayWeight > 0) L = Li(ray, scene, *tileSampler, arena);
                     // Issue warning if unexpected radiance value returned
@@ -317,20 +407,45 @@ void SamplerIntegrator::Render(const Scene &scene) {
 
                     // Add camera ray's contribution to image
                     filmTile->AddSample(cameraSample.pFilm, L, rayWeight);
+                    if (targetError > 0)
+                        camera->film->AddErrorSample(pixel, L * rayWeight);
+
+                    // Add auxiliary film channels if _Li()_ recorded them
+                    if (pendingAOV) {
+                        pendingAOV = nullptr;
+                    } else if (rayWeight > 0 && camera->film->HasAOVs())
+                        camera->film->AddAOVSample(pixel, aov);
 
                     // Free _MemoryArena_ memory from computing image sample
                     // value
                     arena.Reset();
-                } while (tileSampler->StartNextSample());
+                } while (tileSampler->StartNextSample() &&
+                         tileSampler->CurrentSampleNumber() < endSample);
             }
             LOG(INFO) << "Finished image tile " << tileBounds;
 
             // Merge image tile into _Film_
             camera->film->MergeFilmTile(std::move(filmTile));
             reporter.Update();
+            if (maxSeconds > 0 && reporter.ElapsedMS() >= 1000 * maxSeconds)
+                outOfTime = true;
         }, nTiles);
-        reporter.Done();
+        camera->film->MergeDeferredTiles();
+
+        // Stop early if the budget is used up or all pixels have converged
+        if (pass + 1 == nPasses) break;
+        bool converged = targetError > 0;
+        for (Point2i pixel : pixelBounds) {
+            if (!converged) break;
+            converged = pixelConverged(pixel);
+        }
+        if (outOfTime || converged) {
+            LOG(INFO) << StringPrintf("Stopping after %d of %d sample passes",
+                                      pass + 1, nPasses);
+            break;
+        }
     }
+    reporter.Done();
     LOG(INFO) << "Rendering finished";
 
     // Save final image after rendering
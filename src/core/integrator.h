@@ -46,6 +46,7 @@
 #include "reflection.h"
 #include "sampler.h"
 #include "material.h"
+#include "film.h"
 
 namespace pbrt {
 
@@ -65,6 +66,10 @@ Spectrum UniformSampleOneLight(const Interaction &it, const Scene &scene,
                                MemoryArena &arena, Sampler &sampler,
                                bool handleMedia = false,
                                const Distribution1D *lightDistrib = nullptr);
+Spectrum UniformSampleOneLight(const Interaction &it, const Scene &scene,
+                               MemoryArena &arena, Sampler &sampler,
+                               bool handleMedia,
+                               const LightDistribution &lightDistrib);
 Spectrum EstimateDirect(const Interaction &it, const Point2f &uShading,
                         const Light &light, const Point2f &uLight,
                         const Scene &scene, Sampler &sampler,
@@ -72,6 +77,8 @@ Spectrum EstimateDirect(const Interaction &it, const Point2f &uShading,
                         bool specular = false);
 std::unique_ptr<Distribution1D> ComputeLightPowerDistribution(
     const Scene &scene);
+AOVSample ComputeAOVSample(const SurfaceInteraction &isect,
+                           const Point3f &pCamera, bool computeAlbedo);
 
 // SamplerIntegrator Declarations
 class SamplerIntegrator : public Integrator {
@@ -83,6 +90,16 @@ class SamplerIntegrator : public Integrator {
         : camera(camera), sampler(sampler), pixelBounds(pixelBounds) {}
     virtual void Preprocess(const Scene &scene, Sampler &sampler) {}
     void Render(const Scene &scene);
+    // Rendering stops early after _maxSeconds_ of wall-clock time or once
+    // every pixel's relative error is below _targetError_; zero disables
+    // the corresponding limit.
+    void SetRenderBudget(Float maxSeconds, Float targetError) {
+        this->maxSeconds = maxSeconds;
+        this->targetError = targetError;
+    }
+    // Sets the budget from the "maxseconds" and "targeterror" parameters;
+    // the Create functions of _SamplerIntegrator_s call this
+    void SetRenderBudget(const ParamSet &params);
     virtual Spectrum Li(const RayDifferential &ray, const Scene &scene,
                         Sampler &sampler, MemoryArena &arena,
                         int depth = 0) const = 0;
@@ -96,13 +113,21 @@ class SamplerIntegrator : public Integrator {
                               MemoryArena &arena, int depth) const;
 
   protected:
+    // SamplerIntegrator Protected Methods
+    bool HasRenderBudget() const { return maxSeconds > 0 || targetError > 0; }
+    // _Li()_ calls this with the first intersection of the camera ray that
+    // has a BSDF; only the first call per camera sample has any effect
+    void RecordAOVSample(const SurfaceInteraction &isect) const;
+
     // SamplerIntegrator Protected Data
     std::shared_ptr<const Camera> camera;
+    std::shared_ptr<Sampler> sampler;
+    const Bounds2i pixelBounds;
 
   private:
     // SamplerIntegrator Private Data
-    std::shared_ptr<Sampler> sampler;
-    const Bounds2i pixelBounds;
+    Float maxSeconds = 0;
+    Float targetError = 0;
 };
 
 }  // namespace pbrt
@@ -58,6 +58,26 @@ inline bool IsDeltaLight(int flags) {
            flags & (int)LightFlags::DeltaDirection;
 }
 
+// LightBounds Declarations
+// Bounds the positions a light emits from, the directions it emits in and
+// its power; all emission directions are within $\theta_o+\theta_e$ of
+// _w_, where $\theta_o$ bounds the spread of the emitters' normals and
+// $\theta_e$ the spread of emission around each normal.
+struct LightBounds {
+    LightBounds() {}
+    LightBounds(const Bounds3f &bounds, const Vector3f &w, Float phi,
+                Float cosTheta_o, Float cosTheta_e)
+        : bounds(bounds),
+          w(w),
+          phi(phi),
+          cosTheta_o(cosTheta_o),
+          cosTheta_e(cosTheta_e) {}
+    Bounds3f bounds;
+    Vector3f w;
+    Float phi = 0;
+    Float cosTheta_o = 1, cosTheta_e = 1;
+};
+
 // Light Declarations
 class Light {
   public:
@@ -77,6 +97,9 @@ class Light {
                                Float *pdfDir) const = 0;
     virtual void Pdf_Le(const Ray &ray, const Normal3f &nLight, Float *pdfPos,
                         Float *pdfDir) const = 0;
+    // Lights that return false here have no useful spatial bound, like
+    // infinite and distant lights.
+    virtual bool GetLightBounds(LightBounds *lb) const { return false; }
 
     // Light Public Data
     const int flags;
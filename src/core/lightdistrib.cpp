@@ -44,6 +44,14 @@ namespace pbrt {
 
 LightDistribution::~LightDistribution() {}
 
+int LightDistribution::Sample(const Point3f &p, Float u, Float *pdf) const {
+    return Lookup(p)->SampleDiscrete(u, pdf);
+}
+
+Float LightDistribution::Pdf(const Point3f &p, int lightIndex) const {
+    return Lookup(p)->DiscretePDF(lightIndex);
+}
+
 std::unique_ptr<LightDistribution> CreateLightSampleDistribution(
     const std::string &name, const Scene &scene) {
     if (name == "uniform" || scene.lights.size() == 1)
@@ -55,6 +63,9 @@ std::unique_ptr<LightDistribution> CreateLightSampleDistribution(
     else if (name == "spatial")
         return std::unique_ptr<LightDistribution>{
             new SpatialLightDistribution(scene)};
+    else if (name == "lighttree")
+        return std::unique_ptr<LightDistribution>{
+            new LightTreeDistribution(scene)};
     else {
         Error(
             "Light sample distribution type \"%s\" unknown. Using \"spatial\".",
@@ -64,6 +75,33 @@ std::unique_ptr<LightDistribution> CreateLightSampleDistribution(
     }
 }
 
+// The most recent precomputed distribution that was given a cache key
+static std::string cachedDistributionKey;
+static std::shared_ptr<SpatialLightDistribution> cachedDistribution;
+
+std::shared_ptr<LightDistribution> CreateLightSampleDistribution(
+    const std::string &name, const Scene &scene, bool precompute,
+    const std::string &cacheKey) {
+    if (!precompute || name != "spatial" || scene.lights.size() == 1)
+        return CreateLightSampleDistribution(name, scene);
+    if (!cacheKey.empty() && cachedDistribution &&
+        cacheKey == cachedDistributionKey)
+        return cachedDistribution;
+    std::shared_ptr<SpatialLightDistribution> distrib =
+        std::make_shared<SpatialLightDistribution>(scene);
+    distrib->Precompute(scene);
+    if (!cacheKey.empty()) {
+        cachedDistributionKey = cacheKey;
+        cachedDistribution = distrib;
+    }
+    return distrib;
+}
+
+void ClearLightSampleDistributionCache() {
+    cachedDistributionKey.clear();
+    cachedDistribution.reset();
+}
+
 UniformLightDistribution::UniformLightDistribution(const Scene &scene) {
     std::vector<Float> prob(scene.lights.size(), Float(1));
     distrib.reset(new Distribution1D(&prob[0], prob.size()));
@@ -86,6 +124,7 @@ const Distribution1D *PowerLightDistribution::Lookup(const Point3f &p) const {
 STAT_COUNTER("SpatialLightDistribution/Distributions created", nCreated);
 STAT_RATIO("SpatialLightDistribution/Lookups per distribution", nLookups, nDistributions);
 STAT_INT_DISTRIBUTION("SpatialLightDistribution/Hash probes per lookup", nProbesPerLookup);
+STAT_COUNTER("SpatialLightDistribution/Distributions precomputed", nPrecomputed);
 
 // Voxel coordinates are packed into a uint64_t for hash table lookups;
 // 10 bits are allocated to each coordinate.  invalidPackedPos is an impossible
@@ -94,11 +133,11 @@ static const uint64_t invalidPackedPos = 0xffffffffffffffff;
 
 SpatialLightDistribution::SpatialLightDistribution(const Scene &scene,
                                                    int maxVoxels)
-    : scene(scene) {
+    : worldBound(scene.WorldBound()), lights(scene.lights) {
     // Compute the number of voxels so that the widest scene bounding box
     // dimension has maxVoxels voxels and the other dimensions have a number
     // of voxels so that voxels are roughly cube shaped.
-    Bounds3f b = scene.WorldBound();
+    const Bounds3f &b = worldBound;
     Vector3f diag = b.Diagonal();
     Float bmax = diag[b.MaximumExtent()];
     for (int i = 0; i < 3; ++i) {
@@ -124,11 +163,85 @@ SpatialLightDistribution::SpatialLightDistribution(const Scene &scene,
 SpatialLightDistribution::~SpatialLightDistribution() {
     // Gather statistics about how well the computed distributions are across
     // the buckets.
-    for (size_t i = 0; i < hashTableSize; ++i) {
-        HashEntry &entry = hashTable[i];
-        if (entry.distribution.load())
-            delete entry.distribution.load();
+    if (hashTable)
+        for (size_t i = 0; i < hashTableSize; ++i) {
+            HashEntry &entry = hashTable[i];
+            if (entry.distribution.load())
+                delete entry.distribution.load();
+        }
+    if (voxelDistributions)
+        for (int i = 0; i < nVoxels[0] * nVoxels[1] * nVoxels[2]; ++i)
+            delete voxelDistributions[i].load();
+}
+
+// Finds the voxels that contain geometry by tracing probe rays through
+// the scene along each axis, four per column of voxels, and recording
+// every surface they cross.  Geometry small enough to fall between the
+// probes is missed; its voxels are computed on first use.
+std::vector<int> SpatialLightDistribution::FindOccupiedVoxels(
+    const Scene &scene) const {
+    int nTotal = nVoxels[0] * nVoxels[1] * nVoxels[2];
+    std::unique_ptr<std::atomic<bool>[]> occupied(
+        new std::atomic<bool>[nTotal]);
+    for (int i = 0; i < nTotal; ++i) occupied[i] = false;
+    const Bounds3f &b = worldBound;
+    for (int axis = 0; axis < 3; ++axis) {
+        int u = (axis + 1) % 3, v = (axis + 2) % 3;
+        ParallelFor([&](int64_t column) {
+            int iu = column % nVoxels[u], iv = column / nVoxels[u];
+            for (int j = 0; j < 4; ++j) {
+                // Trace a ray along _axis_ through the column
+                Point3f o;
+                o[axis] = b.pMin[axis] - b.Diagonal()[axis] * .01f;
+                o[u] = Lerp((iu + (j % 2 == 0 ? .25f : .75f)) / nVoxels[u],
+                            b.pMin[u], b.pMax[u]);
+                o[v] = Lerp((iv + (j / 2 == 0 ? .25f : .75f)) / nVoxels[v],
+                            b.pMin[v], b.pMax[v]);
+                Vector3f d(0, 0, 0);
+                d[axis] = 1;
+                Ray ray(o, d);
+                SurfaceInteraction isect;
+                for (int hits = 0; hits < 1024 && scene.Intersect(ray, &isect);
+                     ++hits) {
+                    Vector3f offset = b.Offset(isect.p);
+                    Point3i pi;
+                    for (int c = 0; c < 3; ++c)
+                        pi[c] = Clamp(int(offset[c] * nVoxels[c]), 0,
+                                      nVoxels[c] - 1);
+                    occupied[VoxelIndex(pi)] = true;
+                    ray = isect.SpawnRay(d);
+                }
+            }
+        }, nVoxels[u] * nVoxels[v], 16);
     }
+    std::vector<int> occupiedVoxels;
+    for (int i = 0; i < nTotal; ++i)
+        if (occupied[i]) occupiedVoxels.push_back(i);
+    return occupiedVoxels;
+}
+
+void SpatialLightDistribution::Precompute(const Scene &scene) {
+    if (voxelDistributions) return;
+    int nTotal = nVoxels[0] * nVoxels[1] * nVoxels[2];
+    voxelDistributions.reset(new std::atomic<Distribution1D *>[nTotal]);
+    for (int i = 0; i < nTotal; ++i) voxelDistributions[i] = nullptr;
+
+    // Free the hash table, which the flat array replaces
+    for (size_t i = 0; i < hashTableSize; ++i)
+        delete hashTable[i].distribution.load();
+    hashTable.reset();
+
+    // Compute the distributions of the occupied voxels in parallel
+    std::vector<int> occupiedVoxels = FindOccupiedVoxels(scene);
+    ParallelFor([&](int64_t i) {
+        int index = occupiedVoxels[i];
+        Point3i pi(index % nVoxels[0], (index / nVoxels[0]) % nVoxels[1],
+                   index / (nVoxels[0] * nVoxels[1]));
+        voxelDistributions[index] = ComputeDistribution(pi);
+    }, occupiedVoxels.size(), 8);
+    nPrecomputed += occupiedVoxels.size();
+    LOG(INFO) << "SpatialLightDistribution: precomputed "
+              << occupiedVoxels.size() << " of " << nTotal << " voxels";
 }
 
 const Distribution1D *SpatialLightDistribution::Lookup(const Point3f &p) const {
@@ -137,7 +250,7 @@ const Distribution1D *SpatialLightDistribution::Lookup(const Point3f &p) const {
 
     // First, compute integer voxel coordinates for the given point |p|
     // with respect to the overall voxel grid.
-    Vector3f offset = scene.WorldBound().Offset(p);  // offset in [0,1].
+    Vector3f offset = worldBound.Offset(p);  // offset in [0,1].
     Point3i pi;
     for (int i = 0; i < 3; ++i)
         // The clamp should almost never be necessary, but is there to be
@@ -145,6 +258,23 @@ const Distribution1D *SpatialLightDistribution::Lookup(const Point3f &p) const {
         // the scene bounds due to floating-point roundoff error.
         pi[i] = Clamp(int(offset[i] * nVoxels[i]), 0, nVoxels[i] - 1);
 
+    if (voxelDistributions) {
+        // Return the precomputed distribution; voxels that the
+        // precomputation missed are computed now, and if two threads race
+        // to do so, the loser's distribution is discarded
+        std::atomic<Distribution1D *> &entry =
+            voxelDistributions[VoxelIndex(pi)];
+        Distribution1D *dist = entry.load(std::memory_order_acquire);
+        if (!dist) {
+            Distribution1D *newDist = ComputeDistribution(pi);
+            if (entry.compare_exchange_strong(dist, newDist))
+                dist = newDist;
+            else
+                delete newDist;
+        }
+        return dist;
+    }
+
     // Pack the 3D integer voxel coordinates into a single 64-bit value.
     uint64_t packedPos = (uint64_t(pi[0]) << 40) | (uint64_t(pi[1]) << 20) | pi[2];
     CHECK_NE(packedPos, invalidPackedPos);
@@ -242,8 +372,7 @@ SpatialLightDistribution::ComputeDistribution(Point3i pi) const {
     Point3f p1(Float(pi[0] + 1) / Float(nVoxels[0]),
                Float(pi[1] + 1) / Float(nVoxels[1]),
                Float(pi[2] + 1) / Float(nVoxels[2]));
-    Bounds3f voxelBounds(scene.WorldBound().Lerp(p0),
-                         scene.WorldBound().Lerp(p1));
+    Bounds3f voxelBounds(worldBound.Lerp(p0), worldBound.Lerp(p1));
 
     // Compute the sampling distribution. Sample a number of points inside
     // voxelBounds using a 3D Halton sequence; at each one, sample each
@@ -252,7 +381,7 @@ SpatialLightDistribution::ComputeDistribution(Point3i pi) const {
     // point on the light source) as an approximation to how much the light
     // is likely to contribute to illumination in the voxel.
     int nSamples = 128;
-    std::vector<Float> lightContrib(scene.lights.size(), Float(0));
+    std::vector<Float> lightContrib(lights.size(), Float(0));
     for (int i = 0; i < nSamples; ++i) {
         Point3f po = voxelBounds.Lerp(Point3f(
             RadicalInverse(0, i), RadicalInverse(1, i), RadicalInverse(2, i)));
@@ -262,11 +391,11 @@ SpatialLightDistribution::ComputeDistribution(Point3i pi) const {
         // Use the next two Halton dimensions to sample a point on the
         // light source.
         Point2f u(RadicalInverse(3, i), RadicalInverse(4, i));
-        for (size_t j = 0; j < scene.lights.size(); ++j) {
+        for (size_t j = 0; j < lights.size(); ++j) {
             Float pdf;
             Vector3f wi;
             VisibilityTester vis;
-            Spectrum Li = scene.lights[j]->Sample_Li(intr, u, &wi, &pdf, &vis);
+            Spectrum Li = lights[j]->Sample_Li(intr, u, &wi, &pdf, &vis);
             if (pdf > 0) {
                 // TODO: look at tracing shadow rays / computing beam
                 // transmittance.  Probably shouldn't give those full weight
@@ -298,4 +427,334 @@ SpatialLightDistribution::ComputeDistribution(Point3i pi) const {
     return new Distribution1D(&lightContrib[0], lightContrib.size());
 }
 
+///////////////////////////////////////////////////////////////////////////
+// LightTreeDistribution
+
+STAT_COUNTER("LightTreeDistribution/Nodes", nLightTreeNodes);
+STAT_INT_DISTRIBUTION("LightTreeDistribution/Nodes visited per sample",
+                      nLightTreeNodesVisited);
+
+// Bit trails of lights that aren't in the tree; real trails are shorter
+// than 62 bits, so they can't collide with these.
+static const uint64_t UnboundedLight = ~uint64_t(0);
+static const uint64_t UnsampledLight = ~uint64_t(0) - 1;
+
+static Float SafeAcos(Float x) { return std::acos(Clamp(x, -1, 1)); }
+static Float SafeSqrt(Float x) { return std::sqrt(std::max(x, (Float)0)); }
+
+// Returns the union of two emission bounds, with a cone that contains
+// both cones.
+static LightBounds Union(const LightBounds &a, const LightBounds &b) {
+    if (a.phi == 0) return b;
+    if (b.phi == 0) return a;
+    LightBounds u;
+    u.bounds = Union(a.bounds, b.bounds);
+    u.phi = a.phi + b.phi;
+    u.cosTheta_e = std::min(a.cosTheta_e, b.cosTheta_e);
+
+    // Find the smallest cone containing the cones of _a_ and _b_
+    Float theta_a = SafeAcos(a.cosTheta_o), theta_b = SafeAcos(b.cosTheta_o);
+    Float theta_d = SafeAcos(Dot(a.w, b.w));
+    if (std::min(theta_d + theta_b, Pi) <= theta_a) {
+        u.w = a.w;
+        u.cosTheta_o = a.cosTheta_o;
+    } else if (std::min(theta_d + theta_a, Pi) <= theta_b) {
+        u.w = b.w;
+        u.cosTheta_o = b.cosTheta_o;
+    } else {
+        Float theta_o = (theta_a + theta_d + theta_b) / 2;
+        Vector3f wr = Cross(a.w, b.w);
+        if (theta_o >= Pi || wr.LengthSquared() == 0) {
+            u.w = a.w;
+            u.cosTheta_o = -1;
+        } else {
+            // Rotate _a.w_ toward _b.w_ to the new cone's axis
+            u.w = Rotate(Degrees(theta_o - theta_a), wr)(a.w);
+            u.cosTheta_o = std::cos(theta_o);
+        }
+    }
+    return u;
+}
+
+// Estimates how much the lights in _lb_ may illuminate _p_: their power
+// divided by the squared distance, times the cosine of the smallest angle
+// between the emission cone and the direction toward _p_.  It is zero
+// only if no emission direction can reach _p_.
+static Float Importance(const LightBounds &lb, const Point3f &p) {
+    if (lb.phi == 0) return 0;
+    Point3f pc = (lb.bounds.pMin + lb.bounds.pMax) * .5f;
+    Float d2 = DistanceSquared(p, pc);
+    d2 = std::max(d2, lb.bounds.Diagonal().Length() / 2);
+
+    // Compute the angle between the cone axis and the direction to _p_
+    Vector3f wi = p - pc;
+    if (wi.LengthSquared() > 0) wi = Normalize(wi);
+    Float cosTheta_w = Dot(lb.w, wi);
+    Float sinTheta_w = SafeSqrt(1 - cosTheta_w * cosTheta_w);
+
+    // Bound the angle the light bounds subtend as seen from _p_
+    Float cosTheta_b = -1;
+    if (!Inside(p, lb.bounds)) {
+        Point3f center;
+        Float radius;
+        lb.bounds.BoundingSphere(&center, &radius);
+        Float dc2 = DistanceSquared(p, center);
+        if (dc2 > radius * radius)
+            cosTheta_b = SafeSqrt(1 - radius * radius / dc2);
+    }
+    Float sinTheta_b = SafeSqrt(1 - cosTheta_b * cosTheta_b);
+
+    // Compute $\cos\theta'$, the cosine of the smallest angle between an
+    // emission direction and a direction toward _p_, clamped to zero when
+    // the difference of the angles is negative
+    Float sinTheta_o = SafeSqrt(1 - lb.cosTheta_o * lb.cosTheta_o);
+    Float cosTheta_x = 1, sinTheta_x = 0;
+    if (cosTheta_w <= lb.cosTheta_o) {
+        cosTheta_x = cosTheta_w * lb.cosTheta_o + sinTheta_w * sinTheta_o;
+        sinTheta_x = sinTheta_w * lb.cosTheta_o - cosTheta_w * sinTheta_o;
+    }
+    Float cosThetap = 1;
+    if (cosTheta_x <= cosTheta_b)
+        cosThetap = cosTheta_x * cosTheta_b + sinTheta_x * sinTheta_b;
+    if (cosThetap <= lb.cosTheta_e) return 0;
+    return lb.phi * cosThetap / d2;
+}
+
+// The surface area orientation heuristic cost of a node with bounds _lb_,
+// where _kr_ penalizes long, thin bounds
+static Float LightTreeCost(const LightBounds &lb, Float kr) {
+    Float theta_o = SafeAcos(lb.cosTheta_o), theta_e = SafeAcos(lb.cosTheta_e);
+    Float theta_w = std::min(theta_o + theta_e, Pi);
+    Float sinTheta_o = SafeSqrt(1 - lb.cosTheta_o * lb.cosTheta_o);
+    Float M_omega = 2 * Pi * (1 - lb.cosTheta_o) +
+                    Pi / 2 * (2 * theta_w * sinTheta_o -
+                              std::cos(theta_o - 2 * theta_w) -
+                              2 * theta_o * sinTheta_o + lb.cosTheta_o);
+    return lb.phi * M_omega * kr * lb.bounds.SurfaceArea();
+}
+
+LightTreeDistribution::LightTreeDistribution(const Scene &scene)
+    : scene(scene),
+      lightBitTrails(scene.lights.size(), UnsampledLight),
+      threadLookups(MaxThreadIndex(),
+                    std::make_pair(invalidPackedPos, nullptr)) {
+    std::vector<std::pair<int, LightBounds>> boundedLights;
+    for (size_t i = 0; i < scene.lights.size(); ++i) {
+        LightBounds lb;
+        if (!scene.lights[i]->GetLightBounds(&lb)) {
+            lightBitTrails[i] = UnboundedLight;
+            unboundedLights.push_back(i);
+        } else if (lb.phi > 0)
+            boundedLights.push_back(std::make_pair((int)i, lb));
+    }
+    if (!boundedLights.empty())
+        Build(boundedLights, 0, boundedLights.size(), 0, 0);
+    nLightTreeNodes += nodes.size();
+    if (!unboundedLights.empty())
+        pUnbounded = Float(unboundedLights.size()) /
+                     (unboundedLights.size() + (nodes.empty() ? 0 : 1));
+
+    // Lookup() caches distributions over the same voxel grid as
+    // SpatialLightDistribution
+    Vector3f diag = scene.WorldBound().Diagonal();
+    Float bmax = diag[scene.WorldBound().MaximumExtent()];
+    for (int i = 0; i < 3; ++i)
+        nVoxels[i] =
+            bmax > 0 ? std::max(1, int(std::round(diag[i] / bmax * 64))) : 1;
+    LOG(INFO) << "LightTreeDistribution: " << boundedLights.size()
+              << " bounded lights, " << unboundedLights.size()
+              << " unbounded, " << nodes.size() << " nodes";
+}
+
+LightTreeDistribution::~LightTreeDistribution() {}
+
+int LightTreeDistribution::Build(
+    std::vector<std::pair<int, LightBounds>> &lights, int start, int end,
+    uint64_t bitTrail, int depth) {
+    CHECK_LT(depth, 62);
+    if (end - start == 1) {
+        // Create a leaf for a single light
+        int nodeIndex = nodes.size();
+        nodes.push_back({lights[start].second, lights[start].first, true});
+        lightBitTrails[lights[start].first] = bitTrail;
+        return nodeIndex;
+    }
+
+    // Compute the bounds of the lights and of their centroids
+    LightBounds lb;
+    Bounds3f centroidBounds;
+    for (int i = start; i < end; ++i) {
+        const LightBounds &b = lights[i].second;
+        lb = Union(lb, b);
+        centroidBounds =
+            Union(centroidBounds, (b.bounds.pMin + b.bounds.pMax) * .5f);
+    }
+
+    // Choose the split with the lowest cost over 12 buckets along each axis
+    PBRT_CONSTEXPR int nBuckets = 12;
+    Float minCost = Infinity;
+    int minCostSplitBucket = -1, minCostSplitDim = -1;
+    Vector3f d = lb.bounds.Diagonal();
+    Float maxExtent = MaxComponent(d);
+    for (int dim = 0; dim < 3; ++dim) {
+        if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) continue;
+        LightBounds buckets[nBuckets];
+        for (int i = start; i < end; ++i) {
+            const LightBounds &b = lights[i].second;
+            Point3f pc = (b.bounds.pMin + b.bounds.pMax) * .5f;
+            int bucket = std::min(
+                int(nBuckets * centroidBounds.Offset(pc)[dim]), nBuckets - 1);
+            buckets[bucket] = Union(buckets[bucket], b);
+        }
+        Float kr = d[dim] > 0 ? maxExtent / d[dim] : 1;
+        for (int split = 0; split < nBuckets - 1; ++split) {
+            LightBounds b0, b1;
+            for (int i = 0; i <= split; ++i) b0 = Union(b0, buckets[i]);
+            for (int i = split + 1; i < nBuckets; ++i)
+                b1 = Union(b1, buckets[i]);
+            Float cost = LightTreeCost(b0, kr) + LightTreeCost(b1, kr);
+            if (b0.phi > 0 && b1.phi > 0 && cost < minCost) {
+                minCost = cost;
+                minCostSplitBucket = split;
+                minCostSplitDim = dim;
+            }
+        }
+    }
+
+    // Partition the lights, or split them in half if all centroids
+    // coincide or no split separates them
+    int mid;
+    if (minCostSplitDim == -1)
+        mid = (start + end) / 2;
+    else {
+        auto midIter = std::partition(
+            &lights[start], &lights[end - 1] + 1,
+            [=](const std::pair<int, LightBounds> &l) {
+                const Bounds3f &b = l.second.bounds;
+                Point3f pc = (b.pMin + b.pMax) * .5f;
+                int bucket = std::min(
+                    int(nBuckets * centroidBounds.Offset(pc)[minCostSplitDim]),
+                    nBuckets - 1);
+                return bucket <= minCostSplitBucket;
+            });
+        mid = midIter - &lights[0];
+        if (mid == start || mid == end) mid = (start + end) / 2;
+    }
+
+    // Create the interior node and its children
+    int nodeIndex = nodes.size();
+    nodes.push_back({lb, -1, false});
+    Build(lights, start, mid, bitTrail, depth + 1);
+    int secondChild =
+        Build(lights, mid, end, bitTrail | (uint64_t(1) << depth), depth + 1);
+    nodes[nodeIndex].childOrLightIndex = secondChild;
+    return nodeIndex;
+}
+
+int LightTreeDistribution::Sample(const Point3f &p, Float u,
+                                  Float *pdf) const {
+    // Sample an unbounded light with probability _pUnbounded_
+    if (u < pUnbounded) {
+        int n = unboundedLights.size();
+        int index = std::min(int(u / pUnbounded * n), n - 1);
+        *pdf = pUnbounded / n;
+        return unboundedLights[index];
+    }
+    *pdf = 0;
+    if (nodes.empty()) return -1;
+
+    // Descend the tree, choosing children by their importance
+    u = std::min((u - pUnbounded) / (1 - pUnbounded), OneMinusEpsilon);
+    Float pmf = 1 - pUnbounded;
+    int nodeIndex = 0, nVisited = 1;
+    while (!nodes[nodeIndex].isLeaf) {
+        const Node &node = nodes[nodeIndex];
+        Float ci[2] = {Importance(nodes[nodeIndex + 1].lb, p),
+                       Importance(nodes[node.childOrLightIndex].lb, p)};
+        if (ci[0] == 0 && ci[1] == 0) return -1;
+        Float p0 = ci[0] / (ci[0] + ci[1]);
+        if (u < p0) {
+            nodeIndex = nodeIndex + 1;
+            pmf *= p0;
+            u = std::min(u / p0, OneMinusEpsilon);
+        } else {
+            nodeIndex = node.childOrLightIndex;
+            pmf *= 1 - p0;
+            u = std::min((u - p0) / (1 - p0), OneMinusEpsilon);
+        }
+        ++nVisited;
+    }
+    ReportValue(nLightTreeNodesVisited, nVisited);
+    // A single-light tree still needs the light's importance test
+    if (nodeIndex == 0 && Importance(nodes[0].lb, p) == 0) return -1;
+    *pdf = pmf;
+    return nodes[nodeIndex].childOrLightIndex;
+}
+
+Float LightTreeDistribution::Pdf(const Point3f &p, int lightIndex) const {
+    uint64_t bitTrail = lightBitTrails[lightIndex];
+    if (bitTrail == UnboundedLight) return pUnbounded / unboundedLights.size();
+    if (bitTrail == UnsampledLight) return 0;
+
+    // Follow the light's path from the root, accumulating the probability
+    // of each choice
+    Float pmf = 1 - pUnbounded;
+    int nodeIndex = 0;
+    while (!nodes[nodeIndex].isLeaf) {
+        const Node &node = nodes[nodeIndex];
+        Float ci[2] = {Importance(nodes[nodeIndex + 1].lb, p),
+                       Importance(nodes[node.childOrLightIndex].lb, p)};
+        int child = bitTrail & 1;
+        if (ci[child] == 0) return 0;
+        pmf *= ci[child] / (ci[0] + ci[1]);
+        nodeIndex = child ? node.childOrLightIndex : nodeIndex + 1;
+        bitTrail >>= 1;
+    }
+    if (nodeIndex == 0 && Importance(nodes[0].lb, p) == 0) return 0;
+    return pmf;
+}
+
+const Distribution1D *LightTreeDistribution::Lookup(const Point3f &p) const {
+    ProfilePhase _(Prof::LightDistribLookup);
+    // Compute the packed coordinates of the voxel containing _p_
+    Vector3f offset = scene.WorldBound().Offset(p);
+    Point3i pi;
+    for (int i = 0; i < 3; ++i)
+        pi[i] = Clamp(int(offset[i] * nVoxels[i]), 0, nVoxels[i] - 1);
+    uint64_t packedPos =
+        (uint64_t(pi[0]) << 40) | (uint64_t(pi[1]) << 20) | pi[2];
+
+    // Return the thread's previous distribution if it is for the same
+    // voxel, as it is for BDPT's lookups at a pinhole camera
+    std::pair<uint64_t, const Distribution1D *> &last =
+        threadLookups[ThreadIndex];
+    if (last.first == packedPos) return last.second;
+
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    std::unique_ptr<Distribution1D> &distrib = distributionCache[packedPos];
+    if (!distrib) {
+        ProfilePhase _(Prof::LightDistribCreation);
+        Point3f pCenter = scene.WorldBound().Lerp(
+            Point3f((pi[0] + .5f) / nVoxels[0], (pi[1] + .5f) / nVoxels[1],
+                    (pi[2] + .5f) / nVoxels[2]));
+        distrib.reset(ComputeDistribution(pCenter));
+    }
+    last = std::make_pair(packedPos, distrib.get());
+    return distrib.get();
+}
+
+Distribution1D *LightTreeDistribution::ComputeDistribution(
+    const Point3f &p) const {
+    // As in SpatialLightDistribution, don't leave any light with zero
+    // probability, since it may still illuminate points elsewhere in the
+    // voxel or light paths that leave it
+    std::vector<Float> prob(scene.lights.size());
+    for (size_t i = 0; i < prob.size(); ++i) prob[i] = Pdf(p, i);
+    Float avgProb =
+        std::accumulate(prob.begin(), prob.end(), Float(0)) / prob.size();
+    Float minProb = avgProb > 0 ? .001f * avgProb : 1;
+    for (Float &pr : prob) pr = std::max(pr, minProb);
+    return new Distribution1D(&prob[0], prob.size());
+}
+
 }  // namespace pbrt
@@ -35,6 +35,7 @@
 
 #include "pbrt.h"
 #include "geometry.h"
+#include "light.h"
 #include "sampling.h"
 #include <atomic>
 #include <functional>
@@ -54,10 +55,27 @@ class LightDistribution {
     // Given a point |p| in space, this method returns a (hopefully
     // effective) sampling distribution for light sources at that point.
     virtual const Distribution1D *Lookup(const Point3f &p) const = 0;
+
+    // Samples a light for illuminating |p| using |u| and returns its index
+    // in scene.lights along with the discrete probability of choosing it,
+    // or -1 if no light can be chosen.  The default implementations use
+    // the distribution returned by Lookup().
+    virtual int Sample(const Point3f &p, Float u, Float *pdf) const;
+    virtual Float Pdf(const Point3f &p, int lightIndex) const;
 };
 
 std::unique_ptr<LightDistribution> CreateLightSampleDistribution(
     const std::string &name, const Scene &scene);
+// With |precompute|, a "spatial" distribution computes the distributions
+// of all voxels that contain geometry up front, in parallel.  If
+// |cacheKey| is non-empty, the precomputed distribution is also kept and
+// returned to later scenes that pass the same key; the caller promises
+// that those scenes have the same geometry and lights.
+std::shared_ptr<LightDistribution> CreateLightSampleDistribution(
+    const std::string &name, const Scene &scene, bool precompute,
+    const std::string &cacheKey);
+// Releases the distribution kept for |cacheKey|; called by pbrtCleanup().
+void ClearLightSampleDistributionCache();
 
 // The simplest possible implementation of LightDistribution: this returns
 // a uniform distribution over all light sources, ignoring the provided
@@ -97,20 +115,35 @@ class PowerLightDistribution : public LightDistribution {
 // sampling a light source based on an estimate of its contribution to a
 // region of space.  A fixed voxel grid is imposed over the scene bounds
 // and a sampling distribution is computed as needed for each voxel.
+// It keeps the scene's bounds and lights rather than the scene itself,
+// so that a cached distribution can outlive the scene it was built for.
 class SpatialLightDistribution : public LightDistribution {
   public:
     SpatialLightDistribution(const Scene &scene, int maxVoxels = 64);
     ~SpatialLightDistribution();
     const Distribution1D *Lookup(const Point3f &p) const;
+    // Switches to a flat array of per-voxel distributions and fills in
+    // those of all voxels that contain geometry; other voxels are still
+    // computed on first use.
+    void Precompute(const Scene &scene);
 
   private:
     // Compute the sampling distribution for the voxel with integer
     // coordiantes given by "pi".
     Distribution1D *ComputeDistribution(Point3i pi) const;
+    std::vector<int> FindOccupiedVoxels(const Scene &scene) const;
+    int VoxelIndex(const Point3i &pi) const {
+        return (pi[2] * nVoxels[1] + pi[1]) * nVoxels[0] + pi[0];
+    }
 
-    const Scene &scene;
+    Bounds3f worldBound;
+    std::vector<std::shared_ptr<Light>> lights;
     int nVoxels[3];
 
+    // After Precompute(), the distributions are stored in a flat array
+    // indexed by voxel, and the hash table is freed.
+    std::unique_ptr<std::atomic<Distribution1D *>[]> voxelDistributions;
+
     // The hash table is a fixed number of HashEntry structs (where we
     // allocate more than enough entries in the SpatialLightDistribution
     // constructor). During rendering, the table is allocated without
@@ -124,6 +157,56 @@ class SpatialLightDistribution : public LightDistribution {
     size_t hashTableSize;
 };
 
+// LightTreeDistribution organizes the lights into a bounding volume
+// hierarchy over their spatial and directional emission bounds, and
+// samples a light for a point by descending the tree, choosing each child
+// with probability proportional to an estimate of its contribution to the
+// point.  Sampling a light and evaluating its probability take time
+// proportional to the depth of the tree rather than to the number of
+// lights.  Lights without bounds, like infinite lights, are sampled
+// uniformly with a probability proportional to their number.
+class LightTreeDistribution : public LightDistribution {
+  public:
+    LightTreeDistribution(const Scene &scene);
+    ~LightTreeDistribution();
+    // Returns the full distribution over the lights, evaluated at the
+    // center of a voxel around |p| and cached, for callers that need one;
+    // unlike Sample(), it gives every light a nonzero probability.
+    const Distribution1D *Lookup(const Point3f &p) const;
+    int Sample(const Point3f &p, Float u, Float *pdf) const;
+    Float Pdf(const Point3f &p, int lightIndex) const;
+
+  private:
+    // LightTreeDistribution Private Methods
+    int Build(std::vector<std::pair<int, LightBounds>> &lights, int start,
+              int end, uint64_t bitTrail, int depth);
+    Distribution1D *ComputeDistribution(const Point3f &p) const;
+
+    // LightTreeDistribution Private Data
+    struct Node {
+        LightBounds lb;
+        // Interior nodes store their first child right after themselves
+        // and the index of the second one here; leaves store a light index
+        int childOrLightIndex;
+        bool isLeaf;
+    };
+    const Scene &scene;
+    std::vector<Node> nodes;
+    std::vector<int> unboundedLights;
+    // Each light's path from the root, one bit per level that is set when
+    // the second child is taken; lights that aren't in the tree store
+    // UnboundedLight or UnsampledLight
+    std::vector<uint64_t> lightBitTrails;
+    Float pUnbounded = 0;
+    int nVoxels[3];
+    mutable std::mutex cacheMutex;
+    mutable std::unordered_map<uint64_t, std::unique_ptr<Distribution1D>>
+        distributionCache;
+    // The last distribution each thread looked up
+    mutable std::vector<std::pair<uint64_t, const Distribution1D *>>
+        threadLookups;
+};
+
 }  // namespace pbrt
 
 #endif  // PBRT_CORE_LIGHTDISTRIB_H
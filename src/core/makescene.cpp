@@ -1,4 +1,5 @@
 #include "makescene.h"
+#include "integrators/vpl.h"
 
 namespace ns {
     // a simple struct to model a person
@@ -14,6 +15,11 @@ namespace ns {
         std::string envmap_mesh;
         int xresolution;
         int yresolution;
+        std::vector<std::string> aovs;
+        float maxseconds = 0;
+        float targeterror = 0;
+        std::string integrator = "sppm";
+        int maxdepth = 5;
     };
 
     void from_json(const json& j, scene& s) {
@@ -39,6 +45,16 @@ namespace ns {
             s.xresolution = j.at("xresolution").get<int>();
         if(j.find("yresolution") != j.end())
             s.yresolution = j.at("yresolution").get<int>();
+        if(j.find("aovs") != j.end())
+            s.aovs = j.at("aovs").get<std::vector<std::string> >();
+        if(j.find("maxseconds") != j.end())
+            s.maxseconds = j.at("maxseconds").get<float>();
+        if(j.find("targeterror") != j.end())
+            s.targeterror = j.at("targeterror").get<float>();
+        if(j.find("integrator") != j.end())
+            s.integrator = j.at("integrator").get<std::string>();
+        if(j.find("maxdepth") != j.end())
+            s.maxdepth = j.at("maxdepth").get<int>();
     };
 }
 
@@ -73,13 +89,6 @@ struct ParamListItem {
     bool isString;
 };
 
-struct vpls {
-    double pos[3]; // 4.644200 0.000000 -1.963826
-    double nor[3]; // -0.886482 0.264871 0.379464
-    double col[3]; // 0.000260 0.000143 0.000094
-    double scale; // 27.385206
-};
-
 static std::vector<ParamListItem> cur_paramlist;
 static ParamArray *cur_array = nullptr;
 
@@ -98,8 +107,12 @@ void MakeScene(std::string filename)
     json j;
     i >> j;
     ns::scene s = j;
-    int NVPLS = 0;
-    vpls *p;
+    // The "vpl" integrator lights the scene with the VPLs directly; SPPM
+    // sees them as small spherical area lights
+    bool vplIntegrator = s.integrator == "vpl";
+    std::vector<VPL> vpls;
+    if (!s.vpls.empty() && !ReadVPLFile(s.vpls, &vpls))
+        vpls.clear();
     
     for(int ix = 0; ix<j["nScenes"];ix++)
     {
@@ -140,18 +153,75 @@ void MakeScene(std::string filename)
         //Integrator "volpath" "integer maxdepth" [25]
         pbrt::InitParamSet(params, pbrt::SpectrumType::Reflectance);
         std::unique_ptr<int[]> maxdepth(new int[1]);
-        maxdepth[0] = 1;
+        maxdepth[0] = s.maxdepth;
         params.AddInt("maxdepth",std::move(maxdepth),1);
-        std::unique_ptr<int[]> iterations(new int[1]);
-        iterations[0] = 1;
-        params.AddInt("iterations",std::move(iterations),1);
-        std::unique_ptr<std::string[]> lightsamplestrategy(new std::string[1]);
-        lightsamplestrategy[0] = "uniform";
-        params.AddString("lightsamplestrategy",std::move(lightsamplestrategy),1);
-        std::unique_ptr<Float[]> rrthreshold(new Float[1]);
-        rrthreshold[0] = 1;
-        params.AddFloat("rrthreshold",std::move(rrthreshold),1);
-        pbrt::pbrtIntegrator("sppm", params);
+        bool budgeted = s.maxseconds > 0 || s.targeterror > 0;
+        if (budgeted) {
+            std::unique_ptr<Float[]> maxseconds(new Float[1]);
+            maxseconds[0] = s.maxseconds;
+            params.AddFloat("maxseconds",std::move(maxseconds),1);
+            std::unique_ptr<Float[]> targeterror(new Float[1]);
+            targeterror[0] = s.targeterror;
+            params.AddFloat("targeterror",std::move(targeterror),1);
+        }
+        if (vplIntegrator) {
+            // Light the scene with the file's VPLs alone, through lightcuts
+            // so that large VPL files stay affordable
+            std::unique_ptr<std::string[]> vplfile(new std::string[1]);
+            vplfile[0] = s.vpls;
+            params.AddString("vplfile",std::move(vplfile),1);
+            std::unique_ptr<int[]> nlightpaths(new int[1]);
+            nlightpaths[0] = 0;
+            params.AddInt("nlightpaths",std::move(nlightpaths),1);
+            std::unique_ptr<int[]> nsets(new int[1]);
+            nsets[0] = 1;
+            params.AddInt("nsets",std::move(nsets),1);
+            std::unique_ptr<bool[]> lightcuts(new bool[1]);
+            lightcuts[0] = true;
+            params.AddBool("lightcuts",std::move(lightcuts),1);
+            pbrt::pbrtIntegrator("vpl", params);
+        } else {
+            // With a time or error budget, iterations is only an upper bound
+            std::unique_ptr<int[]> iterations(new int[1]);
+            iterations[0] = budgeted ? 1024 : 1;
+            params.AddInt("iterations",std::move(iterations),1);
+            if (budgeted) {
+                // Keep the shared photon map at a fixed size rather than one
+                // photon per pixel for each of the allowed iterations
+                std::unique_ptr<int[]> photonmapphotons(new int[1]);
+                photonmapphotons[0] = 16 * s.xresolution * s.yresolution;
+                params.AddInt("photonmapphotons",std::move(photonmapphotons),1);
+                std::unique_ptr<bool[]> adaptivephotons(new bool[1]);
+                adaptivephotons[0] = true;
+                params.AddBool("adaptivephotons",std::move(adaptivephotons),1);
+            }
+            std::unique_ptr<std::string[]> lightsamplestrategy(new std::string[1]);
+            lightsamplestrategy[0] = "uniform";
+            params.AddString("lightsamplestrategy",std::move(lightsamplestrategy),1);
+            std::unique_ptr<Float[]> rrthreshold(new Float[1]);
+            rrthreshold[0] = 1;
+            params.AddFloat("rrthreshold",std::move(rrthreshold),1);
+            // Only the camera changes between scenes that share an object
+            // pose, so they can all gather from the same stored photon map.
+            // Photons are only stored after their first bounce, so with a
+            // depth of one the map would be empty and isn't traced.  A
+            // target error needs independent photons in every iteration to
+            // be measured, so it keeps SPPM progressive.
+            if (s.maxdepth > 1 && s.targeterror <= 0) {
+                std::unique_ptr<bool[]> photonmap(new bool[1]);
+                photonmap[0] = true;
+                params.AddBool("photonmap",std::move(photonmap),1);
+                std::unique_ptr<std::string[]> photonmapkey(new std::string[1]);
+                photonmapkey[0] = s.envmap + ";" + s.envmap_mesh + ";" +
+                                  s.vpls + ";" + s.mesh + ";" + s.bsdf;
+                if (!s.mesh.empty())
+                    for (int k = 0; k < 3; k++)
+                        photonmapkey[0] +=
+                            ";" + std::to_string(s.objectPose[ix][k]);
+                params.AddString("photonmapkey",std::move(photonmapkey),1);
+            }
+            pbrt::pbrtIntegrator("sppm", params);
+        }
 
         //Film "image" "string filename" ["green-acrylic-bunny.png"]
         pbrt::InitParamSet(params, pbrt::SpectrumType::Reflectance);
@@ -166,6 +236,16 @@ void MakeScene(std::string filename)
         std::unique_ptr<int[]> yresolution(new int[1]);
         yresolution[0] = s.yresolution;
         params.AddInt("yresolution",std::move(yresolution),1);  
+        // Let the EXR write of this scene overlap the next scene's render
+        std::unique_ptr<bool[]> asyncwrite(new bool[1]);
+        asyncwrite[0] = true;
+        params.AddBool("asyncwrite",std::move(asyncwrite),1);
+        //     "string aovs" ["depth" "normal"]
+        if (!s.aovs.empty()) {
+            std::unique_ptr<std::string[]> aovs(new std::string[s.aovs.size()]);
+            std::copy(s.aovs.begin(), s.aovs.end(), aovs.get());
+            params.AddString("aovs",std::move(aovs),s.aovs.size());
+        }
         pbrt::pbrtFilm("image", params);
 
         //WorldBegin
@@ -192,99 +272,14 @@ void MakeScene(std::string filename)
             pbrt::pbrtAttributeEnd();
         }   
         
-        if(!s.vpls.empty()){
-
-            std::string line;
-            std::ifstream vpls_data;
-            vpls_data.open(s.vpls);
-            
-            std::istringstream iss;
-            std::string substring;
-
-            //pbrt::pbrtRotate(90,1,0,0);
-
-            if (vpls_data.is_open()) 
-            {
-                std::getline (vpls_data,line); //skips first line of data_vpls.txt
-                
-
-                iss.str(line);
-                iss >> substring; iss >> substring; 
-                int step = 1;
-                NVPLS = std::stoi(substring)/step;
-
-/*                for(int v=0;v<2294272;v++)
-                        std::getline (vpls_data,line);
-*/
-                p = (struct vpls*)  malloc(NVPLS * sizeof(struct vpls)); 
-                for(int j=0;j<NVPLS;j++)
-                {
-
-                    /*for(int v=0;v<step*4;v++)
-                        std::getline (vpls_data,line);*/
-
-                    std::getline (vpls_data,line);
-                    //std::cout<<line<<std::endl;
-                    iss.str(line);
-                    //position
-                    iss >> substring;
-                    for (int i=0;i<3;i++)
-                    {
-                        iss >> substring;
-                        p[j].pos[i] = std::stod(substring);
-                    }
-                    
-                    //normal
-                    std::getline (vpls_data,line);  
-                    iss.str(line);
-                    iss >> substring;
-                    for (int i=0;i<3;i++)
-                    {
-                        iss >> substring;
-                        p[j].nor[i] = std::stod(substring);
-                    }
-
-                    //color
-                    std::getline (vpls_data,line);  
-                    iss.str(line);
-                    iss >> substring;
-                    for (int i=0;i<3;i++)
-                    {
-                        iss >> substring;
-                        p[j].col[i] = std::stod(substring);
-                    }
-
-                    //scale
-                    std::getline (vpls_data,line);
-                    iss.str(line);
-                    iss >> substring;
-                    iss >> substring;
-                    p[j].scale = std::stod(substring);
-                    
-                    /*std::cout<<"pos: "<<p[j].pos[0]<<" "<<p[j].pos[1]<<" "<<p[j].pos[2]<<" "<<std::endl;
-                    std::cout<<"nor: "<<p[j].nor[0]<<" "<<p[j].nor[1]<<" "<<p[j].nor[2]<<" "<<std::endl;
-                    std::cout<<"col: "<<p[j].col[0]<<" "<<p[j].col[1]<<" "<<p[j].col[2]<<" "<<std::endl;
-                    std::cout<<"sca: "<<p[j].scale<<std::endl;
-                    char a;
-                    scanf("%c",&a);*/
-                    
-                }
-                vpls_data.close();
-                
-            }
-            else
-            {
-                std::cout<<"Error reading vpls_data.txt"<<std::endl;
-            }
-
-            for(int j=0;j<NVPLS;j++)
+        if(!vplIntegrator){
+            for(size_t j=0;j<vpls.size();j++)
             {
                 //AttributeBegin
                 pbrt::pbrtAttributeBegin();
                 pbrt::InitParamSet(params, pbrt::SpectrumType::Illuminant);
                 std::unique_ptr<Float[]> rgb(new Float[3]);
-                for(int i=0;i<3;i++)
-                    rgb[i] = p[j].col[i];
+                vpls[j].I.ToRGB(rgb.get());
                 params.AddRGBSpectrum("L", std::move(rgb), 3);
                 //AreaLightSource "diffuse"
                 pbrt::pbrtAreaLightSource("diffuse", params);
@@ -292,8 +287,7 @@ void MakeScene(std::string filename)
                 
                 //Translate 0 0 10
                 pbrt::pbrtTransformBegin();
-                pbrt::pbrtTranslate(p[j].pos[0],p[j].pos[1],p[j].pos[2]);
-                //std::cout<<p[j].pos[0]<<" "<<p[j].pos[1]<<" "<<p[j].pos[2]<<std::endl;
+                pbrt::pbrtTranslate(vpls[j].p.x,vpls[j].p.y,vpls[j].p.z);
                 //pbrt::pbrtTranslate(0,1,1);
                 pbrt::InitParamSet(params, pbrt::SpectrumType::Reflectance);
                 //Shape "sphere" "float radius" [1]                
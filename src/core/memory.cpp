@@ -33,9 +33,115 @@
 
 // core/memory.cpp*
 #include "memory.h"
+#include "parallel.h"
+#include "stats.h"
+#include "stringprint.h"
+#include <map>
+#include <mutex>
+#include <set>
+#ifdef PBRT_IS_LINUX
+#include <sys/mman.h>
+#endif
 
 namespace pbrt {
 
+STAT_PERCENT("Memory/Arena blocks reused from pool", arenaBlocksReused,
+             arenaBlockRequests);
+STAT_MEMORY_COUNTER("Memory/Arena pool blocks allocated", arenaPoolMemory);
+
+// Memory Local Definitions
+static const char *ArenaCategoryNames[] = {
+    "general", "rendering", "SPPM camera pass", "SPPM visible points",
+    "SPPM photon pass", "BDPT light paths",
+};
+
+static_assert((int)ArenaCategory::NumCategories ==
+                  sizeof(ArenaCategoryNames) / sizeof(ArenaCategoryNames[0]),
+              "ArenaCategoryNames[] array and ArenaCategory enumerant have "
+              "different numbers of entries!");
+
+static PBRT_CONSTEXPR size_t HugePageSize = 2 * 1024 * 1024;
+
+// _MemoryArena_ is over-aligned, so the per-thread arenas are allocated
+// with _AllocAligned()_ rather than with a new-expression
+struct AlignedArenaDeleter {
+    void operator()(MemoryArena *arena) const {
+        arena->~MemoryArena();
+        FreeAligned(arena);
+    }
+};
+typedef std::unique_ptr<MemoryArena, AlignedArenaDeleter> ThreadArenaPtr;
+
+struct ArenaBlockPool {
+    std::mutex mutex;
+    bool useHugePages = false;
+    std::multimap<size_t, uint8_t *> freeBlocks;
+    // Blocks that came from mmap() rather than AllocAligned()
+    std::set<uint8_t *> mappedBlocks;
+    std::vector<ThreadArenaPtr>
+        threadArenas[(int)ArenaCategory::NumCategories];
+};
+
+// The pool is intentionally leaked so that arenas with static storage
+// duration can still hand back their blocks during program exit.
+static ArenaBlockPool &GetArenaBlockPool() {
+    static ArenaBlockPool *pool = new ArenaBlockPool;
+    return *pool;
+}
+
+// Bytes of arena blocks currently held per category, the high-water mark
+// since the last statistics report, and the total handed out since then.
+static std::atomic<int64_t> arenaBytesInUse[(int)ArenaCategory::NumCategories];
+static std::atomic<int64_t> arenaPeakBytes[(int)ArenaCategory::NumCategories];
+static std::atomic<int64_t> arenaTotalBytes[(int)ArenaCategory::NumCategories];
+
+static void ReportArenaStats(StatsAccumulator &accum) {
+    // Every thread runs the stat callbacks; only the first one to get here
+    // after a change reports nonzero values.
+    for (int i = 0; i < (int)ArenaCategory::NumCategories; ++i) {
+        accum.ReportMemoryCounter(
+            StringPrintf("Memory/Arena peak (%s)", ArenaCategoryNames[i]),
+            arenaPeakBytes[i].exchange(0));
+        accum.ReportMemoryCounter(
+            StringPrintf("Memory/Arena total (%s)", ArenaCategoryNames[i]),
+            arenaTotalBytes[i].exchange(0));
+    }
+}
+
+static StatRegisterer arenaStatsRegisterer(ReportArenaStats);
+
+static uint8_t *AllocHugePageBlock(size_t size) {
+#ifdef PBRT_IS_LINUX
+    // Prefer explicitly reserved huge pages; fall back to asking for
+    // transparent huge pages if none are available.
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr == MAP_FAILED) {
+        ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED) return nullptr;
+#ifdef MADV_HUGEPAGE
+        madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+    }
+    return (uint8_t *)ptr;
+#else
+    return nullptr;
+#endif
+}
+
+static void FreePoolBlock(ArenaBlockPool &pool, uint8_t *block, size_t size) {
+#ifdef PBRT_IS_LINUX
+    auto iter = pool.mappedBlocks.find(block);
+    if (iter != pool.mappedBlocks.end()) {
+        pool.mappedBlocks.erase(iter);
+        munmap(block, size);
+        return;
+    }
+#endif
+    FreeAligned(block);
+}
+
 // Memory Allocation Functions
 void *AllocAligned(size_t size) {
 #if defined(PBRT_IS_WINDOWS)
@@ -58,4 +164,102 @@ void FreeAligned(void *ptr) {
 #endif
 }
 
+uint8_t *AllocArenaBlock(size_t minSize, ArenaCategory category,
+                         size_t *allocSize) {
+    ArenaBlockPool &pool = GetArenaBlockPool();
+    uint8_t *block = nullptr;
+    ++arenaBlockRequests;
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        // Reuse the smallest free block that is large enough
+        auto iter = pool.freeBlocks.lower_bound(minSize);
+        if (iter != pool.freeBlocks.end()) {
+            *allocSize = iter->first;
+            block = iter->second;
+            pool.freeBlocks.erase(iter);
+            ++arenaBlocksReused;
+        } else if (pool.useHugePages) {
+            size_t size = (minSize + HugePageSize - 1) & ~(HugePageSize - 1);
+            block = AllocHugePageBlock(size);
+            if (block) {
+                pool.mappedBlocks.insert(block);
+                *allocSize = size;
+                arenaPoolMemory += size;
+            }
+        }
+    }
+    if (!block) {
+        block = AllocAligned<uint8_t>(minSize);
+        *allocSize = minSize;
+        arenaPoolMemory += minSize;
+    }
+
+    // Update arena statistics for _category_
+    int c = (int)category;
+    int64_t inUse = (arenaBytesInUse[c] += *allocSize);
+    arenaTotalBytes[c] += *allocSize;
+    int64_t peak = arenaPeakBytes[c];
+    while (inUse > peak && !arenaPeakBytes[c].compare_exchange_weak(peak, inUse))
+        ;
+    return block;
+}
+
+void FreeArenaBlock(uint8_t *block, size_t size, ArenaCategory category) {
+    arenaBytesInUse[(int)category] -= size;
+    ArenaBlockPool &pool = GetArenaBlockPool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    pool.freeBlocks.insert(std::make_pair(size, block));
+}
+
+void ArenaPoolInit(bool useHugePages) {
+    ArenaBlockPool &pool = GetArenaBlockPool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    pool.useHugePages = useHugePages;
+    // Give each thread its own arena per category; with huge pages enabled,
+    // size their blocks to match a single huge page.
+    size_t blockSize = useHugePages ? HugePageSize : 262144;
+    for (int c = 0; c < (int)ArenaCategory::NumCategories; ++c) {
+        pool.threadArenas[c].clear();
+        for (int i = 0; i < MaxThreadIndex(); ++i) {
+            MemoryArena *arena = AllocAligned<MemoryArena>(1);
+            new (arena) MemoryArena(blockSize, ArenaCategory(c));
+            pool.threadArenas[c].push_back(ThreadArenaPtr(arena));
+        }
+    }
+}
+
+void ArenaPoolCleanup() {
+    ArenaBlockPool &pool = GetArenaBlockPool();
+    // Destroy the per-thread arenas first so that their blocks return to
+    // the pool before it is emptied. (This must happen without holding the
+    // pool's mutex, since the arenas' destructors acquire it.)
+    std::vector<ThreadArenaPtr>
+        threadArenas[(int)ArenaCategory::NumCategories];
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        for (int c = 0; c < (int)ArenaCategory::NumCategories; ++c)
+            threadArenas[c].swap(pool.threadArenas[c]);
+    }
+    for (int c = 0; c < (int)ArenaCategory::NumCategories; ++c)
+        threadArenas[c].clear();
+
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    for (auto &block : pool.freeBlocks)
+        FreePoolBlock(pool, block.second, block.first);
+    pool.freeBlocks.clear();
+}
+
+MemoryArena &ThreadArena(ArenaCategory category) {
+    std::vector<ThreadArenaPtr> &arenas =
+        GetArenaBlockPool().threadArenas[(int)category];
+    CHECK_LT(ThreadIndex, (int)arenas.size())
+        << "ThreadArena() called before ArenaPoolInit()";
+    return *arenas[ThreadIndex];
+}
+
+void ResetThreadArenas(ArenaCategory category) {
+    for (auto &arena : GetArenaBlockPool().threadArenas[(int)category])
+        arena->Reset();
+}
+
 }  // namespace pbrt
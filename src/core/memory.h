@@ -55,6 +55,21 @@ T *AllocAligned(size_t count) {
 }
 
 void FreeAligned(void *);
+
+// Arena categories; used to attribute pooled arena memory in the statistics
+enum class ArenaCategory {
+    General,
+    Render,
+    SPPMCameraPass,
+    SPPMVisiblePoints,
+    SPPMPhotonPass,
+    BDPTLightPaths,
+    NumCategories
+};
+
+uint8_t *AllocArenaBlock(size_t minSize, ArenaCategory category,
+                         size_t *allocSize);
+void FreeArenaBlock(uint8_t *block, size_t size, ArenaCategory category);
 class
 #ifdef PBRT_HAVE_ALIGNAS
 alignas(PBRT_L1_CACHE_LINE_SIZE)
@@ -62,11 +77,16 @@ alignas(PBRT_L1_CACHE_LINE_SIZE)
     MemoryArena {
   public:
     // MemoryArena Public Methods
-    MemoryArena(size_t blockSize = 262144) : blockSize(blockSize) {}
+    MemoryArena(size_t blockSize = 262144,
+                ArenaCategory category = ArenaCategory::General)
+        : blockSize(blockSize), category(category) {}
     ~MemoryArena() {
-        FreeAligned(currentBlock);
-        for (auto &block : usedBlocks) FreeAligned(block.second);
-        for (auto &block : availableBlocks) FreeAligned(block.second);
+        if (currentBlock)
+            FreeArenaBlock(currentBlock, currentAllocSize, category);
+        for (auto &block : usedBlocks)
+            FreeArenaBlock(block.second, block.first, category);
+        for (auto &block : availableBlocks)
+            FreeArenaBlock(block.second, block.first, category);
     }
     void *Alloc(size_t nBytes) {
         // Round up _nBytes_ to minimum machine alignment
@@ -103,10 +123,9 @@ alignas(PBRT_L1_CACHE_LINE_SIZE)
                     break;
                 }
             }
-            if (!currentBlock) {
-                currentAllocSize = std::max(nBytes, blockSize);
-                currentBlock = AllocAligned<uint8_t>(currentAllocSize);
-            }
+            if (!currentBlock)
+                currentBlock = AllocArenaBlock(std::max(nBytes, blockSize),
+                                               category, &currentAllocSize);
             currentBlockPos = 0;
         }
         void *ret = currentBlock + currentBlockPos;
@@ -136,11 +155,19 @@ alignas(PBRT_L1_CACHE_LINE_SIZE)
     MemoryArena &operator=(const MemoryArena &) = delete;
     // MemoryArena Private Data
     const size_t blockSize;
+    const ArenaCategory category;
     size_t currentBlockPos = 0, currentAllocSize = 0;
     uint8_t *currentBlock = nullptr;
     std::list<std::pair<size_t, uint8_t *>> usedBlocks, availableBlocks;
 };
 
+// Process-wide arena pool; blocks released by arenas are kept for reuse
+// by later passes and renders rather than being returned to the system.
+void ArenaPoolInit(bool useHugePages);
+void ArenaPoolCleanup();
+MemoryArena &ThreadArena(ArenaCategory category);
+void ResetThreadArenas(ArenaCategory category);
+
 template <typename T, int logBlockSize>
 class BlockedArray {
   public:
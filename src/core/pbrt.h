@@ -133,6 +133,7 @@ struct BSSRDFTable;
 class Light;
 class VisibilityTester;
 class AreaLight;
+class LightDistribution;
 struct Distribution1D;
 class Distribution2D;
 //#define PBRT_FLOAT_AS_DOUBLE
@@ -155,6 +156,7 @@ struct Options {
     bool quickRender = false;
     bool quiet = false;
     bool cat = false, toPly = false;
+    bool hugePages = false;
     std::string imageFile;
 };
 
@@ -212,6 +214,46 @@ inline double BitsToFloat(uint64_t ui) {
     return f;
 }
 
+// Converts to IEEE 754 half precision, rounding to nearest even
+inline uint16_t FloatToHalf(float f) {
+    uint32_t bits = FloatToBits(f);
+    uint16_t sign = (bits >> 16) & 0x8000;
+    uint32_t absBits = bits & 0x7fffffff;
+    // Handle infinity, NaN and values that round to infinity
+    if (absBits >= 0x7f800000)
+        return sign | 0x7c00 | (absBits > 0x7f800000 ? 0x200 : 0);
+    if (absBits >= 0x477ff000) return sign | 0x7c00;
+    if (absBits < 0x38800000) {
+        // Compute denormalized half, or zero
+        if (absBits < 0x33000000) return sign;
+        uint32_t exponent = absBits >> 23;
+        uint32_t mantissa = (absBits & 0x7fffff) | 0x800000;
+        int shift = 126 - exponent;
+        uint32_t halfBits = mantissa >> shift;
+        uint32_t rem = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        if (rem > halfway || (rem == halfway && (halfBits & 1))) ++halfBits;
+        return sign | halfBits;
+    }
+    // Rebias the exponent and round the mantissa; a carry out of the
+    // mantissa correctly increments the exponent
+    uint32_t halfBits = (absBits - 0x38000000) >> 13;
+    uint32_t rem = absBits & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (halfBits & 1))) ++halfBits;
+    return sign | halfBits;
+}
+
+inline float HalfToFloat(uint16_t h) {
+    uint32_t sign = uint32_t(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f, mantissa = h & 0x3ff;
+    if (exponent == 0x1f)
+        return BitsToFloat(sign | 0x7f800000 | (mantissa << 13));
+    if (exponent == 0) {
+        float v = mantissa * (1.f / 16777216.f);
+        return sign ? -v : v;
+    }
+    return BitsToFloat(sign | ((exponent + 112) << 23) | (mantissa << 13));
+}
+
 inline float NextFloatUp(float v) {
     // Handle infinity and negative zero for _NextFloatUp()_
     if (std::isinf(v) && v > 0.) return v;
@@ -60,6 +60,7 @@ class Primitive {
                                             MemoryArena &arena,
                                             TransportMode mode,
                                             bool allowMultipleLobes) const = 0;
+    virtual int GetObjectID() const { return -1; }
 };
 
 // GeometricPrimitive Declarations
@@ -72,16 +73,19 @@ class GeometricPrimitive : public Primitive {
     GeometricPrimitive(const std::shared_ptr<Shape> &shape,
                        const std::shared_ptr<Material> &material,
                        const std::shared_ptr<AreaLight> &areaLight,
-                       const MediumInterface &mediumInterface)
+                       const MediumInterface &mediumInterface,
+                       int objectID = -1)
         : shape(shape),
           material(material),
           areaLight(areaLight),
-          mediumInterface(mediumInterface) {}
+          mediumInterface(mediumInterface),
+          objectID(objectID) {}
     const AreaLight *GetAreaLight() const;
     const Material *GetMaterial() const;
     void ComputeScatteringFunctions(SurfaceInteraction *isect,
                                     MemoryArena &arena, TransportMode mode,
                                     bool allowMultipleLobes) const;
+    int GetObjectID() const { return objectID; }
 
   private:
     // GeometricPrimitive Private Data
@@ -89,6 +93,8 @@ class GeometricPrimitive : public Primitive {
     std::shared_ptr<Material> material;
     std::shared_ptr<AreaLight> areaLight;
     MediumInterface mediumInterface;
+    // Index of the Shape statement this primitive came from
+    int objectID;
 };
 
 // TransformedPrimitive Declarations
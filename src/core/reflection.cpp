@@ -682,6 +682,18 @@ Spectrum BSDF::f(const Vector3f &woW, const Vector3f &wiW,
     return f;
 }
 
+// Returns true if the BSDF only has Lambertian reflection components, in
+// which case their total reflectance is returned in _R_.
+bool BSDF::IsLambertian(Spectrum *R) const {
+    *R = Spectrum(0.f);
+    for (int i = 0; i < nBxDFs; ++i) {
+        if (!dynamic_cast<const LambertianReflection *>(bxdfs[i]))
+            return false;
+        *R += bxdfs[i]->rho(Vector3f(0, 0, 1), 0, nullptr);
+    }
+    return nBxDFs > 0;
+}
+
 Spectrum BSDF::rho(int nSamples, const Point2f *samples1,
                    const Point2f *samples2, BxDFType flags) const {
     Spectrum ret(0.f);
@@ -183,6 +183,7 @@ class BSDF {
                       BxDFType *sampledType = nullptr) const;
     Float Pdf(const Vector3f &wo, const Vector3f &wi,
               BxDFType flags = BSDF_ALL) const;
+    bool IsLambertian(Spectrum *R) const;
     std::string ToString() const;
 
     // BSDF Public Data
@@ -0,0 +1,225 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+
+// core/sparsevolume.cpp*
+#include "sparsevolume.h"
+#include "stats.h"
+#include <cstdio>
+#ifdef PBRT_IS_LINUX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace pbrt {
+
+STAT_MEMORY_COUNTER("Memory/Sparse volume files", sparseVolumeBytes);
+STAT_COUNTER("Media/Sparse volume leaves", sparseVolumeLeaves);
+
+static const char sparseVolumeMagic[8] = {'P', 'B', 'R', 'T',
+                                          'S', 'V', 'O', 'L'};
+
+static bool IsLittleEndian() {
+    int32_t one = 1;
+    return *(const char *)&one == 1;
+}
+
+// SparseVolume Method Definitions
+std::unique_ptr<SparseVolume> SparseVolume::Read(const std::string &filename) {
+    if (!IsLittleEndian()) {
+        Error("Sparse volume files are only supported on little-endian "
+              "systems.");
+        return nullptr;
+    }
+    std::unique_ptr<SparseVolume> volume(new SparseVolume);
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+#ifdef PBRT_IS_LINUX
+    // Map the file into memory
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        size = st.st_size;
+        void *ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr != MAP_FAILED) {
+            volume->mapping = ptr;
+            volume->mappingSize = size;
+            data = (const uint8_t *)ptr;
+        }
+    }
+    if (fd >= 0) close(fd);
+#endif
+    if (!data) {
+        // Read the whole file if it couldn't be mapped
+        FILE *f = fopen(filename.c_str(), "rb");
+        if (!f) {
+            Error("Unable to open sparse volume file \"%s\"", filename.c_str());
+            return nullptr;
+        }
+        fseek(f, 0, SEEK_END);
+        long fileSize = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        size = std::max(0L, fileSize);
+        volume->fileData.reset(new uint8_t[size]);
+        if (fread(volume->fileData.get(), 1, size, f) != size) size = 0;
+        fclose(f);
+        data = volume->fileData.get();
+    }
+
+    // Validate the header and set up pointers into the file's arrays
+    const size_t headerSize = sizeof(sparseVolumeMagic) + 4 * sizeof(int32_t);
+    if (size < headerSize ||
+        memcmp(data, sparseVolumeMagic, sizeof(sparseVolumeMagic)) != 0) {
+        Error("\"%s\" is not a sparse volume file", filename.c_str());
+        return nullptr;
+    }
+    int32_t header[4];
+    memcpy(header, data + sizeof(sparseVolumeMagic), sizeof(header));
+    volume->res = Point3i(header[0], header[1], header[2]);
+    volume->nLeaves = header[3];
+    const int leafSize = 1 << LogLeafSize;
+    volume->nBlocks = Point3i((volume->res.x + leafSize - 1) / leafSize,
+                              (volume->res.y + leafSize - 1) / leafSize,
+                              (volume->res.z + leafSize - 1) / leafSize);
+    size_t nBlocks = (size_t)std::max(0, volume->nBlocks.x) *
+                     std::max(0, volume->nBlocks.y) *
+                     std::max(0, volume->nBlocks.z);
+    size_t nLeaves = std::max(0, volume->nLeaves);
+    if (volume->res.x <= 0 || volume->res.y <= 0 || volume->res.z <= 0 ||
+        volume->nLeaves < 0 ||
+        size != headerSize + sizeof(int32_t) * nBlocks +
+                    sizeof(float) * nLeaves * (1 + LeafVoxels)) {
+        Error("Sparse volume file \"%s\" has an invalid header or size",
+              filename.c_str());
+        return nullptr;
+    }
+    volume->leafIndex = (const int32_t *)(data + headerSize);
+    volume->leafMax = (const float *)(volume->leafIndex + nBlocks);
+    volume->leafValues = volume->leafMax + nLeaves;
+    for (size_t i = 0; i < nBlocks; ++i)
+        if (volume->leafIndex[i] < -1 ||
+            volume->leafIndex[i] >= volume->nLeaves) {
+            Error("Sparse volume file \"%s\" has an invalid leaf index",
+                  filename.c_str());
+            return nullptr;
+        }
+    sparseVolumeBytes += size;
+    sparseVolumeLeaves += nLeaves;
+    return volume;
+}
+
+bool SparseVolume::Write(const std::string &filename, int nx, int ny, int nz,
+                         const Float *values) {
+    // Gather the values of each block that has nonzero values into a leaf
+    const int leafSize = 1 << LogLeafSize;
+    Point3i nBlocks((nx + leafSize - 1) / leafSize,
+                    (ny + leafSize - 1) / leafSize,
+                    (nz + leafSize - 1) / leafSize);
+    std::vector<int32_t> leafIndex;
+    std::vector<float> leafMax, leafValues;
+    std::vector<float> leaf(LeafVoxels);
+    for (int bz = 0; bz < nBlocks.z; ++bz)
+        for (int by = 0; by < nBlocks.y; ++by)
+            for (int bx = 0; bx < nBlocks.x; ++bx) {
+                bool empty = true;
+                float maxValue = 0;
+                for (int i = 0; i < LeafVoxels; ++i) {
+                    int x = bx * leafSize + (i & (leafSize - 1));
+                    int y = by * leafSize +
+                            ((i >> LogLeafSize) & (leafSize - 1));
+                    int z = bz * leafSize + (i >> (2 * LogLeafSize));
+                    leaf[i] = (x < nx && y < ny && z < nz)
+                                  ? values[((size_t)z * ny + y) * nx + x]
+                                  : 0;
+                    if (leaf[i] != 0) empty = false;
+                    maxValue = std::max(maxValue, leaf[i]);
+                }
+                if (empty) {
+                    leafIndex.push_back(-1);
+                    continue;
+                }
+                leafIndex.push_back(leafMax.size());
+                leafMax.push_back(maxValue);
+                leafValues.insert(leafValues.end(), leaf.begin(), leaf.end());
+            }
+
+    FILE *f = fopen(filename.c_str(), "wb");
+    if (!f) {
+        Error("Unable to open sparse volume file \"%s\" for writing",
+              filename.c_str());
+        return false;
+    }
+    int32_t header[4] = {nx, ny, nz, (int32_t)leafMax.size()};
+    bool ok =
+        fwrite(sparseVolumeMagic, sizeof(sparseVolumeMagic), 1, f) == 1 &&
+        fwrite(header, sizeof(header), 1, f) == 1 &&
+        fwrite(leafIndex.data(), sizeof(int32_t), leafIndex.size(), f) ==
+            leafIndex.size() &&
+        fwrite(leafMax.data(), sizeof(float), leafMax.size(), f) ==
+            leafMax.size() &&
+        fwrite(leafValues.data(), sizeof(float), leafValues.size(), f) ==
+            leafValues.size();
+    if (fclose(f) != 0 || !ok) {
+        Error("Unable to write sparse volume file \"%s\"", filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+SparseVolume::~SparseVolume() {
+#ifdef PBRT_IS_LINUX
+    if (mapping) munmap(mapping, mappingSize);
+#endif
+}
+
+Float SparseVolume::MaxValue(const Bounds3i &bounds) const {
+    // Return the maximum of the leaves that overlap _bounds_
+    Bounds3i b = Intersect(bounds, Bounds3i(Point3i(0, 0, 0), res));
+    if (b.pMin.x >= b.pMax.x || b.pMin.y >= b.pMax.y || b.pMin.z >= b.pMax.z)
+        return 0;
+    Float maxValue = 0;
+    for (int bz = b.pMin.z >> LogLeafSize; bz <= (b.pMax.z - 1) >> LogLeafSize;
+         ++bz)
+        for (int by = b.pMin.y >> LogLeafSize;
+             by <= (b.pMax.y - 1) >> LogLeafSize; ++by)
+            for (int bx = b.pMin.x >> LogLeafSize;
+                 bx <= (b.pMax.x - 1) >> LogLeafSize; ++bx) {
+                int leaf = leafIndex[(bz * nBlocks.y + by) * nBlocks.x + bx];
+                if (leaf >= 0)
+                    maxValue = std::max(maxValue, (Float)leafMax[leaf]);
+            }
+    return maxValue;
+}
+
+}  // namespace pbrt
@@ -0,0 +1,103 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_CORE_SPARSEVOLUME_H
+#define PBRT_CORE_SPARSEVOLUME_H
+
+// core/sparsevolume.h*
+#include "pbrt.h"
+#include "geometry.h"
+
+namespace pbrt {
+
+// SparseVolume Declarations
+// Scalar voxel grid stored as 8x8x8 leaf blocks, where only blocks with
+// nonzero values are stored; a dense index over all blocks gives each
+// block's leaf, or -1 for empty blocks, whose values are all zero.
+// Volumes are read from files with the following little-endian layout,
+// which are memory mapped where possible so that only the leaves that
+// are actually used are paged in:
+//
+//     char magic[8] = "PBRTSVOL"
+//     int32_t nx, ny, nz, nLeaves
+//     int32_t leafIndex[nBlocks]   // x varies fastest (z-major order)
+//     float leafMax[nLeaves]       // maximum value in each leaf
+//     float leafValues[nLeaves][512]
+class SparseVolume {
+  public:
+    // SparseVolume Public Methods
+    static std::unique_ptr<SparseVolume> Read(const std::string &filename);
+    static bool Write(const std::string &filename, int nx, int ny, int nz,
+                      const Float *values);
+    ~SparseVolume();
+    Point3i Resolution() const { return res; }
+    int LeafCount() const { return nLeaves; }
+    Float Lookup(const Point3i &p) const {
+        if (!InsideExclusive(p, Bounds3i(Point3i(0, 0, 0), res))) return 0;
+        int leaf = leafIndex[((p.z >> LogLeafSize) * nBlocks.y +
+                              (p.y >> LogLeafSize)) *
+                                 nBlocks.x +
+                             (p.x >> LogLeafSize)];
+        if (leaf < 0) return 0;
+        const int mask = (1 << LogLeafSize) - 1;
+        return leafValues[(size_t)leaf * LeafVoxels +
+                          ((((p.z & mask) << LogLeafSize) + (p.y & mask))
+                           << LogLeafSize) +
+                          (p.x & mask)];
+    }
+    Float MaxValue(const Bounds3i &bounds) const;
+
+  private:
+    // SparseVolume Private Methods
+    SparseVolume() {}
+
+    // SparseVolume Private Data
+    static PBRT_CONSTEXPR int LogLeafSize = 3;
+    static PBRT_CONSTEXPR int LeafVoxels = 1 << (3 * LogLeafSize);
+    Point3i res, nBlocks;
+    int nLeaves;
+    const int32_t *leafIndex;
+    const float *leafMax, *leafValues;
+    // The file's contents, either memory mapped or read into _fileData_
+    void *mapping = nullptr;
+    size_t mappingSize = 0;
+    std::unique_ptr<uint8_t[]> fileData;
+};
+
+}  // namespace pbrt
+
+#endif  // PBRT_CORE_SPARSEVOLUME_H
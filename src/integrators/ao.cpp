@@ -71,6 +71,7 @@ Spectrum AOIntegrator::Li(const RayDifferential &r, const Scene &scene,
             ray = isect.SpawnRay(ray.d);
             goto retry;
         }
+        RecordAOVSample(isect);
 
         // Compute coordinate frame based on true geometry, not shading
         // geometry.
@@ -122,7 +123,10 @@ AOIntegrator *CreateAOIntegrator(const ParamSet &params,
     Float rrThreshold = params.FindOneFloat("rrthreshold", 1.);
     bool cosSample = params.FindOneBool("cossample", "true");
     int nSamples = params.FindOneInt("nsamples", 64);
-    return new AOIntegrator(cosSample, nSamples, camera, sampler, pixelBounds);
+    AOIntegrator *integrator =
+        new AOIntegrator(cosSample, nSamples, camera, sampler, pixelBounds);
+    integrator->SetRenderBudget(params);
+    return integrator;
 }
 
 }  // namespace pbrt
@@ -39,12 +39,14 @@
 #include "paramset.h"
 #include "progressreporter.h"
 #include "sampler.h"
+#include "samplers/random.h"
 #include "stats.h"
 
 namespace pbrt {
 
 STAT_PERCENT("Integrator/Zero-radiance paths", zeroRadiancePaths, totalPaths);
 STAT_INT_DISTRIBUTION("Integrator/Path length", pathLength);
+STAT_COUNTER("Integrator/Cached light vertices", cachedLightVertices);
 
 // BDPT Forward Declarations
 int RandomWalk(const Scene &scene, RayDifferential ray, Sampler &sampler,
@@ -87,9 +89,12 @@ int GenerateCameraSubpath(const Scene &scene, Sampler &sampler,
     camera.Pdf_We(ray, &pdfPos, &pdfDir);
     VLOG(2) << "Starting camera subpath. Ray: " << ray << ", beta " << beta
             << ", pdfPos " << pdfPos << ", pdfDir " << pdfDir;
-    return RandomWalk(scene, ray, sampler, arena, beta, pdfDir, maxDepth - 1,
-                      TransportMode::Radiance, path + 1) +
-           1;
+    int nVertices =
+        RandomWalk(scene, ray, sampler, arena, beta, pdfDir, maxDepth - 1,
+                   TransportMode::Radiance, path + 1) +
+        1;
+    InitMISSums(path, nVertices, false);
+    return nVertices;
 }
 
 int GenerateLightSubpath(
@@ -133,6 +138,7 @@ int GenerateLightSubpath(
         path[0].pdfFwd =
             InfiniteLightDensity(scene, lightDistr, lightToIndex, ray.d);
     }
+    InitMISSums(path, nVertices + 1, true);
     return nVertices + 1;
 }
 
@@ -214,6 +220,31 @@ int RandomWalk(const Scene &scene, RayDifferential ray, Sampler &sampler,
     return bounces;
 }
 
+void InitMISSums(Vertex *path, int nVertices, bool lightSubpath) {
+    // Accumulate the ratios of the strategies that _MISWeight()_ considers
+    // at vertices $i \le k$ for connections at vertex $k+2$ and beyond
+    auto remap0 = [](Float f) -> Float { return f != 0 ? f : 1; };
+    Float sumRiConnect = 0, sumRiEndpoint = 0, sumRiMerge = 0;
+    for (int k = lightSubpath ? 0 : 1; k < nVertices; ++k) {
+        Float ri = remap0(path[k].pdfRev) / remap0(path[k].pdfFwd);
+        bool deltaPrev = k > 0 ? path[k - 1].delta : path[0].IsDeltaLight();
+        bool valid = !path[k].delta && !deltaPrev;
+        // Vertices 0 and 1 start the strategies that sample a point on
+        // a light or on the camera
+        if (valid) (k < 2 ? sumRiEndpoint : sumRiConnect) += 1;
+        sumRiConnect *= ri;
+        sumRiEndpoint *= ri;
+        // Merging is possible at non-specular surface vertices other than
+        // the subpath endpoints
+        sumRiMerge *= ri;
+        if (k > 0 && !path[k].delta && path[k].IsMergeable())
+            sumRiMerge += path[k].pdfRev;
+        path[k].sumRiConnect = sumRiConnect;
+        path[k].sumRiEndpoint = sumRiEndpoint;
+        path[k].sumRiMerge = sumRiMerge;
+    }
+}
+
 Spectrum G(const Scene &scene, Sampler &sampler, const Vertex &v0,
            const Vertex &v1) {
     Vector3f d = v0.p() - v1.p();
@@ -225,72 +256,128 @@ Spectrum G(const Scene &scene, Sampler &sampler, const Vertex &v0,
     return g * vis.Tr(scene, sampler);
 }
 
-Float MISWeight(const Scene &scene, Vertex *lightVertices,
-                Vertex *cameraVertices, Vertex &sampled, int s, int t,
-                const Distribution1D &lightPdf,
-                const std::unordered_map<const Light *, size_t> &lightToIndex) {
-    if (s + t == 2) return 1;
-    Float sumRi = 0;
+// Returns the summed densities of the strategies other than the $(s, t)$
+// connection that can sample the path, relative to the connection's. With
+// a positive _mergeEta_, the number of light subpaths times the area of
+// the merge disk, merging at any vertex is counted as well; _qsDelta_ is
+// set when the path scatters specularly at $\pq{}_{s-1}$ and _ptPdfRev_
+// returns the light subpath's density at $\pt{}_{t-1}$.
+static Float OtherStrategies(
+    const Scene &scene, const Vertex *lightVertices,
+    const Vertex *cameraVertices, const Vertex &sampled, int s, int t,
+    const Distribution1D &lightPdf,
+    const std::unordered_map<const Light *, size_t> &lightToIndex,
+    Float connectionCount, Float mergeEta, bool qsDelta, Float *ptPdfRev) {
+    Float sumRi = 0, sumMergeRi = 0;
     // Define helper function _remap0_ that deals with Dirac delta functions
     auto remap0 = [](Float f) -> Float { return f != 0 ? f : 1; };
 
-    // Temporarily update vertex properties for current strategy
-
-    // Look up connection vertices and their predecessors
-    Vertex *qs = s > 0 ? &lightVertices[s - 1] : nullptr,
-           *pt = t > 0 ? &cameraVertices[t - 1] : nullptr,
-           *qsMinus = s > 1 ? &lightVertices[s - 2] : nullptr,
-           *ptMinus = t > 1 ? &cameraVertices[t - 2] : nullptr;
-
-    // Update sampled vertex for $s=1$ or $t=1$ strategy
-    ScopedAssignment<Vertex> a1;
-    if (s == 1)
-        a1 = {qs, sampled};
-    else if (t == 1)
-        a1 = {pt, sampled};
-
-    // Mark connection vertices as non-degenerate
-    ScopedAssignment<bool> a2, a3;
-    if (pt) a2 = {&pt->delta, false};
-    if (qs) a3 = {&qs->delta, false};
-
-    // Update reverse density of vertex $\pt{}_{t-1}$
-    ScopedAssignment<Float> a4;
+    // Define helper function _count_ giving the number of samples taken of
+    // a strategy, relative to those of the current one
+    auto count = [&](int si, int ti) -> Float {
+        Float n = (si >= 2 && ti >= 2) ? connectionCount : 1;
+        return (s >= 2 && t >= 2) ? n / connectionCount : n;
+    };
+
+    // Look up connection vertices and their predecessors; the sampled
+    // vertex replaces the endpoint for $s=1$ or $t=1$ strategies
+    const Vertex *qs = s == 1 ? &sampled : s > 1 ? &lightVertices[s - 1]
+                                                 : nullptr,
+                 *pt = t == 1 ? &sampled : t > 1 ? &cameraVertices[t - 1]
+                                                 : nullptr,
+                 *qsMinus = s > 1 ? &lightVertices[s - 2] : nullptr,
+                 *ptMinus = t > 1 ? &cameraVertices[t - 2] : nullptr;
+
+    // Compute the reverse densities that the connection changes; only the
+    // connection vertices and their predecessors are affected, and the
+    // connection vertices are treated as non-degenerate
+    Float ptPdfRevConnect = 0, ptMinusPdfRev = 0, qsPdfRev = 0,
+          qsMinusPdfRev = 0;
     if (pt)
-        a4 = {&pt->pdfRev, s > 0 ? qs->Pdf(scene, qsMinus, *pt)
-                                 : pt->PdfLightOrigin(scene, *ptMinus, lightPdf,
-                                                      lightToIndex)};
-
-    // Update reverse density of vertex $\pt{}_{t-2}$
-    ScopedAssignment<Float> a5;
+        ptPdfRevConnect = s > 0 ? qs->Pdf(scene, qsMinus, *pt)
+                                : pt->PdfLightOrigin(scene, *ptMinus,
+                                                     lightPdf, lightToIndex);
     if (ptMinus)
-        a5 = {&ptMinus->pdfRev, s > 0 ? pt->Pdf(scene, qs, *ptMinus)
-                                      : pt->PdfLight(scene, *ptMinus)};
-
-    // Update reverse density of vertices $\pq{}_{s-1}$ and $\pq{}_{s-2}$
-    ScopedAssignment<Float> a6;
-    if (qs) a6 = {&qs->pdfRev, pt->Pdf(scene, ptMinus, *qs)};
-    ScopedAssignment<Float> a7;
-    if (qsMinus) a7 = {&qsMinus->pdfRev, qs->Pdf(scene, pt, *qsMinus)};
-
-    // Consider hypothetical connection strategies along the camera subpath
-    Float ri = 1;
-    for (int i = t - 1; i > 0; --i) {
-        ri *=
-            remap0(cameraVertices[i].pdfRev) / remap0(cameraVertices[i].pdfFwd);
-        if (!cameraVertices[i].delta && !cameraVertices[i - 1].delta)
-            sumRi += ri;
+        ptMinusPdfRev = s > 0 ? pt->Pdf(scene, qs, *ptMinus)
+                              : pt->PdfLight(scene, *ptMinus);
+    if (qs) qsPdfRev = pt->Pdf(scene, ptMinus, *qs);
+    if (qsMinus) qsMinusPdfRev = qs->Pdf(scene, pt, *qsMinus);
+    if (ptPdfRev) *ptPdfRev = ptPdfRevConnect;
+
+    // Consider hypothetical connection strategies along the camera subpath;
+    // those ending before $\pt{}_{t-2}$ come from the cached sums. Merging
+    // at a vertex samples the path with the density of the strategy that
+    // ends there times the light subpath's density of reaching it.
+    Float ri;
+    if (t > 1) {
+        if (s > 0 && pt->IsMergeable()) sumMergeRi += ptPdfRevConnect;
+        ri = remap0(ptPdfRevConnect) / remap0(pt->pdfFwd);
+        if (!ptMinus->delta) sumRi += ri * count(s + 1, t - 1);
+    }
+    if (t > 2) {
+        const Vertex &prev = cameraVertices[t - 3];
+        if (!ptMinus->delta && ptMinus->IsMergeable())
+            sumMergeRi += ri * ptMinusPdfRev;
+        ri *= remap0(ptMinusPdfRev) / remap0(ptMinus->pdfFwd);
+        if (!ptMinus->delta && !prev.delta)
+            sumRi += ri * count(s + 2, t - 2);
+        sumRi += ri * (prev.sumRiConnect * count(2, 2) +
+                       prev.sumRiEndpoint * count(1, 1));
+        sumMergeRi += ri * prev.sumRiMerge;
     }
 
     // Consider hypothetical connection strategies along the light subpath
-    ri = 1;
-    for (int i = s - 1; i >= 0; --i) {
-        ri *= remap0(lightVertices[i].pdfRev) / remap0(lightVertices[i].pdfFwd);
-        bool deltaLightvertex = i > 0 ? lightVertices[i - 1].delta
-                                      : lightVertices[0].IsDeltaLight();
-        if (!lightVertices[i].delta && !deltaLightvertex) sumRi += ri;
+    if (s > 0) {
+        if (s > 1 && !qsDelta && qs->IsMergeable()) sumMergeRi += qsPdfRev;
+        ri = remap0(qsPdfRev) / remap0(qs->pdfFwd);
+        bool deltaLightvertex = s > 1 ? qsMinus->delta : qs->IsDeltaLight();
+        if (!qsDelta && !deltaLightvertex) sumRi += ri * count(s - 1, t + 1);
     }
-    return 1 / (1 + sumRi);
+    if (s > 1) {
+        if (s > 2 && !qsMinus->delta && qsMinus->IsMergeable())
+            sumMergeRi += ri * qsMinusPdfRev;
+        ri *= remap0(qsMinusPdfRev) / remap0(qsMinus->pdfFwd);
+        bool deltaLightvertex =
+            s > 2 ? lightVertices[s - 3].delta : qsMinus->IsDeltaLight();
+        if (!qsMinus->delta && !deltaLightvertex)
+            sumRi += ri * count(s - 2, t + 2);
+        if (s > 2) {
+            const Vertex &prev = lightVertices[s - 3];
+            sumRi += ri * (prev.sumRiConnect * count(2, 2) +
+                           prev.sumRiEndpoint * count(1, 1));
+            sumMergeRi += ri * prev.sumRiMerge;
+        }
+    }
+    return sumRi + mergeEta * sumMergeRi;
+}
+
+Float MISWeight(const Scene &scene, Vertex *lightVertices,
+                Vertex *cameraVertices, Vertex &sampled, int s, int t,
+                const Distribution1D &lightPdf,
+                const std::unordered_map<const Light *, size_t> &lightToIndex,
+                Float connectionCount, Float mergeEta) {
+    if (s + t == 2) return 1;
+    return 1 / (1 + OtherStrategies(scene, lightVertices, cameraVertices,
+                                    sampled, s, t, lightPdf, lightToIndex,
+                                    connectionCount, mergeEta, false,
+                                    nullptr));
+}
+
+Float MergeMISWeight(
+    const Scene &scene, const Vertex *lightVertices,
+    const Vertex *cameraVertices, int s, int t,
+    const Distribution1D &lightPdf,
+    const std::unordered_map<const Light *, size_t> &lightToIndex,
+    Float mergeEta) {
+    // Weigh merging at $\pt{}_{t-1}$ against all strategies, including the
+    // $(s, t)$ connection when $\pq{}_{s-1}$ scatters non-specularly
+    const Vertex &qs = lightVertices[s - 1];
+    Float ptPdfRev;
+    Float others = OtherStrategies(scene, lightVertices, cameraVertices, qs,
+                                   s, t, lightPdf, lightToIndex, 1, mergeEta,
+                                   qs.delta, &ptPdfRev);
+    Float connect = (!qs.delta && qs.IsConnectible()) ? 1 : 0;
+    return others > 0 ? mergeEta * ptPdfRev / (connect + others) : 0;
 }
 
 // BDPT Method Definitions
@@ -300,6 +387,10 @@ inline int BufferIndex(int s, int t) {
 }
 
 void BDPTIntegrator::Render(const Scene &scene) {
+    if (lightVertexCache) {
+        RenderLightVertexCache(scene);
+        return;
+    }
     std::unique_ptr<LightDistribution> lightDistribution =
         CreateLightSampleDistribution(lightSampleStrategy, scene);
 
@@ -345,7 +436,7 @@ void BDPTIntegrator::Render(const Scene &scene) {
     if (scene.lights.size() > 0) {
         ParallelFor2D([&](const Point2i tile) {
             // Render a single tile using BDPT
-            MemoryArena arena;
+            MemoryArena &arena = ThreadArena(ArenaCategory::Render);
             int seed = tile.y * nXTiles + tile.x;
             std::unique_ptr<Sampler> tileSampler = sampler->Clone(seed);
             int x0 = sampleBounds.pMin.x + tile.x * tileSize;
@@ -438,12 +529,188 @@ void BDPTIntegrator::Render(const Scene &scene) {
     }
 }
 
+// With the light vertex cache, each pass first traces one light subpath
+// per pixel into a shared array of vertices and splats their connections
+// to the camera. Each camera vertex then connects to a few cached
+// vertices chosen uniformly, rather than to every vertex of its own light
+// subpath.
+void BDPTIntegrator::RenderLightVertexCache(const Scene &scene) {
+    std::unique_ptr<LightDistribution> lightDistribution =
+        CreateLightSampleDistribution(lightSampleStrategy, scene);
+    std::unordered_map<const Light *, size_t> lightToIndex;
+    for (size_t i = 0; i < scene.lights.size(); ++i)
+        lightToIndex[scene.lights[i].get()] = i;
+
+    // Partition the image into tiles
+    Film *film = camera->film;
+    const Bounds2i sampleBounds = film->GetSampleBounds();
+    const Vector2i sampleExtent = sampleBounds.Diagonal();
+    const int tileSize = 16;
+    const int nXTiles = (sampleExtent.x + tileSize - 1) / tileSize;
+    const int nYTiles = (sampleExtent.y + tileSize - 1) / tileSize;
+    const int64_t spp = sampler->samplesPerPixel;
+    ProgressReporter reporter(spp * nXTiles * nYTiles, "Rendering");
+
+    if (scene.lights.size() > 0) {
+        // As with the regular renderer, the light distribution is looked
+        // up at the camera, which all camera subpaths start from
+        const Distribution1D *lightDistr = lightDistribution->Lookup(
+            camera->CameraToWorld(camera->shutterOpen, Point3f(0, 0, 0)));
+        const int nLightPaths = pixelBounds.Area();
+        const int chunkSize = 64;
+        const int nChunks = (nLightPaths + chunkSize - 1) / chunkSize;
+        std::vector<std::vector<Vertex>> chunkVertices(nChunks);
+        std::vector<Vertex> cache;
+        std::vector<int> cacheDepth, pathStarts, connectible;
+        for (int64_t pass = 0; pass < spp; ++pass) {
+            // Trace the pass's light subpaths; each chunk keeps its own
+            // vertices so that the cache does not depend on the order
+            // threads finish in
+            ResetThreadArenas(ArenaCategory::BDPTLightPaths);
+            ParallelFor([&](int64_t chunk) {
+                MemoryArena &arena = ThreadArena(ArenaCategory::BDPTLightPaths);
+                RandomSampler chunkSampler(1, pass * nChunks + chunk);
+                Vertex *path = arena.Alloc<Vertex>(maxDepth + 1);
+                std::vector<Vertex> &vertices = chunkVertices[chunk];
+                vertices.clear();
+                int end = std::min<int>(nLightPaths, (chunk + 1) * chunkSize);
+                for (int i = chunk * chunkSize; i < end; ++i) {
+                    chunkSampler.StartPixel(Point2i(i, 0));
+                    Float time = Lerp(chunkSampler.Get1D(),
+                                      camera->shutterOpen,
+                                      camera->shutterClose);
+                    int nLight = GenerateLightSubpath(
+                        scene, chunkSampler, arena, maxDepth + 1, time,
+                        *lightDistr, lightToIndex, path);
+                    vertices.insert(vertices.end(), path, path + nLight);
+                }
+            }, nChunks);
+
+            // Gather the subpaths into the cache
+            cache.clear();
+            cacheDepth.clear();
+            pathStarts.clear();
+            connectible.clear();
+            for (const std::vector<Vertex> &vertices : chunkVertices) {
+                for (const Vertex &v : vertices) {
+                    int s = v.type == VertexType::Light
+                                ? 1 : cacheDepth.back() + 1;
+                    if (s == 1) pathStarts.push_back(cache.size());
+                    if (s >= 2 && v.IsConnectible())
+                        connectible.push_back(cache.size());
+                    cache.push_back(v);
+                    cacheDepth.push_back(s);
+                }
+            }
+            pathStarts.push_back(cache.size());
+            cachedLightVertices += connectible.size();
+
+            // Choose the number of connections per camera vertex, by
+            // default the average number of cached vertices per subpath,
+            // and the rate at which that samples connection strategies
+            int nCached = connectible.size();
+            int nConnections = nCacheConnections;
+            if (nConnections <= 0)
+                nConnections =
+                    std::max(1, (int)std::round(Float(nCached) / nLightPaths));
+            Float connectionCount =
+                nCached > 0 ? Float(nConnections) * nLightPaths / nCached : 1;
+
+            // Connect the light subpaths to the camera
+            const int nPaths = pathStarts.size() - 1;
+            ParallelFor([&](int64_t chunk) {
+                RandomSampler chunkSampler(1, (spp + pass) * nChunks + chunk);
+                Vertex cameraVertex;
+                int end = std::min<int>(nPaths, (chunk + 1) * chunkSize);
+                for (int i = chunk * chunkSize; i < end; ++i) {
+                    chunkSampler.StartPixel(Point2i(i, 0));
+                    Vertex *lightVertices = &cache[pathStarts[i]];
+                    int nLight = pathStarts[i + 1] - pathStarts[i];
+                    for (int s = 2; s <= nLight; ++s) {
+                        Point2f pFilm;
+                        Spectrum Lpath = ConnectBDPT(
+                            scene, lightVertices, &cameraVertex, s, 1,
+                            *lightDistr, lightToIndex, *camera, chunkSampler,
+                            &pFilm, nullptr, connectionCount);
+                        if (!Lpath.IsBlack()) film->AddSplat(pFilm, Lpath);
+                    }
+                }
+            }, (nPaths + chunkSize - 1) / chunkSize);
+
+            // Trace the camera subpaths and connect them
+            ParallelFor2D([&](const Point2i tile) {
+                MemoryArena &arena = ThreadArena(ArenaCategory::Render);
+                // Seed by pass as well so that samplers drawing from an RNG
+                // do not repeat the same values in every pass
+                int seed = (pass * nYTiles + tile.y) * nXTiles + tile.x;
+                std::unique_ptr<Sampler> tileSampler = sampler->Clone(seed);
+                int x0 = sampleBounds.pMin.x + tile.x * tileSize;
+                int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
+                int y0 = sampleBounds.pMin.y + tile.y * tileSize;
+                int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
+                Bounds2i tileBounds(Point2i(x0, y0), Point2i(x1, y1));
+                std::unique_ptr<FilmTile> filmTile =
+                    camera->film->GetFilmTile(tileBounds);
+                for (Point2i pPixel : tileBounds) {
+                    tileSampler->StartPixel(pPixel);
+                    if (!InsideExclusive(pPixel, pixelBounds)) continue;
+                    tileSampler->SetSampleNumber(pass);
+                    Point2f pFilm = (Point2f)pPixel + tileSampler->Get2D();
+                    Vertex *cameraVertices = arena.Alloc<Vertex>(maxDepth + 2);
+                    Vertex *lightVertices = arena.Alloc<Vertex>(maxDepth + 1);
+                    int nCamera = GenerateCameraSubpath(
+                        scene, *tileSampler, arena, maxDepth + 2, *camera,
+                        pFilm, cameraVertices);
+                    Spectrum L(0.f);
+                    Point2f pFilmNew;
+                    for (int t = 2; t <= nCamera; ++t) {
+                        // Execute the $(0, t)$ and $(1, t)$ strategies
+                        for (int s = 0; s <= 1 && s + t - 2 <= maxDepth; ++s)
+                            L += ConnectBDPT(scene, lightVertices,
+                                             cameraVertices, s, t, *lightDistr,
+                                             lightToIndex, *camera,
+                                             *tileSampler, &pFilmNew, nullptr,
+                                             connectionCount);
+
+                        // Connect to cached light vertices, which are
+                        // stored contiguously with their subpaths
+                        const Vertex &pt = cameraVertices[t - 1];
+                        if (nCached == 0 || pt.type == VertexType::Light ||
+                            !pt.IsConnectible())
+                            continue;
+                        for (int i = 0; i < nConnections; ++i) {
+                            int index = std::min(
+                                int(tileSampler->Get1D() * nCached),
+                                nCached - 1);
+                            int v = connectible[index], s = cacheDepth[v];
+                            if (s + t - 2 > maxDepth) continue;
+                            L += ConnectBDPT(scene, &cache[v - s + 1],
+                                             cameraVertices, s, t, *lightDistr,
+                                             lightToIndex, *camera,
+                                             *tileSampler, &pFilmNew, nullptr,
+                                             connectionCount) /
+                                 connectionCount;
+                        }
+                    }
+                    filmTile->AddSample(pFilm, L);
+                    arena.Reset();
+                }
+                film->MergeFilmTile(std::move(filmTile));
+                reporter.Update();
+            }, Point2i(nXTiles, nYTiles));
+            film->MergeDeferredTiles();
+        }
+    }
+    reporter.Done();
+    film->WriteImage(1.0f / sampler->samplesPerPixel);
+}
+
 Spectrum ConnectBDPT(
     const Scene &scene, Vertex *lightVertices, Vertex *cameraVertices, int s,
     int t, const Distribution1D &lightDistr,
     const std::unordered_map<const Light *, size_t> &lightToIndex,
     const Camera &camera, Sampler &sampler, Point2f *pRaster,
-    Float *misWeightPtr) {
+    Float *misWeightPtr, Float connectionCount, Float mergeEta) {
     ProfilePhase _(Prof::BDPTConnectSubpaths);
     Spectrum L(0.f);
     // Ignore invalid connections related to infinite area lights
@@ -522,7 +789,8 @@ Spectrum ConnectBDPT(
     // Compute MIS weight for connection strategy
     Float misWeight =
         L.IsBlack() ? 0.f : MISWeight(scene, lightVertices, cameraVertices,
-                                      sampled, s, t, lightDistr, lightToIndex);
+                                      sampled, s, t, lightDistr, lightToIndex,
+                                      connectionCount, mergeEta);
     VLOG(2) << "MIS weight for (s,t) = (" << s << ", " << t << ") connection: "
             << misWeight;
     DCHECK(!std::isnan(misWeight));
@@ -561,8 +829,17 @@ BDPTIntegrator *CreateBDPTIntegrator(const ParamSet &params,
 
     std::string lightStrategy = params.FindOneString("lightsamplestrategy",
                                                      "power");
+    bool lightVertexCache = params.FindOneBool("lightvertexcache", false);
+    int nCacheConnections = params.FindOneInt("cacheconnections", 0);
+    if (lightVertexCache && (visualizeStrategies || visualizeWeights)) {
+        Warning(
+            "visualizestrategies/visualizeweights aren't supported with "
+            "lightvertexcache; ignoring them");
+        visualizeStrategies = visualizeWeights = false;
+    }
     return new BDPTIntegrator(sampler, camera, maxDepth, visualizeStrategies,
-                              visualizeWeights, pixelBounds, lightStrategy);
+                              visualizeWeights, pixelBounds, lightStrategy,
+                              lightVertexCache, nCacheConnections);
 }
 
 }  // namespace pbrt
@@ -131,17 +131,23 @@ class BDPTIntegrator : public Integrator {
                    std::shared_ptr<const Camera> camera, int maxDepth,
                    bool visualizeStrategies, bool visualizeWeights,
                    const Bounds2i &pixelBounds,
-                   const std::string &lightSampleStrategy = "power")
+                   const std::string &lightSampleStrategy = "power",
+                   bool lightVertexCache = false, int nCacheConnections = 0)
         : sampler(sampler),
           camera(camera),
           maxDepth(maxDepth),
           visualizeStrategies(visualizeStrategies),
           visualizeWeights(visualizeWeights),
           pixelBounds(pixelBounds),
-          lightSampleStrategy(lightSampleStrategy) {}
+          lightSampleStrategy(lightSampleStrategy),
+          lightVertexCache(lightVertexCache),
+          nCacheConnections(nCacheConnections) {}
     void Render(const Scene &scene);
 
   private:
+    // BDPTIntegrator Private Methods
+    void RenderLightVertexCache(const Scene &scene);
+
     // BDPTIntegrator Private Data
     std::shared_ptr<Sampler> sampler;
     std::shared_ptr<const Camera> camera;
@@ -150,6 +156,8 @@ class BDPTIntegrator : public Integrator {
     const bool visualizeWeights;
     const Bounds2i pixelBounds;
     const std::string lightSampleStrategy;
+    const bool lightVertexCache;
+    const int nCacheConnections;
 };
 
 struct Vertex {
@@ -167,6 +175,11 @@ struct Vertex {
     };
     bool delta = false;
     Float pdfFwd = 0, pdfRev = 0;
+    // Running sums of the probability ratios of the alternative strategies
+    // that end at or before this vertex, split by whether they connect two
+    // subpath vertices or merge; set by InitMISSums() once the subpath is
+    // complete
+    Float sumRiConnect = 0, sumRiEndpoint = 0, sumRiMerge = 0;
 
     // Vertex Public Methods
     Vertex() : ei() {}
@@ -252,6 +265,9 @@ struct Vertex {
         LOG(FATAL) << "Unhandled vertex type in IsConnectable()";
         return false;  // NOTREACHED
     }
+    bool IsMergeable() const {
+        return type == VertexType::Surface && IsConnectible();
+    }
     bool IsLight() const {
         return type == VertexType::Light ||
                (type == VertexType::Surface && si.primitive->GetAreaLight());
@@ -433,12 +449,33 @@ extern int GenerateLightSubpath(
     Float time, const Distribution1D &lightDistr,
     const std::unordered_map<const Light *, size_t> &lightToIndex,
     Vertex *path);
+extern void InitMISSums(Vertex *path, int nVertices, bool lightSubpath);
+
+// The MIS weights count the strategies that connect two subpath vertices
+// (s, t >= 2) _connectionCount_ times per path and all others once; the
+// light vertex cache samples connections at a fractional rate. A nonzero
+// _mergeEta_, the number of light subpaths times the area of the merge
+// disk, also weighs against merging light and camera vertices.
 Spectrum ConnectBDPT(
     const Scene &scene, Vertex *lightVertices, Vertex *cameraVertices, int s,
     int t, const Distribution1D &lightDistr,
     const std::unordered_map<const Light *, size_t> &lightToIndex,
     const Camera &camera, Sampler &sampler, Point2f *pRaster,
-    Float *misWeight = nullptr);
+    Float *misWeight = nullptr, Float connectionCount = 1,
+    Float mergeEta = 0);
+Float MISWeight(const Scene &scene, Vertex *lightVertices,
+                Vertex *cameraVertices, Vertex &sampled, int s, int t,
+                const Distribution1D &lightPdf,
+                const std::unordered_map<const Light *, size_t> &lightToIndex,
+                Float connectionCount = 1, Float mergeEta = 0);
+// Returns the MIS weight of merging light vertex $\pq{}_{s}$, reached from
+// $\pq{}_{s-1}$, at camera vertex $\pt{}_{t-1}$.
+Float MergeMISWeight(
+    const Scene &scene, const Vertex *lightVertices,
+    const Vertex *cameraVertices, int s, int t,
+    const Distribution1D &lightPdf,
+    const std::unordered_map<const Light *, size_t> &lightToIndex,
+    Float mergeEta);
 BDPTIntegrator *CreateBDPTIntegrator(const ParamSet &params,
                                      std::shared_ptr<Sampler> sampler,
                                      std::shared_ptr<const Camera> camera);
@@ -56,7 +56,9 @@ void DirectLightingIntegrator::Preprocess(const Scene &scene,
                 sampler.Request2DArray(nLightSamples[j]);
             }
         }
-    }
+    } else if (lightSampleStrategy != "uniform")
+        lightDistribution =
+            CreateLightSampleDistribution(lightSampleStrategy, scene);
 }
 
 Spectrum DirectLightingIntegrator::Li(const RayDifferential &ray,
@@ -75,6 +77,7 @@ Spectrum DirectLightingIntegrator::Li(const RayDifferential &ray,
     isect.ComputeScatteringFunctions(ray, arena);
     if (!isect.bsdf)
         return Li(isect.SpawnRay(ray.d), scene, sampler, arena, depth);
+    if (depth == 0) RecordAOVSample(isect);
     Vector3f wo = isect.wo;
     // Compute emitted light if ray hit an area light source
     L += isect.Le(wo);
@@ -83,6 +86,9 @@ Spectrum DirectLightingIntegrator::Li(const RayDifferential &ray,
         if (strategy == LightStrategy::UniformSampleAll)
             L += UniformSampleAllLights(isect, scene, arena, sampler,
                                         nLightSamples);
+        else if (lightDistribution)
+            L += UniformSampleOneLight(isect, scene, arena, sampler, false,
+                                       *lightDistribution);
         else
             L += UniformSampleOneLight(isect, scene, arena, sampler);
     }
@@ -112,6 +118,9 @@ DirectLightingIntegrator *CreateDirectLightingIntegrator(
             st.c_str());
         strategy = LightStrategy::UniformSampleAll;
     }
+    // Light selection for the "one" strategy
+    std::string lightStrategy =
+        params.FindOneString("lightsamplestrategy", "uniform");
     int np;
     const int *pb = params.FindInt("pixelbounds", &np);
     Bounds2i pixelBounds = camera->film->GetSampleBounds();
@@ -126,8 +135,10 @@ DirectLightingIntegrator *CreateDirectLightingIntegrator(
                 Error("Degenerate \"pixelbounds\" specified.");
         }
     }
-    return new DirectLightingIntegrator(strategy, maxDepth, camera, sampler,
-                                        pixelBounds);
+    DirectLightingIntegrator *integrator = new DirectLightingIntegrator(
+        strategy, maxDepth, camera, sampler, pixelBounds, lightStrategy);
+    integrator->SetRenderBudget(params);
+    return integrator;
 }
 
 }  // namespace pbrt
@@ -41,6 +41,7 @@
 // integrators/directlighting.h*
 #include "pbrt.h"
 #include "integrator.h"
+#include "lightdistrib.h"
 #include "scene.h"
 
 namespace pbrt {
@@ -55,10 +56,12 @@ class DirectLightingIntegrator : public SamplerIntegrator {
     DirectLightingIntegrator(LightStrategy strategy, int maxDepth,
                              std::shared_ptr<const Camera> camera,
                              std::shared_ptr<Sampler> sampler,
-                             const Bounds2i &pixelBounds)
+                             const Bounds2i &pixelBounds,
+                             const std::string &lightSampleStrategy = "uniform")
         : SamplerIntegrator(camera, sampler, pixelBounds),
           strategy(strategy),
-          maxDepth(maxDepth) {}
+          maxDepth(maxDepth),
+          lightSampleStrategy(lightSampleStrategy) {}
     Spectrum Li(const RayDifferential &ray, const Scene &scene,
                 Sampler &sampler, MemoryArena &arena, int depth) const;
     void Preprocess(const Scene &scene, Sampler &sampler);
@@ -67,7 +70,9 @@ class DirectLightingIntegrator : public SamplerIntegrator {
     // DirectLightingIntegrator Private Data
     const LightStrategy strategy;
     const int maxDepth;
+    const std::string lightSampleStrategy;
     std::vector<int> nLightSamples;
+    std::unique_ptr<LightDistribution> lightDistribution;
 };
 
 DirectLightingIntegrator *CreateDirectLightingIntegrator(
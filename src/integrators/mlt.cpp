@@ -48,6 +48,8 @@
 namespace pbrt {
 
 STAT_PERCENT("Integrator/Acceptance rate", acceptedMutations, totalMutations);
+STAT_PERCENT("Integrator/Replica exchange acceptance rate", acceptedSwaps,
+             totalSwaps);
 
 // MLTSampler Constants
 static const int cameraStreamIndex = 0;
@@ -55,6 +57,17 @@ static const int lightStreamIndex = 1;
 static const int connectionStreamIndex = 2;
 static const int nSampleStreams = 3;
 
+// Checkpoint I/O Helpers
+template <typename T>
+static bool WriteValue(FILE *f, const T &v) {
+    return fwrite(&v, sizeof(T), 1, f) == 1;
+}
+
+template <typename T>
+static bool ReadValue(FILE *f, T *v) {
+    return fread(v, sizeof(T), 1, f) == 1;
+}
+
 // MLTSampler Method Definitions
 Float MLTSampler::Get1D() {
     ProfilePhase _(Prof::GetSample);
@@ -122,6 +135,121 @@ void MLTSampler::StartStream(int index) {
     sampleIndex = 0;
 }
 
+bool MLTSampler::WriteState(FILE *f) const {
+    uint64_t nX = X.size();
+    return WriteValue(f, rng) && WriteValue(f, currentIteration) &&
+           WriteValue(f, largeStep) && WriteValue(f, lastLargeStepIteration) &&
+           WriteValue(f, nX) &&
+           fwrite(X.data(), sizeof(PrimarySample), nX, f) == nX;
+}
+
+bool MLTSampler::ReadState(FILE *f) {
+    uint64_t nX;
+    if (!ReadValue(f, &rng) || !ReadValue(f, &currentIteration) ||
+        !ReadValue(f, &largeStep) || !ReadValue(f, &lastLargeStepIteration) ||
+        !ReadValue(f, &nX))
+        return false;
+    X.resize(nX);
+    return fread(X.data(), sizeof(PrimarySample), nX, f) == nX;
+}
+
+// MLT Local Declarations
+struct MLTReplica {
+    std::unique_ptr<MLTSampler> sampler;
+    int depth;
+    Point2f pCurrent;
+    Spectrum LCurrent;
+};
+
+struct MLTChain {
+    RNG rng;
+    // Replicas are ordered from the coldest, which samples the path
+    // contribution itself, to the hottest
+    std::vector<MLTReplica> replicas;
+};
+
+static const char mltCheckpointMagic[8] = {'P', 'B', 'R', 'T', 'M',
+                                           'L', 'T', '\x01'};
+
+// Parameters that must match for a checkpoint to be resumed
+struct MLTCheckpointHeader {
+    int32_t floatSize, maxDepth, nChains, nTemperatures, nRounds;
+    int64_t nTotalMutations;
+    bool operator==(const MLTCheckpointHeader &h) const {
+        return floatSize == h.floatSize && maxDepth == h.maxDepth &&
+               nChains == h.nChains && nTemperatures == h.nTemperatures &&
+               nRounds == h.nRounds && nTotalMutations == h.nTotalMutations;
+    }
+};
+
+static void WriteCheckpoint(const std::string &filename,
+                            const MLTCheckpointHeader &header, int round,
+                            Float b, const std::vector<MLTChain> &chains,
+                            Film &film) {
+    // Write to a temporary file first so that an interrupted write leaves
+    // the previous checkpoint intact
+    std::string tmpFilename = filename + ".tmp";
+    FILE *f = fopen(tmpFilename.c_str(), "wb");
+    if (!f) {
+        Error("Unable to open MLT checkpoint file \"%s\"",
+              tmpFilename.c_str());
+        return;
+    }
+    bool ok = fwrite(mltCheckpointMagic, 1, 8, f) == 8 &&
+              WriteValue(f, header) && WriteValue(f, round) &&
+              WriteValue(f, b);
+    for (size_t i = 0; ok && i < chains.size(); ++i) {
+        ok = WriteValue(f, chains[i].rng);
+        for (const MLTReplica &r : chains[i].replicas)
+            ok = ok && WriteValue(f, r.depth) && WriteValue(f, r.pCurrent) &&
+                 WriteValue(f, r.LCurrent) && r.sampler->WriteState(f);
+    }
+    std::vector<Float> splatXYZ = film.GetSplatXYZ();
+    ok = ok && fwrite(splatXYZ.data(), sizeof(Float), splatXYZ.size(), f) ==
+                   splatXYZ.size();
+    if (fclose(f) != 0 || !ok ||
+        std::rename(tmpFilename.c_str(), filename.c_str()) != 0)
+        Error("Unable to write MLT checkpoint file \"%s\"", filename.c_str());
+}
+
+static bool ReadCheckpoint(const std::string &filename,
+                           const MLTCheckpointHeader &header,
+                           const MLTSampler &samplerPrototype, int *round,
+                           Float *b, std::vector<MLTChain> *chains,
+                           Film &film) {
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) return false;
+    char magic[8];
+    MLTCheckpointHeader fileHeader;
+    bool ok = fread(magic, 1, 8, f) == 8 &&
+              memcmp(magic, mltCheckpointMagic, 8) == 0 &&
+              ReadValue(f, &fileHeader) && fileHeader == header &&
+              ReadValue(f, round) && ReadValue(f, b);
+    chains->resize(header.nChains);
+    for (size_t i = 0; ok && i < chains->size(); ++i) {
+        MLTChain &chain = (*chains)[i];
+        ok = ReadValue(f, &chain.rng);
+        chain.replicas.resize(header.nTemperatures);
+        for (MLTReplica &r : chain.replicas) {
+            r.sampler.reset(new MLTSampler(samplerPrototype));
+            ok = ok && ReadValue(f, &r.depth) && ReadValue(f, &r.pCurrent) &&
+                 ReadValue(f, &r.LCurrent) && r.sampler->ReadState(f);
+        }
+    }
+    std::vector<Float> splatXYZ(3 * film.croppedPixelBounds.Area());
+    ok = ok && fread(splatXYZ.data(), sizeof(Float), splatXYZ.size(), f) ==
+                   splatXYZ.size();
+    fclose(f);
+    if (!ok) {
+        Warning("Ignoring MLT checkpoint file \"%s\", which is incomplete or "
+                "was written with different parameters", filename.c_str());
+        chains->clear();
+        return false;
+    }
+    film.SetSplatXYZ(splatXYZ);
+    return true;
+}
+
 // MLT Method Definitions
 Spectrum MLTIntegrator::L(const Scene &scene, MemoryArena &arena,
                           const std::unique_ptr<Distribution1D> &lightDistr,
@@ -174,95 +302,193 @@ void MLTIntegrator::Render(const Scene &scene) {
     for (size_t i = 0; i < scene.lights.size(); ++i)
         lightToIndex[scene.lights[i].get()] = i;
 
-    // Generate bootstrap samples and compute normalization constant $b$
-    int nBootstrapSamples = nBootstrap * (maxDepth + 1);
-    std::vector<Float> bootstrapWeights(nBootstrapSamples, 0);
-    if (scene.lights.size() > 0) {
-        ProgressReporter progress(nBootstrap / 256,
-                                  "Generating bootstrap paths");
-        std::vector<MemoryArena> bootstrapThreadArenas(MaxThreadIndex());
-        int chunkSize = Clamp(nBootstrap / 128, 1, 8192);
-        ParallelFor([&](int i) {
-            // Generate _i_th bootstrap sample
-            MemoryArena &arena = bootstrapThreadArenas[ThreadIndex];
+    Film &film = *camera->film;
+    int64_t nTotalMutations =
+        (int64_t)mutationsPerPixel * (int64_t)film.GetSampleBounds().Area();
+    MLTCheckpointHeader header = {(int32_t)sizeof(Float), maxDepth, nChains,
+                                  nTemperatures, nRounds, nTotalMutations};
+
+    // Resume from the checkpoint, if there is one
+    std::vector<MLTChain> chains;
+    int firstRound = 0;
+    Float b = 0;
+    if (scene.lights.size() > 0 && !checkpointFilename.empty() &&
+        ReadCheckpoint(checkpointFilename, header,
+                       MLTSampler(mutationsPerPixel, 0, sigma,
+                                  largeStepProbability, nSampleStreams),
+                       &firstRound, &b, &chains, film))
+        LOG(INFO) << "Resuming MLT from round " << firstRound << " of "
+                  << nRounds;
+    else if (scene.lights.size() > 0) {
+        // Generate bootstrap samples and compute normalization constant $b$
+        int nBootstrapSamples = nBootstrap * (maxDepth + 1);
+        std::vector<Float> bootstrapWeights(nBootstrapSamples, 0);
+        {
+            ProgressReporter progress(nBootstrap / 256,
+                                      "Generating bootstrap paths");
+            int chunkSize = Clamp(nBootstrap / 128, 1, 8192);
+            ParallelFor([&](int i) {
+                // Generate _i_th bootstrap sample
+                MemoryArena &arena = ThreadArena(ArenaCategory::Render);
+                for (int depth = 0; depth <= maxDepth; ++depth) {
+                    int rngIndex = i * (maxDepth + 1) + depth;
+                    MLTSampler sampler(mutationsPerPixel, rngIndex, sigma,
+                                       largeStepProbability, nSampleStreams);
+                    Point2f pRaster;
+                    bootstrapWeights[rngIndex] =
+                        L(scene, arena, lightDistr, lightToIndex, sampler,
+                          depth, &pRaster).y();
+                    arena.Reset();
+                }
+                if ((i + 1 % 256) == 0) progress.Update();
+            }, nBootstrap, chunkSize);
+            progress.Done();
+        }
+        Distribution1D bootstrap(&bootstrapWeights[0], nBootstrapSamples);
+        b = bootstrap.funcInt * (maxDepth + 1);
+
+        // All replicas of a chain sample paths of the same depth, so that
+        // swaps leave the coldest replica's depth distribution unchanged;
+        // the hotter replicas start from bootstrap samples of the depth
+        // chosen for the coldest
+        std::vector<std::unique_ptr<Distribution1D>> depthBootstrap;
+        if (nTemperatures > 1)
             for (int depth = 0; depth <= maxDepth; ++depth) {
-                int rngIndex = i * (maxDepth + 1) + depth;
-                MLTSampler sampler(mutationsPerPixel, rngIndex, sigma,
-                                   largeStepProbability, nSampleStreams);
-                Point2f pRaster;
-                bootstrapWeights[rngIndex] =
-                    L(scene, arena, lightDistr, lightToIndex, sampler, depth, &pRaster).y();
+                std::vector<Float> weights(nBootstrap);
+                for (int i = 0; i < nBootstrap; ++i)
+                    weights[i] = bootstrapWeights[i * (maxDepth + 1) + depth];
+                depthBootstrap.push_back(std::unique_ptr<Distribution1D>(
+                    new Distribution1D(&weights[0], nBootstrap)));
+            }
+
+        // Select the initial state of each replica from the set of
+        // bootstrap samples
+        chains.resize(nChains);
+        ParallelFor([&](int i) {
+            MemoryArena &arena = ThreadArena(ArenaCategory::Render);
+            MLTChain &chain = chains[i];
+            chain.rng.SetSequence(i);
+            chain.replicas.resize(nTemperatures);
+            for (int k = 0; k < nTemperatures; ++k) {
+                MLTReplica &r = chain.replicas[k];
+                Float u = chain.rng.UniformFloat();
+                int bootstrapIndex;
+                if (k == 0)
+                    bootstrapIndex = bootstrap.SampleDiscrete(u);
+                else {
+                    int depth = chain.replicas[0].depth;
+                    bootstrapIndex =
+                        depthBootstrap[depth]->SampleDiscrete(u) *
+                            (maxDepth + 1) +
+                        depth;
+                }
+                r.depth = bootstrapIndex % (maxDepth + 1);
+                r.sampler.reset(new MLTSampler(mutationsPerPixel,
+                                               bootstrapIndex, sigma,
+                                               largeStepProbability,
+                                               nSampleStreams));
+                r.LCurrent = L(scene, arena, lightDistr, lightToIndex,
+                               *r.sampler, r.depth, &r.pCurrent);
                 arena.Reset();
             }
-            if ((i + 1 % 256) == 0) progress.Update();
-        }, nBootstrap, chunkSize);
-        progress.Done();
+        }, nChains);
     }
-    Distribution1D bootstrap(&bootstrapWeights[0], nBootstrapSamples);
-    Float b = bootstrap.funcInt * (maxDepth + 1);
+
+    // Compute the inverse temperature of each replica
+    std::vector<Float> beta(nTemperatures, 1);
+    for (int k = 1; k < nTemperatures; ++k)
+        beta[k] = std::pow(maxTemperature, -(Float)k / (nTemperatures - 1));
 
     // Run _nChains_ Markov chains in parallel
-    Film &film = *camera->film;
-    int64_t nTotalMutations =
-        (int64_t)mutationsPerPixel * (int64_t)film.GetSampleBounds().Area();
     if (scene.lights.size() > 0) {
         const int progressFrequency = 32768;
         ProgressReporter progress(nTotalMutations / progressFrequency,
                                   "Rendering");
-        ParallelFor([&](int i) {
-            int64_t nChainMutations =
-                std::min((i + 1) * nTotalMutations / nChains, nTotalMutations) -
-                i * nTotalMutations / nChains;
-            // Follow {i}th Markov chain for _nChainMutations_
-            MemoryArena arena;
-
-            // Select initial state from the set of bootstrap samples
-            RNG rng(i);
-            int bootstrapIndex = bootstrap.SampleDiscrete(rng.UniformFloat());
-            int depth = bootstrapIndex % (maxDepth + 1);
-
-            // Initialize local variables for selected state
-            MLTSampler sampler(mutationsPerPixel, bootstrapIndex, sigma,
-                               largeStepProbability, nSampleStreams);
-            Point2f pCurrent;
-            Spectrum LCurrent =
-                L(scene, arena, lightDistr, lightToIndex, sampler, depth, &pCurrent);
-
-            // Run the Markov chain for _nChainMutations_ steps
-            for (int64_t j = 0; j < nChainMutations; ++j) {
-                sampler.StartIteration();
-                Point2f pProposed;
-                Spectrum LProposed =
-                    L(scene, arena, lightDistr, lightToIndex, sampler, depth, &pProposed);
-                // Compute acceptance probability for proposed sample
-                Float accept = std::min((Float)1, LProposed.y() / LCurrent.y());
-
-                // Splat both current and proposed samples to _film_
-                if (accept > 0)
-                    film.AddSplat(pProposed,
-                                  LProposed * accept / LProposed.y());
-                film.AddSplat(pCurrent, LCurrent * (1 - accept) / LCurrent.y());
-
-                // Accept or reject the proposal
-                if (rng.UniformFloat() < accept) {
-                    pCurrent = pProposed;
-                    LCurrent = LProposed;
-                    sampler.Accept();
-                    ++acceptedMutations;
-                } else
-                    sampler.Reject();
-                ++totalMutations;
-                if ((i * nTotalMutations / nChains + j) % progressFrequency ==
-                    0)
-                    progress.Update();
-                arena.Reset();
-            }
-        }, nChains);
+        for (int round = firstRound; round < nRounds; ++round) {
+            ParallelFor([&](int i) {
+                int64_t chainStart = i * nTotalMutations / nChains;
+                int64_t nChainMutations =
+                    std::min((i + 1) * nTotalMutations / nChains,
+                             nTotalMutations) -
+                    chainStart;
+                // Follow {i}th Markov chain for this round's mutations
+                MemoryArena &arena = ThreadArena(ArenaCategory::Render);
+                MLTChain &chain = chains[i];
+                std::vector<FilmSplat> splats;
+                const size_t maxBufferedSplats = 4096;
+                for (int64_t j = round * nChainMutations / nRounds;
+                     j < (round + 1) * nChainMutations / nRounds; ++j) {
+                    for (int k = 0; k < nTemperatures; ++k) {
+                        MLTReplica &r = chain.replicas[k];
+                        r.sampler->StartIteration();
+                        Point2f pProposed;
+                        Spectrum LProposed =
+                            L(scene, arena, lightDistr, lightToIndex,
+                              *r.sampler, r.depth, &pProposed);
+                        // Compute acceptance probability for proposed sample
+                        Float accept = std::min(
+                            (Float)1, LProposed.y() / r.LCurrent.y());
+                        if (k > 0) accept = std::pow(accept, beta[k]);
+
+                        // Splat both current and proposed samples of the
+                        // coldest replica to _film_
+                        if (k == 0) {
+                            if (accept > 0)
+                                splats.push_back(
+                                    {pProposed,
+                                     LProposed * accept / LProposed.y()});
+                            splats.push_back(
+                                {r.pCurrent,
+                                 r.LCurrent * (1 - accept) / r.LCurrent.y()});
+                        }
+
+                        // Accept or reject the proposal
+                        if (chain.rng.UniformFloat() < accept) {
+                            r.pCurrent = pProposed;
+                            r.LCurrent = LProposed;
+                            r.sampler->Accept();
+                            ++acceptedMutations;
+                        } else
+                            r.sampler->Reject();
+                        ++totalMutations;
+                        arena.Reset();
+                    }
+                    if (splats.size() >= maxBufferedSplats)
+                        film.AddSplats(splats);
+
+                    // Attempt to exchange the states of neighboring
+                    // replicas, alternating between even and odd pairs;
+                    // all of them sample the same depth
+                    if (nTemperatures > 1 && (j + 1) % swapInterval == 0) {
+                        for (int k = ((j + 1) / swapInterval) % 2;
+                             k + 1 < nTemperatures; k += 2) {
+                            MLTReplica &r0 = chain.replicas[k];
+                            MLTReplica &r1 = chain.replicas[k + 1];
+                            Float swap = std::pow(
+                                r1.LCurrent.y() / r0.LCurrent.y(),
+                                beta[k] - beta[k + 1]);
+                            ++totalSwaps;
+                            if (chain.rng.UniformFloat() < swap) {
+                                std::swap(r0, r1);
+                                ++acceptedSwaps;
+                            }
+                        }
+                    }
+                    if ((chainStart + j) % progressFrequency == 0)
+                        progress.Update();
+                }
+                film.AddSplats(splats);
+            }, nChains);
+            if (!checkpointFilename.empty() && round + 1 < nRounds)
+                WriteCheckpoint(checkpointFilename, header, round + 1, b,
+                                chains, film);
+        }
         progress.Done();
     }
 
     // Store final image computed with MLT
     camera->film->WriteImage(b / mutationsPerPixel);
+    if (!checkpointFilename.empty()) std::remove(checkpointFilename.c_str());
 }
 
 MLTIntegrator *CreateMLTIntegrator(const ParamSet &params,
@@ -274,12 +500,27 @@ MLTIntegrator *CreateMLTIntegrator(const ParamSet &params,
     Float largeStepProbability =
         params.FindOneFloat("largestepprobability", 0.3f);
     Float sigma = params.FindOneFloat("sigma", .01f);
+    int nTemperatures = params.FindOneInt("temperatures", 1);
+    Float maxTemperature = params.FindOneFloat("maxtemperature", 8.f);
+    int swapInterval = params.FindOneInt("swapinterval", 32);
+    if (nTemperatures < 1 || maxTemperature < 1 || swapInterval < 1) {
+        Error("MLT \"temperatures\", \"maxtemperature\" and \"swapinterval\" "
+              "must be at least one. Using a single temperature.");
+        nTemperatures = 1;
+        maxTemperature = 1;
+        swapInterval = 1;
+    }
+    std::string checkpointFilename = params.FindOneString("checkpointfile", "");
+    int nRounds =
+        params.FindOneInt("checkpoints", checkpointFilename.empty() ? 1 : 16);
     if (PbrtOptions.quickRender) {
         mutationsPerPixel = std::max(1, mutationsPerPixel / 16);
         nBootstrap = std::max(1, nBootstrap / 16);
     }
     return new MLTIntegrator(camera, maxDepth, nBootstrap, nChains,
-                             mutationsPerPixel, sigma, largeStepProbability);
+                             mutationsPerPixel, sigma, largeStepProbability,
+                             nTemperatures, maxTemperature, swapInterval,
+                             checkpointFilename, std::max(1, nRounds));
 }
 
 }  // namespace pbrt
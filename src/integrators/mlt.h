@@ -45,6 +45,7 @@
 #include "spectrum.h"
 #include "film.h"
 #include "rng.h"
+#include <cstdio>
 #include <unordered_map>
 
 namespace pbrt {
@@ -68,6 +69,8 @@ class MLTSampler : public Sampler {
     void Reject();
     void StartStream(int index);
     int GetNextIndex() { return streamIndex + streamCount * sampleIndex++; }
+    bool WriteState(FILE *f) const;
+    bool ReadState(FILE *f);
 
   protected:
     // MLTSampler Private Declarations
@@ -109,14 +112,23 @@ class MLTIntegrator : public Integrator {
     // MLTIntegrator Public Methods
     MLTIntegrator(std::shared_ptr<const Camera> camera, int maxDepth,
                   int nBootstrap, int nChains, int mutationsPerPixel,
-                  Float sigma, Float largeStepProbability)
+                  Float sigma, Float largeStepProbability,
+                  int nTemperatures = 1, Float maxTemperature = 8,
+                  int swapInterval = 32,
+                  const std::string &checkpointFilename = "",
+                  int nRounds = 1)
         : camera(camera),
           maxDepth(maxDepth),
           nBootstrap(nBootstrap),
           nChains(nChains),
           mutationsPerPixel(mutationsPerPixel),
           sigma(sigma),
-          largeStepProbability(largeStepProbability) {}
+          largeStepProbability(largeStepProbability),
+          nTemperatures(nTemperatures),
+          maxTemperature(maxTemperature),
+          swapInterval(swapInterval),
+          checkpointFilename(checkpointFilename),
+          nRounds(nRounds) {}
     void Render(const Scene &scene);
     Spectrum L(const Scene &scene, MemoryArena &arena,
                const std::unique_ptr<Distribution1D> &lightDistr,
@@ -131,6 +143,18 @@ class MLTIntegrator : public Integrator {
     const int nChains;
     const int mutationsPerPixel;
     const Float sigma, largeStepProbability;
+    // Each chain runs _nTemperatures_ replicas, whose targets are the path
+    // contribution raised to powers geometrically spaced between 1 and
+    // 1 / _maxTemperature_; neighboring replicas attempt to exchange
+    // states every _swapInterval_ mutations and only the first replica
+    // splats to the film.
+    const int nTemperatures;
+    const Float maxTemperature;
+    const int swapInterval;
+    // Chain states and splats are written to _checkpointFilename_ after
+    // each of the _nRounds_ rounds the mutations are divided into
+    const std::string checkpointFilename;
+    const int nRounds;
 };
 
 MLTIntegrator *CreateMLTIntegrator(const ParamSet &params,
@@ -37,28 +37,48 @@
 #include "film.h"
 #include "interaction.h"
 #include "paramset.h"
+#include "parallel.h"
+#include "progressreporter.h"
+#include "sampler.h"
 #include "scene.h"
 #include "stats.h"
+#include <algorithm>
 
 namespace pbrt {
 
 STAT_PERCENT("Integrator/Zero-radiance paths", zeroRadiancePaths, totalPaths);
 STAT_INT_DISTRIBUTION("Integrator/Path length", pathLength);
+STAT_COUNTER("Integrator/Wavefront iterations", wavefrontIterations);
 
 // PathIntegrator Method Definitions
 PathIntegrator::PathIntegrator(int maxDepth,
                                std::shared_ptr<const Camera> camera,
                                std::shared_ptr<Sampler> sampler,
                                const Bounds2i &pixelBounds, Float rrThreshold,
-                               const std::string &lightSampleStrategy)
+                               const std::string &lightSampleStrategy,
+                               bool precomputeLightDistribution,
+                               const std::string &lightDistributionKey,
+                               bool wavefront, int wavefrontPaths,
+                               int guidingPasses, Float guidingBSDFFraction)
     : SamplerIntegrator(camera, sampler, pixelBounds),
       maxDepth(maxDepth),
       rrThreshold(rrThreshold),
-      lightSampleStrategy(lightSampleStrategy) {}
+      lightSampleStrategy(lightSampleStrategy),
+      precomputeLightDistribution(precomputeLightDistribution),
+      lightDistributionKey(lightDistributionKey),
+      wavefront(wavefront),
+      wavefrontPaths(wavefrontPaths),
+      guidingPasses(guidingPasses),
+      guidingBSDFFraction(guidingBSDFFraction) {}
 
 void PathIntegrator::Preprocess(const Scene &scene, Sampler &sampler) {
-    lightDistribution =
-        CreateLightSampleDistribution(lightSampleStrategy, scene);
+    lightDistribution = CreateLightSampleDistribution(
+        lightSampleStrategy, scene, precomputeLightDistribution,
+        lightDistributionKey);
+    if (guidingPasses > 0) {
+        guide.reset(new PathGuide(scene.WorldBound(), guidingBSDFFraction));
+        TrainPathGuide(*this, scene, *camera, guide.get(), guidingPasses);
+    }
 }
 
 Spectrum PathIntegrator::Li(const RayDifferential &r, const Scene &scene,
@@ -77,6 +97,7 @@ Spectrum PathIntegrator::Li(const RayDifferential &r, const Scene &scene,
     // avoid terminating refracted rays that are about to be refracted back
     // out of a medium and thus have their beta value increased.
     Float etaScale = 1;
+    GuidedPathRecorder recorder(guide.get());
 
     for (bounces = 0;; ++bounces) {
         // Find next path vertex and accumulate contribution
@@ -111,16 +132,16 @@ Spectrum PathIntegrator::Li(const RayDifferential &r, const Scene &scene,
             bounces--;
             continue;
         }
-
-        const Distribution1D *distrib = lightDistribution->Lookup(isect.p);
+        if (bounces == 0) RecordAOVSample(isect);
 
         // Sample illumination from lights to find path contribution.
         // (But skip this for perfectly specular BSDFs.)
         if (isect.bsdf->NumComponents(BxDFType(BSDF_ALL & ~BSDF_SPECULAR)) >
             0) {
             ++totalPaths;
-            Spectrum Ld = beta * UniformSampleOneLight(isect, scene, arena,
-                                                       sampler, false, distrib);
+            Spectrum Ld =
+                beta * UniformSampleOneLight(isect, scene, arena, sampler,
+                                             false, *lightDistribution);
             VLOG(2) << "Sampled direct lighting Ld = " << Ld;
             if (Ld.IsBlack()) ++zeroRadiancePaths;
             CHECK_GE(Ld.y(), 0.f);
@@ -131,12 +152,18 @@ Spectrum PathIntegrator::Li(const RayDifferential &r, const Scene &scene,
         Vector3f wo = -ray.d, wi;
         Float pdf;
         BxDFType flags;
-        Spectrum f = isect.bsdf->Sample_f(wo, &wi, sampler.Get2D(), &pdf,
-                                          BSDF_ALL, &flags);
+        Spectrum f =
+            guide ? guide->Sample_f(isect, wo, &wi, sampler.Get2D(), &pdf,
+                                    &flags)
+                  : isect.bsdf->Sample_f(wo, &wi, sampler.Get2D(), &pdf,
+                                         BSDF_ALL, &flags);
         VLOG(2) << "Sampled BSDF, f = " << f << ", pdf = " << pdf;
         if (f.IsBlack() || pdf == 0.f) break;
         beta *= f * AbsDot(wi, isect.shading.n) / pdf;
         VLOG(2) << "Updated beta = " << beta;
+        if (!(flags & BSDF_SPECULAR) &&
+            !(isect.bssrdf && (flags & BSDF_TRANSMISSION)))
+            recorder.AddVertex(isect.p, wi, beta, pdf, L);
         CHECK_GE(beta.y(), 0.f);
         DCHECK(!std::isinf(beta.y()));
         specularBounce = (flags & BSDF_SPECULAR) != 0;
@@ -161,7 +188,7 @@ Spectrum PathIntegrator::Li(const RayDifferential &r, const Scene &scene,
 
             // Account for the direct subsurface scattering component
             L += beta * UniformSampleOneLight(pi, scene, arena, sampler, false,
-                                              lightDistribution->Lookup(pi.p));
+                                              *lightDistribution);
 
             // Account for the indirect subsurface scattering component
             Spectrum f = pi.bsdf->Sample_f(pi.wo, &wi, sampler.Get2D(), &pdf,
@@ -183,10 +210,477 @@ Spectrum PathIntegrator::Li(const RayDifferential &r, const Scene &scene,
             DCHECK(!std::isinf(beta.y()));
         }
     }
+    recorder.Finish(L);
     ReportValue(pathLength, bounces);
     return L;
 }
 
+// Wavefront Path Tracing Declarations
+enum class WavefrontPathState : uint8_t { Idle, Active, Finished };
+
+// WavefrontPaths stores the paths in flight in wavefront mode as a
+// structure of arrays, with one slot per pixel of the current batch of
+// image tiles; each slot traces its pixel's samples one path after
+// another.  Direct lighting is deferred to the shadow stage using the
+// shadow ray entries 2 * slot and 2 * slot + 1.
+struct WavefrontPaths {
+    explicit WavefrontPaths(int n)
+        : samplers(n),
+          state(new WavefrontPathState[n]),
+          pixel(new Point2i[n]),
+          pFilm(new Point2f[n]),
+          rayWeight(new Float[n]),
+          ray(new RayDifferential[n]),
+          isect(new SurfaceInteraction[n]),
+          material(new const Material *[n]),
+          L(new Spectrum[n]),
+          beta(new Spectrum[n]),
+          etaScale(new Float[n]),
+          bounces(new int[n]),
+          specularBounce(new bool[n]),
+          directBeta(new Spectrum[n]),
+          lightPdf(new Float[n]()),
+          shadowRay(new Ray[2 * n]),
+          shadowLight(new const Light *[2 * n]),
+          shadowF(new Spectrum[2 * n]),
+          shadowWeight(new Float[2 * n]),
+          shadowPdf(new Float[2 * n]),
+          Ld(new Spectrum[2 * n]) {}
+
+    // Per-path state
+    std::vector<std::unique_ptr<Sampler>> samplers;
+    std::unique_ptr<WavefrontPathState[]> state;
+    std::unique_ptr<Point2i[]> pixel;
+    std::unique_ptr<Point2f[]> pFilm;
+    std::unique_ptr<Float[]> rayWeight;
+    std::unique_ptr<RayDifferential[]> ray;
+    std::unique_ptr<SurfaceInteraction[]> isect;
+    std::unique_ptr<const Material *[]> material;
+    std::unique_ptr<Spectrum[]> L, beta;
+    std::unique_ptr<Float[]> etaScale;
+    std::unique_ptr<int[]> bounces;
+    std::unique_ptr<bool[]> specularBounce;
+
+    // Deferred direct lighting; _lightPdf_ is zero if no light was sampled
+    std::unique_ptr<Spectrum[]> directBeta;
+    std::unique_ptr<Float[]> lightPdf;
+    std::unique_ptr<Ray[]> shadowRay;
+    // Null for shadow rays that only test visibility; otherwise the light
+    // that the BSDF-sampled ray must hit to contribute
+    std::unique_ptr<const Light *[]> shadowLight;
+    std::unique_ptr<Spectrum[]> shadowF;
+    std::unique_ptr<Float[]> shadowWeight, shadowPdf;
+    std::unique_ptr<Spectrum[]> Ld;
+};
+
+// A fixed-capacity queue of path slots that parallel stages push to
+class WavefrontQueue {
+  public:
+    explicit WavefrontQueue(int capacity) : items(new int[capacity]) {}
+    void Push(int slot) { items[size++] = slot; }
+    int Size() const { return size; }
+    int operator[](int i) const { return items[i]; }
+    int *begin() { return items.get(); }
+    int *end() { return items.get() + size; }
+    void Clear() { size = 0; }
+
+  private:
+    std::unique_ptr<int[]> items;
+    std::atomic<int> size{0};
+};
+
+void PathIntegrator::Render(const Scene &scene) {
+    if (!wavefront) {
+        SamplerIntegrator::Render(scene);
+        return;
+    }
+    if (HasRenderBudget() || camera->film->HasAOVs()) {
+        Warning("Wavefront path tracing doesn't support render budgets or "
+                "auxiliary film channels. Rendering tile by tile.");
+        SamplerIntegrator::Render(scene);
+        return;
+    }
+    RenderWavefront(scene);
+}
+
+// Renders the image in batches of tiles.  Each iteration advances every
+// path of the batch by one bounce through a series of parallel stages:
+// camera ray generation, intersection, shading sorted by material,
+// shadow rays and accumulation into the film.  The sampler dimensions
+// are consumed in the same order as Li(), so the two modes estimate the
+// same integral with the same samples.
+void PathIntegrator::RenderWavefront(const Scene &scene) {
+    Preprocess(scene, *sampler);
+
+    // Group the image tiles into batches of at most _wavefrontPaths_ pixels
+    Bounds2i sampleBounds = camera->film->GetSampleBounds();
+    Vector2i sampleExtent = sampleBounds.Diagonal();
+    const int tileSize = 16;
+    Point2i nTiles((sampleExtent.x + tileSize - 1) / tileSize,
+                   (sampleExtent.y + tileSize - 1) / tileSize);
+    std::vector<Bounds2i> tiles;
+    for (int y = 0; y < nTiles.y; ++y)
+        for (int x = 0; x < nTiles.x; ++x) {
+            int x0 = sampleBounds.pMin.x + x * tileSize;
+            int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
+            int y0 = sampleBounds.pMin.y + y * tileSize;
+            int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
+            tiles.push_back(Bounds2i(Point2i(x0, y0), Point2i(x1, y1)));
+        }
+    std::vector<int> batchStart(1, 0);
+    int batchPixels = 0, maxBatchPixels = 0;
+    for (size_t t = 0; t < tiles.size(); ++t) {
+        int area = tiles[t].Area();
+        if ((int)t > batchStart.back() && batchPixels + area > wavefrontPaths) {
+            batchStart.push_back(t);
+            batchPixels = 0;
+        }
+        batchPixels += area;
+        maxBatchPixels = std::max(maxBatchPixels, batchPixels);
+    }
+    int nBatches = batchStart.size();
+    batchStart.push_back(tiles.size());
+
+    // Allocate path state and queues
+    WavefrontPaths paths(maxBatchPixels);
+    for (int i = 0; i < maxBatchPixels; ++i)
+        paths.samplers[i] = sampler->Clone(i);
+    WavefrontQueue generateQueue(maxBatchPixels), rayQueue(maxBatchPixels);
+    WavefrontQueue shadeQueue(maxBatchPixels);
+    WavefrontQueue shadowQueue(2 * maxBatchPixels);
+    const int chunkSize = 64;
+
+    // Samples a light for the path at _slot_ and records the shadow rays
+    // of both strategies of EstimateDirect() for the shadow stage
+    auto sampleDirect = [&](int slot) {
+        ProfilePhase p(Prof::DirectLighting);
+        Sampler &pathSampler = *paths.samplers[slot];
+        const SurfaceInteraction &isect = paths.isect[slot];
+        if (scene.lights.empty()) return false;
+        Float lightPdf;
+        int lightNum =
+            lightDistribution->Sample(isect.p, pathSampler.Get1D(), &lightPdf);
+        if (lightNum < 0 || lightPdf == 0) return false;
+        const Light &light = *scene.lights[lightNum];
+        Point2f uLight = pathSampler.Get2D();
+        Point2f uScattering = pathSampler.Get2D();
+        int e0 = 2 * slot, e1 = 2 * slot + 1;
+        paths.directBeta[slot] = paths.beta[slot];
+        paths.lightPdf[slot] = lightPdf;
+        paths.Ld[e0] = paths.Ld[e1] = Spectrum(0.f);
+
+        // Sample light source with multiple importance sampling
+        BxDFType bsdfFlags = BxDFType(BSDF_ALL & ~BSDF_SPECULAR);
+        Vector3f wi;
+        Float lightSamplePdf = 0, scatteringPdf = 0;
+        VisibilityTester visibility;
+        Spectrum Li =
+            light.Sample_Li(isect, uLight, &wi, &lightSamplePdf, &visibility);
+        if (lightSamplePdf > 0 && !Li.IsBlack()) {
+            Spectrum f = isect.bsdf->f(isect.wo, wi, bsdfFlags) *
+                         AbsDot(wi, isect.shading.n);
+            scatteringPdf = isect.bsdf->Pdf(isect.wo, wi, bsdfFlags);
+            if (!f.IsBlack()) {
+                if (IsDeltaLight(light.flags))
+                    paths.Ld[e0] = f * Li / lightSamplePdf;
+                else {
+                    Float weight =
+                        PowerHeuristic(1, lightSamplePdf, 1, scatteringPdf);
+                    paths.Ld[e0] = f * Li * weight / lightSamplePdf;
+                }
+                paths.shadowRay[e0] =
+                    visibility.P0().SpawnRayTo(visibility.P1());
+                paths.shadowLight[e0] = nullptr;
+                shadowQueue.Push(e0);
+            }
+        }
+
+        // Sample BSDF with multiple importance sampling
+        if (!IsDeltaLight(light.flags)) {
+            BxDFType sampledType;
+            Spectrum f = isect.bsdf->Sample_f(isect.wo, &wi, uScattering,
+                                              &scatteringPdf, bsdfFlags,
+                                              &sampledType);
+            f *= AbsDot(wi, isect.shading.n);
+            if (!f.IsBlack() && scatteringPdf > 0) {
+                Float weight = 1;
+                if (!(sampledType & BSDF_SPECULAR)) {
+                    lightSamplePdf = light.Pdf_Li(isect, wi);
+                    if (lightSamplePdf == 0) return true;
+                    weight =
+                        PowerHeuristic(1, scatteringPdf, 1, lightSamplePdf);
+                }
+                paths.shadowRay[e1] = isect.SpawnRay(wi);
+                paths.shadowLight[e1] = &light;
+                paths.shadowF[e1] = f;
+                paths.shadowWeight[e1] = weight;
+                paths.shadowPdf[e1] = scatteringPdf;
+                shadowQueue.Push(e1);
+            }
+        }
+        return true;
+    };
+
+    // Shades the intersection of the path at _slot_ and samples the next
+    // direction; this follows the body of the loop in Li()
+    auto shade = [&](int slot, MemoryArena &arena) {
+        Sampler &pathSampler = *paths.samplers[slot];
+        RayDifferential &ray = paths.ray[slot];
+        SurfaceInteraction &isect = paths.isect[slot];
+        Spectrum &beta = paths.beta[slot];
+
+        // Compute scattering functions and skip over medium boundaries
+        isect.ComputeScatteringFunctions(ray, arena, true);
+        if (!isect.bsdf) {
+            ray = isect.SpawnRay(ray.d);
+            return;
+        }
+
+        // Sample illumination from lights, deferring the shadow rays
+        if (isect.bsdf->NumComponents(BxDFType(BSDF_ALL & ~BSDF_SPECULAR)) >
+            0) {
+            ++totalPaths;
+            if (!sampleDirect(slot)) ++zeroRadiancePaths;
+        }
+
+        // Sample BSDF to get new path direction
+        Vector3f wo = -ray.d, wi;
+        Float pdf;
+        BxDFType flags;
+        Spectrum f =
+            guide ? guide->Sample_f(isect, wo, &wi, pathSampler.Get2D(), &pdf,
+                                    &flags)
+                  : isect.bsdf->Sample_f(wo, &wi, pathSampler.Get2D(), &pdf,
+                                         BSDF_ALL, &flags);
+        if (f.IsBlack() || pdf == 0.f) {
+            paths.state[slot] = WavefrontPathState::Finished;
+            return;
+        }
+        beta *= f * AbsDot(wi, isect.shading.n) / pdf;
+        paths.specularBounce[slot] = (flags & BSDF_SPECULAR) != 0;
+        if ((flags & BSDF_SPECULAR) && (flags & BSDF_TRANSMISSION)) {
+            Float eta = isect.bsdf->eta;
+            paths.etaScale[slot] *=
+                (Dot(wo, isect.n) > 0) ? (eta * eta) : 1 / (eta * eta);
+        }
+        ray = isect.SpawnRay(wi);
+
+        // Account for subsurface scattering, if applicable; its rays are
+        // traced here rather than in the batched stages
+        if (isect.bssrdf && (flags & BSDF_TRANSMISSION)) {
+            SurfaceInteraction pi;
+            Spectrum S = isect.bssrdf->Sample_S(scene, pathSampler.Get1D(),
+                                                pathSampler.Get2D(), arena,
+                                                &pi, &pdf);
+            if (S.IsBlack() || pdf == 0) {
+                paths.state[slot] = WavefrontPathState::Finished;
+                return;
+            }
+            beta *= S / pdf;
+            paths.L[slot] +=
+                beta * UniformSampleOneLight(pi, scene, arena, pathSampler,
+                                             false, *lightDistribution);
+            Spectrum f = pi.bsdf->Sample_f(pi.wo, &wi, pathSampler.Get2D(),
+                                           &pdf, BSDF_ALL, &flags);
+            if (f.IsBlack() || pdf == 0) {
+                paths.state[slot] = WavefrontPathState::Finished;
+                return;
+            }
+            beta *= f * AbsDot(wi, pi.shading.n) / pdf;
+            paths.specularBounce[slot] = (flags & BSDF_SPECULAR) != 0;
+            ray = pi.SpawnRay(wi);
+        }
+
+        // Possibly terminate the path with Russian roulette
+        Spectrum rrBeta = beta * paths.etaScale[slot];
+        if (rrBeta.MaxComponentValue() < rrThreshold &&
+            paths.bounces[slot] > 3) {
+            Float q = std::max((Float).05, 1 - rrBeta.MaxComponentValue());
+            if (pathSampler.Get1D() < q) {
+                paths.state[slot] = WavefrontPathState::Finished;
+                return;
+            }
+            beta /= 1 - q;
+        }
+        ++paths.bounces[slot];
+    };
+
+    ProgressReporter reporter(nBatches, "Rendering");
+    for (int batch = 0; batch < nBatches; ++batch) {
+        // Assign a path slot to each pixel of the batch's tiles, keeping
+        // the slots of each tile contiguous
+        int firstTile = batchStart[batch];
+        int nBatchTiles = batchStart[batch + 1] - firstTile;
+        std::vector<int> tileSlot(nBatchTiles + 1, 0);
+        std::vector<std::unique_ptr<FilmTile>> filmTiles(nBatchTiles);
+        for (int t = 0; t < nBatchTiles; ++t) {
+            tileSlot[t + 1] = tileSlot[t] + tiles[firstTile + t].Area();
+            filmTiles[t] = camera->film->GetFilmTile(tiles[firstTile + t]);
+        }
+        ParallelFor([&](int64_t t) {
+            int slot = tileSlot[t];
+            for (Point2i pixel : tiles[firstTile + t]) {
+                paths.pixel[slot] = pixel;
+                {
+                    ProfilePhase pp(Prof::StartPixel);
+                    paths.samplers[slot]->StartPixel(pixel);
+                }
+                if (InsideExclusive(pixel, pixelBounds)) {
+                    paths.state[slot] = WavefrontPathState::Active;
+                    generateQueue.Push(slot);
+                } else
+                    paths.state[slot] = WavefrontPathState::Idle;
+                ++slot;
+            }
+        }, nBatchTiles);
+
+        while (generateQueue.Size() > 0 || rayQueue.Size() > 0) {
+            ++wavefrontIterations;
+            // Generate camera rays for paths starting a new pixel sample
+            ParallelFor([&](int64_t i) {
+                int slot = generateQueue[i];
+                Sampler &pathSampler = *paths.samplers[slot];
+                CameraSample cameraSample =
+                    pathSampler.GetCameraSample(paths.pixel[slot]);
+                paths.pFilm[slot] = cameraSample.pFilm;
+                paths.rayWeight[slot] = camera->GenerateRayDifferential(
+                    cameraSample, &paths.ray[slot]);
+                paths.ray[slot].ScaleDifferentials(
+                    1 / std::sqrt((Float)pathSampler.samplesPerPixel));
+                paths.L[slot] = Spectrum(0.f);
+                paths.beta[slot] = Spectrum(1.f);
+                paths.etaScale[slot] = 1;
+                paths.bounces[slot] = 0;
+                paths.specularBounce[slot] = false;
+                if (paths.rayWeight[slot] > 0)
+                    rayQueue.Push(slot);
+                else
+                    paths.state[slot] = WavefrontPathState::Finished;
+            }, generateQueue.Size(), chunkSize);
+            generateQueue.Clear();
+
+            // Intersect rays and add emission; surviving paths are queued
+            // for shading
+            ParallelFor([&](int64_t i) {
+                int slot = rayQueue[i];
+                RayDifferential &ray = paths.ray[slot];
+                SurfaceInteraction &isect = paths.isect[slot];
+                bool foundIntersection = scene.Intersect(ray, &isect);
+                if (paths.bounces[slot] == 0 || paths.specularBounce[slot]) {
+                    if (foundIntersection)
+                        paths.L[slot] += paths.beta[slot] * isect.Le(-ray.d);
+                    else
+                        for (const auto &light : scene.infiniteLights)
+                            paths.L[slot] += paths.beta[slot] * light->Le(ray);
+                }
+                if (!foundIntersection || paths.bounces[slot] >= maxDepth) {
+                    paths.state[slot] = WavefrontPathState::Finished;
+                    return;
+                }
+                paths.material[slot] = isect.primitive->GetMaterial();
+                shadeQueue.Push(slot);
+            }, rayQueue.Size(), chunkSize);
+            rayQueue.Clear();
+
+            // Sort the shading queue so that each material's intersections
+            // are shaded together
+            std::sort(shadeQueue.begin(), shadeQueue.end(), [&](int a, int b) {
+                const Material *ma = paths.material[a];
+                const Material *mb = paths.material[b];
+                return ma != mb ? std::less<const Material *>()(ma, mb)
+                                : a < b;
+            });
+            int nShadeChunks = (shadeQueue.Size() + chunkSize - 1) / chunkSize;
+            ParallelFor([&](int64_t chunk) {
+                ProfilePhase p(Prof::SamplerIntegratorLi);
+                MemoryArena &arena = ThreadArena(ArenaCategory::Render);
+                int end =
+                    std::min(shadeQueue.Size(), int(chunk + 1) * chunkSize);
+                for (int i = chunk * chunkSize; i < end; ++i)
+                    shade(shadeQueue[i], arena);
+                arena.Reset();
+            }, nShadeChunks);
+            shadeQueue.Clear();
+
+            // Trace shadow rays
+            ParallelFor([&](int64_t i) {
+                int e = shadowQueue[i];
+                const Light *light = paths.shadowLight[e];
+                if (!light) {
+                    if (scene.IntersectP(paths.shadowRay[e]))
+                        paths.Ld[e] = Spectrum(0.f);
+                    return;
+                }
+                Ray ray = paths.shadowRay[e];
+                SurfaceInteraction lightIsect;
+                Spectrum Li(0.f);
+                if (scene.Intersect(ray, &lightIsect)) {
+                    if (lightIsect.primitive->GetAreaLight() == light)
+                        Li = lightIsect.Le(-ray.d);
+                } else
+                    Li = light->Le(ray);
+                if (!Li.IsBlack())
+                    paths.Ld[e] = paths.shadowF[e] * Li *
+                                  paths.shadowWeight[e] / paths.shadowPdf[e];
+            }, shadowQueue.Size(), chunkSize);
+            shadowQueue.Clear();
+
+            // Accumulate direct lighting, add finished paths to the film
+            // and queue the next stage of every path, one tile per task
+            ParallelFor([&](int64_t t) {
+                FilmTile &filmTile = *filmTiles[t];
+                for (int slot = tileSlot[t]; slot < tileSlot[t + 1]; ++slot) {
+                    if (paths.state[slot] == WavefrontPathState::Idle)
+                        continue;
+                    if (paths.lightPdf[slot] > 0) {
+                        Spectrum Ld =
+                            paths.directBeta[slot] *
+                            ((paths.Ld[2 * slot] + paths.Ld[2 * slot + 1]) /
+                             paths.lightPdf[slot]);
+                        if (Ld.IsBlack()) ++zeroRadiancePaths;
+                        paths.L[slot] += Ld;
+                        paths.lightPdf[slot] = 0;
+                    }
+                    if (paths.state[slot] == WavefrontPathState::Active) {
+                        rayQueue.Push(slot);
+                        continue;
+                    }
+
+                    // Add the finished path's radiance to the film
+                    Spectrum L = paths.L[slot];
+                    if (paths.rayWeight[slot] > 0)
+                        ReportValue(pathLength, paths.bounces[slot]);
+                    if (L.HasNaNs() || L.y() < -1e-5 || std::isinf(L.y())) {
+                        LOG(ERROR) << StringPrintf(
+                            "Invalid radiance value returned for pixel "
+                            "(%d, %d), sample %d. Setting to black.",
+                            paths.pixel[slot].x, paths.pixel[slot].y,
+                            (int)paths.samplers[slot]->CurrentSampleNumber());
+                        L = Spectrum(0.f);
+                    }
+                    filmTile.AddSample(paths.pFilm[slot], L,
+                                       paths.rayWeight[slot]);
+
+                    // Start the pixel's next sample, if any
+                    if (paths.samplers[slot]->StartNextSample()) {
+                        paths.state[slot] = WavefrontPathState::Active;
+                        generateQueue.Push(slot);
+                    } else
+                        paths.state[slot] = WavefrontPathState::Idle;
+                }
+            }, nBatchTiles);
+        }
+
+        // Merge the batch's tiles into the _Film_
+        for (int t = 0; t < nBatchTiles; ++t)
+            camera->film->MergeFilmTile(std::move(filmTiles[t]));
+        reporter.Update();
+    }
+    reporter.Done();
+    LOG(INFO) << "Rendering finished";
+    camera->film->WriteImage();
+}
+
 PathIntegrator *CreatePathIntegrator(const ParamSet &params,
                                      std::shared_ptr<Sampler> sampler,
                                      std::shared_ptr<const Camera> camera) {
@@ -208,8 +702,24 @@ PathIntegrator *CreatePathIntegrator(const ParamSet &params,
     Float rrThreshold = params.FindOneFloat("rrthreshold", 1.);
     std::string lightStrategy =
         params.FindOneString("lightsamplestrategy", "spatial");
-    return new PathIntegrator(maxDepth, camera, sampler, pixelBounds,
-                              rrThreshold, lightStrategy);
+    bool precompute = params.FindOneBool("precomputelightdistribution", false);
+    std::string lightDistribKey =
+        params.FindOneString("lightdistributionkey", "");
+    bool wavefront = params.FindOneBool("wavefront", false);
+    int guidingPasses = params.FindOneInt("guidingpasses", 0);
+    Float guidingBSDFFraction =
+        Clamp(params.FindOneFloat("guidingbsdffraction", .5f), .01f, 1);
+    int wavefrontPaths = params.FindOneInt("wavefrontpaths", 32768);
+    if (wavefrontPaths < 1) {
+        Error("\"wavefrontpaths\" must be positive. Using 32768.");
+        wavefrontPaths = 32768;
+    }
+    PathIntegrator *integrator = new PathIntegrator(
+        maxDepth, camera, sampler, pixelBounds, rrThreshold, lightStrategy,
+        precompute, lightDistribKey, wavefront, wavefrontPaths, guidingPasses,
+        guidingBSDFFraction);
+    integrator->SetRenderBudget(params);
+    return integrator;
 }
 
 }  // namespace pbrt
@@ -40,6 +40,7 @@
 
 // integrators/path.h*
 #include "pbrt.h"
+#include "guiding.h"
 #include "integrator.h"
 #include "lightdistrib.h"
 
@@ -52,18 +53,38 @@ class PathIntegrator : public SamplerIntegrator {
     PathIntegrator(int maxDepth, std::shared_ptr<const Camera> camera,
                    std::shared_ptr<Sampler> sampler,
                    const Bounds2i &pixelBounds, Float rrThreshold = 1,
-                   const std::string &lightSampleStrategy = "spatial");
+                   const std::string &lightSampleStrategy = "spatial",
+                   bool precomputeLightDistribution = false,
+                   const std::string &lightDistributionKey = "",
+                   bool wavefront = false, int wavefrontPaths = 32768,
+                   int guidingPasses = 0, Float guidingBSDFFraction = .5f);
 
     void Preprocess(const Scene &scene, Sampler &sampler);
+    void Render(const Scene &scene);
     Spectrum Li(const RayDifferential &ray, const Scene &scene,
                 Sampler &sampler, MemoryArena &arena, int depth) const;
 
   private:
+    // PathIntegrator Private Methods
+    void RenderWavefront(const Scene &scene);
+
     // PathIntegrator Private Data
     const int maxDepth;
     const Float rrThreshold;
     const std::string lightSampleStrategy;
-    std::unique_ptr<LightDistribution> lightDistribution;
+    const bool precomputeLightDistribution;
+    const std::string lightDistributionKey;
+    std::shared_ptr<LightDistribution> lightDistribution;
+    // In wavefront mode, up to _wavefrontPaths_ paths are advanced one
+    // bounce at a time by a sequence of parallel stages, rather than
+    // each path being traced to completion by Li().
+    const bool wavefront;
+    const int wavefrontPaths;
+    // With guiding, _guidingPasses_ training passes learn _guide_ in
+    // Preprocess(), which then shares path sampling with the BSDF.
+    const int guidingPasses;
+    const Float guidingBSDFFraction;
+    std::unique_ptr<PathGuide> guide;
 };
 
 PathIntegrator *CreatePathIntegrator(const ParamSet &params,
@@ -42,8 +42,11 @@
 #include "progressreporter.h"
 #include "interaction.h"
 #include "sampling.h"
+#include "lightdistrib.h"
 #include "samplers/halton.h"
+#include "lights/infinite.h"
 #include "stats.h"
+#include <chrono>
 
 namespace pbrt {
 
@@ -56,70 +59,524 @@ STAT_COUNTER("Stochastic Progressive Photon Mapping/Photon paths followed",
 STAT_INT_DISTRIBUTION(
     "Stochastic Progressive Photon Mapping/Grid cells per visible point",
     gridCellsPerVisiblePoint);
+STAT_PERCENT(
+    "Stochastic Progressive Photon Mapping/Photon deposits merged per thread",
+    mergedPhotonDeposits, totalPhotonDeposits);
+STAT_RATIO("Stochastic Progressive Photon Mapping/Stored photons checked per "
+           "gather",
+           storedPhotonsChecked, photonMapGathers);
+STAT_INT_DISTRIBUTION("Stochastic Progressive Photon Mapping/Photons per "
+                      "iteration",
+                      photonsPerIterationTraced);
+STAT_PERCENT("Stochastic Progressive Photon Mapping/Visible points reused",
+             reusedVisiblePoints, totalVisiblePoints);
 STAT_MEMORY_COUNTER("Memory/SPPM Pixels", pixelMemoryBytes);
+STAT_MEMORY_COUNTER("Memory/SPPM Stored Photons", storedPhotonBytes);
 STAT_FLOAT_DISTRIBUTION("Memory/SPPM BSDF and Grid Memory", memoryArenaMB);
 
 // SPPM Local Definitions
-struct SPPMPixel {
-    // SPPMPixel Public Methods
-    SPPMPixel() : M(0) {}
-
-    // SPPMPixel Public Data
-    Float radius = 0;
-    Spectrum Ld;
-    struct VisiblePoint {
-        // VisiblePoint Public Methods
-        VisiblePoint() {}
-        VisiblePoint(const Point3f &p, const Vector3f &wo, const BSDF *bsdf,
-                     const Spectrum &beta)
-            : p(p), wo(wo), bsdf(bsdf), beta(beta) {}
-        Point3f p;
-        Vector3f wo;
-        const BSDF *bsdf = nullptr;
-        Spectrum beta;
-    } vp;
-    AtomicFloat Phi[Spectrum::nSamples];
-    std::atomic<int> M;
-    Float N = 0;
-    Spectrum tau;
+// Limits on the photon batch size chosen with "adaptivephotons"; the
+// lower one is the chunk size the photon pass hands to each thread.
+static PBRT_CONSTEXPR int MinPhotonsPerThread = 8192;
+static PBRT_CONSTEXPR int MaxPhotonsPerIteration = 1 << 26;
+
+// Spectral sums are stored in single precision, whatever _Float_ is.
+struct SPPMSpectrum {
+    SPPMSpectrum() {
+        for (int i = 0; i < Spectrum::nSamples; ++i) c[i] = 0;
+    }
+    SPPMSpectrum(const CoefficientSpectrum<Spectrum::nSamples> &s) {
+        for (int i = 0; i < Spectrum::nSamples; ++i) c[i] = s[i];
+    }
+    operator Spectrum() const {
+        Spectrum s;
+        for (int i = 0; i < Spectrum::nSamples; ++i) s[i] = c[i];
+        return s;
+    }
+    SPPMSpectrum &operator+=(
+        const CoefficientSpectrum<Spectrum::nSamples> &s) {
+        for (int i = 0; i < Spectrum::nSamples; ++i) c[i] += s[i];
+        return *this;
+    }
+    bool IsBlack() const {
+        for (int i = 0; i < Spectrum::nSamples; ++i)
+            if (c[i] != 0) return false;
+        return true;
+    }
+    float c[Spectrum::nSamples];
+};
+
+// Unit vectors are stored as two 16-bit octahedral coordinates.
+static uint32_t EncodeDirection(const Vector3f &v) {
+    Float invL1 = 1 / (std::abs(v.x) + std::abs(v.y) + std::abs(v.z));
+    Float x = v.x * invL1, y = v.y * invL1;
+    if (v.z < 0) {
+        Float xf = (1 - std::abs(y)) * (x >= 0 ? 1 : -1);
+        y = (1 - std::abs(x)) * (y >= 0 ? 1 : -1);
+        x = xf;
+    }
+    auto encode = [](Float f) {
+        return (uint32_t)std::round(Clamp((f + 1) / 2, 0, 1) * 65535.f);
+    };
+    return encode(x) | (encode(y) << 16);
+}
+
+static Vector3f DecodeDirection(uint32_t e) {
+    Float x = (e & 0xffff) / 65535.f * 2 - 1;
+    Float y = (e >> 16) / 65535.f * 2 - 1;
+    Float z = 1 - std::abs(x) - std::abs(y);
+    if (z < 0) {
+        Float xf = (1 - std::abs(y)) * (x >= 0 ? 1 : -1);
+        y = (1 - std::abs(x)) * (y >= 0 ? 1 : -1);
+        x = xf;
+    }
+    return Normalize(Vector3f(x, y, z));
+}
+
+// Classification of the visible point found by a pixel's last camera path:
+// _Diffuse_ ones are on a Lambertian surface seen directly from the camera,
+// and _Stable_ ones additionally agree with the previous path's visible
+// point, so they can be kept for a few iterations.
+enum class SPPMVisiblePointState : uint8_t { Other, Diffuse, Stable };
+
+// SPPM pixels are stored as a structure of arrays, so that each pass only
+// streams through the fields it uses.  The grid construction and photon
+// pass read the visible point positions and radii, the photon deposits
+// evaluate the visible points' compact BSDF records, and the running
+// estimates are only touched once per iteration.
+class SPPMPixels {
+  public:
+    // SPPMPixels Public Methods
+    SPPMPixels(int nPixels, Float initialRadius)
+        : nPixels(nPixels),
+          radius(new Float[nPixels]),
+          vpP(new Point3f[nPixels]),
+          vpBSDF(new const BSDF *[nPixels]()),
+          vpDirection(new uint32_t[nPixels]()),
+          vpWeight(new SPPMSpectrum[nPixels]),
+          Phi(new AtomicFloat[nPixels * Spectrum::nSamples]),
+          M(new std::atomic<int>[nPixels]()),
+          N(new Float[nPixels]()),
+          Ld(new SPPMSpectrum[nPixels]),
+          tau(new SPPMSpectrum[nPixels]),
+          cameraPaths(new int[nPixels]()),
+          vpState(new SPPMVisiblePointState[nPixels]()),
+          vpKeep(new int[nPixels]()) {
+        for (int i = 0; i < nPixels; ++i) radius[i] = initialRadius;
+    }
+    size_t BytesPerPixel() const {
+        return sizeof(Float) + sizeof(Point3f) + sizeof(const BSDF *) +
+               sizeof(uint32_t) + sizeof(SPPMSpectrum) +
+               Spectrum::nSamples * sizeof(AtomicFloat) +
+               sizeof(std::atomic<int>) + sizeof(Float) +
+               2 * sizeof(SPPMSpectrum) + 2 * sizeof(int) +
+               sizeof(SPPMVisiblePointState);
+    }
+    bool HasVisiblePoint(int i) const { return !vpWeight[i].IsBlack(); }
+    // A visible point on a purely Lambertian surface is stored as its
+    // position, its normal facing the camera path, and the path weight
+    // times the BSDF value; others keep a pointer to their BSDF.
+    void SetLambertianVisiblePoint(int i, const Point3f &p,
+                                   const Normal3f &n, const Spectrum &weight) {
+        vpP[i] = p;
+        vpBSDF[i] = nullptr;
+        vpDirection[i] = EncodeDirection(Vector3f(n));
+        vpWeight[i] = weight;
+    }
+    void SetVisiblePoint(int i, const Point3f &p, const Vector3f &wo,
+                         const BSDF *bsdf, const Spectrum &beta) {
+        vpP[i] = p;
+        vpBSDF[i] = bsdf;
+        vpDirection[i] = EncodeDirection(wo);
+        vpWeight[i] = beta;
+    }
+    void ClearVisiblePoint(int i) {
+        vpBSDF[i] = nullptr;
+        vpWeight[i] = SPPMSpectrum();
+    }
+    // Returns the visible point's BSDF for light arriving from _wi_,
+    // divided by whatever part of it is folded into _vpWeight_.
+    Spectrum f(int i, const Vector3f &wi) const {
+        if (vpBSDF[i])
+            return vpBSDF[i]->f(DecodeDirection(vpDirection[i]), wi);
+        return Dot(wi, DecodeDirection(vpDirection[i])) > 0 ? Spectrum(1.f)
+                                                            : Spectrum(0.f);
+    }
+
+    // SPPMPixels Public Data
+    const int nPixels;
+    // Hot data: visible point positions and search radii
+    std::unique_ptr<Float[]> radius;
+    std::unique_ptr<Point3f[]> vpP;
+    // Visible point shading records and weights
+    std::unique_ptr<const BSDF *[]> vpBSDF;
+    std::unique_ptr<uint32_t[]> vpDirection;
+    std::unique_ptr<SPPMSpectrum[]> vpWeight;
+    // Photon sums for the current iteration, _Spectrum::nSamples_ per pixel
+    std::unique_ptr<AtomicFloat[]> Phi;
+    std::unique_ptr<std::atomic<int>[]> M;
+    // Cold data: the running estimates; _Ld_ sums the direct lighting of
+    // _cameraPaths_ camera paths
+    std::unique_ptr<Float[]> N;
+    std::unique_ptr<SPPMSpectrum[]> Ld, tau;
+    std::unique_ptr<int[]> cameraPaths;
+    // Visible point reuse: _vpState_ records whether the last camera path
+    // ended in a stable visible point, and _vpKeep_ is the number of
+    // following iterations that keep it without tracing a new path
+    std::unique_ptr<SPPMVisiblePointState[]> vpState;
+    std::unique_ptr<int[]> vpKeep;
+};
+
+// Visible points are stored in the grid by value, sorted by hash cell, so
+// that photon lookups scan contiguous memory and only touch the shading
+// records of visible points that the photon actually lands near.
+struct SPPMGridEntry {
+    Point3f p;
+    Float radius2;
+    int pixelIndex;
+};
+
+// Each thread sums the photons it deposits into a small open-addressing
+// table keyed by pixel index, so repeated deposits into the same pixel,
+// as happen in caustics, don't bounce the pixel's cache line between
+// threads.  Sums are only added to the shared _SPPMPixels_ atomics when
+// the table fills up and once at the end of the photon pass.
+class SPPMPhotonAccumulator {
+  public:
+    // SPPMPhotonAccumulator Public Methods
+    SPPMPhotonAccumulator() : entries(TableSize) {}
+    void Add(SPPMPixels &pixels, int pixelIndex, const Spectrum &Phi) {
+        ++totalPhotonDeposits;
+        uint32_t h = ((uint32_t)pixelIndex * 2654435761u) >> (32 - TableBits);
+        for (int probe = 0; probe < MaxProbes; ++probe) {
+            int index = (h + probe) & (TableSize - 1);
+            Entry &entry = entries[index];
+            if (entry.pixelIndex == pixelIndex) {
+                ++mergedPhotonDeposits;
+                entry.Phi += Phi;
+                ++entry.M;
+                return;
+            } else if (entry.pixelIndex == -1) {
+                entry.pixelIndex = pixelIndex;
+                entry.Phi = Phi;
+                entry.M = 1;
+                usedEntries.push_back(index);
+                return;
+            }
+        }
+        // Make room by flushing the table and then add the photon
+        Flush(pixels);
+        Entry &entry = entries[h];
+        entry.pixelIndex = pixelIndex;
+        entry.Phi = Phi;
+        entry.M = 1;
+        usedEntries.push_back(h);
+    }
+    void Flush(SPPMPixels &pixels) {
+        for (int index : usedEntries) {
+            Entry &entry = entries[index];
+            int pixelIndex = entry.pixelIndex;
+            for (int i = 0; i < Spectrum::nSamples; ++i)
+                pixels.Phi[pixelIndex * Spectrum::nSamples + i].Add(
+                    entry.Phi[i]);
+            pixels.M[pixelIndex] += entry.M;
+            entry.pixelIndex = -1;
+        }
+        usedEntries.clear();
+    }
+
+  private:
+    // SPPMPhotonAccumulator Private Data
+    // 4096 entries of 20 bytes with the default RGB spectra take 80KB per
+    // thread, which fits in L2; with 60-sample spectra they take about 1MB
+    static PBRT_CONSTEXPR int TableBits = 12;
+    static PBRT_CONSTEXPR int TableSize = 1 << TableBits;
+    static PBRT_CONSTEXPR int MaxProbes = 16;
+    struct Entry {
+        int pixelIndex = -1;
+        int M = 0;
+        Spectrum Phi;
+    };
+    std::vector<Entry> entries;
+    std::vector<int> usedEntries;
 };
 
-struct SPPMPixelListNode {
-    SPPMPixel *pixel;
-    SPPMPixelListNode *next;
+// Follows the photon path with Halton index _haltonIndex_ through the
+// scene and calls _deposit_ with the position, incident direction and
+// weight of the photon at every surface it reaches after its first bounce.
+// Photons from infinite lights are partly aimed at _region_.
+template <typename DepositFunc>
+static void TracePhotonPath(const Scene &scene,
+                            const Distribution1D &lightDistr,
+                            uint64_t haltonIndex, int maxDepth,
+                            const Camera &camera,
+                            const EmissionRegion &region, MemoryArena &arena,
+                            DepositFunc deposit) {
+    int haltonDim = 0;
+
+    // Choose light to shoot photon from
+    Float lightPdf;
+    Float lightSample = RadicalInverse(haltonDim++, haltonIndex);
+    int lightNum = lightDistr.SampleDiscrete(lightSample, &lightPdf);
+    const std::shared_ptr<Light> &light = scene.lights[lightNum];
+
+    // Compute sample values for photon ray leaving light source
+    Point2f uLight0(RadicalInverse(haltonDim, haltonIndex),
+                    RadicalInverse(haltonDim + 1, haltonIndex));
+    Point2f uLight1(RadicalInverse(haltonDim + 2, haltonIndex),
+                    RadicalInverse(haltonDim + 3, haltonIndex));
+    Float uLightTime = Lerp(RadicalInverse(haltonDim + 4, haltonIndex),
+                            camera.shutterOpen, camera.shutterClose);
+    haltonDim += 5;
+
+    // Generate _photonRay_ from light source and initialize _beta_
+    RayDifferential photonRay;
+    Normal3f nLight;
+    Float pdfPos, pdfDir;
+    const InfiniteAreaLight *infiniteLight =
+        region.fraction > 0
+            ? dynamic_cast<const InfiniteAreaLight *>(light.get())
+            : nullptr;
+    Spectrum Le =
+        infiniteLight
+            ? infiniteLight->Sample_Le(uLight0, uLight1, uLightTime, region,
+                                       &photonRay, &nLight, &pdfPos, &pdfDir)
+            : light->Sample_Le(uLight0, uLight1, uLightTime, &photonRay,
+                               &nLight, &pdfPos, &pdfDir);
+    if (pdfPos == 0 || pdfDir == 0 || Le.IsBlack()) return;
+    Spectrum beta =
+        (AbsDot(nLight, photonRay.d) * Le) / (lightPdf * pdfPos * pdfDir);
+    if (beta.IsBlack()) return;
+
+    // Follow photon path through scene and record intersections
+    SurfaceInteraction isect;
+    for (int depth = 0; depth < maxDepth; ++depth) {
+        if (!scene.Intersect(photonRay, &isect)) break;
+        ++totalPhotonSurfaceInteractions;
+        if (depth > 0) deposit(isect.p, -photonRay.d, beta);
+        // Sample new photon ray direction
+
+        // Compute BSDF at photon intersection point
+        isect.ComputeScatteringFunctions(photonRay, arena, true,
+                                         TransportMode::Importance);
+        if (!isect.bsdf) {
+            --depth;
+            photonRay = isect.SpawnRay(photonRay.d);
+            continue;
+        }
+        const BSDF &photonBSDF = *isect.bsdf;
+
+        // Sample BSDF _fr_ and direction _wi_ for reflected photon
+        Vector3f wi, wo = -photonRay.d;
+        Float pdf;
+        BxDFType flags;
+
+        // Generate _bsdfSample_ for outgoing photon sample
+        Point2f bsdfSample(RadicalInverse(haltonDim, haltonIndex),
+                           RadicalInverse(haltonDim + 1, haltonIndex));
+        haltonDim += 2;
+        Spectrum fr = photonBSDF.Sample_f(wo, &wi, bsdfSample, &pdf, BSDF_ALL,
+                                          &flags);
+        if (fr.IsBlack() || pdf == 0.f) break;
+        Spectrum bnew = beta * fr * AbsDot(wi, isect.shading.n) / pdf;
+
+        // Possibly terminate photon path with Russian roulette
+        Float q = std::max((Float)0, 1 - bnew.y() / beta.y());
+        if (RadicalInverse(haltonDim++, haltonIndex) < q) break;
+        beta = bnew / (1 - q);
+        photonRay = (RayDifferential)isect.SpawnRay(wi);
+    }
+}
+
+// A photon map stores the photon hits of a single view-independent photon
+// pass, bucketed by hashed grid cell, so that the visible points of any
+// number of cameras can gather from it.
+struct SPPMStoredPhoton {
+    Point3f p;
+    Vector3f wi;
+    Spectrum beta;
 };
 
-static bool ToGrid(const Point3f &p, const Bounds3f &bounds,
-                   const int gridRes[3], Point3i *pi) {
-    bool inBounds = true;
-    Vector3f pg = bounds.Offset(p);
-    for (int i = 0; i < 3; ++i) {
-        (*pi)[i] = (int)(gridRes[i] * pg[i]);
-        inBounds &= ((*pi)[i] >= 0 && (*pi)[i] < gridRes[i]);
-        (*pi)[i] = Clamp((*pi)[i], 0, gridRes[i] - 1);
+class SPPMPhotonMap {
+  public:
+    // SPPMPhotonMap Public Methods
+    SPPMPhotonMap(const Scene &scene, const Camera &camera,
+                  const Distribution1D *lightDistr,
+                  const EmissionRegion &region, int nPhotonPaths,
+                  int maxDepth, Float cellSize);
+    template <typename BSDFFunc>
+    Spectrum Gather(const Point3f &p, BSDFFunc f, int nNearest,
+                    std::vector<std::pair<Float, int>> *nearest) const;
+    int NumPhotonPaths() const { return nPhotonPaths; }
+    size_t NumPhotons() const { return photons.size(); }
+
+  private:
+    // SPPMPhotonMap Private Data
+    const int nPhotonPaths;
+    const Float cellSize;
+    Bounds3f bounds;
+    int gridRes[3];
+    int hashSize = 1;
+    std::vector<int> cellOffsets;
+    std::vector<SPPMStoredPhoton> photons;
+};
+
+SPPMPhotonMap::SPPMPhotonMap(const Scene &scene, const Camera &camera,
+                             const Distribution1D *lightDistr,
+                             const EmissionRegion &region, int nPhotonPaths,
+                             int maxDepth, Float cellSize)
+    : nPhotonPaths(nPhotonPaths), cellSize(cellSize) {
+    if (!lightDistr) return;
+
+    // Trace photon paths, keeping each thread's photons separately
+    std::vector<std::vector<SPPMStoredPhoton>> threadPhotons(MaxThreadIndex());
+    {
+        ProfilePhase _(Prof::SPPMPhotonPass);
+        ParallelFor([&](int photonIndex) {
+            MemoryArena &arena = ThreadArena(ArenaCategory::SPPMPhotonPass);
+            std::vector<SPPMStoredPhoton> &threadPhotonList =
+                threadPhotons[ThreadIndex];
+            TracePhotonPath(scene, *lightDistr, photonIndex, maxDepth, camera,
+                            region, arena,
+                            [&](const Point3f &p, const Vector3f &wi,
+                                const Spectrum &beta) {
+                                threadPhotonList.push_back({p, wi, beta});
+                            });
+            arena.Reset();
+        }, nPhotonPaths, 8192);
+        photonPaths += nPhotonPaths;
+    }
+
+    // Sort the photons into hashed grid cells of width _cellSize_
+    ProfilePhase _(Prof::SPPMGridConstruction);
+    size_t nPhotons = 0;
+    for (const auto &list : threadPhotons) {
+        nPhotons += list.size();
+        for (const SPPMStoredPhoton &photon : list)
+            bounds = Union(bounds, photon.p);
+    }
+    if (nPhotons == 0) return;
+    Vector3f diag = bounds.Diagonal();
+    for (int i = 0; i < 3; ++i)
+        gridRes[i] = Clamp((int)std::ceil(diag[i] / cellSize), 1, 1 << 20);
+    bounds.pMax = bounds.pMin + Vector3f(gridRes[0] * cellSize,
+                                         gridRes[1] * cellSize,
+                                         gridRes[2] * cellSize);
+    hashSize = (int)nPhotons;
+    cellOffsets.assign(hashSize + 1, 0);
+    std::vector<int> photonHash;
+    photonHash.reserve(nPhotons);
+    for (const auto &list : threadPhotons)
+        for (const SPPMStoredPhoton &photon : list) {
+            Point3i pi;
+            ToGrid(photon.p, bounds, gridRes, &pi);
+            int h = hash(pi, hashSize);
+            photonHash.push_back(h);
+            ++cellOffsets[h + 1];
+        }
+    for (int h = 0; h < hashSize; ++h) cellOffsets[h + 1] += cellOffsets[h];
+    std::vector<int> cursor(cellOffsets.begin(), cellOffsets.end() - 1);
+    photons.resize(nPhotons);
+    int photonNum = 0;
+    for (auto &list : threadPhotons) {
+        for (const SPPMStoredPhoton &photon : list)
+            photons[cursor[photonHash[photonNum++]]++] = photon;
+        std::vector<SPPMStoredPhoton>().swap(list);
     }
-    return inBounds;
+    storedPhotonBytes += photons.size() * sizeof(SPPMStoredPhoton);
 }
 
-inline unsigned int hash(const Point3i &p, int hashSize) {
-    return (unsigned int)((p.x * 73856093) ^ (p.y * 19349663) ^
-                          (p.z * 83492791)) %
-           hashSize;
+// Returns the photon density estimate of the radiance reflected at _p_,
+// where _f_ gives the BSDF value for each photon's incident direction.
+// With _nNearest_ of zero all photons within one cell width are gathered;
+// otherwise the search radius shrinks to the distance of the _nNearest_th
+// closest photon.
+template <typename BSDFFunc>
+Spectrum SPPMPhotonMap::Gather(
+    const Point3f &p, BSDFFunc f, int nNearest,
+    std::vector<std::pair<Float, int>> *nearest) const {
+    ++photonMapGathers;
+    if (photons.empty()) return Spectrum(0.f);
+    Float radius2 = cellSize * cellSize;
+
+    // Find the distinct hash buckets of the cells overlapping the search
+    // sphere, so that colliding cells aren't scanned twice; since the
+    // search radius is one cell width, at most 3 (4 with round-off) cells
+    // overlap along each axis
+    Point3i pMin, pMax;
+    ToGrid(p - Vector3f(cellSize, cellSize, cellSize), bounds, gridRes, &pMin);
+    ToGrid(p + Vector3f(cellSize, cellSize, cellSize), bounds, gridRes, &pMax);
+    int buckets[64], nBuckets = 0;
+    for (int z = pMin.z; z <= pMax.z; ++z)
+        for (int y = pMin.y; y <= pMax.y; ++y)
+            for (int x = pMin.x; x <= pMax.x; ++x) {
+                int h = hash(Point3i(x, y, z), hashSize);
+                if (std::find(buckets, buckets + nBuckets, h) ==
+                    buckets + nBuckets)
+                    buckets[nBuckets++] = h;
+            }
+
+    Spectrum L(0.f);
+    if (nNearest == 0) {
+        for (int b = 0; b < nBuckets; ++b)
+            for (int i = cellOffsets[buckets[b]];
+                 i < cellOffsets[buckets[b] + 1]; ++i) {
+                ++storedPhotonsChecked;
+                const SPPMStoredPhoton &photon = photons[i];
+                if (DistanceSquared(photon.p, p) <= radius2)
+                    L += photon.beta * f(photon.wi);
+            }
+    } else {
+        // Keep the _nNearest_ closest photons in a max-heap on distance
+        nearest->clear();
+        for (int b = 0; b < nBuckets; ++b)
+            for (int i = cellOffsets[buckets[b]];
+                 i < cellOffsets[buckets[b] + 1]; ++i) {
+                ++storedPhotonsChecked;
+                Float d2 = DistanceSquared(photons[i].p, p);
+                if (d2 > radius2) continue;
+                if ((int)nearest->size() < nNearest) {
+                    nearest->push_back(std::make_pair(d2, i));
+                    std::push_heap(nearest->begin(), nearest->end());
+                } else if (d2 < nearest->front().first) {
+                    std::pop_heap(nearest->begin(), nearest->end());
+                    nearest->back() = std::make_pair(d2, i);
+                    std::push_heap(nearest->begin(), nearest->end());
+                }
+            }
+        if ((int)nearest->size() == nNearest)
+            radius2 = nearest->front().first;
+        for (const std::pair<Float, int> &n : *nearest)
+            L += photons[n.second].beta * f(photons[n.second].wi);
+    }
+    if (radius2 == 0) return Spectrum(0.f);
+    return L / (Pi * radius2 * nPhotonPaths);
 }
 
+// The most recently built photon map is kept across renders, so that a
+// batch of cameras viewing the same world pays for a single photon pass.
+static std::string cachedPhotonMapKey;
+static std::shared_ptr<const SPPMPhotonMap> cachedPhotonMap;
+
 // SPPM Method Definitions
 void SPPMIntegrator::Render(const Scene &scene) {
     ProfilePhase p(Prof::IntegratorRender);
     // Initialize _pixelBounds_ and _pixels_ array for SPPM
     Bounds2i pixelBounds = camera->film->croppedPixelBounds;
     int nPixels = pixelBounds.Area();
-    std::unique_ptr<SPPMPixel[]> pixels(new SPPMPixel[nPixels]);
-    for (int i = 0; i < nPixels; ++i) pixels[i].radius = initialSearchRadius;
+    SPPMPixels pixels(nPixels, initialSearchRadius);
     const Float invSqrtSPP = 1.f / std::sqrt(nIterations);
-    pixelMemoryBytes = nPixels * sizeof(SPPMPixel);
-    // Compute _lightDistr_ for sampling lights proportional to power
-    std::unique_ptr<Distribution1D> lightDistr =
-        ComputeLightPowerDistribution(scene);
+    pixelMemoryBytes = nPixels * pixels.BytesPerPixel();
+    // Compute _lightDistr_ for choosing the lights photons leave from; with
+    // point-dependent strategies, the distribution at the camera is used
+    std::unique_ptr<LightDistribution> lightDistribution;
+    const Distribution1D *lightDistr = nullptr;
+    if (!scene.lights.empty()) {
+        lightDistribution =
+            CreateLightSampleDistribution(lightSampleStrategy, scene);
+        lightDistr = lightDistribution->Lookup(
+            camera->CameraToWorld(camera->shutterOpen, Point3f(0, 0, 0)));
+    }
 
     // Perform _nIterations_ of SPPM integration
     HaltonSampler sampler(nIterations, pixelBounds);
@@ -129,14 +586,65 @@ void SPPMIntegrator::Render(const Scene &scene) {
     const int tileSize = 16;
     Point2i nTiles((pixelExtent.x + tileSize - 1) / tileSize,
                    (pixelExtent.y + tileSize - 1) / tileSize);
+
+    std::shared_ptr<const SPPMPhotonMap> photonMap;
     ProgressReporter progress(2 * nIterations, "Rendering");
+
+    // Allocate storage for the SPPM visible point grid; it is rebuilt
+    // in place every iteration, with the hash table sized to the number of
+    // visible points, which is at most one per pixel
+    int hashSize = nPixels;
+    std::vector<int> gridCellOffsets(nPixels + 1);
+    std::vector<std::atomic<int>> gridCursor(nPixels);
+    std::vector<SPPMGridEntry> gridEntries;
+    std::vector<SPPMPhotonAccumulator> photonAccumulators(MaxThreadIndex());
+
+    // With a target error, every iteration's radiance estimate for each
+    // pixel is recorded in the film; _iterationLd_ holds its direct part
+    std::vector<Spectrum> iterationLd(targetError > 0 ? nPixels : 0);
+    if (targetError > 0) camera->film->EnableErrorEstimate();
+    auto addErrorSample = [&](int pixelIndex, const Spectrum &Lindirect) {
+        int width = pixelBounds.pMax.x - pixelBounds.pMin.x;
+        Point2i pPixel(pixelBounds.pMin.x + pixelIndex % width,
+                       pixelBounds.pMin.y + pixelIndex / width);
+        camera->film->AddErrorSample(pPixel,
+                                     iterationLd[pixelIndex] + Lindirect);
+    };
+    // With "visiblepointreuse", a directly visible Lambertian visible point
+    // is stable if the pixel's previous one was too and lay within the
+    // search radius with the same orientation, so that the pixel is
+    // neither at a silhouette nor on strongly curved geometry; the
+    // previous position and normal are still in _pixels_ even after the
+    // visible point was cleared
+    auto visiblePointState = [&](int i, const Point3f &p, const Normal3f &n) {
+        if (visiblePointReuse <= 1 ||
+            pixels.vpState[i] == SPPMVisiblePointState::Other)
+            return SPPMVisiblePointState::Diffuse;
+        Float radius = pixels.radius[i];
+        if (DistanceSquared(p, pixels.vpP[i]) > radius * radius ||
+            Dot(Vector3f(n), DecodeDirection(pixels.vpDirection[i])) < .99f)
+            return SPPMVisiblePointState::Diffuse;
+        return SPPMVisiblePointState::Stable;
+    };
+    // With adaptive photon counts, each iteration traces a different number
+    // of photons; _photonsTraced_ is the running total
+    int iterationPhotons = photonsPerIteration;
+    if (adaptivePhotons)
+        iterationPhotons = std::max(iterationPhotons, MinPhotonsPerThread *
+                                                          MaxThreadIndex());
+    uint64_t photonsTraced = 0;
     for (int iter = 0; iter < nIterations; ++iter) {
-        // Generate SPPM visible points
-        std::vector<MemoryArena> perThreadArenas(MaxThreadIndex());
+        std::chrono::steady_clock::time_point iterationStart =
+            std::chrono::steady_clock::now();
+        // Generate SPPM visible points; the camera paths use scratch
+        // memory, and only the BSDFs kept by visible points persist until
+        // the next iteration
+        ResetThreadArenas(ArenaCategory::SPPMVisiblePoints);
         {
             ProfilePhase _(Prof::SPPMCameraPass);
             ParallelFor2D([&](Point2i tile) {
-                MemoryArena &arena = perThreadArenas[ThreadIndex];
+                MemoryArena &arena =
+                    ThreadArena(ArenaCategory::SPPMCameraPass);
                 // Follow camera paths for _tile_ in image for SPPM
                 int tileIndex = tile.y * nTiles.x + tile.x;
                 std::unique_ptr<Sampler> tileSampler = sampler.Clone(tileIndex);
@@ -148,6 +656,24 @@ void SPPMIntegrator::Render(const Scene &scene) {
                 int y1 = std::min(y0 + tileSize, pixelBounds.pMax.y);
                 Bounds2i tileBounds(Point2i(x0, y0), Point2i(x1, y1));
                 for (Point2i pPixel : tileBounds) {
+                    // Get pixel index for _pPixel_
+                    Point2i pPixelO = Point2i(pPixel - pixelBounds.pMin);
+                    int pixelOffset =
+                        pPixelO.x +
+                        pPixelO.y * (pixelBounds.pMax.x - pixelBounds.pMin.x);
+
+                    // Keep the visible point of a stable pixel
+                    ++totalVisiblePoints;
+                    if (pixels.vpKeep[pixelOffset] > 0) {
+                        --pixels.vpKeep[pixelOffset];
+                        ++reusedVisiblePoints;
+                        if (targetError > 0)
+                            iterationLd[pixelOffset] =
+                                Spectrum(pixels.Ld[pixelOffset]) /
+                                pixels.cameraPaths[pixelOffset];
+                        continue;
+                    }
+
                     // Prepare _tileSampler_ for _pPixel_
                     tileSampler->StartPixel(pPixel);
                     tileSampler->SetSampleNumber(iter);
@@ -161,14 +687,10 @@ void SPPMIntegrator::Render(const Scene &scene) {
                     ray.ScaleDifferentials(invSqrtSPP);
 
                     // Follow camera ray path until a visible point is created
-
-                    // Get _SPPMPixel_ for _pPixel_
-                    Point2i pPixelO = Point2i(pPixel - pixelBounds.pMin);
-                    int pixelOffset =
-                        pPixelO.x +
-                        pPixelO.y * (pixelBounds.pMax.x - pixelBounds.pMin.x);
-                    SPPMPixel &pixel = pixels[pixelOffset];
+                    Spectrum Ld(0.f);
+                    SPPMVisiblePointState state = SPPMVisiblePointState::Other;
                     bool specularBounce = false;
+                    Point3f pCamera = ray.o;
                     for (int depth = 0; depth < maxDepth; ++depth) {
                         SurfaceInteraction isect;
                         ++totalPhotonSurfaceInteractions;
@@ -176,12 +698,15 @@ void SPPMIntegrator::Render(const Scene &scene) {
                             // Accumulate light contributions for ray with no
                             // intersection
                             for (const auto &light : scene.lights)
-                                pixel.Ld += beta * light->Le(ray);
+                                Ld += beta * light->Le(ray);
                             break;
                         }
                         // Process SPPM camera ray intersection
 
-                        // Compute BSDF at SPPM camera ray intersection
+                        // Compute BSDF at SPPM camera ray intersection,
+                        // keeping the unshaded interaction in case a visible
+                        // point needs the BSDF again
+                        SurfaceInteraction unshaded = isect;
                         isect.ComputeScatteringFunctions(ray, arena, true);
                         if (!isect.bsdf) {
                             ray = isect.SpawnRay(ray.d);
@@ -189,13 +714,19 @@ void SPPMIntegrator::Render(const Scene &scene) {
                             continue;
                         }
                         const BSDF &bsdf = *isect.bsdf;
+                        if (depth == 0 && camera->film->HasAOVs())
+                            camera->film->AddAOVSample(
+                                pPixel,
+                                ComputeAOVSample(
+                                    isect, pCamera,
+                                    camera->film->HasAOV(AOVType::Albedo)));
 
                         // Accumulate direct illumination at SPPM camera ray
                         // intersection
                         Vector3f wo = -ray.d;
                         if (depth == 0 || specularBounce)
-                            pixel.Ld += beta * isect.Le(wo);
-                        pixel.Ld +=
+                            Ld += beta * isect.Le(wo);
+                        Ld +=
                             beta * UniformSampleOneLight(isect, scene, arena,
                                                          *tileSampler);
 
@@ -207,7 +738,26 @@ void SPPMIntegrator::Render(const Scene &scene) {
                                             BSDF_GLOSSY | BSDF_REFLECTION |
                                             BSDF_TRANSMISSION)) > 0;
                         if (isDiffuse || (isGlossy && depth == maxDepth - 1)) {
-                            pixel.vp = {isect.p, wo, &bsdf, beta};
+                            Spectrum R;
+                            if (bsdf.IsLambertian(&R)) {
+                                Normal3f n = Faceforward(isect.n, wo);
+                                if (depth == 0)
+                                    state = visiblePointState(
+                                        pixelOffset, isect.p, n);
+                                pixels.SetLambertianVisiblePoint(
+                                    pixelOffset, isect.p, n, beta * R * InvPi);
+                            } else {
+                                // Recompute the BSDF in memory that lasts
+                                // for the whole iteration; shading _isect_
+                                // again would apply bump mapping twice
+                                unshaded.ComputeScatteringFunctions(
+                                    ray,
+                                    ThreadArena(
+                                        ArenaCategory::SPPMVisiblePoints),
+                                    true);
+                                pixels.SetVisiblePoint(pixelOffset, isect.p, wo,
+                                                       unshaded.bsdf, beta);
+                            }
                             break;
                         }
 
@@ -231,229 +781,321 @@ void SPPMIntegrator::Render(const Scene &scene) {
                             ray = (RayDifferential)isect.SpawnRay(wi);
                         }
                     }
+                    pixels.Ld[pixelOffset] += Ld;
+                    ++pixels.cameraPaths[pixelOffset];
+                    if (targetError > 0) iterationLd[pixelOffset] = Ld;
+
+                    // Decide how many iterations keep this visible point;
+                    // pixels that have just become stable are staggered so
+                    // that they don't all trace new paths together
+                    pixels.vpKeep[pixelOffset] = 0;
+                    if (state == SPPMVisiblePointState::Stable)
+                        pixels.vpKeep[pixelOffset] =
+                            pixels.vpState[pixelOffset] ==
+                                    SPPMVisiblePointState::Stable
+                                ? visiblePointReuse - 1
+                                : pixelOffset % visiblePointReuse;
+                    pixels.vpState[pixelOffset] = state;
+                    arena.Reset();
                 }
             }, nTiles);
         }
         progress.Update();
 
-        // Create grid of all SPPM visible points
-        int gridRes[3];
-        Bounds3f gridBounds;
-        // Allocate grid for SPPM visible points
-        const int hashSize = nPixels;
-        std::vector<std::atomic<SPPMPixelListNode *>> grid(hashSize);
-        {
-            ProfilePhase _(Prof::SPPMGridConstruction);
-
-            // Compute grid bounds for SPPM visible points
-            Float maxRadius = 0.;
-            for (int i = 0; i < nPixels; ++i) {
-                const SPPMPixel &pixel = pixels[i];
-                if (pixel.vp.beta.IsBlack()) continue;
-                Bounds3f vpBound = Expand(Bounds3f(pixel.vp.p), pixel.radius);
-                gridBounds = Union(gridBounds, vpBound);
-                maxRadius = std::max(maxRadius, pixel.radius);
+        // Trace the stored photon map after the first camera pass, unless
+        // the previous render built one for the same world
+        if (usePhotonMap && !photonMap) {
+            std::string key =
+                StringPrintf("%s/%s/%d/%d/%f", photonMapKey.c_str(),
+                             lightSampleStrategy.c_str(), photonMapPhotons,
+                             maxDepth, initialSearchRadius);
+            if (!photonMapKey.empty() && cachedPhotonMap &&
+                key == cachedPhotonMapKey)
+                photonMap = cachedPhotonMap;
+            else {
+                // Infinite lights can aim part of their photons at the
+                // visible points; maps shared through _photonMapKey_ have
+                // _roiFraction_ zero, since other views use them too
+                Bounds3f roi;
+                if (roiFraction > 0)
+                    for (int i = 0; i < nPixels; ++i)
+                        if (pixels.HasVisiblePoint(i))
+                            roi = Union(roi, Expand(Bounds3f(pixels.vpP[i]),
+                                                    pixels.radius[i]));
+                photonMap = std::make_shared<const SPPMPhotonMap>(
+                    scene, *camera, lightDistr,
+                    EmissionRegion(roi, roiFraction), photonMapPhotons,
+                    maxDepth, initialSearchRadius);
+                if (!photonMapKey.empty()) {
+                    cachedPhotonMapKey = key;
+                    cachedPhotonMap = photonMap;
+                }
             }
+        }
+
+        if (photonMap) {
+            // Gather stored photons at this iteration's visible points
+            ProfilePhase _(Prof::SPPMStatsUpdate);
+            std::vector<std::vector<std::pair<Float, int>>> nearest(
+                MaxThreadIndex());
+            ParallelFor([&](int i) {
+                Spectrum Lindirect(0.f);
+                if (pixels.HasVisiblePoint(i))
+                    Lindirect =
+                        Spectrum(pixels.vpWeight[i]) *
+                        photonMap->Gather(
+                            pixels.vpP[i],
+                            [&](const Vector3f &wi) { return pixels.f(i, wi); },
+                            gatherPhotons, &nearest[ThreadIndex]);
+                pixels.tau[i] += Lindirect;
+                if (targetError > 0) addErrorSample(i, Lindirect);
+                // Reset visible point in pixel, unless it is kept
+                if (pixels.vpKeep[i] == 0) pixels.ClearVisiblePoint(i);
+            }, nPixels, 4096);
+            progress.Update();
+        } else {
+            // Create grid of all SPPM visible points
+            int gridRes[3];
+            Bounds3f gridBounds;
+            {
+                ProfilePhase _(Prof::SPPMGridConstruction);
 
-            // Compute resolution of SPPM grid in each dimension
-            Vector3f diag = gridBounds.Diagonal();
-            Float maxDiag = MaxComponent(diag);
-            int baseGridRes = (int)(maxDiag / maxRadius);
-            CHECK_GT(baseGridRes, 0);
-            for (int i = 0; i < 3; ++i)
-                gridRes[i] = std::max((int)(baseGridRes * diag[i] / maxDiag), 1);
-
-            // Add visible points to SPPM grid
-            ParallelFor([&](int pixelIndex) {
-                MemoryArena &arena = perThreadArenas[ThreadIndex];
-                SPPMPixel &pixel = pixels[pixelIndex];
-                if (!pixel.vp.beta.IsBlack()) {
-                    // Add pixel's visible point to applicable grid cells
-                    Float radius = pixel.radius;
+                // Compute grid bounds for SPPM visible points
+                Float radiusSum = 0.;
+                int nVisiblePoints = 0;
+                for (int i = 0; i < nPixels; ++i) {
+                    if (!pixels.HasVisiblePoint(i)) continue;
+                    Bounds3f vpBound =
+                        Expand(Bounds3f(pixels.vpP[i]), pixels.radius[i]);
+                    gridBounds = Union(gridBounds, vpBound);
+                    radiusSum += pixels.radius[i];
+                    ++nVisiblePoints;
+                }
+                hashSize = std::max(nVisiblePoints, 1);
+
+                // Compute resolution of SPPM grid in each dimension; cells
+                // are as wide as the mean search diameter of the visible
+                // points, so that a typical one overlaps at most 2x2x2
+                // cells even after the radii have shrunk unevenly
+                Vector3f diag = gridBounds.Diagonal();
+                Float maxDiag = MaxComponent(diag);
+                Float cellSize = 2 * radiusSum / hashSize;
+                int baseGridRes =
+                    cellSize > 0 ? std::max((int)(maxDiag / cellSize), 1) : 1;
+                for (int i = 0; i < 3; ++i)
+                    gridRes[i] =
+                        std::max((int)(baseGridRes * diag[i] / maxDiag), 1);
+
+                // Count the visible points overlapping each grid cell; a
+                // visible point is added only once to each hash bucket,
+                // even if several of the cells it overlaps collide there,
+                // so that photons don't deposit into it twice
+                for (int h = 0; h < hashSize; ++h) gridCursor[h] = 0;
+                auto visiblePointBuckets = [&](int pixelIndex,
+                                               std::vector<int> *buckets) {
+                    buckets->clear();
+                    if (!pixels.HasVisiblePoint(pixelIndex)) return;
+                    const Point3f &vpP = pixels.vpP[pixelIndex];
+                    Float radius = pixels.radius[pixelIndex];
                     Point3i pMin, pMax;
-                    ToGrid(pixel.vp.p - Vector3f(radius, radius, radius),
+                    ToGrid(vpP - Vector3f(radius, radius, radius),
                            gridBounds, gridRes, &pMin);
-                    ToGrid(pixel.vp.p + Vector3f(radius, radius, radius),
+                    ToGrid(vpP + Vector3f(radius, radius, radius),
                            gridBounds, gridRes, &pMax);
                     for (int z = pMin.z; z <= pMax.z; ++z)
                         for (int y = pMin.y; y <= pMax.y; ++y)
-                            for (int x = pMin.x; x <= pMax.x; ++x) {
-                                // Add visible point to grid cell $(x, y, z)$
-                                int h = hash(Point3i(x, y, z), hashSize);
-                                SPPMPixelListNode *node =
-                                    arena.Alloc<SPPMPixelListNode>();
-                                node->pixel = &pixel;
-
-                                // Atomically add _node_ to the start of
-                                // _grid[h]_'s linked list
-                                node->next = grid[h];
-                                while (grid[h].compare_exchange_weak(
-                                           node->next, node) == false)
-                                    ;
-                            }
-                    ReportValue(gridCellsPerVisiblePoint,
-                                (1 + pMax.x - pMin.x) * (1 + pMax.y - pMin.y) *
-                                    (1 + pMax.z - pMin.z));
+                            for (int x = pMin.x; x <= pMax.x; ++x)
+                                buckets->push_back(
+                                    hash(Point3i(x, y, z), hashSize));
+                    ReportValue(gridCellsPerVisiblePoint, buckets->size());
+                    std::sort(buckets->begin(), buckets->end());
+                    buckets->erase(
+                        std::unique(buckets->begin(), buckets->end()),
+                        buckets->end());
+                };
+                std::vector<std::vector<int>> threadBuckets(MaxThreadIndex());
+                ParallelFor([&](int pixelIndex) {
+                    std::vector<int> &buckets = threadBuckets[ThreadIndex];
+                    visiblePointBuckets(pixelIndex, &buckets);
+                    for (int h : buckets)
+                        gridCursor[h].fetch_add(1, std::memory_order_relaxed);
+                }, nPixels, 4096);
+
+                // Compute each cell's offset into _gridEntries_
+                gridCellOffsets[0] = 0;
+                for (int h = 0; h < hashSize; ++h) {
+                    int count = gridCursor[h].load(std::memory_order_relaxed);
+                    gridCellOffsets[h + 1] = gridCellOffsets[h] + count;
+                    gridCursor[h].store(gridCellOffsets[h],
+                                        std::memory_order_relaxed);
                 }
-            }, nPixels, 4096);
-        }
+                gridEntries.resize(gridCellOffsets[hashSize]);
 
-        // Trace photons and accumulate contributions
-        {
-            ProfilePhase _(Prof::SPPMPhotonPass);
-            std::vector<MemoryArena> photonShootArenas(MaxThreadIndex());
-            ParallelFor([&](int photonIndex) {
-                MemoryArena &arena = photonShootArenas[ThreadIndex];
-                // Follow photon path for _photonIndex_
-                uint64_t haltonIndex =
-                    (uint64_t)iter * (uint64_t)photonsPerIteration +
-                    photonIndex;
-                int haltonDim = 0;
-
-                // Choose light to shoot photon from
-                Float lightPdf;
-                Float lightSample = RadicalInverse(haltonDim++, haltonIndex);
-                int lightNum =
-                    lightDistr->SampleDiscrete(lightSample, &lightPdf);
-                const std::shared_ptr<Light> &light = scene.lights[lightNum];
-
-                // Compute sample values for photon ray leaving light source
-                Point2f uLight0(RadicalInverse(haltonDim, haltonIndex),
-                                RadicalInverse(haltonDim + 1, haltonIndex));
-                Point2f uLight1(RadicalInverse(haltonDim + 2, haltonIndex),
-                                RadicalInverse(haltonDim + 3, haltonIndex));
-                Float uLightTime =
-                    Lerp(RadicalInverse(haltonDim + 4, haltonIndex),
-                         camera->shutterOpen, camera->shutterClose);
-                haltonDim += 5;
-
-                // Generate _photonRay_ from light source and initialize _beta_
-                RayDifferential photonRay;
-                Normal3f nLight;
-                Float pdfPos, pdfDir;
-                Spectrum Le =
-                    light->Sample_Le(uLight0, uLight1, uLightTime, &photonRay,
-                                     &nLight, &pdfPos, &pdfDir);
-                if (pdfPos == 0 || pdfDir == 0 || Le.IsBlack()) return;
-                Spectrum beta = (AbsDot(nLight, photonRay.d) * Le) /
-                                (lightPdf * pdfPos * pdfDir);
-                if (beta.IsBlack()) return;
-
-                // Follow photon path through scene and record intersections
-                SurfaceInteraction isect;
-                for (int depth = 0; depth < maxDepth; ++depth) {
-                    if (!scene.Intersect(photonRay, &isect)) break;
-                    ++totalPhotonSurfaceInteractions;
-                    if (depth > 0) {
-                        // Add photon contribution to nearby visible points
-                        Point3i photonGridIndex;
-                        if (ToGrid(isect.p, gridBounds, gridRes,
-                                   &photonGridIndex)) {
+                // Add visible points to SPPM grid
+                ParallelFor([&](int pixelIndex) {
+                    std::vector<int> &buckets = threadBuckets[ThreadIndex];
+                    visiblePointBuckets(pixelIndex, &buckets);
+                    Float radius = pixels.radius[pixelIndex];
+                    SPPMGridEntry entry{pixels.vpP[pixelIndex], radius * radius,
+                                        pixelIndex};
+                    for (int h : buckets) {
+                        int slot =
+                            gridCursor[h].fetch_add(1, std::memory_order_relaxed);
+                        gridEntries[slot] = entry;
+                    }
+                }, nPixels, 4096);
+            }
+
+            // Aim infinite lights' photons at this iteration's visible points
+            EmissionRegion photonRegion(gridBounds, roiFraction);
+
+            // Trace photons and accumulate contributions
+            std::chrono::steady_clock::time_point photonStart =
+                std::chrono::steady_clock::now();
+            {
+                ProfilePhase _(Prof::SPPMPhotonPass);
+                ParallelFor([&](int photonIndex) {
+                    MemoryArena &arena =
+                        ThreadArena(ArenaCategory::SPPMPhotonPass);
+                    SPPMPhotonAccumulator &accumulator =
+                        photonAccumulators[ThreadIndex];
+                    // Follow photon path for _photonIndex_
+                    uint64_t haltonIndex = photonsTraced + photonIndex;
+                    TracePhotonPath(
+                        scene, *lightDistr, haltonIndex, maxDepth, *camera,
+                        photonRegion, arena,
+                        [&](const Point3f &p, const Vector3f &wi,
+                            const Spectrum &beta) {
+                            // Add photon contribution to nearby visible points
+                            Point3i photonGridIndex;
+                            if (!ToGrid(p, gridBounds, gridRes, &photonGridIndex))
+                                return;
                             int h = hash(photonGridIndex, hashSize);
-                            // Add photon contribution to visible points in
-                            // _grid[h]_
-                            for (SPPMPixelListNode *node =
-                                     grid[h].load(std::memory_order_relaxed);
-                                 node != nullptr; node = node->next) {
+                            // Add photon contribution to visible points in grid
+                            // cell _h_
+                            for (int e = gridCellOffsets[h];
+                                 e < gridCellOffsets[h + 1]; ++e) {
                                 ++visiblePointsChecked;
-                                SPPMPixel &pixel = *node->pixel;
-                                Float radius = pixel.radius;
-                                if (DistanceSquared(pixel.vp.p, isect.p) >
-                                    radius * radius)
+                                const SPPMGridEntry &entry = gridEntries[e];
+                                if (DistanceSquared(entry.p, p) > entry.radius2)
                                     continue;
-                                // Update _pixel_ $\Phi$ and $M$ for nearby
-                                // photon
-                                Vector3f wi = -photonRay.d;
+                                // Update pixel $\Phi$ and $M$ for nearby photon
                                 Spectrum Phi =
-                                    beta * pixel.vp.bsdf->f(pixel.vp.wo, wi);
-                                for (int i = 0; i < Spectrum::nSamples; ++i)
-                                    pixel.Phi[i].Add(Phi[i]);
-                                ++pixel.M;
+                                    beta * pixels.f(entry.pixelIndex, wi);
+                                accumulator.Add(pixels, entry.pixelIndex, Phi);
                             }
-                        }
-                    }
-                    // Sample new photon ray direction
-
-                    // Compute BSDF at photon intersection point
-                    isect.ComputeScatteringFunctions(photonRay, arena, true,
-                                                     TransportMode::Importance);
-                    if (!isect.bsdf) {
-                        --depth;
-                        photonRay = isect.SpawnRay(photonRay.d);
-                        continue;
+                        });
+                    arena.Reset();
+                }, iterationPhotons, MinPhotonsPerThread);
+                for (SPPMPhotonAccumulator &accumulator : photonAccumulators)
+                    accumulator.Flush(pixels);
+                progress.Update();
+                photonPaths += iterationPhotons;
+                ReportValue(photonsPerIterationTraced, iterationPhotons);
+            }
+            std::chrono::steady_clock::time_point photonEnd =
+                std::chrono::steady_clock::now();
+
+            // Update pixel values from this pass's photons
+            {
+                ProfilePhase _(Prof::SPPMStatsUpdate);
+                ParallelFor([&](int i) {
+                    Spectrum Lindirect(0.f);
+                    int M = pixels.M[i];
+                    if (M > 0) {
+                        // Update pixel photon count, search radius, and $\tau$ from
+                        // photons
+                        Float gamma = (Float)2 / (Float)3;
+                        Float N = pixels.N[i], radius = pixels.radius[i];
+                        Float Nnew = N + gamma * M;
+                        Float Rnew = radius * std::sqrt(Nnew / (N + M));
+                        AtomicFloat *pixelPhi =
+                            &pixels.Phi[i * Spectrum::nSamples];
+                        Spectrum Phi;
+                        for (int j = 0; j < Spectrum::nSamples; ++j)
+                            Phi[j] = pixelPhi[j];
+                        Phi *= Spectrum(pixels.vpWeight[i]);
+                        if (targetError > 0)
+                            Lindirect =
+                                Phi / (iterationPhotons * Pi * radius * radius);
+                        pixels.tau[i] = (Spectrum(pixels.tau[i]) + Phi) *
+                                        (Rnew * Rnew) / (radius * radius);
+                        pixels.N[i] = Nnew;
+                        pixels.radius[i] = Rnew;
+                        pixels.M[i] = 0;
+                        for (int j = 0; j < Spectrum::nSamples; ++j)
+                            pixelPhi[j] = (Float)0;
                     }
-                    const BSDF &photonBSDF = *isect.bsdf;
-
-                    // Sample BSDF _fr_ and direction _wi_ for reflected photon
-                    Vector3f wi, wo = -photonRay.d;
-                    Float pdf;
-                    BxDFType flags;
-
-                    // Generate _bsdfSample_ for outgoing photon sample
-                    Point2f bsdfSample(
-                        RadicalInverse(haltonDim, haltonIndex),
-                        RadicalInverse(haltonDim + 1, haltonIndex));
-                    haltonDim += 2;
-                    Spectrum fr = photonBSDF.Sample_f(wo, &wi, bsdfSample, &pdf,
-                                                      BSDF_ALL, &flags);
-                    if (fr.IsBlack() || pdf == 0.f) break;
-                    Spectrum bnew =
-                        beta * fr * AbsDot(wi, isect.shading.n) / pdf;
-
-                    // Possibly terminate photon path with Russian roulette
-                    Float q = std::max((Float)0, 1 - bnew.y() / beta.y());
-                    if (RadicalInverse(haltonDim++, haltonIndex) < q) break;
-                    beta = bnew / (1 - q);
-                    photonRay = (RayDifferential)isect.SpawnRay(wi);
-                }
-                arena.Reset();
-            }, photonsPerIteration, 8192);
-            progress.Update();
-            photonPaths += photonsPerIteration;
+                    if (targetError > 0) addErrorSample(i, Lindirect);
+                    // Reset visible point in pixel, unless it is kept
+                    if (pixels.vpKeep[i] == 0) pixels.ClearVisiblePoint(i);
+                }, nPixels, 4096);
+            }
+            photonsTraced += iterationPhotons;
+
+            // Size the next photon batch so that tracing photons takes
+            // about twice as long as the rest of the iteration; the batch
+            // grows or shrinks at most twofold per iteration and always
+            // keeps every thread busy
+            if (adaptivePhotons) {
+                using Seconds = std::chrono::duration<double>;
+                double photonSeconds = Seconds(photonEnd - photonStart).count();
+                double otherSeconds =
+                    Seconds(photonStart - iterationStart).count() +
+                    Seconds(std::chrono::steady_clock::now() - photonEnd)
+                        .count();
+                double target = photonSeconds > 0
+                                    ? 2 * otherSeconds / photonSeconds *
+                                          iterationPhotons
+                                    : 2. * iterationPhotons;
+                target = Clamp(target, 0.5 * iterationPhotons,
+                               2. * iterationPhotons);
+                iterationPhotons = (int)Clamp(
+                    target, (double)MinPhotonsPerThread * MaxThreadIndex(),
+                    (double)MaxPhotonsPerIteration);
+            }
         }
 
-        // Update pixel values from this pass's photons
-        {
-            ProfilePhase _(Prof::SPPMStatsUpdate);
-            ParallelFor([&](int i) {
-                SPPMPixel &p = pixels[i];
-                if (p.M > 0) {
-                    // Update pixel photon count, search radius, and $\tau$ from
-                    // photons
-                    Float gamma = (Float)2 / (Float)3;
-                    Float Nnew = p.N + gamma * p.M;
-                    Float Rnew = p.radius * std::sqrt(Nnew / (p.N + p.M));
-                    Spectrum Phi;
-                    for (int j = 0; j < Spectrum::nSamples; ++j)
-                        Phi[j] = p.Phi[j];
-                    p.tau = (p.tau + p.vp.beta * Phi) * (Rnew * Rnew) /
-                            (p.radius * p.radius);
-                    p.N = Nnew;
-                    p.radius = Rnew;
-                    p.M = 0;
-                    for (int j = 0; j < Spectrum::nSamples; ++j)
-                        p.Phi[j] = (Float)0;
+        // Stop early once the time budget is used up or every pixel's
+        // relative error is below _targetError_
+        bool stop = false;
+        if (iter + 1 < nIterations) {
+            if (maxSeconds > 0 && progress.ElapsedMS() >= 1000 * maxSeconds)
+                stop = true;
+            if (targetError > 0) {
+                bool converged = true;
+                for (Point2i pPixel : pixelBounds) {
+                    if (!converged) break;
+                    converged =
+                        camera->film->RelativeError(pPixel) <= targetError;
                 }
-                // Reset _VisiblePoint_ in pixel
-                p.vp.beta = 0.;
-                p.vp.bsdf = nullptr;
-            }, nPixels, 4096);
+                stop |= converged;
+            }
+            if (stop)
+                LOG(INFO) << StringPrintf("Stopping after %d of %d iterations",
+                                          iter + 1, nIterations);
         }
 
         // Periodically store SPPM image in film and write image
-        if (iter + 1 == nIterations || ((iter + 1) % writeFrequency) == 0) {
+        if (iter + 1 == nIterations || stop ||
+            ((iter + 1) % writeFrequency) == 0) {
             int x0 = pixelBounds.pMin.x;
             int x1 = pixelBounds.pMax.x;
-            uint64_t Np = (uint64_t)(iter + 1) * (uint64_t)photonsPerIteration;
+            uint64_t Np = photonsTraced;
             std::unique_ptr<Spectrum[]> image(new Spectrum[pixelBounds.Area()]);
             int offset = 0;
             for (int y = pixelBounds.pMin.y; y < pixelBounds.pMax.y; ++y) {
                 for (int x = x0; x < x1; ++x) {
-                    // Compute radiance _L_ for SPPM pixel _pixel_
-                    const SPPMPixel &pixel =
-                        pixels[(y - pixelBounds.pMin.y) * (x1 - x0) + (x - x0)];
-                    Spectrum L = pixel.Ld / (iter + 1);
-                    L += pixel.tau / (Np * Pi * pixel.radius * pixel.radius);
+                    // Compute radiance _L_ for SPPM pixel _i_
+                    int i = (y - pixelBounds.pMin.y) * (x1 - x0) + (x - x0);
+                    Spectrum L =
+                        Spectrum(pixels.Ld[i]) / pixels.cameraPaths[i];
+                    Float radius = pixels.radius[i];
+                    if (photonMap)
+                        L += Spectrum(pixels.tau[i]) / (iter + 1);
+                    else
+                        L += Spectrum(pixels.tau[i]) /
+                             (Np * Pi * radius * radius);
                     image[offset++] = L;
                 }
             }
@@ -466,11 +1108,11 @@ void SPPMIntegrator::Render(const Scene &scene) {
                 Float minrad = 1e30f, maxrad = 0;
                 for (int y = pixelBounds.pMin.y; y < pixelBounds.pMax.y; ++y) {
                     for (int x = x0; x < x1; ++x) {
-                        const SPPMPixel &p =
-                            pixels[(y - pixelBounds.pMin.y) * (x1 - x0) +
-                                   (x - x0)];
-                        minrad = std::min(minrad, p.radius);
-                        maxrad = std::max(maxrad, p.radius);
+                        Float radius =
+                            pixels.radius[(y - pixelBounds.pMin.y) * (x1 - x0) +
+                                          (x - x0)];
+                        minrad = std::min(minrad, radius);
+                        maxrad = std::max(maxrad, radius);
                     }
                 }
                 fprintf(stderr,
@@ -479,10 +1121,10 @@ void SPPMIntegrator::Render(const Scene &scene) {
                 int offset = 0;
                 for (int y = pixelBounds.pMin.y; y < pixelBounds.pMax.y; ++y) {
                     for (int x = x0; x < x1; ++x) {
-                        const SPPMPixel &p =
-                            pixels[(y - pixelBounds.pMin.y) * (x1 - x0) +
-                                   (x - x0)];
-                        Float v = 1.f - (p.radius - minrad) / (maxrad - minrad);
+                        Float radius =
+                            pixels.radius[(y - pixelBounds.pMin.y) * (x1 - x0) +
+                                          (x - x0)];
+                        Float v = 1.f - (radius - minrad) / (maxrad - minrad);
                         rimg[offset++] = v;
                         rimg[offset++] = v;
                         rimg[offset++] = v;
@@ -493,6 +1135,7 @@ void SPPMIntegrator::Render(const Scene &scene) {
                 WriteImage("sppm_radius.png", rimg.get(), pixelBounds, res);
             }
         }
+        if (stop) break;
     }
     progress.Done();
 }
@@ -506,9 +1149,47 @@ Integrator *CreateSPPMIntegrator(const ParamSet &params,
     int photonsPerIter = params.FindOneInt("photonsperiteration", -1);
     int writeFreq = params.FindOneInt("imagewritefrequency", 1 << 31);
     Float radius = params.FindOneFloat("radius", 1.f);
+    // Gather from a photon map traced once instead of tracing new photons
+    // for every iteration; renders that pass the same "photonmapkey"
+    // share the map
+    bool usePhotonMap = params.FindOneBool("photonmap", false);
+    std::string photonMapKey = params.FindOneString("photonmapkey", "");
+    int photonMapPhotons = params.FindOneInt("photonmapphotons", -1);
+    int gatherPhotons = params.FindOneInt("gatherphotons", 0);
+    // Retune the photons traced per iteration from the measured cost of
+    // each iteration, starting from "photonsperiteration"
+    bool adaptivePhotons = params.FindOneBool("adaptivephotons", false);
+    // Stable diffuse pixels trace a new camera path only every this many
+    // iterations
+    int visiblePointReuse =
+        std::max(params.FindOneInt("visiblepointreuse", 1), 1);
+    std::string lightStrategy =
+        params.FindOneString("lightsamplestrategy", "power");
+    // Fraction of each infinite light's photons aimed at the bounds of the
+    // visible points rather than at the whole scene
+    Float roiFraction =
+        Clamp(params.FindOneFloat("roifraction", 0.f), 0.f, 0.99f);
+    if (roiFraction > 0 && usePhotonMap && !photonMapKey.empty()) {
+        Warning("\"roifraction\" is ignored for photon maps shared through "
+                "\"photonmapkey\", since they must serve every view.");
+        roiFraction = 0;
+    }
+    // Stop before _nIterations_ once either budget is reached
+    Float maxSeconds = params.FindOneFloat("maxseconds", 0.f);
+    Float targetError = params.FindOneFloat("targeterror", 0.f);
+    if (targetError > 0 && usePhotonMap) {
+        // Iterations that gather from one stored photon map make correlated
+        // estimates, whose spread doesn't include the map's photon noise
+        Warning("\"targeterror\" is ignored with \"photonmap\", since "
+                "every iteration gathers the same photons.");
+        targetError = 0;
+    }
     if (PbrtOptions.quickRender) nIterations = std::max(1, nIterations / 16);
     return new SPPMIntegrator(camera, nIterations, photonsPerIter, maxDepth,
-                              radius, writeFreq);
+                              radius, writeFreq, usePhotonMap, photonMapKey,
+                              photonMapPhotons, std::max(0, gatherPhotons),
+                              maxSeconds, targetError, adaptivePhotons,
+                              roiFraction, visiblePointReuse, lightStrategy);
 }
 
 }  // namespace pbrt
@@ -43,16 +43,46 @@
 #include "integrator.h"
 #include "camera.h"
 #include "film.h"
+#include "geometry.h"
 
 namespace pbrt {
 
+// SPPM Grid Helpers
+// Points are bucketed in a uniform grid over _bounds_ with _gridRes_ cells
+// along each axis, whose cells are hashed into a table of _hashSize_
+// entries; the VCM integrator stores its light vertices the same way.
+inline bool ToGrid(const Point3f &p, const Bounds3f &bounds,
+                   const int gridRes[3], Point3i *pi) {
+    bool inBounds = true;
+    Vector3f pg = bounds.Offset(p);
+    for (int i = 0; i < 3; ++i) {
+        (*pi)[i] = (int)(gridRes[i] * pg[i]);
+        inBounds &= ((*pi)[i] >= 0 && (*pi)[i] < gridRes[i]);
+        (*pi)[i] = Clamp((*pi)[i], 0, gridRes[i] - 1);
+    }
+    return inBounds;
+}
+
+inline unsigned int hash(const Point3i &p, int hashSize) {
+    return (unsigned int)((p.x * 73856093) ^ (p.y * 19349663) ^
+                          (p.z * 83492791)) %
+           hashSize;
+}
+
 // SPPM Declarations
 class SPPMIntegrator : public Integrator {
   public:
     // SPPMIntegrator Public Methods
     SPPMIntegrator(std::shared_ptr<const Camera> &camera, int nIterations,
                    int photonsPerIteration, int maxDepth,
-                   Float initialSearchRadius, int writeFrequency)
+                   Float initialSearchRadius, int writeFrequency,
+                   bool usePhotonMap = false,
+                   const std::string &photonMapKey = "",
+                   int photonMapPhotons = -1, int gatherPhotons = 0,
+                   Float maxSeconds = 0, Float targetError = 0,
+                   bool adaptivePhotons = false, Float roiFraction = 0,
+                   int visiblePointReuse = 1,
+                   const std::string &lightSampleStrategy = "power")
         : camera(camera),
           initialSearchRadius(initialSearchRadius),
           nIterations(nIterations),
@@ -60,7 +90,19 @@ class SPPMIntegrator : public Integrator {
           photonsPerIteration(photonsPerIteration > 0
                                   ? photonsPerIteration
                                   : camera->film->croppedPixelBounds.Area()),
-          writeFrequency(writeFrequency) {}
+          writeFrequency(writeFrequency),
+          usePhotonMap(usePhotonMap),
+          photonMapKey(photonMapKey),
+          photonMapPhotons(photonMapPhotons > 0
+                               ? photonMapPhotons
+                               : this->photonsPerIteration * nIterations),
+          gatherPhotons(gatherPhotons),
+          maxSeconds(maxSeconds),
+          targetError(targetError),
+          adaptivePhotons(adaptivePhotons),
+          roiFraction(roiFraction),
+          visiblePointReuse(visiblePointReuse),
+          lightSampleStrategy(lightSampleStrategy) {}
     void Render(const Scene &scene);
 
   private:
@@ -71,6 +113,16 @@ class SPPMIntegrator : public Integrator {
     const int maxDepth;
     const int photonsPerIteration;
     const int writeFrequency;
+    const bool usePhotonMap;
+    const std::string photonMapKey;
+    const int photonMapPhotons;
+    const int gatherPhotons;
+    const Float maxSeconds;
+    const Float targetError;
+    const bool adaptivePhotons;
+    const Float roiFraction;
+    const int visiblePointReuse;
+    const std::string lightSampleStrategy;
 };
 
 Integrator *CreateSPPMIntegrator(const ParamSet &params,
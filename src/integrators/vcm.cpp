@@ -0,0 +1,326 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+
+
+// integrators/vcm.cpp*
+#include "integrators/vcm.h"
+#include "camera.h"
+#include "film.h"
+#include "integrators/bdpt.h"
+#include "integrators/sppm.h"
+#include "lightdistrib.h"
+#include "paramset.h"
+#include "parallel.h"
+#include "progressreporter.h"
+#include "sampler.h"
+#include "samplers/random.h"
+#include "scene.h"
+#include "stats.h"
+
+namespace pbrt {
+
+STAT_COUNTER("Integrator/VCM light vertices stored", storedLightVertices);
+STAT_RATIO("Integrator/VCM merges per merging camera vertex", nMerges,
+           nMergeQueries);
+
+// VCM Method Definitions
+void VCMIntegrator::Render(const Scene &scene) {
+    std::unique_ptr<LightDistribution> lightDistribution =
+        CreateLightSampleDistribution(lightSampleStrategy, scene);
+    std::unordered_map<const Light *, size_t> lightToIndex;
+    for (size_t i = 0; i < scene.lights.size(); ++i)
+        lightToIndex[scene.lights[i].get()] = i;
+
+    // Partition the image into tiles
+    Film *film = camera->film;
+    const Bounds2i sampleBounds = film->GetSampleBounds();
+    const Vector2i sampleExtent = sampleBounds.Diagonal();
+    const int tileSize = 16;
+    const int nXTiles = (sampleExtent.x + tileSize - 1) / tileSize;
+    const int nYTiles = (sampleExtent.y + tileSize - 1) / tileSize;
+    const int64_t spp = sampler->samplesPerPixel;
+    ProgressReporter reporter(spp * nXTiles * nYTiles, "Rendering");
+
+    if (scene.lights.size() > 0) {
+        // As in BDPT, the light distribution is looked up at the camera
+        const Distribution1D *lightDistr = lightDistribution->Lookup(
+            camera->CameraToWorld(camera->shutterOpen, Point3f(0, 0, 0)));
+
+        // Without a given radius, start from a small fraction of the
+        // scene's extent
+        Float radius0 = initialRadius;
+        if (radius0 <= 0) {
+            Point3f center;
+            Float worldRadius;
+            scene.WorldBound().BoundingSphere(&center, &worldRadius);
+            radius0 = .003f * worldRadius;
+        }
+
+        // Each pixel's camera subpath is paired with one light subpath
+        const int nLightPaths = pixelBounds.Area();
+        const int chunkSize = 64;
+        const int nChunks = (nLightPaths + chunkSize - 1) / chunkSize;
+        std::vector<std::vector<Vertex>> chunkVertices(nChunks);
+        std::vector<std::vector<int>> chunkPathLengths(nChunks);
+        std::vector<Vertex> lightVertices;
+        std::vector<int> pathStarts(nLightPaths + 1), vertexPath;
+        std::vector<int> cellOffsets, gridVertices;
+        for (int64_t pass = 0; pass < spp; ++pass) {
+            // Shrink the merge radius over the passes as in progressive
+            // photon mapping
+            Float radius =
+                radius0 * std::pow(Float(pass + 1), (radiusAlpha - 1) / 2);
+            Float mergeEta = nLightPaths * Pi * radius * radius;
+
+            // Trace the pass's light subpaths and connect them to the
+            // camera; each chunk keeps its own vertices so that the result
+            // does not depend on the order threads finish in
+            ResetThreadArenas(ArenaCategory::BDPTLightPaths);
+            ParallelFor([&](int64_t chunk) {
+                MemoryArena &arena = ThreadArena(ArenaCategory::BDPTLightPaths);
+                RandomSampler chunkSampler(1, pass * nChunks + chunk);
+                Vertex *path = arena.Alloc<Vertex>(maxDepth + 1);
+                Vertex cameraVertex;
+                std::vector<Vertex> &vertices = chunkVertices[chunk];
+                std::vector<int> &pathLengths = chunkPathLengths[chunk];
+                vertices.clear();
+                pathLengths.clear();
+                int end = std::min<int>(nLightPaths, (chunk + 1) * chunkSize);
+                for (int i = chunk * chunkSize; i < end; ++i) {
+                    chunkSampler.StartPixel(Point2i(i, 0));
+                    Float time = Lerp(chunkSampler.Get1D(),
+                                      camera->shutterOpen,
+                                      camera->shutterClose);
+                    int nLight = GenerateLightSubpath(
+                        scene, chunkSampler, arena, maxDepth + 1, time,
+                        *lightDistr, lightToIndex, path);
+                    for (int s = 2; s <= nLight; ++s) {
+                        Point2f pFilm;
+                        Spectrum Lpath = ConnectBDPT(
+                            scene, path, &cameraVertex, s, 1, *lightDistr,
+                            lightToIndex, *camera, chunkSampler, &pFilm,
+                            nullptr, 1, mergeEta);
+                        if (!Lpath.IsBlack()) film->AddSplat(pFilm, Lpath);
+                    }
+                    vertices.insert(vertices.end(), path, path + nLight);
+                    pathLengths.push_back(nLight);
+                }
+            }, nChunks);
+
+            // Gather the subpaths and find the vertices available for
+            // merging: those on surfaces with a non-specular BSDF, past
+            // the light
+            lightVertices.clear();
+            vertexPath.clear();
+            std::vector<int> mergeable;
+            Bounds3f bounds;
+            int pathIndex = 0;
+            for (int chunk = 0; chunk < nChunks; ++chunk) {
+                const std::vector<Vertex> &vertices = chunkVertices[chunk];
+                int v = 0;
+                for (int nLight : chunkPathLengths[chunk]) {
+                    pathStarts[pathIndex] = lightVertices.size();
+                    for (int k = 0; k < nLight; ++k, ++v) {
+                        if (k > 0 && vertices[v].IsMergeable()) {
+                            mergeable.push_back(lightVertices.size());
+                            bounds = Union(bounds, vertices[v].p());
+                        }
+                        lightVertices.push_back(vertices[v]);
+                        vertexPath.push_back(pathIndex);
+                    }
+                    ++pathIndex;
+                }
+            }
+            pathStarts[nLightPaths] = lightVertices.size();
+            storedLightVertices += mergeable.size();
+
+            // Sort the mergeable vertices into hashed grid cells whose
+            // width is the merge radius
+            int gridRes[3] = {1, 1, 1};
+            int hashSize = std::max<int>(1, mergeable.size());
+            cellOffsets.assign(hashSize + 1, 0);
+            gridVertices.resize(mergeable.size());
+            if (!mergeable.empty()) {
+                Vector3f diag = bounds.Diagonal();
+                for (int i = 0; i < 3; ++i)
+                    gridRes[i] = Clamp((int)std::ceil(diag[i] / radius), 1,
+                                       1 << 20);
+                bounds.pMax = bounds.pMin + Vector3f(gridRes[0] * radius,
+                                                     gridRes[1] * radius,
+                                                     gridRes[2] * radius);
+                std::vector<int> vertexHash(mergeable.size());
+                for (size_t i = 0; i < mergeable.size(); ++i) {
+                    Point3i pi;
+                    ToGrid(lightVertices[mergeable[i]].p(), bounds, gridRes,
+                           &pi);
+                    vertexHash[i] = hash(pi, hashSize);
+                    ++cellOffsets[vertexHash[i] + 1];
+                }
+                for (int h = 0; h < hashSize; ++h)
+                    cellOffsets[h + 1] += cellOffsets[h];
+                std::vector<int> cursor(cellOffsets.begin(),
+                                        cellOffsets.end() - 1);
+                for (size_t i = 0; i < mergeable.size(); ++i)
+                    gridVertices[cursor[vertexHash[i]]++] = mergeable[i];
+            }
+
+            // Returns the merging estimate at camera vertex _t_-1, from
+            // the light vertices within the merge radius
+            auto merge = [&](const Vertex *cameraVertices, int t) {
+                const Vertex &pt = cameraVertices[t - 1];
+                Spectrum L(0.f);
+                ++nMergeQueries;
+                // Find the distinct hash buckets of the cells overlapping
+                // the merge disk, as in _SPPMPhotonMap::Gather()_
+                Point3i pMin, pMax;
+                Vector3f r(radius, radius, radius);
+                ToGrid(pt.p() - r, bounds, gridRes, &pMin);
+                ToGrid(pt.p() + r, bounds, gridRes, &pMax);
+                int buckets[64], nBuckets = 0;
+                for (int z = pMin.z; z <= pMax.z; ++z)
+                    for (int y = pMin.y; y <= pMax.y; ++y)
+                        for (int x = pMin.x; x <= pMax.x; ++x) {
+                            int h = hash(Point3i(x, y, z), hashSize);
+                            if (std::find(buckets, buckets + nBuckets, h) ==
+                                buckets + nBuckets)
+                                buckets[nBuckets++] = h;
+                        }
+                for (int b = 0; b < nBuckets; ++b)
+                    for (int i = cellOffsets[buckets[b]];
+                         i < cellOffsets[buckets[b] + 1]; ++i) {
+                        int v = gridVertices[i];
+                        const Vertex &q = lightVertices[v];
+                        if (DistanceSquared(q.p(), pt.p()) > radius * radius)
+                            continue;
+                        // The light vertex is the $s$th of its subpath,
+                        // counting from zero
+                        int start = pathStarts[vertexPath[v]], s = v - start;
+                        if (s + t - 2 > maxDepth) continue;
+                        Spectrum f = pt.si.bsdf->f(pt.si.wo, q.si.wo);
+                        if (f.IsBlack()) continue;
+                        ++nMerges;
+                        L += f * q.beta *
+                             MergeMISWeight(scene, &lightVertices[start],
+                                            cameraVertices, s, t,
+                                            *lightDistr, lightToIndex,
+                                            mergeEta);
+                    }
+                return pt.beta * L / mergeEta;
+            };
+
+            // Trace the camera subpaths, connect them to their light
+            // subpaths and merge
+            ParallelFor2D([&](const Point2i tile) {
+                MemoryArena &arena = ThreadArena(ArenaCategory::Render);
+                int seed = (pass * nYTiles + tile.y) * nXTiles + tile.x;
+                std::unique_ptr<Sampler> tileSampler = sampler->Clone(seed);
+                int x0 = sampleBounds.pMin.x + tile.x * tileSize;
+                int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
+                int y0 = sampleBounds.pMin.y + tile.y * tileSize;
+                int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
+                Bounds2i tileBounds(Point2i(x0, y0), Point2i(x1, y1));
+                std::unique_ptr<FilmTile> filmTile =
+                    camera->film->GetFilmTile(tileBounds);
+                for (Point2i pPixel : tileBounds) {
+                    tileSampler->StartPixel(pPixel);
+                    if (!InsideExclusive(pPixel, pixelBounds)) continue;
+                    tileSampler->SetSampleNumber(pass);
+                    Point2f pFilm = (Point2f)pPixel + tileSampler->Get2D();
+                    Vertex *cameraVertices = arena.Alloc<Vertex>(maxDepth + 2);
+                    int nCamera = GenerateCameraSubpath(
+                        scene, *tileSampler, arena, maxDepth + 2, *camera,
+                        pFilm, cameraVertices);
+                    Point2i pPixelO = Point2i(pPixel - pixelBounds.pMin);
+                    int pathIndex =
+                        pPixelO.y * (pixelBounds.pMax.x - pixelBounds.pMin.x) +
+                        pPixelO.x;
+                    int start = pathStarts[pathIndex];
+                    Vertex *path = lightVertices.data() + start;
+                    int nLight = pathStarts[pathIndex + 1] - start;
+                    Spectrum L(0.f);
+                    Point2f pFilmNew;
+                    for (int t = 2; t <= nCamera; ++t) {
+                        // Execute the connection strategies with the
+                        // pixel's light subpath
+                        for (int s = 0; s <= nLight && s + t - 2 <= maxDepth;
+                             ++s)
+                            L += ConnectBDPT(scene, path, cameraVertices, s, t,
+                                             *lightDistr, lightToIndex,
+                                             *camera, *tileSampler, &pFilmNew,
+                                             nullptr, 1, mergeEta);
+
+                        // Merge at non-specular surface vertices
+                        if (t - 1 <= maxDepth && !mergeable.empty() &&
+                            cameraVertices[t - 1].IsMergeable())
+                            L += merge(cameraVertices, t);
+                    }
+                    filmTile->AddSample(pFilm, L);
+                    arena.Reset();
+                }
+                film->MergeFilmTile(std::move(filmTile));
+                reporter.Update();
+            }, Point2i(nXTiles, nYTiles));
+            film->MergeDeferredTiles();
+        }
+    }
+    reporter.Done();
+    film->WriteImage(1.0f / sampler->samplesPerPixel);
+}
+
+VCMIntegrator *CreateVCMIntegrator(const ParamSet &params,
+                                   std::shared_ptr<Sampler> sampler,
+                                   std::shared_ptr<const Camera> camera) {
+    int maxDepth = params.FindOneInt("maxdepth", 5);
+    Float radius = params.FindOneFloat("radius", 0.f);
+    Float radiusAlpha = Clamp(params.FindOneFloat("radiusalpha", .75f), 0, 1);
+    int np;
+    const int *pb = params.FindInt("pixelbounds", &np);
+    Bounds2i pixelBounds = camera->film->GetSampleBounds();
+    if (pb) {
+        if (np != 4)
+            Error("Expected four values for \"pixelbounds\" parameter. Got %d.",
+                  np);
+        else {
+            pixelBounds = Intersect(pixelBounds,
+                                    Bounds2i{{pb[0], pb[2]}, {pb[1], pb[3]}});
+            if (pixelBounds.Area() == 0)
+                Error("Degenerate \"pixelbounds\" specified.");
+        }
+    }
+    std::string lightStrategy =
+        params.FindOneString("lightsamplestrategy", "power");
+    return new VCMIntegrator(sampler, camera, maxDepth, radius, radiusAlpha,
+                             pixelBounds, lightStrategy);
+}
+
+}  // namespace pbrt
@@ -0,0 +1,87 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_INTEGRATORS_VCM_H
+#define PBRT_INTEGRATORS_VCM_H
+
+// integrators/vcm.h*
+#include "pbrt.h"
+#include "integrator.h"
+
+namespace pbrt {
+
+// VCM Declarations
+// Vertex connection and merging: each pass traces one light subpath per
+// pixel, which is connected to the pixel's camera subpath as in BDPT, and
+// merges the camera vertices with nearby light vertices of all subpaths
+// as in progressive photon mapping. MIS weighs all of these strategies
+// against each other.
+class VCMIntegrator : public Integrator {
+  public:
+    // VCMIntegrator Public Methods
+    VCMIntegrator(std::shared_ptr<Sampler> sampler,
+                  std::shared_ptr<const Camera> camera, int maxDepth,
+                  Float initialRadius, Float radiusAlpha,
+                  const Bounds2i &pixelBounds,
+                  const std::string &lightSampleStrategy = "power")
+        : sampler(sampler),
+          camera(camera),
+          maxDepth(maxDepth),
+          initialRadius(initialRadius),
+          radiusAlpha(radiusAlpha),
+          pixelBounds(pixelBounds),
+          lightSampleStrategy(lightSampleStrategy) {}
+    void Render(const Scene &scene);
+
+  private:
+    // VCMIntegrator Private Data
+    std::shared_ptr<Sampler> sampler;
+    std::shared_ptr<const Camera> camera;
+    const int maxDepth;
+    const Float initialRadius, radiusAlpha;
+    const Bounds2i pixelBounds;
+    const std::string lightSampleStrategy;
+};
+
+VCMIntegrator *CreateVCMIntegrator(const ParamSet &params,
+                                   std::shared_ptr<Sampler> sampler,
+                                   std::shared_ptr<const Camera> camera);
+
+}  // namespace pbrt
+
+#endif  // PBRT_INTEGRATORS_VCM_H
@@ -48,8 +48,13 @@ STAT_COUNTER("Integrator/Surface interactions", surfaceInteractions);
 
 // VolPathIntegrator Method Definitions
 void VolPathIntegrator::Preprocess(const Scene &scene, Sampler &sampler) {
-    lightDistribution =
-        CreateLightSampleDistribution(lightSampleStrategy, scene);
+    lightDistribution = CreateLightSampleDistribution(
+        lightSampleStrategy, scene, precomputeLightDistribution,
+        lightDistributionKey);
+    if (guidingPasses > 0) {
+        guide.reset(new PathGuide(scene.WorldBound(), guidingBSDFFraction));
+        TrainPathGuide(*this, scene, *camera, guide.get(), guidingPasses);
+    }
 }
 
 Spectrum VolPathIntegrator::Li(const RayDifferential &r, const Scene &scene,
@@ -68,6 +73,7 @@ Spectrum VolPathIntegrator::Li(const RayDifferential &r, const Scene &scene,
     // avoid terminating refracted rays that are about to be refracted back
     // out of a medium and thus have their beta value increased.
     Float etaScale = 1;
+    GuidedPathRecorder recorder(guide.get());
 
     for (bounces = 0;; ++bounces) {
         // Intersect _ray_ with scene and store intersection in _isect_
@@ -86,10 +92,8 @@ Spectrum VolPathIntegrator::Li(const RayDifferential &r, const Scene &scene,
 
             ++volumeInteractions;
             // Handle scattering at point in medium for volumetric path tracer
-            const Distribution1D *lightDistrib =
-                lightDistribution->Lookup(mi.p);
             L += beta * UniformSampleOneLight(mi, scene, arena, sampler, true,
-                                              lightDistrib);
+                                              *lightDistribution);
 
             Vector3f wo = -ray.d, wi;
             mi.phase->Sample_p(wo, &wi, sampler.Get2D());
@@ -118,23 +122,28 @@ Spectrum VolPathIntegrator::Li(const RayDifferential &r, const Scene &scene,
                 bounces--;
                 continue;
             }
+            if (bounces == 0) RecordAOVSample(isect);
 
             // Sample illumination from lights to find attenuated path
             // contribution
-            const Distribution1D *lightDistrib =
-                lightDistribution->Lookup(isect.p);
             L += beta * UniformSampleOneLight(isect, scene, arena, sampler,
-                                              true, lightDistrib);
+                                              true, *lightDistribution);
 
             // Sample BSDF to get new path direction
             Vector3f wo = -ray.d, wi;
             Float pdf;
             BxDFType flags;
-            Spectrum f = isect.bsdf->Sample_f(wo, &wi, sampler.Get2D(), &pdf,
-                                              BSDF_ALL, &flags);
+            Spectrum f =
+                guide ? guide->Sample_f(isect, wo, &wi, sampler.Get2D(), &pdf,
+                                        &flags)
+                      : isect.bsdf->Sample_f(wo, &wi, sampler.Get2D(), &pdf,
+                                             BSDF_ALL, &flags);
             if (f.IsBlack() || pdf == 0.f) break;
             beta *= f * AbsDot(wi, isect.shading.n) / pdf;
             DCHECK(std::isinf(beta.y()) == false);
+            if (!(flags & BSDF_SPECULAR) &&
+                !(isect.bssrdf && (flags & BSDF_TRANSMISSION)))
+                recorder.AddVertex(isect.p, wi, beta, pdf, L);
             specularBounce = (flags & BSDF_SPECULAR) != 0;
             if ((flags & BSDF_SPECULAR) && (flags & BSDF_TRANSMISSION)) {
                 Float eta = isect.bsdf->eta;
@@ -160,7 +169,7 @@ Spectrum VolPathIntegrator::Li(const RayDifferential &r, const Scene &scene,
                 // component
                 L += beta *
                      UniformSampleOneLight(pi, scene, arena, sampler, true,
-                                           lightDistribution->Lookup(pi.p));
+                                           *lightDistribution);
 
                 // Account for the indirect subsurface scattering component
                 Spectrum f = pi.bsdf->Sample_f(pi.wo, &wi, sampler.Get2D(),
@@ -183,6 +192,7 @@ Spectrum VolPathIntegrator::Li(const RayDifferential &r, const Scene &scene,
             DCHECK(std::isinf(beta.y()) == false);
         }
     }
+    recorder.Finish(L);
     ReportValue(pathLength, bounces);
     return L;
 }
@@ -208,8 +218,17 @@ VolPathIntegrator *CreateVolPathIntegrator(
     Float rrThreshold = params.FindOneFloat("rrthreshold", 1.);
     std::string lightStrategy =
         params.FindOneString("lightsamplestrategy", "spatial");
-    return new VolPathIntegrator(maxDepth, camera, sampler, pixelBounds,
-                                 rrThreshold, lightStrategy);
+    bool precompute = params.FindOneBool("precomputelightdistribution", false);
+    int guidingPasses = params.FindOneInt("guidingpasses", 0);
+    Float guidingBSDFFraction =
+        Clamp(params.FindOneFloat("guidingbsdffraction", .5f), .01f, 1);
+    std::string lightDistribKey =
+        params.FindOneString("lightdistributionkey", "");
+    VolPathIntegrator *integrator = new VolPathIntegrator(
+        maxDepth, camera, sampler, pixelBounds, rrThreshold, lightStrategy,
+        precompute, lightDistribKey, guidingPasses, guidingBSDFFraction);
+    integrator->SetRenderBudget(params);
+    return integrator;
 }
 
 }  // namespace pbrt
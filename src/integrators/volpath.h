@@ -40,6 +40,7 @@
 
 // integrators/volpath.h*
 #include "pbrt.h"
+#include "guiding.h"
 #include "integrator.h"
 #include "lightdistrib.h"
 
@@ -52,11 +53,18 @@ class VolPathIntegrator : public SamplerIntegrator {
     VolPathIntegrator(int maxDepth, std::shared_ptr<const Camera> camera,
                       std::shared_ptr<Sampler> sampler,
                       const Bounds2i &pixelBounds, Float rrThreshold = 1,
-                      const std::string &lightSampleStrategy = "spatial")
+                      const std::string &lightSampleStrategy = "spatial",
+                      bool precomputeLightDistribution = false,
+                      const std::string &lightDistributionKey = "",
+                      int guidingPasses = 0, Float guidingBSDFFraction = .5f)
         : SamplerIntegrator(camera, sampler, pixelBounds),
           maxDepth(maxDepth),
           rrThreshold(rrThreshold),
-          lightSampleStrategy(lightSampleStrategy) { }
+          lightSampleStrategy(lightSampleStrategy),
+          precomputeLightDistribution(precomputeLightDistribution),
+          lightDistributionKey(lightDistributionKey),
+          guidingPasses(guidingPasses),
+          guidingBSDFFraction(guidingBSDFFraction) { }
     void Preprocess(const Scene &scene, Sampler &sampler);
     Spectrum Li(const RayDifferential &ray, const Scene &scene,
                 Sampler &sampler, MemoryArena &arena, int depth) const;
@@ -66,7 +74,13 @@ class VolPathIntegrator : public SamplerIntegrator {
     const int maxDepth;
     const Float rrThreshold;
     const std::string lightSampleStrategy;
-    std::unique_ptr<LightDistribution> lightDistribution;
+    const bool precomputeLightDistribution;
+    const std::string lightDistributionKey;
+    std::shared_ptr<LightDistribution> lightDistribution;
+    // Path guiding at surfaces, as in PathIntegrator
+    const int guidingPasses;
+    const Float guidingBSDFFraction;
+    std::unique_ptr<PathGuide> guide;
 };
 
 VolPathIntegrator *CreateVolPathIntegrator(
@@ -0,0 +1,501 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+
+// integrators/vpl.cpp*
+#include "integrators/vpl.h"
+#include "camera.h"
+#include "film.h"
+#include "interaction.h"
+#include "lowdiscrepancy.h"
+#include "paramset.h"
+#include "parallel.h"
+#include "rng.h"
+#include "sampling.h"
+#include "scene.h"
+#include "stats.h"
+#include <fstream>
+#include <sstream>
+
+namespace pbrt {
+
+STAT_COUNTER("Integrator/VPLs created", nVPLsCreated);
+STAT_COUNTER("Integrator/VPL shadow rays", nVPLShadowRays);
+STAT_INT_DISTRIBUTION("Integrator/Lightcut size", lightcutSize);
+
+// VPL Method Definitions
+bool ReadVPLFile(const std::string &filename, std::vector<VPL> *vpls) {
+    std::ifstream in(filename);
+    if (!in) {
+        Error("%s: unable to open VPL file", filename.c_str());
+        return false;
+    }
+    // Reads a line holding a tag followed by _n_ values
+    auto readLine = [&](int n, double *v) {
+        std::string line, tag;
+        if (!std::getline(in, line)) return false;
+        std::istringstream iss(line);
+        iss >> tag;
+        for (int i = 0; i < n; ++i)
+            if (!(iss >> v[i])) return false;
+        return true;
+    };
+    double count;
+    if (!readLine(1, &count)) {
+        Error("%s: missing VPL count", filename.c_str());
+        return false;
+    }
+    int nVPLs = int(count);
+    vpls->reserve(vpls->size() + nVPLs);
+    for (int i = 0; i < nVPLs; ++i) {
+        double pos[3], nor[3], col[3], scale;
+        if (!readLine(3, pos) || !readLine(3, nor) || !readLine(3, col) ||
+            !readLine(1, &scale)) {
+            Error("%s: VPL %d of %d is malformed", filename.c_str(), i, nVPLs);
+            return false;
+        }
+        VPL vpl;
+        vpl.p = Point3f(pos[0], pos[1], pos[2]);
+        vpl.n = Normalize(Normal3f(nor[0], nor[1], nor[2]));
+        Float rgb[3] = {Float(col[0]), Float(col[1]), Float(col[2])};
+        vpl.I = Spectrum::FromRGB(rgb);
+        vpls->push_back(vpl);
+    }
+    return true;
+}
+
+// Traces the shadow rays for _n_ VPL contributions, computing all of the
+// rays before testing any of them, and returns the unoccluded sum
+static Spectrum TraceShadowRays(const SurfaceInteraction &isect,
+                                const Scene &scene,
+                                const std::vector<VPL> &vpls,
+                                const int *vplIndex, const Spectrum *contrib,
+                                int n, MemoryArena &arena) {
+    Ray *rays = arena.Alloc<Ray>(n);
+    for (int i = 0; i < n; ++i) {
+        const VPL &vpl = vpls[vplIndex[i]];
+        Interaction it(vpl.p, vpl.n, vpl.pError, Vector3f(vpl.n), isect.time,
+                       MediumInterface());
+        rays[i] = isect.SpawnRayTo(it);
+    }
+    nVPLShadowRays += n;
+    Spectrum L(0.f);
+    for (int i = 0; i < n; ++i)
+        if (!scene.IntersectP(rays[i])) L += contrib[i];
+    return L;
+}
+
+// VPLIntegrator Method Definitions
+VPLIntegrator::VPLIntegrator(int maxDepth, int nLightPaths, int nVPLSets,
+                             int vplMaxDepth, Float gLimit, Float rrThreshold,
+                             bool lightcuts, Float cutError, int maxCutSize,
+                             std::vector<VPL> fileVPLs,
+                             std::shared_ptr<const Camera> camera,
+                             std::shared_ptr<Sampler> sampler,
+                             const Bounds2i &pixelBounds)
+    : SamplerIntegrator(camera, sampler, pixelBounds),
+      maxDepth(maxDepth),
+      nLightPaths(nLightPaths),
+      nVPLSets(nVPLSets),
+      vplMaxDepth(vplMaxDepth),
+      gLimit(gLimit),
+      rrThreshold(rrThreshold),
+      lightcuts(lightcuts),
+      cutError(cutError),
+      maxCutSize(maxCutSize),
+      fileVPLs(std::move(fileVPLs)) {}
+
+void VPLIntegrator::Preprocess(const Scene &scene, Sampler &sampler) {
+    // Request samples for sampling all lights at each specular bounce
+    nLightSamples.clear();
+    for (const auto &light : scene.lights)
+        nLightSamples.push_back(sampler.RoundCount(light->nSamples));
+    for (int i = 0; i < maxDepth; ++i) {
+        for (size_t j = 0; j < scene.lights.size(); ++j) {
+            sampler.Request2DArray(nLightSamples[j]);
+            sampler.Request2DArray(nLightSamples[j]);
+        }
+    }
+
+    // Trace the light paths of each VPL set; each path keeps its own VPLs
+    // so that the sets do not depend on the order threads finish in
+    vplSets.assign(nVPLSets, fileVPLs);
+    std::unique_ptr<Distribution1D> lightDistr =
+        ComputeLightPowerDistribution(scene);
+    if (lightDistr && nLightPaths > 0) {
+        std::vector<std::vector<VPL>> pathVPLs(nLightPaths);
+        for (int set = 0; set < nVPLSets; ++set) {
+            ParallelFor([&](int64_t i) {
+                MemoryArena &arena = ThreadArena(ArenaCategory::Render);
+                pathVPLs[i].clear();
+                TraceVPLPath(scene, *lightDistr,
+                             uint64_t(set) * nLightPaths + i, arena,
+                             &pathVPLs[i]);
+                arena.Reset();
+            }, nLightPaths, 64);
+            for (const std::vector<VPL> &vpls : pathVPLs)
+                vplSets[set].insert(vplSets[set].end(), vpls.begin(),
+                                    vpls.end());
+        }
+    }
+    for (const std::vector<VPL> &vpls : vplSets) nVPLsCreated += vpls.size();
+
+    // Build a light tree over each set for lightcuts
+    lightTrees.clear();
+    if (lightcuts) {
+        lightTrees.resize(nVPLSets);
+        for (int set = 0; set < nVPLSets; ++set) {
+            std::vector<int> indices(vplSets[set].size());
+            for (size_t i = 0; i < indices.size(); ++i) indices[i] = i;
+            if (indices.empty()) continue;
+            RNG rng(set);
+            lightTrees[set].reserve(2 * indices.size() - 1);
+            BuildLightTree(vplSets[set], &indices[0], indices.size(), rng,
+                           &lightTrees[set]);
+        }
+    }
+}
+
+void VPLIntegrator::TraceVPLPath(const Scene &scene,
+                                 const Distribution1D &lightDistr,
+                                 uint64_t haltonIndex, MemoryArena &arena,
+                                 std::vector<VPL> *vpls) const {
+    int haltonDim = 0;
+
+    // Choose light to start the path from
+    Float lightPdf;
+    Float lightSample = RadicalInverse(haltonDim++, haltonIndex);
+    int lightNum = lightDistr.SampleDiscrete(lightSample, &lightPdf);
+    const std::shared_ptr<Light> &light = scene.lights[lightNum];
+
+    // Sample the ray leaving the light and initialize _beta_ to the flux
+    // the path carries, shared among all of the set's paths
+    Point2f uLight0(RadicalInverse(haltonDim, haltonIndex),
+                    RadicalInverse(haltonDim + 1, haltonIndex));
+    Point2f uLight1(RadicalInverse(haltonDim + 2, haltonIndex),
+                    RadicalInverse(haltonDim + 3, haltonIndex));
+    Float uLightTime = Lerp(RadicalInverse(haltonDim + 4, haltonIndex),
+                            camera->shutterOpen, camera->shutterClose);
+    haltonDim += 5;
+    RayDifferential ray;
+    Normal3f nLight;
+    Float pdfPos, pdfDir;
+    Spectrum Le = light->Sample_Le(uLight0, uLight1, uLightTime, &ray,
+                                   &nLight, &pdfPos, &pdfDir);
+    if (pdfPos == 0 || pdfDir == 0 || Le.IsBlack()) return;
+    Spectrum beta = (AbsDot(nLight, ray.d) * Le) /
+                    (lightPdf * pdfPos * pdfDir * nLightPaths);
+    if (beta.IsBlack()) return;
+
+    // Fixed samples for estimating the reflectance at each VPL
+    const int nRhoSamples = 16;
+    Point2f rhoSamples[nRhoSamples];
+    for (int i = 0; i < nRhoSamples; ++i)
+        rhoSamples[i] =
+            Point2f((i + .5f) / nRhoSamples, RadicalInverse(0, i));
+    const BxDFType nonSpecular = BxDFType(BSDF_ALL & ~BSDF_SPECULAR);
+
+    SurfaceInteraction isect;
+    for (int depth = 0; depth < vplMaxDepth; ++depth) {
+        if (!scene.Intersect(ray, &isect)) break;
+        isect.ComputeScatteringFunctions(ray, arena, true,
+                                         TransportMode::Importance);
+        if (!isect.bsdf) {
+            --depth;
+            ray = isect.SpawnRay(ray.d);
+            continue;
+        }
+        const BSDF &bsdf = *isect.bsdf;
+        Vector3f wo = -ray.d;
+
+        // Leave a VPL that reflects the arriving flux diffusely
+        if (bsdf.NumComponents(nonSpecular) > 0) {
+            Spectrum rho = bsdf.rho(bsdf.WorldToLocal(wo), nRhoSamples,
+                                    rhoSamples, nonSpecular);
+            if (!rho.IsBlack())
+                vpls->push_back({isect.p, Faceforward(isect.n, wo),
+                                 isect.pError, beta * rho * InvPi});
+        }
+
+        // Sample the BSDF to continue the path
+        Vector3f wi;
+        Float pdf;
+        BxDFType flags;
+        Point2f u(RadicalInverse(haltonDim, haltonIndex),
+                  RadicalInverse(haltonDim + 1, haltonIndex));
+        haltonDim += 2;
+        Spectrum f = bsdf.Sample_f(wo, &wi, u, &pdf, BSDF_ALL, &flags);
+        if (f.IsBlack() || pdf == 0.f) break;
+        Spectrum betaNew = beta * f * AbsDot(wi, isect.shading.n) / pdf;
+
+        // Possibly terminate the path with Russian roulette
+        Float q = std::max((Float)0, 1 - betaNew.y() / beta.y());
+        if (RadicalInverse(haltonDim++, haltonIndex) < q) break;
+        beta = betaNew / (1 - q);
+        ray = isect.SpawnRay(wi);
+    }
+}
+
+int VPLIntegrator::BuildLightTree(const std::vector<VPL> &vpls, int *indices,
+                                  int nIndices, RNG &rng,
+                                  std::vector<LightTreeNode> *tree) const {
+    int nodeIndex = tree->size();
+    tree->push_back(LightTreeNode());
+    if (nIndices == 1) {
+        const VPL &vpl = vpls[indices[0]];
+        (*tree)[nodeIndex] = {Bounds3f(vpl.p), vpl.I, indices[0], -1};
+        return nodeIndex;
+    }
+
+    // Split the VPLs at the median of the widest axis
+    Bounds3f centroidBounds;
+    for (int i = 0; i < nIndices; ++i)
+        centroidBounds = Union(centroidBounds, vpls[indices[i]].p);
+    int dim = centroidBounds.MaximumExtent();
+    int mid = nIndices / 2;
+    std::nth_element(indices, indices + mid, indices + nIndices,
+                     [&](int a, int b) {
+                         return vpls[a].p[dim] < vpls[b].p[dim];
+                     });
+    int c0 = BuildLightTree(vpls, indices, mid, rng, tree);
+    int c1 = BuildLightTree(vpls, indices + mid, nIndices - mid, rng, tree);
+
+    // Choose the representative in proportion to the children's intensity
+    const LightTreeNode &n0 = (*tree)[c0], &n1 = (*tree)[c1];
+    Float w0 = std::max((Float)0, n0.I.y()), w1 = std::max((Float)0, n1.I.y());
+    int representative = (w0 + w1 == 0 || rng.UniformFloat() * (w0 + w1) < w0)
+                             ? n0.representative
+                             : n1.representative;
+    (*tree)[nodeIndex] = {Union(n0.bounds, n1.bounds), n0.I + n1.I,
+                          representative, c1};
+    return nodeIndex;
+}
+
+Spectrum VPLIntegrator::Contribution(const SurfaceInteraction &isect,
+                                     const VPL &vpl,
+                                     const Spectrum &I) const {
+    Vector3f w = vpl.p - isect.p;
+    Float d2 = w.LengthSquared();
+    if (d2 == 0) return Spectrum(0.f);
+    Vector3f wi = w / std::sqrt(d2);
+    Float cosLight = Dot(vpl.n, -wi);
+    if (cosLight <= 0) return Spectrum(0.f);
+    Spectrum f = isect.bsdf->f(isect.wo, wi) * AbsDot(wi, isect.shading.n);
+    if (f.IsBlack()) return Spectrum(0.f);
+    // Clamp the inverse-square falloff, which otherwise makes VPLs close
+    // to the receiver show up as bright splotches
+    return f * std::min(cosLight / d2, gLimit) * I;
+}
+
+Spectrum VPLIntegrator::EstimateAll(const SurfaceInteraction &isect, int set,
+                                    const Scene &scene, Float u,
+                                    MemoryArena &arena) const {
+    const std::vector<VPL> &vpls = vplSets[set];
+    int *vplIndex = arena.Alloc<int>(vpls.size());
+    Spectrum *contrib = arena.Alloc<Spectrum>(vpls.size());
+    int n = 0;
+    for (size_t i = 0; i < vpls.size(); ++i) {
+        Spectrum c = Contribution(isect, vpls[i], vpls[i].I);
+        if (c.IsBlack()) continue;
+        // Skip most of the faint VPLs with Russian roulette, stepping
+        // through a golden ratio sequence offset by _u_
+        if (c.y() < rrThreshold) {
+            double ur = u + i * 0.6180339887498949;
+            if (ur - std::floor(ur) > .1) continue;
+            c /= .1f;
+        }
+        vplIndex[n] = i;
+        contrib[n++] = c;
+    }
+    return TraceShadowRays(isect, scene, vpls, vplIndex, contrib, n, arena);
+}
+
+Spectrum VPLIntegrator::EstimateLightcut(const SurfaceInteraction &isect,
+                                         int set, const Scene &scene,
+                                         MemoryArena &arena) const {
+    const std::vector<VPL> &vpls = vplSets[set];
+    const std::vector<LightTreeNode> &tree = lightTrees[set];
+    if (tree.empty()) return Spectrum(0.f);
+
+    // Each cut node is estimated with its representative VPL; the error
+    // bound takes both cosines as one, the falloff from the closest point
+    // of the node's bounds, and the larger BSDF value toward the
+    // representative and the bounds' center
+    struct CutNode {
+        int node;
+        Spectrum estimate;
+        Float error;
+    };
+    auto evaluate = [&](int nodeIndex, CutNode *c) {
+        const LightTreeNode &node = tree[nodeIndex];
+        const VPL &rep = vpls[node.representative];
+        c->node = nodeIndex;
+        c->estimate = Contribution(isect, rep, node.I);
+        c->error = 0;
+        if (node.secondChild < 0) return;
+        Float fMax = 0;
+        for (Point3f p : {rep.p, (node.bounds.pMin + node.bounds.pMax) / 2}) {
+            Vector3f w = p - isect.p;
+            if (w.LengthSquared() > 0)
+                fMax = std::max(fMax,
+                                isect.bsdf->f(isect.wo, Normalize(w)).y());
+        }
+        Float d2 = DistanceSquared(isect.p, node.bounds);
+        Float G = d2 > 0 ? std::min(1 / d2, gLimit) : gLimit;
+        c->error = fMax * G * node.I.y();
+    };
+
+    // Refine the cut, always splitting the node with the largest error
+    // bound, until every bound is a small fraction of the total
+    CutNode *cut = arena.Alloc<CutNode>(maxCutSize + 1);
+    auto byError = [](const CutNode &a, const CutNode &b) {
+        return a.error < b.error;
+    };
+    int cutSize = 1;
+    evaluate(0, &cut[0]);
+    Spectrum total = cut[0].estimate;
+    while (cutSize < maxCutSize) {
+        if (cut[0].error == 0 || cut[0].error <= cutError * total.y()) break;
+        int nodeIndex = cut[0].node;
+        total = total - cut[0].estimate;
+        std::pop_heap(cut, cut + cutSize, byError);
+        evaluate(nodeIndex + 1, &cut[cutSize - 1]);
+        total += cut[cutSize - 1].estimate;
+        std::push_heap(cut, cut + cutSize, byError);
+        evaluate(tree[nodeIndex].secondChild, &cut[cutSize]);
+        total += cut[cutSize].estimate;
+        std::push_heap(cut, cut + ++cutSize, byError);
+    }
+    ReportValue(lightcutSize, cutSize);
+
+    // Test the visibility of each cut node's representative
+    int *vplIndex = arena.Alloc<int>(cutSize);
+    Spectrum *contrib = arena.Alloc<Spectrum>(cutSize);
+    int n = 0;
+    for (int i = 0; i < cutSize; ++i) {
+        if (cut[i].estimate.IsBlack()) continue;
+        vplIndex[n] = tree[cut[i].node].representative;
+        contrib[n++] = cut[i].estimate;
+    }
+    return TraceShadowRays(isect, scene, vpls, vplIndex, contrib, n, arena);
+}
+
+Spectrum VPLIntegrator::Li(const RayDifferential &ray, const Scene &scene,
+                           Sampler &sampler, MemoryArena &arena,
+                           int depth) const {
+    ProfilePhase p(Prof::SamplerIntegratorLi);
+    Spectrum L(0.f);
+    // Find closest ray intersection or return background radiance
+    SurfaceInteraction isect;
+    if (!scene.Intersect(ray, &isect)) {
+        for (const auto &light : scene.lights) L += light->Le(ray);
+        return L;
+    }
+
+    // Compute scattering functions for surface interaction
+    isect.ComputeScatteringFunctions(ray, arena);
+    if (!isect.bsdf)
+        return Li(isect.SpawnRay(ray.d), scene, sampler, arena, depth);
+    if (depth == 0) RecordAOVSample(isect);
+    Vector3f wo = isect.wo;
+    // Compute emitted light if ray hit an area light source
+    L += isect.Le(wo);
+
+    // Add direct lighting from the scene's lights
+    if (scene.lights.size() > 0)
+        L += UniformSampleAllLights(isect, scene, arena, sampler,
+                                    nLightSamples);
+
+    // Add the lighting from one of the VPL sets; what is left of the
+    // sample after choosing the set drives the Russian roulette
+    Float uSet = sampler.Get1D() * nVPLSets;
+    int set = std::min((int)uSet, nVPLSets - 1);
+    if (!vplSets[set].empty())
+        L += lightcuts
+                 ? EstimateLightcut(isect, set, scene, arena)
+                 : EstimateAll(isect, set, scene, uSet - set, arena);
+
+    if (depth + 1 < maxDepth) {
+        // Trace rays for specular reflection and refraction
+        L += SpecularReflect(ray, isect, scene, sampler, arena, depth);
+        L += SpecularTransmit(ray, isect, scene, sampler, arena, depth);
+    }
+    return L;
+}
+
+VPLIntegrator *CreateVPLIntegrator(const ParamSet &params,
+                                   std::shared_ptr<Sampler> sampler,
+                                   std::shared_ptr<const Camera> camera) {
+    int maxDepth = params.FindOneInt("maxdepth", 5);
+    int nLightPaths = params.FindOneInt("nlightpaths", 64);
+    int nVPLSets = std::max(1, params.FindOneInt("nsets", 4));
+    // Each bounce of a light path takes three Halton dimensions
+    int vplMaxDepth = Clamp(params.FindOneInt("vplmaxdepth", 5), 0, 256);
+    Float gLimit = params.FindOneFloat("glimit", 10.f);
+    Float rrThreshold = params.FindOneFloat("rrthreshold", .0001f);
+    bool lightcuts = params.FindOneBool("lightcuts", false);
+    Float cutError = params.FindOneFloat("cuterror", .02f);
+    int maxCutSize = std::max(1, params.FindOneInt("maxcutsize", 1000));
+
+    // The JSON driver's VPL files give each VPL as the radiance of a
+    // diffuse sphere of radius "vplradius"; convert that to the intensity
+    // of a cosine lobe emitting the same power
+    std::vector<VPL> fileVPLs;
+    std::string vplFile = params.FindOneFilename("vplfile", "");
+    Float vplRadius = params.FindOneFloat("vplradius", .3f);
+    if (!vplFile.empty() && !ReadVPLFile(vplFile, &fileVPLs))
+        fileVPLs.clear();
+    for (VPL &vpl : fileVPLs) vpl.I *= 4 * Pi * vplRadius * vplRadius;
+
+    int np;
+    const int *pb = params.FindInt("pixelbounds", &np);
+    Bounds2i pixelBounds = camera->film->GetSampleBounds();
+    if (pb) {
+        if (np != 4)
+            Error("Expected four values for \"pixelbounds\" parameter. Got %d.",
+                  np);
+        else {
+            pixelBounds = Intersect(pixelBounds,
+                                    Bounds2i{{pb[0], pb[2]}, {pb[1], pb[3]}});
+            if (pixelBounds.Area() == 0)
+                Error("Degenerate \"pixelbounds\" specified.");
+        }
+    }
+    VPLIntegrator *integrator = new VPLIntegrator(
+        maxDepth, nLightPaths, nVPLSets, vplMaxDepth, gLimit, rrThreshold,
+        lightcuts, cutError, maxCutSize, std::move(fileVPLs), camera, sampler,
+        pixelBounds);
+    integrator->SetRenderBudget(params);
+    return integrator;
+}
+
+}  // namespace pbrt
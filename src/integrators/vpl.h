@@ -0,0 +1,123 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_INTEGRATORS_VPL_H
+#define PBRT_INTEGRATORS_VPL_H
+
+// integrators/vpl.h*
+#include "pbrt.h"
+#include "integrator.h"
+
+namespace pbrt {
+
+// VPL Declarations
+// A virtual point light is an oriented point emitter whose radiant
+// intensity falls off with the cosine to its normal, _I_ being the
+// intensity along _n_.
+struct VPL {
+    Point3f p;
+    Normal3f n;
+    Vector3f pError;
+    Spectrum I;
+};
+
+// Reads a data_vpls.txt file: a header line ending with the number of
+// VPLs, then a "pos", "nor", "col" and "scale" line for each VPL. The
+// color is returned in _I_ as is and the scale is ignored.
+bool ReadVPLFile(const std::string &filename, std::vector<VPL> *vpls);
+
+// VPLIntegrator Declarations
+class VPLIntegrator : public SamplerIntegrator {
+  public:
+    // VPLIntegrator Public Methods
+    VPLIntegrator(int maxDepth, int nLightPaths, int nVPLSets, int vplMaxDepth,
+                  Float gLimit, Float rrThreshold, bool lightcuts,
+                  Float cutError, int maxCutSize, std::vector<VPL> fileVPLs,
+                  std::shared_ptr<const Camera> camera,
+                  std::shared_ptr<Sampler> sampler,
+                  const Bounds2i &pixelBounds);
+    void Preprocess(const Scene &scene, Sampler &sampler);
+    Spectrum Li(const RayDifferential &ray, const Scene &scene,
+                Sampler &sampler, MemoryArena &arena, int depth) const;
+
+  private:
+    // VPLIntegrator Private Declarations
+    struct LightTreeNode {
+        Bounds3f bounds;
+        Spectrum I;
+        // Index of the VPL that stands in for the whole cluster
+        int representative;
+        // Leaves have no children; interior nodes store their first child
+        // right after themselves
+        int secondChild;
+    };
+
+    // VPLIntegrator Private Methods
+    void TraceVPLPath(const Scene &scene, const Distribution1D &lightDistr,
+                      uint64_t haltonIndex, MemoryArena &arena,
+                      std::vector<VPL> *vpls) const;
+    int BuildLightTree(const std::vector<VPL> &vpls, int *indices, int nIndices,
+                       RNG &rng, std::vector<LightTreeNode> *tree) const;
+    Spectrum Contribution(const SurfaceInteraction &isect, const VPL &vpl,
+                          const Spectrum &I) const;
+    Spectrum EstimateAll(const SurfaceInteraction &isect, int set,
+                         const Scene &scene, Float u,
+                         MemoryArena &arena) const;
+    Spectrum EstimateLightcut(const SurfaceInteraction &isect, int set,
+                              const Scene &scene, MemoryArena &arena) const;
+
+    // VPLIntegrator Private Data
+    const int maxDepth;
+    const int nLightPaths, nVPLSets, vplMaxDepth;
+    const Float gLimit, rrThreshold;
+    const bool lightcuts;
+    const Float cutError;
+    const int maxCutSize;
+    const std::vector<VPL> fileVPLs;
+    std::vector<int> nLightSamples;
+    std::vector<std::vector<VPL>> vplSets;
+    std::vector<std::vector<LightTreeNode>> lightTrees;
+};
+
+VPLIntegrator *CreateVPLIntegrator(const ParamSet &params,
+                                   std::shared_ptr<Sampler> sampler,
+                                   std::shared_ptr<const Camera> camera);
+
+}  // namespace pbrt
+
+#endif  // PBRT_INTEGRATORS_VPL_H
@@ -62,6 +62,7 @@ Spectrum WhittedIntegrator::Li(const RayDifferential &ray, const Scene &scene,
     isect.ComputeScatteringFunctions(ray, arena);
     if (!isect.bsdf)
         return Li(isect.SpawnRay(ray.d), scene, sampler, arena, depth);
+    if (depth == 0) RecordAOVSample(isect);
 
     // Compute emitted light if ray hit an area light source
     L += isect.Le(wo);
@@ -104,7 +105,10 @@ WhittedIntegrator *CreateWhittedIntegrator(
                 Error("Degenerate \"pixelbounds\" specified.");
         }
     }
-    return new WhittedIntegrator(maxDepth, camera, sampler, pixelBounds);
+    WhittedIntegrator *integrator =
+        new WhittedIntegrator(maxDepth, camera, sampler, pixelBounds);
+    integrator->SetRenderBudget(params);
+    return integrator;
 }
 
 }  // namespace pbrt
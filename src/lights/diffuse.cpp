@@ -65,6 +65,13 @@ Spectrum DiffuseAreaLight::Power() const {
     return (twoSided ? 2 : 1) * Lemit * area * Pi;
 }
 
+bool DiffuseAreaLight::GetLightBounds(LightBounds *lb) const {
+    // Shapes don't bound their normals, so allow emission in all directions
+    *lb = LightBounds(shape->WorldBound(), Vector3f(0, 0, 1), Power().y(), -1,
+                      0);
+    return true;
+}
+
 Spectrum DiffuseAreaLight::Sample_Li(const Interaction &ref, const Point2f &u,
                                      Vector3f *wi, Float *pdf,
                                      VisibilityTester *vis) const {
@@ -39,6 +39,14 @@
 
 namespace pbrt {
 
+// EmissionRegion Method Definitions
+EmissionRegion::EmissionRegion(const Bounds3f &bounds, Float fraction) {
+    // An empty region or a zero fraction leaves emission unchanged
+    if (fraction <= 0 || bounds.pMin.x > bounds.pMax.x) return;
+    bounds.BoundingSphere(&center, &radius);
+    this->fraction = radius > 0 ? std::min(fraction, (Float)0.99) : 0;
+}
+
 // InfiniteAreaLight Method Definitions
 InfiniteAreaLight::InfiniteAreaLight(const Transform &LightToWorld,
                                      const Spectrum &L, int nSamples,
@@ -134,6 +142,17 @@ Float InfiniteAreaLight::Pdf_Li(const Interaction &, const Vector3f &w) const {
 Spectrum InfiniteAreaLight::Sample_Le(const Point2f &u1, const Point2f &u2,
                                       Float time, Ray *ray, Normal3f *nLight,
                                       Float *pdfPos, Float *pdfDir) const {
+    return Sample_Le(u1, u2, time, EmissionRegion(), ray, nLight, pdfPos,
+                     pdfDir);
+}
+
+// Samples emission as above, but starts a fraction _region.fraction_ of
+// the rays in the region; the remaining rays still cover the whole scene,
+// so the estimates of light transport elsewhere stay unbiased.
+Spectrum InfiniteAreaLight::Sample_Le(const Point2f &u1, const Point2f &u2,
+                                      Float time, const EmissionRegion &region,
+                                      Ray *ray, Normal3f *nLight,
+                                      Float *pdfPos, Float *pdfDir) const {
     ProfilePhase _(Prof::LightSample);
     // Compute direction for infinite light sample ray
     Point2f u = u1;
@@ -152,13 +171,28 @@ Spectrum InfiniteAreaLight::Sample_Le(const Point2f &u1, const Point2f &u2,
     // Compute origin for infinite light sample ray
     Vector3f v1, v2;
     CoordinateSystem(-d, &v1, &v2);
-    Point2f cd = ConcentricSampleDisk(u2);
-    Point3f pDisk = worldCenter + worldRadius * (cd.x * v1 + cd.y * v2);
+    Point3f pDisk;
+    Float fraction = region.fraction;
+    if (u2[0] < fraction) {
+        // Start the ray on the disk covering the region, projected onto
+        // the plane of the scene disk
+        Point2f cd = ConcentricSampleDisk(Point2f(u2[0] / fraction, u2[1]));
+        Point3f pCenter =
+            region.center - Dot(region.center - worldCenter, d) * d;
+        pDisk = pCenter + region.radius * (cd.x * v1 + cd.y * v2);
+    } else {
+        Point2f uDisk = u2;
+        if (fraction > 0)
+            uDisk[0] = std::min((u2[0] - fraction) / (1 - fraction),
+                                OneMinusEpsilon);
+        Point2f cd = ConcentricSampleDisk(uDisk);
+        pDisk = worldCenter + worldRadius * (cd.x * v1 + cd.y * v2);
+    }
     *ray = Ray(pDisk + worldRadius * -d, d, Infinity, time);
 
     // Compute _InfiniteAreaLight_ ray PDFs
     *pdfDir = sinTheta == 0 ? 0 : mapPdf / (2 * Pi * Pi * sinTheta);
-    *pdfPos = 1 / (Pi * worldRadius * worldRadius);
+    *pdfPos = PdfEmissionPosition(pDisk, d, region);
     return Spectrum(Lmap->Lookup(uv), SpectrumType::Illuminant);
 }
 
@@ -170,7 +204,28 @@ void InfiniteAreaLight::Pdf_Le(const Ray &ray, const Normal3f &, Float *pdfPos,
     Point2f uv(phi * Inv2Pi, theta * InvPi);
     Float mapPdf = distribution->Pdf(uv);
     *pdfDir = mapPdf / (2 * Pi * Pi * std::sin(theta));
-    *pdfPos = 1 / (Pi * worldRadius * worldRadius);
+    *pdfPos = PdfEmissionPosition(ray.o, Normalize(ray.d), EmissionRegion());
+}
+
+// Returns the density of ray origins for emission direction _d_ at the
+// point _p_, with respect to area on the plane perpendicular to _d_.
+Float InfiniteAreaLight::PdfEmissionPosition(
+    const Point3f &p, const Vector3f &d, const EmissionRegion &region) const {
+    Float fraction = region.fraction;
+    if (fraction == 0) return 1 / (Pi * worldRadius * worldRadius);
+    // Check which disks cover _p_, measuring distances within the plane
+    // perpendicular to _d_ and allowing for round-off at the disk edges
+    auto insideDisk = [&](const Point3f &center, Float radius) {
+        Vector3f v = p - center;
+        return (v - Dot(v, d) * d).LengthSquared() <=
+               1.001f * radius * radius;
+    };
+    Float pdf = 0;
+    if (insideDisk(worldCenter, worldRadius))
+        pdf += (1 - fraction) / (Pi * worldRadius * worldRadius);
+    if (insideDisk(region.center, region.radius))
+        pdf += fraction / (Pi * region.radius * region.radius);
+    return pdf;
 }
 
 std::shared_ptr<InfiniteAreaLight> CreateInfiniteLight(
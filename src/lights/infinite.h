@@ -48,6 +48,18 @@
 
 namespace pbrt {
 
+// EmissionRegion Declarations
+// A region of the scene that an _InfiniteAreaLight_ can aim a fraction
+// _fraction_ of its emitted rays at; the rays start on the disk covering
+// the region's bounding sphere instead of the disk covering the scene.
+struct EmissionRegion {
+    EmissionRegion() = default;
+    EmissionRegion(const Bounds3f &bounds, Float fraction);
+    Point3f center;
+    Float radius = 0;
+    Float fraction = 0;
+};
+
 // InfiniteAreaLight Declarations
 class InfiniteAreaLight : public Light {
   public:
@@ -65,10 +77,17 @@ class InfiniteAreaLight : public Light {
     Spectrum Sample_Le(const Point2f &u1, const Point2f &u2, Float time,
                        Ray *ray, Normal3f *nLight, Float *pdfPos,
                        Float *pdfDir) const;
+    Spectrum Sample_Le(const Point2f &u1, const Point2f &u2, Float time,
+                       const EmissionRegion &region, Ray *ray,
+                       Normal3f *nLight, Float *pdfPos, Float *pdfDir) const;
     void Pdf_Le(const Ray &, const Normal3f &, Float *pdfPos,
                 Float *pdfDir) const;
 
   private:
+    // InfiniteAreaLight Private Methods
+    Float PdfEmissionPosition(const Point3f &p, const Vector3f &d,
+                              const EmissionRegion &region) const;
+
     // InfiniteAreaLight Private Data
     std::unique_ptr<MIPMap<RGBSpectrum>> Lmap;
     Point3f worldCenter;
@@ -54,6 +54,11 @@ Spectrum PointLight::Sample_Li(const Interaction &ref, const Point2f &u,
 
 Spectrum PointLight::Power() const { return 4 * Pi * I; }
 
+bool PointLight::GetLightBounds(LightBounds *lb) const {
+    *lb = LightBounds(Bounds3f(pLight), Vector3f(0, 0, 1), Power().y(), -1, 0);
+    return true;
+}
+
 Float PointLight::Pdf_Li(const Interaction &, const Vector3f &) const {
     return 0;
 }
@@ -76,6 +76,16 @@ Spectrum SpotLight::Power() const {
     return I * 2 * Pi * (1 - .5f * (cosFalloffStart + cosTotalWidth));
 }
 
+bool SpotLight::GetLightBounds(LightBounds *lb) const {
+    // Bound the falloff region's emission by the cone's full intensity
+    Vector3f w = Normalize(LightToWorld(Vector3f(0, 0, 1)));
+    Float cosTheta_e = std::cos(std::acos(Clamp(cosTotalWidth, -1, 1)) -
+                                std::acos(Clamp(cosFalloffStart, -1, 1)));
+    *lb = LightBounds(Bounds3f(pLight), w, 4 * Pi * I.y(), cosFalloffStart,
+                      cosTheta_e);
+    return true;
+}
+
 Float SpotLight::Pdf_Li(const Interaction &, const Vector3f &) const {
     return 0.f;
 }
@@ -48,6 +48,7 @@ static void usage(const char *msg = nullptr) {
     fprintf(stderr, R"(usage: pbrt [<options>] <filename.pbrt...>
 Rendering options:
   --help               Print this help text.
+  --hugepages          Back memory arenas with 2 MB huge pages, if available.
   --nthreads <num>     Use specified number of threads for rendering.
   --outfile <filename> Write the final image to the given filename.
   --quick              Automatically reduce a number of quality settings to
@@ -107,6 +108,9 @@ int main(int argc, char *argv[]) {
             FLAGS_minloglevel = atoi(&argv[i][14]);
         } else if (!strcmp(argv[i], "--quick") || !strcmp(argv[i], "-quick")) {
             options.quickRender = true;
+        } else if (!strcmp(argv[i], "--hugepages") ||
+                   !strcmp(argv[i], "-hugepages")) {
+            options.hugePages = true;
         } else if (!strcmp(argv[i], "--quiet") || !strcmp(argv[i], "-quiet")) {
             options.quiet = true;
         } else if (!strcmp(argv[i], "--cat") || !strcmp(argv[i], "-cat")) {
@@ -59,6 +59,41 @@ Float GridDensityMedium::Density(const Point3f &p) const {
     return Lerp(d.z, d0, d1);
 }
 
+void GridDensityMedium::Precompute() {
+    // Precompute values for Monte Carlo sampling of _GridDensityMedium_
+    sigma_t = sigma_a + sigma_s;
+    gray = sigma_t == Spectrum(sigma_t[0]);
+
+    // Bound the density in each majorant cell by the maximum of all
+    // voxels that trilinear interpolation reads within it
+    const Point3i &res = majorantGrid.res;
+    for (int z = 0; z < res.z; ++z)
+        for (int y = 0; y < res.y; ++y)
+            for (int x = 0; x < res.x; ++x) {
+                Bounds3f bounds = majorantGrid.CellBounds(x, y, z);
+                Point3i p0(std::floor(bounds.pMin.x * nx - .5f),
+                           std::floor(bounds.pMin.y * ny - .5f),
+                           std::floor(bounds.pMin.z * nz - .5f));
+                Point3i p1(std::floor(bounds.pMax.x * nx - .5f) + 1,
+                           std::floor(bounds.pMax.y * ny - .5f) + 1,
+                           std::floor(bounds.pMax.z * nz - .5f) + 1);
+                p0 = Max(p0, Point3i(0, 0, 0));
+                p1 = Min(p1, Point3i(nx - 1, ny - 1, nz - 1));
+                Float maxDensity = 0;
+                if (sparseDensity)
+                    // Use the per-leaf maxima rather than reading every voxel
+                    maxDensity = sparseDensity->MaxValue(
+                        Bounds3i(p0, p1 + Vector3i(1, 1, 1)));
+                else
+                    for (int vz = p0.z; vz <= p1.z; ++vz)
+                        for (int vy = p0.y; vy <= p1.y; ++vy)
+                            for (int vx = p0.x; vx <= p1.x; ++vx)
+                                maxDensity = std::max(maxDensity,
+                                                      D(Point3i(vx, vy, vz)));
+                majorantGrid(x, y, z) = maxDensity;
+            }
+}
+
 Spectrum GridDensityMedium::Sample(const Ray &rWorld, Sampler &sampler,
                                    MemoryArena &arena,
                                    MediumInteraction *mi) const {
@@ -69,23 +104,120 @@ Spectrum GridDensityMedium::Sample(const Ray &rWorld, Sampler &sampler,
     const Bounds3f b(Point3f(0, 0, 0), Point3f(1, 1, 1));
     Float tMin, tMax;
     if (!b.IntersectP(ray, &tMin, &tMax)) return Spectrum(1.f);
+    if (!gray)
+        return SampleChromatic(rWorld, ray, tMin, tMax, sampler, arena, mi);
 
-    // Run delta-tracking iterations to sample a medium interaction
-    Float t = tMin;
-    while (true) {
-        t -= std::log(1 - sampler.Get1D()) * invMaxDensity / sigma_t;
-        if (t >= tMax) break;
-        if (Density(ray(t)) * invMaxDensity > sampler.Get1D()) {
-            // Populate _mi_ with medium interaction information and return
-            PhaseFunction *phase = ARENA_ALLOC(arena, HenyeyGreenstein)(g);
-            *mi = MediumInteraction(rWorld(t), -rWorld.d, rWorld.time, this,
-                                    phase);
-            return sigma_s / sigma_t;
+    // Run delta-tracking iterations in each majorant cell along _ray_
+    DDAMajorantIterator iter(ray, tMin, tMax, majorantGrid);
+    Float t0, t1, maxDensity;
+    while (iter.Next(&t0, &t1, &maxDensity)) {
+        if (maxDensity == 0) continue;
+        Float t = t0;
+        while (true) {
+            t -= std::log(1 - sampler.Get1D()) / (maxDensity * sigma_t[0]);
+            if (t >= t1) break;
+            if (Density(ray(t)) / maxDensity > sampler.Get1D()) {
+                // Populate _mi_ with medium interaction information and
+                // return
+                PhaseFunction *phase = ARENA_ALLOC(arena, HenyeyGreenstein)(g);
+                *mi = MediumInteraction(rWorld(t), -rWorld.d, rWorld.time,
+                                        this, phase);
+                return sigma_s / sigma_t[0];
+            }
         }
     }
     return Spectrum(1.f);
 }
 
+Spectrum GridDensityMedium::SampleChromatic(const Ray &rWorld, const Ray &ray,
+                                            Float tMin, Float tMax,
+                                            Sampler &sampler,
+                                            MemoryArena &arena,
+                                            MediumInteraction *mi) const {
+    // Delta tracking against the majorant of the most attenuating channel
+    // decides whether each tentative collision is real using the
+    // probabilities of a uniformly sampled hero channel. The weight
+    // returned for each channel is its contribution divided by the average
+    // probability of the decisions over all channels (one-sample spectral
+    // MIS); the tentative collision density is shared by all channels and
+    // cancels.
+    int channel = std::min((int)(sampler.Get1D() * Spectrum::nSamples),
+                           Spectrum::nSamples - 1);
+    auto average = [](const Spectrum &s) {
+        Float sum = 0;
+        for (int i = 0; i < Spectrum::nSamples; ++i) sum += s[i];
+        return sum / Spectrum::nSamples;
+    };
+
+    // Keep each channel's probability of the null collisions taken so far,
+    // scaled to a maximum of one; only ratios between channels matter
+    Spectrum pNull(1.f);
+    Float sigmaMax = sigma_t.MaxComponentValue();
+    DDAMajorantIterator iter(ray, tMin, tMax, majorantGrid);
+    Float t0, t1, maxDensity;
+    while (iter.Next(&t0, &t1, &maxDensity)) {
+        if (maxDensity == 0) continue;
+        Float sigmaMaj = maxDensity * sigmaMax;
+        Float t = t0;
+        while (true) {
+            t -= std::log(1 - sampler.Get1D()) / sigmaMaj;
+            if (t >= t1) break;
+            Float density = std::max((Float)0, Density(ray(t)));
+            Spectrum pCollide = (sigma_t * (density / sigmaMaj)).Clamp(0, 1);
+            if (pCollide[channel] > sampler.Get1D()) {
+                // Populate _mi_ and return the MIS-weighted scattering
+                // coefficient
+                PhaseFunction *phase = ARENA_ALLOC(arena, HenyeyGreenstein)(g);
+                *mi = MediumInteraction(rWorld(t), -rWorld.d, rWorld.time,
+                                        this, phase);
+                return pNull * sigma_s * (density / sigmaMaj) /
+                       average(pNull * pCollide);
+            }
+            pNull *= Spectrum(1.f) - pCollide;
+            pNull /= pNull.MaxComponentValue();
+        }
+    }
+    return pNull / average(pNull);
+}
+
+// Ratio tracking against the majorant of the most attenuating channel;
+// _T_ is _Float_ for gray media and _Spectrum_ otherwise
+static Float MaxComponent(Float v) { return v; }
+static Float MaxComponent(const Spectrum &s) { return s.MaxComponentValue(); }
+
+template <typename T>
+Spectrum GridDensityMedium::RatioTrack(const Ray &ray, Float tMin, Float tMax,
+                                       const T &sigma_t,
+                                       Sampler &sampler) const {
+    T Tr(1.f);
+    Float sigmaMax = MaxComponent(sigma_t);
+    DDAMajorantIterator iter(ray, tMin, tMax, majorantGrid);
+    Float t0, t1, maxDensity;
+    while (iter.Next(&t0, &t1, &maxDensity)) {
+        if (maxDensity == 0) continue;
+        Float sigmaMaj = maxDensity * sigmaMax;
+        Float t = t0;
+        while (true) {
+            ++nTrSteps;
+            t -= std::log(1 - sampler.Get1D()) / sigmaMaj;
+            if (t >= t1) break;
+            Float density = Density(ray(t));
+            Tr *= T(1.f) -
+                  sigma_t * (std::max((Float)0, density) / sigmaMaj);
+            // Added after book publication: when transmittance gets low,
+            // start applying Russian roulette to terminate sampling.
+            const Float rrThreshold = .1;
+            Float TrMax = MaxComponent(Tr);
+            if (TrMax < rrThreshold) {
+                Float q = std::max((Float).05, 1 - TrMax);
+                if (sampler.Get1D() < q) return 0;
+                Tr /= 1 - q;
+            }
+        }
+    }
+    return Spectrum(Tr);
+}
+
 Spectrum GridDensityMedium::Tr(const Ray &rWorld, Sampler &sampler) const {
     ProfilePhase _(Prof::MediumTr);
     ++nTrCalls;
@@ -98,23 +230,58 @@ Spectrum GridDensityMedium::Tr(const Ray &rWorld, Sampler &sampler) const {
     if (!b.IntersectP(ray, &tMin, &tMax)) return Spectrum(1.f);
 
     // Perform ratio tracking to estimate the transmittance value
-    Float Tr = 1, t = tMin;
-    while (true) {
-        ++nTrSteps;
-        t -= std::log(1 - sampler.Get1D()) * invMaxDensity / sigma_t;
-        if (t >= tMax) break;
-        Float density = Density(ray(t));
-        Tr *= 1 - std::max((Float)0, density * invMaxDensity);
-        // Added after book publication: when transmittance gets low,
-        // start applying Russian roulette to terminate sampling.
-        const Float rrThreshold = .1;
-        if (Tr < rrThreshold) {
-            Float q = std::max((Float).05, 1 - Tr);
-            if (sampler.Get1D() < q) return 0;
-            Tr /= 1 - q;
+    if (gray) return RatioTrack(ray, tMin, tMax, sigma_t[0], sampler);
+    return RatioTrack(ray, tMin, tMax, sigma_t, sampler);
+}
+
+// DDAMajorantIterator Method Definitions
+DDAMajorantIterator::DDAMajorantIterator(const Ray &ray, Float tMin,
+                                         Float tMax, const MajorantGrid &grid)
+    : grid(grid), tMin(tMin), tMax(tMax) {
+    // Set up 3D DDA for _ray_ through the majorant grid
+    Point3f pEntry = ray(tMin);
+    for (int axis = 0; axis < 3; ++axis) {
+        // Compute current cell and crossing parameters for _axis_
+        Float pCell = pEntry[axis] * grid.res[axis];
+        voxel[axis] = Clamp((int)pCell, 0, grid.res[axis] - 1);
+        Float dCell = ray.d[axis] * grid.res[axis];
+        if (dCell > 0) {
+            nextCrossingT[axis] = tMin + (voxel[axis] + 1 - pCell) / dCell;
+            deltaT[axis] = 1 / dCell;
+            step[axis] = 1;
+            voxelLimit[axis] = grid.res[axis];
+        } else if (dCell < 0) {
+            nextCrossingT[axis] = tMin + (voxel[axis] - pCell) / dCell;
+            deltaT[axis] = -1 / dCell;
+            step[axis] = -1;
+            voxelLimit[axis] = -1;
+        } else {
+            nextCrossingT[axis] = Infinity;
+            deltaT[axis] = 0;
+            step[axis] = 0;
+            voxelLimit[axis] = -1;
         }
     }
-    return Spectrum(Tr);
+}
+
+bool DDAMajorantIterator::Next(Float *t0, Float *t1, Float *maxDensity) {
+    if (tMin >= tMax) return false;
+    // Find the axis along which the ray leaves the current cell first
+    int axis = 0;
+    if (nextCrossingT[1] < nextCrossingT[axis]) axis = 1;
+    if (nextCrossingT[2] < nextCrossingT[axis]) axis = 2;
+
+    // Return the ray's extent in the current cell and advance to the next
+    *t0 = tMin;
+    *t1 = std::min(tMax, nextCrossingT[axis]);
+    *maxDensity = grid(voxel[0], voxel[1], voxel[2]);
+    tMin = *t1;
+    if (nextCrossingT[axis] < tMax) {
+        voxel[axis] += step[axis];
+        if (voxel[axis] == voxelLimit[axis]) tMin = tMax;
+        nextCrossingT[axis] += deltaT[axis];
+    }
+    return true;
 }
 
 }  // namespace pbrt
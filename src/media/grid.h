@@ -40,6 +40,7 @@
 
 // media/grid.h*
 #include "medium.h"
+#include "sparsevolume.h"
 #include "transform.h"
 #include "stats.h"
 
@@ -47,13 +48,53 @@ namespace pbrt {
 
 STAT_MEMORY_COUNTER("Memory/Volume density grid", densityBytes);
 
+// MajorantGrid Declarations
+// Coarse grid over the medium's $[0,1]^3$ bounds that stores an upper
+// bound of the density in each cell; rays are traced through it with a
+// 3D DDA so that tracking steps are scaled to the local density.
+struct MajorantGrid {
+    MajorantGrid(int nx, int ny, int nz)
+        : res(nx, ny, nz), maxDensity(new Float[nx * ny * nz]) {}
+    Bounds3f CellBounds(int x, int y, int z) const {
+        return Bounds3f(Point3f((Float)x / res.x, (Float)y / res.y,
+                                (Float)z / res.z),
+                        Point3f((Float)(x + 1) / res.x,
+                                (Float)(y + 1) / res.y,
+                                (Float)(z + 1) / res.z));
+    }
+    Float &operator()(int x, int y, int z) {
+        return maxDensity[(z * res.y + y) * res.x + x];
+    }
+    Float operator()(int x, int y, int z) const {
+        return maxDensity[(z * res.y + y) * res.x + x];
+    }
+    const Point3i res;
+    std::unique_ptr<Float[]> maxDensity;
+};
+
+// DDAMajorantIterator Declarations
+// Steps a ray through the cells of a _MajorantGrid_, returning the
+// parametric range of the ray in each cell and the cell's majorant.
+class DDAMajorantIterator {
+  public:
+    DDAMajorantIterator(const Ray &ray, Float tMin, Float tMax,
+                        const MajorantGrid &grid);
+    bool Next(Float *t0, Float *t1, Float *maxDensity);
+
+  private:
+    const MajorantGrid &grid;
+    Float tMin, tMax;
+    Float nextCrossingT[3], deltaT[3];
+    int step[3], voxelLimit[3], voxel[3];
+};
+
 // GridDensityMedium Declarations
 class GridDensityMedium : public Medium {
   public:
     // GridDensityMedium Public Methods
     GridDensityMedium(const Spectrum &sigma_a, const Spectrum &sigma_s, Float g,
                       int nx, int ny, int nz, const Transform &mediumToWorld,
-                      const Float *d)
+                      const Float *d, int majorantRes = 16)
         : sigma_a(sigma_a),
           sigma_s(sigma_s),
           g(g),
@@ -61,23 +102,32 @@ class GridDensityMedium : public Medium {
           ny(ny),
           nz(nz),
           WorldToMedium(Inverse(mediumToWorld)),
-          density(new Float[nx * ny * nz]) {
+          density(new Float[nx * ny * nz]),
+          majorantGrid(std::min(nx, majorantRes), std::min(ny, majorantRes),
+                       std::min(nz, majorantRes)) {
         densityBytes += nx * ny * nz * sizeof(Float);
         memcpy((Float *)density.get(), d, sizeof(Float) * nx * ny * nz);
-        // Precompute values for Monte Carlo sampling of _GridDensityMedium_
-        sigma_t = (sigma_a + sigma_s)[0];
-        if (Spectrum(sigma_t) != sigma_a + sigma_s)
-            Error(
-                "GridDensityMedium requires a spectrally uniform attenuation "
-                "coefficient!");
-        Float maxDensity = 0;
-        for (int i = 0; i < nx * ny * nz; ++i)
-            maxDensity = std::max(maxDensity, density[i]);
-        invMaxDensity = 1 / maxDensity;
+        Precompute();
+    }
+    GridDensityMedium(const Spectrum &sigma_a, const Spectrum &sigma_s, Float g,
+                      std::unique_ptr<const SparseVolume> volume,
+                      const Transform &mediumToWorld, int majorantRes = 16)
+        : sigma_a(sigma_a),
+          sigma_s(sigma_s),
+          g(g),
+          nx(volume->Resolution().x),
+          ny(volume->Resolution().y),
+          nz(volume->Resolution().z),
+          WorldToMedium(Inverse(mediumToWorld)),
+          sparseDensity(std::move(volume)),
+          majorantGrid(std::min(nx, majorantRes), std::min(ny, majorantRes),
+                       std::min(nz, majorantRes)) {
+        Precompute();
     }
 
     Float Density(const Point3f &p) const;
     Float D(const Point3i &p) const {
+        if (sparseDensity) return sparseDensity->Lookup(p);
         Bounds3i sampleBounds(Point3i(0, 0, 0), Point3i(nx, ny, nz));
         if (!InsideExclusive(p, sampleBounds)) return 0;
         return density[(p.z * ny + p.y) * nx + p.x];
@@ -87,14 +137,28 @@ class GridDensityMedium : public Medium {
     Spectrum Tr(const Ray &ray, Sampler &sampler) const;
 
   private:
+    // GridDensityMedium Private Methods
+    void Precompute();
+    Spectrum SampleChromatic(const Ray &rWorld, const Ray &ray, Float tMin,
+                             Float tMax, Sampler &sampler, MemoryArena &arena,
+                             MediumInteraction *mi) const;
+    template <typename T>
+    Spectrum RatioTrack(const Ray &ray, Float tMin, Float tMax,
+                        const T &sigma_t, Sampler &sampler) const;
+
     // GridDensityMedium Private Data
     const Spectrum sigma_a, sigma_s;
     const Float g;
     const int nx, ny, nz;
     const Transform WorldToMedium;
+    // Densities are stored either densely or in a _SparseVolume_
     std::unique_ptr<Float[]> density;
-    Float sigma_t;
-    Float invMaxDensity;
+    std::unique_ptr<const SparseVolume> sparseDensity;
+    Spectrum sigma_t;
+    // Gray media have the same attenuation in all channels and are tracked
+    // with scalar arithmetic
+    bool gray;
+    MajorantGrid majorantGrid;
 };
 
 }  // namespace pbrt
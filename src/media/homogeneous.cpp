@@ -43,18 +43,31 @@ namespace pbrt {
 // HomogeneousMedium Method Definitions
 Spectrum HomogeneousMedium::Tr(const Ray &ray, Sampler &sampler) const {
     ProfilePhase _(Prof::MediumTr);
-    return Exp(-sigma_t * std::min(ray.tMax * ray.d.Length(), MaxFloat));
+    Float dist = std::min(ray.tMax * ray.d.Length(), MaxFloat);
+    if (gray) return Spectrum(std::exp(-sigma_t[0] * dist));
+    return Exp(-sigma_t * dist);
 }
 
 Spectrum HomogeneousMedium::Sample(const Ray &ray, Sampler &sampler,
                                    MemoryArena &arena,
                                    MediumInteraction *mi) const {
     ProfilePhase _(Prof::MediumSample);
+    if (gray) {
+        // Sample a distance along the ray; the transmittance cancels with
+        // the sampling density
+        Float dist = -std::log(1 - sampler.Get1D()) / sigma_t[0];
+        Float t = std::min(dist / ray.d.Length(), ray.tMax);
+        if (t >= ray.tMax) return Spectrum(1.f);
+        *mi = MediumInteraction(ray(t), -ray.d, ray.time, this,
+                                ARENA_ALLOC(arena, HenyeyGreenstein)(g));
+        return sigma_s / sigma_t[0];
+    }
+
     // Sample a channel and distance along the ray
     int channel = std::min((int)(sampler.Get1D() * Spectrum::nSamples),
                            Spectrum::nSamples - 1);
     Float dist = -std::log(1 - sampler.Get1D()) / sigma_t[channel];
-    Float t = std::min(dist * ray.d.Length(), ray.tMax);
+    Float t = std::min(dist / ray.d.Length(), ray.tMax);
     bool sampledMedium = t < ray.tMax;
     if (sampledMedium)
         *mi = MediumInteraction(ray(t), -ray.d, ray.time, this,
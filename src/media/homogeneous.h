@@ -51,7 +51,8 @@ class HomogeneousMedium : public Medium {
         : sigma_a(sigma_a),
           sigma_s(sigma_s),
           sigma_t(sigma_s + sigma_a),
-          g(g) {}
+          g(g),
+          gray(sigma_t == Spectrum(sigma_t[0])) {}
     Spectrum Tr(const Ray &ray, Sampler &sampler) const;
     Spectrum Sample(const Ray &ray, Sampler &sampler, MemoryArena &arena,
                     MediumInteraction *mi) const;
@@ -60,6 +61,9 @@ class HomogeneousMedium : public Medium {
     // HomogeneousMedium Private Data
     const Spectrum sigma_a, sigma_s, sigma_t;
     const Float g;
+    // Gray media, with the same attenuation in all channels, don't need
+    // per-channel sampling and transmittance
+    const bool gray;
 };
 
 }  // namespace pbrt
@@ -14,6 +14,7 @@
 #include "integrators/directlighting.h"
 #include "integrators/mlt.h"
 #include "integrators/path.h"
+#include "integrators/vcm.h"
 #include "integrators/volpath.h"
 #include "lights/diffuse.h"
 #include "lights/point.h"
@@ -311,6 +312,26 @@ std::vector<TestIntegrator> GetIntegrators() {
                                    scene});
         }
 
+        for (auto sampler : GetSamplers(Bounds2i(Point2i(0, 0), resolution))) {
+            std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+            Film *film =
+                new Film(resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                         std::move(filter), 1., "test.exr", 1.);
+            std::shared_ptr<Camera> camera =
+                std::make_shared<PerspectiveCamera>(
+                    identity, Bounds2f(Point2f(-1, -1), Point2f(1, 1)), 0., 1.,
+                    0., 10., 45, film, nullptr);
+
+            Integrator *integrator = new PathIntegrator(
+                8, camera, sampler.first, film->croppedPixelBounds, 1,
+                "spatial", false, "", true, 32);
+            integrators.push_back({integrator, film,
+                                   "Path, depth 8, wavefront, Perspective, " +
+                                       sampler.second + ", " +
+                                       scene.description,
+                                   scene});
+        }
+
         // Volume path tracing integrators
         for (auto sampler : GetSamplers(Bounds2i(Point2i(0, 0), resolution))) {
             std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
@@ -371,6 +392,47 @@ std::vector<TestIntegrator> GetIntegrators() {
                                        scene.description,
                                    scene});
         }
+        for (auto sampler : GetSamplers(Bounds2i(Point2i(0, 0), resolution))) {
+            std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+            Film *film =
+                new Film(resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                         std::move(filter), 1., "test.exr", 1.);
+            std::shared_ptr<Camera> camera =
+                std::make_shared<PerspectiveCamera>(
+                    identity, Bounds2f(Point2f(-1, -1), Point2f(1, 1)), 0., 1.,
+                    0., 10., 45, film, nullptr);
+
+            Integrator *integrator =
+                new BDPTIntegrator(sampler.first, camera, 6, false, false,
+                                   film->croppedPixelBounds, "power", true);
+            integrators.push_back({integrator, film,
+                                   "BDPT, depth 6, light vertex cache, "
+                                   "Perspective, " +
+                                       sampler.second + ", " +
+                                       scene.description,
+                                   scene});
+        }
+        for (auto sampler : GetSamplers(Bounds2i(Point2i(0, 0), resolution))) {
+            std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+            Film *film =
+                new Film(resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                         std::move(filter), 1., "test.exr", 1.);
+            std::shared_ptr<Camera> camera =
+                std::make_shared<PerspectiveCamera>(
+                    identity, Bounds2f(Point2f(-1, -1), Point2f(1, 1)), 0., 1.,
+                    0., 10., 45, film, nullptr);
+
+            // The radiance is uniform, so merging over a large radius
+            // doesn't blur the result
+            Integrator *integrator =
+                new VCMIntegrator(sampler.first, camera, 6, .1, .75,
+                                  film->croppedPixelBounds);
+            integrators.push_back({integrator, film,
+                                   "VCM, depth 6, Perspective, " +
+                                       sampler.second + ", " +
+                                       scene.description,
+                                   scene});
+        }
 #if 0
     // Ortho camera not currently supported with BDPT.
     for (auto sampler : GetSamplers(Bounds2i(Point2i(0,0), resolution))) {
@@ -408,6 +470,30 @@ std::vector<TestIntegrator> GetIntegrators() {
                 {integrator, film,
                  "MLT, depth 8, Perspective, " + scene.description, scene});
         }
+
+        // MLT with replica exchange and checkpointing
+        {
+            std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+            Film *film =
+                new Film(resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                         std::move(filter), 1., "test.exr", 1.);
+            std::shared_ptr<Camera> camera =
+                std::make_shared<PerspectiveCamera>(
+                    identity, Bounds2f(Point2f(-1, -1), Point2f(1, 1)), 0., 1.,
+                    0., 10., 45, film, nullptr);
+
+            Integrator *integrator = new MLTIntegrator(
+                camera, 8 /* depth */, 100000 /* n bootstrap */,
+                1000 /* nchains */, 256 /* mutations per pixel */,
+                0.01 /* sigma */, 0.3 /* large step prob */,
+                4 /* temperatures */, 8 /* max temperature */,
+                16 /* swap interval */, "test_mlt.ckpt", 4 /* rounds */);
+            integrators.push_back(
+                {integrator, film,
+                 "MLT replica exchange, depth 8, Perspective, " +
+                     scene.description,
+                 scene});
+        }
     }
 
     return integrators;
@@ -0,0 +1,173 @@
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+
+#include "accelerators/bvh.h"
+#include "cameras/perspective.h"
+#include "film.h"
+#include "filters/box.h"
+#include "integrators/bdpt.h"
+#include "lights/diffuse.h"
+#include "lights/point.h"
+#include "materials/uber.h"
+#include "memory.h"
+#include "samplers/random.h"
+#include "scene.h"
+#include "shapes/sphere.h"
+#include "textures/constant.h"
+
+using namespace pbrt;
+
+// The original MIS weight computation, which temporarily updates the
+// subpath vertices and then walks both subpaths in full.
+static Float ReferenceMISWeight(
+    const Scene &scene, Vertex *lightVertices, Vertex *cameraVertices,
+    Vertex &sampled, int s, int t, const Distribution1D &lightPdf,
+    const std::unordered_map<const Light *, size_t> &lightToIndex,
+    Float connectionCount) {
+    if (s + t == 2) return 1;
+    Float sumRi = 0;
+    auto remap0 = [](Float f) -> Float { return f != 0 ? f : 1; };
+    auto count = [&](int si, int ti) -> Float {
+        Float n = (si >= 2 && ti >= 2) ? connectionCount : 1;
+        return (s >= 2 && t >= 2) ? n / connectionCount : n;
+    };
+    Vertex *qs = s > 0 ? &lightVertices[s - 1] : nullptr,
+           *pt = t > 0 ? &cameraVertices[t - 1] : nullptr,
+           *qsMinus = s > 1 ? &lightVertices[s - 2] : nullptr,
+           *ptMinus = t > 1 ? &cameraVertices[t - 2] : nullptr;
+    ScopedAssignment<Vertex> a1;
+    if (s == 1)
+        a1 = {qs, sampled};
+    else if (t == 1)
+        a1 = {pt, sampled};
+    ScopedAssignment<bool> a2, a3;
+    if (pt) a2 = {&pt->delta, false};
+    if (qs) a3 = {&qs->delta, false};
+    ScopedAssignment<Float> a4;
+    if (pt)
+        a4 = {&pt->pdfRev, s > 0 ? qs->Pdf(scene, qsMinus, *pt)
+                                 : pt->PdfLightOrigin(scene, *ptMinus, lightPdf,
+                                                      lightToIndex)};
+    ScopedAssignment<Float> a5;
+    if (ptMinus)
+        a5 = {&ptMinus->pdfRev, s > 0 ? pt->Pdf(scene, qs, *ptMinus)
+                                      : pt->PdfLight(scene, *ptMinus)};
+    ScopedAssignment<Float> a6;
+    if (qs) a6 = {&qs->pdfRev, pt->Pdf(scene, ptMinus, *qs)};
+    ScopedAssignment<Float> a7;
+    if (qsMinus) a7 = {&qsMinus->pdfRev, qs->Pdf(scene, pt, *qsMinus)};
+
+    Float ri = 1;
+    for (int i = t - 1; i > 0; --i) {
+        ri *=
+            remap0(cameraVertices[i].pdfRev) / remap0(cameraVertices[i].pdfFwd);
+        if (!cameraVertices[i].delta && !cameraVertices[i - 1].delta)
+            sumRi += ri * count(s + t - i, i);
+    }
+    ri = 1;
+    for (int i = s - 1; i >= 0; --i) {
+        ri *= remap0(lightVertices[i].pdfRev) / remap0(lightVertices[i].pdfFwd);
+        bool deltaLightvertex = i > 0 ? lightVertices[i - 1].delta
+                                      : lightVertices[0].IsDeltaLight();
+        if (!lightVertices[i].delta && !deltaLightvertex)
+            sumRi += ri * count(i, s + t - i);
+    }
+    return 1 / (1 + sumRi);
+}
+
+// Traces subpaths inside an emissive unit sphere with a diffuse and
+// specular surface and an off-center point light, and checks the cached
+// MIS weights of every connection strategy against the reference.
+static void CheckMISWeights(Float connectionCount) {
+    static Transform id;
+    std::shared_ptr<Shape> sphere = std::make_shared<Sphere>(
+        &id, &id, true /* reverse orientation */, 1, -1, 1, 360);
+    std::shared_ptr<Texture<Spectrum>> Kd =
+        std::make_shared<ConstantTexture<Spectrum>>(Spectrum(0.25));
+    std::shared_ptr<Texture<Spectrum>> Kr =
+        std::make_shared<ConstantTexture<Spectrum>>(Spectrum(0.5));
+    std::shared_ptr<Texture<Spectrum>> black =
+        std::make_shared<ConstantTexture<Spectrum>>(0.);
+    std::shared_ptr<Texture<Spectrum>> white =
+        std::make_shared<ConstantTexture<Spectrum>>(1.);
+    std::shared_ptr<Texture<Float>> zero =
+        std::make_shared<ConstantTexture<Float>>(0.);
+    std::shared_ptr<Texture<Float>> one =
+        std::make_shared<ConstantTexture<Float>>(1.);
+    std::shared_ptr<Material> material = std::make_shared<UberMaterial>(
+        Kd, black, Kr, black, zero, zero, zero, white, one, nullptr, false);
+    std::shared_ptr<AreaLight> areaLight = std::make_shared<DiffuseAreaLight>(
+        Transform(), nullptr, Spectrum(0.5), 1, sphere);
+
+    std::vector<std::shared_ptr<Light>> lights;
+    lights.push_back(areaLight);
+    lights.push_back(std::make_shared<PointLight>(
+        Translate(Vector3f(.3, -.2, .1)), nullptr, Spectrum(2.)));
+    std::vector<std::shared_ptr<Primitive>> prims;
+    prims.push_back(std::make_shared<GeometricPrimitive>(
+        sphere, material, areaLight, MediumInterface()));
+    Scene scene(std::make_shared<BVHAccel>(prims), lights);
+
+    Point2i resolution(10, 10);
+    AnimatedTransform identity(new Transform, 0, new Transform, 1);
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+    Film *film = new Film(resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                          std::move(filter), 1., "test.exr", 1.);
+    PerspectiveCamera camera(identity, Bounds2f(Point2f(-1, -1), Point2f(1, 1)),
+                             0., 1., 0., 10., 45, film, nullptr);
+
+    Float lightFunc[2] = {1, 3};
+    Distribution1D lightDistr(lightFunc, 2);
+    std::unordered_map<const Light *, size_t> lightToIndex;
+    for (size_t i = 0; i < scene.lights.size(); ++i)
+        lightToIndex[scene.lights[i].get()] = i;
+
+    const int maxDepth = 8;
+    RandomSampler sampler(1);
+    MemoryArena arena;
+    int nChecked = 0;
+    for (int i = 0; i < 500; ++i) {
+        sampler.StartPixel(Point2i(i % 10, (i / 10) % 10));
+        Point2f pFilm = Point2f(i % 10, (i / 10) % 10) + sampler.Get2D();
+        Vertex *cameraVertices = arena.Alloc<Vertex>(maxDepth + 2);
+        Vertex *lightVertices = arena.Alloc<Vertex>(maxDepth + 1);
+        int nCamera = GenerateCameraSubpath(scene, sampler, arena, maxDepth + 2,
+                                            camera, pFilm, cameraVertices);
+        int nLight = GenerateLightSubpath(scene, sampler, arena, maxDepth + 1,
+                                          cameraVertices[0].time(), lightDistr,
+                                          lightToIndex, lightVertices);
+        for (int t = 1; t <= nCamera; ++t) {
+            for (int s = 0; s <= nLight; ++s) {
+                int depth = t + s - 2;
+                if ((s == 1 && t == 1) || depth < 0 || depth > maxDepth)
+                    continue;
+                if (t > 1 && s != 0 &&
+                    cameraVertices[t - 1].type == VertexType::Light)
+                    continue;
+                // Stand in the subpath endpoints for the vertices that
+                // _ConnectBDPT()_ samples
+                Vertex sampled;
+                if (s == 1)
+                    sampled = lightVertices[0];
+                else if (t == 1)
+                    sampled = cameraVertices[0];
+                Float expected = ReferenceMISWeight(
+                    scene, lightVertices, cameraVertices, sampled, s, t,
+                    lightDistr, lightToIndex, connectionCount);
+                Float weight =
+                    MISWeight(scene, lightVertices, cameraVertices, sampled, s,
+                              t, lightDistr, lightToIndex, connectionCount);
+                if (std::isnan(expected)) continue;
+                EXPECT_NEAR(expected, weight, 1e-4) << "s " << s << ", t "
+                                                    << t;
+                ++nChecked;
+            }
+        }
+        arena.Reset();
+    }
+    EXPECT_GT(nChecked, 5000);
+}
+
+TEST(BDPT, MISWeightMatchesReference) { CheckMISWeights(1); }
+
+TEST(BDPT, MISWeightMatchesReferenceConnectionCount) { CheckMISWeights(2.5); }
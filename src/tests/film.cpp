@@ -0,0 +1,244 @@
+
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "film.h"
+#include "imageio.h"
+#include "parallel.h"
+#include "rng.h"
+#include "filters/box.h"
+#include "filters/triangle.h"
+
+using namespace pbrt;
+
+// Renders a synthetic image into _film_ using 16x16 tiles; the wide
+// reconstruction filter makes neighboring tiles overlap.
+static void RenderNoise(Film *film, int pass = 0) {
+    Bounds2i sampleBounds = film->GetSampleBounds();
+    Vector2i sampleExtent = sampleBounds.Diagonal();
+    const int tileSize = 16;
+    Point2i nTiles((sampleExtent.x + tileSize - 1) / tileSize,
+                   (sampleExtent.y + tileSize - 1) / tileSize);
+    ParallelFor2D([&](Point2i tile) {
+        int x0 = sampleBounds.pMin.x + tile.x * tileSize;
+        int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
+        int y0 = sampleBounds.pMin.y + tile.y * tileSize;
+        int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
+        Bounds2i tileBounds(Point2i(x0, y0), Point2i(x1, y1));
+        std::unique_ptr<FilmTile> filmTile = film->GetFilmTile(tileBounds);
+        RNG rng((pass * nTiles.y + tile.y) * nTiles.x + tile.x);
+        for (Point2i pixel : tileBounds) {
+            for (int s = 0; s < 4; ++s) {
+                Point2f pFilm(pixel.x + rng.UniformFloat(),
+                              pixel.y + rng.UniformFloat());
+                Float rgb[3] = {rng.UniformFloat(), rng.UniformFloat(),
+                                rng.UniformFloat()};
+                Spectrum L = Spectrum::FromRGB(rgb);
+                filmTile->AddSample(pFilm, L);
+            }
+        }
+        film->MergeFilmTile(std::move(filmTile));
+    }, nTiles);
+}
+
+static std::unique_ptr<RGBSpectrum[]> RenderFilm(bool perThread, int nThreads,
+                                                 const char *filename,
+                                                 Point2i *res,
+                                                 bool halfStorage = false,
+                                                 int nPasses = 1) {
+    PbrtOptions.nThreads = nThreads;
+    ParallelInit();
+    std::unique_ptr<Film> film(new Film(
+        Point2i(53, 37), Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+        std::unique_ptr<Filter>(new TriangleFilter(Vector2f(2, 2))), 35.f,
+        filename, 1.f, Infinity, perThread, ImageCompression::ZIP, false, 0,
+        halfStorage));
+    for (int pass = 0; pass < nPasses; ++pass) {
+        RenderNoise(film.get(), pass);
+        film->MergeDeferredTiles();
+    }
+    film->WriteImage();
+    ParallelCleanup();
+    PbrtOptions.nThreads = 0;
+    return ReadImage(filename, res);
+}
+
+TEST(Film, PerThreadAccumulationMatchesSerial) {
+    // Several passes over the image, as budgeted rendering takes
+    Point2i serialRes, perThreadRes;
+    std::unique_ptr<RGBSpectrum[]> serial =
+        RenderFilm(false, 1, "film_serial.pfm", &serialRes, false, 3);
+    std::unique_ptr<RGBSpectrum[]> perThread =
+        RenderFilm(true, 4, "film_perthread.pfm", &perThreadRes, false, 3);
+    ASSERT_TRUE(serial.get() != nullptr);
+    ASSERT_TRUE(perThread.get() != nullptr);
+    ASSERT_EQ(serialRes, perThreadRes);
+
+    for (int i = 0; i < serialRes.x * serialRes.y; ++i) {
+        Float a[3], b[3];
+        serial[i].ToRGB(a);
+        perThread[i].ToRGB(b);
+        for (int c = 0; c < 3; ++c) EXPECT_EQ(a[c], b[c]) << i << " " << c;
+    }
+    remove("film_serial.pfm");
+    remove("film_perthread.pfm");
+}
+
+TEST(Film, HalfStorage) {
+    Point2i floatRes, halfRes;
+    std::unique_ptr<RGBSpectrum[]> full =
+        RenderFilm(false, 1, "film_float.pfm", &floatRes);
+    std::unique_ptr<RGBSpectrum[]> half =
+        RenderFilm(false, 1, "film_half.pfm", &halfRes, true);
+    ASSERT_TRUE(full.get() != nullptr);
+    ASSERT_TRUE(half.get() != nullptr);
+    ASSERT_EQ(floatRes, halfRes);
+
+    for (int i = 0; i < floatRes.x * floatRes.y; ++i) {
+        Float a[3], b[3];
+        full[i].ToRGB(a);
+        half[i].ToRGB(b);
+        // Each pixel's XYZ value is rounded to half precision once per
+        // overlapping tile, and the XYZ to RGB conversion can magnify the
+        // error of an individual channel.
+        Float maxValue = std::max(a[0], std::max(a[1], a[2]));
+        for (int c = 0; c < 3; ++c)
+            EXPECT_LE(std::abs(a[c] - b[c]), 1e-2f * maxValue + 1e-4f)
+                << i << " " << c;
+    }
+    remove("film_float.pfm");
+    remove("film_half.pfm");
+}
+
+TEST(Film, HalfStorageSaturates) {
+    // A pixel far brighter than the largest half, like the sun in an
+    // environment map, is clamped rather than becoming infinite
+    std::unique_ptr<Film> film(new Film(
+        Point2i(4, 4), Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+        std::unique_ptr<Filter>(new BoxFilter(Vector2f(.5f, .5f))), 35.f,
+        "film_bright.pfm", 1.f, Infinity, false, ImageCompression::ZIP,
+        false, 0, true));
+    std::unique_ptr<FilmTile> tile =
+        film->GetFilmTile(Bounds2i(Point2i(0, 0), Point2i(4, 4)));
+    tile->AddSample(Point2f(1.5f, 1.5f), Spectrum(1e6f));
+    tile->AddSample(Point2f(2.5f, 2.5f), Spectrum(1.f));
+    film->MergeFilmTile(std::move(tile));
+    film->WriteImage();
+
+    Point2i res;
+    std::unique_ptr<RGBSpectrum[]> image = ReadImage("film_bright.pfm", &res);
+    ASSERT_TRUE(image.get() != nullptr);
+    Float rgb[3];
+    image[1 * 4 + 1].ToRGB(rgb);
+    for (int c = 0; c < 3; ++c) {
+        EXPECT_FALSE(std::isinf(rgb[c])) << c;
+        EXPECT_GT(rgb[c], 1e4f) << c;
+    }
+    image[2 * 4 + 2].ToRGB(rgb);
+    for (int c = 0; c < 3; ++c) EXPECT_NEAR(1.f, rgb[c], 1e-2f) << c;
+    remove("film_bright.pfm");
+}
+
+TEST(Film, RelativeError) {
+    std::unique_ptr<Film> film(new Film(
+        Point2i(4, 4), Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+        std::unique_ptr<Filter>(new TriangleFilter(Vector2f(2, 2))), 35.f,
+        "unused.pfm", 1.f));
+    film->EnableErrorEstimate();
+    EXPECT_EQ(Infinity, film->RelativeError(Point2i(0, 0)));
+
+    // Constant samples have no error
+    for (int i = 0; i < 8; ++i)
+        film->AddErrorSample(Point2i(0, 0), Spectrum(0.5f));
+    EXPECT_EQ(0, film->RelativeError(Point2i(0, 0)));
+    // Pixels in the filter margin use the nearest image pixel
+    EXPECT_EQ(0, film->RelativeError(Point2i(-1, -1)));
+
+    // Alternating samples of 0 and 1: the mean is 0.5 and the standard
+    // error shrinks with the square root of the sample count
+    Float previousError = Infinity;
+    for (int n = 1; n <= 1024; ++n) {
+        Float v = (n & 1) ? 1.f : 0.f;
+        film->AddErrorSample(Point2i(1, 2), Spectrum(v));
+        if (n == 64 || n == 256 || n == 1024) {
+            Float error = film->RelativeError(Point2i(1, 2));
+            EXPECT_LT(error, previousError);
+            Float expected = std::sqrt(0.25f * n / (n - 1) / n) / 0.5f;
+            EXPECT_NEAR(expected, error, 1e-3f);
+            previousError = error;
+        }
+    }
+}
+
+TEST(Film, SplatBatchMatchesIndividualSplats) {
+    auto makeFilm = []() {
+        return std::unique_ptr<Film>(new Film(
+            Point2i(16, 8), Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+            std::unique_ptr<Filter>(new TriangleFilter(Vector2f(2, 2))), 35.f,
+            "unused.pfm", 1.f));
+    };
+    std::unique_ptr<Film> individual = makeFilm(), batched = makeFilm();
+
+    // Splats repeatedly hit a few pixels, as those of a Markov chain do,
+    // and some fall outside the image
+    RNG rng;
+    std::vector<FilmSplat> splats;
+    for (int i = 0; i < 1000; ++i) {
+        Point2f p(-2 + 20 * rng.UniformFloat(), 4 * rng.UniformFloat());
+        Float rgb[3] = {rng.UniformFloat(), rng.UniformFloat(),
+                        rng.UniformFloat()};
+        Spectrum v = Spectrum::FromRGB(rgb);
+        individual->AddSplat(p, v);
+        splats.push_back({p, v});
+    }
+    batched->AddSplats(splats);
+    EXPECT_TRUE(splats.empty());
+
+    std::vector<Float> a = individual->GetSplatXYZ();
+    std::vector<Float> b = batched->GetSplatXYZ();
+    ASSERT_EQ(a.size(), b.size());
+    for (size_t i = 0; i < a.size(); ++i)
+        EXPECT_NEAR(a[i], b[i], 1e-4f * std::max(Float(1), a[i])) << i;
+
+    // Restoring saved splats reproduces them
+    std::unique_ptr<Film> restored = makeFilm();
+    restored->SetSplatXYZ(a);
+    EXPECT_EQ(a, restored->GetSplatXYZ());
+}
+
+TEST(Film, PerThreadSplatsAreOrderIndependent) {
+    // Splats from many tasks hit the same pixels, so that each thread's
+    // buffer sums a different, scheduling-dependent subset of them
+    std::vector<FilmSplat> splats;
+    RNG rng;
+    for (int i = 0; i < 20000; ++i) {
+        Point2f p(16 * rng.UniformFloat(), 8 * rng.UniformFloat());
+        Float rgb[3] = {rng.UniformFloat(), 100 * rng.UniformFloat(),
+                        1e-3f * rng.UniformFloat()};
+        splats.push_back({p, Spectrum::FromRGB(rgb)});
+    }
+    auto splatAll = [&](bool perThread, int nThreads, bool reverse) {
+        PbrtOptions.nThreads = nThreads;
+        ParallelInit();
+        std::unique_ptr<Film> film(new Film(
+            Point2i(16, 8), Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+            std::unique_ptr<Filter>(new TriangleFilter(Vector2f(2, 2))),
+            35.f, "unused.pfm", 1.f, Infinity, perThread));
+        int n = splats.size();
+        ParallelFor([&](int64_t i) {
+            const FilmSplat &splat = splats[reverse ? n - 1 - i : i];
+            film->AddSplat(splat.p, splat.v);
+        }, n, 64);
+        std::vector<Float> xyz = film->GetSplatXYZ();
+        ParallelCleanup();
+        PbrtOptions.nThreads = 0;
+        return xyz;
+    };
+    std::vector<Float> serial = splatAll(false, 1, false);
+    std::vector<Float> forward = splatAll(true, 4, false);
+    std::vector<Float> backward = splatAll(true, 1, true);
+    EXPECT_EQ(forward, backward);
+    for (size_t i = 0; i < serial.size(); ++i)
+        EXPECT_NEAR(serial[i], forward[i],
+                    1e-4f * std::max(Float(1), serial[i]))
+            << i;
+}
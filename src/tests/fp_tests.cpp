@@ -263,3 +263,35 @@ TEST(EFloat, Div) {
         EXPECT_LE(preciseResult, efResult.UpperBound());
     }
 }
+
+TEST(FloatingPoint, Half) {
+    EXPECT_EQ(0x0000, FloatToHalf(0.f));
+    EXPECT_EQ(0x8000, FloatToHalf(-0.f));
+    EXPECT_EQ(0x3c00, FloatToHalf(1.f));
+    EXPECT_EQ(0xc000, FloatToHalf(-2.f));
+    EXPECT_EQ(0x7bff, FloatToHalf(65504.f));
+    EXPECT_EQ(0x7c00, FloatToHalf(65520.f));
+    EXPECT_EQ(0x7c00, FloatToHalf(Infinity));
+    EXPECT_EQ(0x0001, FloatToHalf(std::ldexp(1.f, -24)));
+    EXPECT_EQ(0x0000, FloatToHalf(std::ldexp(1.f, -25)));
+    EXPECT_TRUE(std::isnan(HalfToFloat(FloatToHalf(NAN))));
+
+    // Every finite half value survives a round trip through float.
+    for (uint32_t bits = 0; bits < 65536; ++bits) {
+        uint16_t h = bits;
+        if ((h & 0x7c00) == 0x7c00) continue;
+        EXPECT_EQ(h, FloatToHalf(HalfToFloat(h))) << h;
+    }
+
+    // Conversion rounds to the nearest half value.
+    RNG rng;
+    for (int i = 0; i < 10000; ++i) {
+        float f = (rng.UniformFloat() - .5f) * 1000.f;
+        if (f == 0) continue;
+        float h = HalfToFloat(FloatToHalf(f));
+        float next = HalfToFloat(FloatToHalf(f) + 1);
+        float prev = HalfToFloat(FloatToHalf(f) - 1);
+        EXPECT_LE(std::abs(f - h), std::abs(f - next)) << f;
+        EXPECT_LE(std::abs(f - h), std::abs(f - prev)) << f;
+    }
+}
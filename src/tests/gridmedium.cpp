@@ -0,0 +1,204 @@
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "rng.h"
+#include "interaction.h"
+#include "media/grid.h"
+#include "memory.h"
+#include "samplers/random.h"
+
+using namespace pbrt;
+
+static Ray RandomRayInUnitCube(RNG &rng, Float *tMax) {
+    Point3f o(rng.UniformFloat(), rng.UniformFloat(), rng.UniformFloat());
+    Vector3f d(rng.UniformFloat() - .5f, rng.UniformFloat() - .5f,
+               rng.UniformFloat() - .5f);
+    Ray ray(o, Normalize(d));
+    Float tMin;
+    Bounds3f(Point3f(0, 0, 0), Point3f(1, 1, 1)).IntersectP(ray, &tMin, tMax);
+    return ray;
+}
+
+TEST(DDAMajorantIterator, VisitsCellsAlongRay) {
+    // Store each cell's index as its majorant so that the iterator's
+    // results identify the cell
+    MajorantGrid grid(5, 4, 3);
+    for (int z = 0; z < 3; ++z)
+        for (int y = 0; y < 4; ++y)
+            for (int x = 0; x < 5; ++x) grid(x, y, z) = (z * 4 + y) * 5 + x;
+
+    RNG rng;
+    for (int i = 0; i < 1000; ++i) {
+        Float tMax;
+        Ray ray = RandomRayInUnitCube(rng, &tMax);
+        DDAMajorantIterator iter(ray, 0, tMax, grid);
+        Float t0, t1, index, tPrev = 0;
+        while (iter.Next(&t0, &t1, &index)) {
+            EXPECT_EQ(tPrev, t0);
+            EXPECT_LE(t0, t1);
+            tPrev = t1;
+            // Check that the segment's midpoint lies in the reported cell
+            if (t1 - t0 < 1e-4f) continue;
+            Point3f p = ray((t0 + t1) / 2);
+            int x = Clamp((int)(p.x * 5), 0, 4);
+            int y = Clamp((int)(p.y * 4), 0, 3);
+            int z = Clamp((int)(p.z * 3), 0, 2);
+            EXPECT_EQ((z * 4 + y) * 5 + x, (int)index) << i;
+        }
+        // The DDA stops where the ray leaves the grid, which may be
+        // slightly before the conservatively rounded _tMax_
+        EXPECT_NEAR(tMax, tPrev, 1e-4f);
+    }
+}
+
+TEST(GridDensityMedium, TrMatchesQuadrature) {
+    // A mostly empty volume with a dense block and a thin slab of
+    // smoothly varying density
+    const int n = 32;
+    std::vector<Float> density(n * n * n, Float(0));
+    for (int z = 0; z < n; ++z)
+        for (int y = 0; y < n; ++y)
+            for (int x = 0; x < n; ++x) {
+                Float &d = density[(z * n + y) * n + x];
+                if (x >= 18 && x < 26 && y >= 4 && y < 12 && z >= 20) d = 4;
+                if (std::abs(2 * y - n) < 5) d += Float(x) / n;
+            }
+    const Float sigma_t = 2;
+    GridDensityMedium medium(Spectrum(sigma_t / 2), Spectrum(sigma_t / 2), 0,
+                             n, n, n, Transform(), &density[0], 8);
+
+    RNG rng;
+    RandomSampler sampler(1);
+    sampler.StartPixel(Point2i(0, 0));
+    for (int i = 0; i < 20; ++i) {
+        Float tMax;
+        Ray ray = RandomRayInUnitCube(rng, &tMax);
+        ray.tMax = tMax;
+
+        // Integrate the density along the ray with the midpoint rule
+        const int nSteps = 4096;
+        Float opticalDepth = 0;
+        for (int j = 0; j < nSteps; ++j)
+            opticalDepth +=
+                medium.Density(ray((j + .5f) * tMax / nSteps)) * tMax / nSteps;
+        Float expected = std::exp(-sigma_t * opticalDepth);
+
+        const int nSamples = 20000;
+        Float sum = 0;
+        for (int j = 0; j < nSamples; ++j) sum += medium.Tr(ray, sampler)[0];
+        EXPECT_NEAR(expected, sum / nSamples, .01f) << i;
+    }
+}
+
+TEST(GridDensityMedium, ChromaticMatchesQuadrature) {
+    const int n = 16;
+    std::vector<Float> density(n * n * n);
+    for (int z = 0; z < n; ++z)
+        for (int y = 0; y < n; ++y)
+            for (int x = 0; x < n; ++x)
+                density[(z * n + y) * n + x] = Float(x + y) / n;
+    Float rgb[3] = {.5, 2, 6};
+    Spectrum sigma_t = Spectrum::FromRGB(rgb);
+    GridDensityMedium medium(sigma_t / 4, sigma_t * .75f, 0, n, n, n,
+                             Transform(), &density[0], 4);
+
+    RNG rng;
+    RandomSampler sampler(1);
+    sampler.StartPixel(Point2i(0, 0));
+    MemoryArena arena;
+    for (int i = 0; i < 10; ++i) {
+        Float tMax;
+        Ray ray = RandomRayInUnitCube(rng, &tMax);
+        ray.tMax = tMax;
+        const int nSteps = 4096;
+        Float opticalDepth = 0;
+        for (int j = 0; j < nSteps; ++j)
+            opticalDepth +=
+                medium.Density(ray((j + .5f) * tMax / nSteps)) * tMax / nSteps;
+        Spectrum expected = Exp(-sigma_t * opticalDepth);
+
+        // Both the ratio tracking estimates and the spectral MIS weights of
+        // the paths that escape the medium estimate each channel's
+        // transmittance
+        const int nSamples = 20000;
+        Spectrum trSum(0.), escapeSum(0.);
+        for (int j = 0; j < nSamples; ++j) {
+            trSum += medium.Tr(ray, sampler);
+            MediumInteraction mi;
+            Spectrum weight = medium.Sample(ray, sampler, arena, &mi);
+            if (!mi.IsValid()) escapeSum += weight;
+            arena.Reset();
+        }
+        for (int c = 0; c < Spectrum::nSamples; ++c) {
+            EXPECT_NEAR(expected[c], trSum[c] / nSamples, .01f) << i;
+            EXPECT_NEAR(expected[c], escapeSum[c] / nSamples, .015f) << i;
+        }
+    }
+}
+
+TEST(SparseVolume, MatchesDenseGrid) {
+    // A volume whose resolution isn't a multiple of the leaf size, with
+    // values in a few scattered blocks
+    const int nx = 21, ny = 9, nz = 17;
+    std::vector<Float> density(nx * ny * nz, Float(0));
+    RNG rng;
+    for (int i = 0; i < 40; ++i)
+        density[rng.UniformUInt32(density.size())] = 1 + rng.UniformFloat();
+    for (int x = 0; x < nx; ++x) density[(16 * ny + 8) * nx + x] = .5f;
+    const char *filename = "sparse_test.svol";
+    ASSERT_TRUE(SparseVolume::Write(filename, nx, ny, nz, &density[0]));
+
+    std::unique_ptr<SparseVolume> volume = SparseVolume::Read(filename);
+    ASSERT_TRUE(volume.get() != nullptr);
+    EXPECT_EQ(Point3i(nx, ny, nz), volume->Resolution());
+    EXPECT_LT(volume->LeafCount(), 3 * 2 * 3);
+    for (int z = -1; z <= nz; ++z)
+        for (int y = -1; y <= ny; ++y)
+            for (int x = -1; x <= nx; ++x) {
+                bool inside = x >= 0 && x < nx && y >= 0 && y < ny && z >= 0 &&
+                              z < nz;
+                Float expected = inside ? density[(z * ny + y) * nx + x] : 0;
+                EXPECT_EQ(expected, volume->Lookup(Point3i(x, y, z)));
+            }
+
+    // The maximum over a region bounds every value in it
+    for (int i = 0; i < 100; ++i) {
+        Point3i p0(rng.UniformUInt32(nx), rng.UniformUInt32(ny),
+                   rng.UniformUInt32(nz));
+        Point3i p1 = p0 + Vector3i(1 + rng.UniformUInt32(6),
+                                   1 + rng.UniformUInt32(6),
+                                   1 + rng.UniformUInt32(6));
+        Float maxValue = volume->MaxValue(Bounds3i(p0, p1));
+        for (int z = p0.z; z < p1.z; ++z)
+            for (int y = p0.y; y < p1.y; ++y)
+                for (int x = p0.x; x < p1.x; ++x)
+                    EXPECT_LE(volume->Lookup(Point3i(x, y, z)), maxValue);
+    }
+
+    // A medium using the sparse volume has the same densities as one
+    // using the dense grid. Its majorants are computed from the leaves'
+    // maxima and are looser, so only the means of the transmittance
+    // estimates agree.
+    GridDensityMedium dense(Spectrum(1.), Spectrum(1.), 0, nx, ny, nz,
+                            Transform(), &density[0], 4);
+    GridDensityMedium sparse(Spectrum(1.), Spectrum(1.), 0, std::move(volume),
+                             Transform(), 4);
+    RandomSampler sampler(1);
+    sampler.StartPixel(Point2i(0, 0));
+    for (int i = 0; i < 20; ++i) {
+        Float tMax;
+        Ray ray = RandomRayInUnitCube(rng, &tMax);
+        ray.tMax = tMax;
+        for (int j = 0; j < 100; ++j) {
+            Point3f p = ray(tMax * rng.UniformFloat());
+            EXPECT_EQ(dense.Density(p), sparse.Density(p));
+        }
+        const int nSamples = 10000;
+        Float denseSum = 0, sparseSum = 0;
+        for (int j = 0; j < nSamples; ++j) {
+            denseSum += dense.Tr(ray, sampler)[0];
+            sparseSum += sparse.Tr(ray, sampler)[0];
+        }
+        EXPECT_NEAR(denseSum / nSamples, sparseSum / nSamples, .02f) << i;
+    }
+    remove(filename);
+}
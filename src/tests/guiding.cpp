@@ -0,0 +1,147 @@
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+
+#include "accelerators/bvh.h"
+#include "api.h"
+#include "cameras/perspective.h"
+#include "film.h"
+#include "filters/box.h"
+#include "guiding.h"
+#include "imageio.h"
+#include "integrators/path.h"
+#include "lights/diffuse.h"
+#include "materials/matte.h"
+#include "materials/mirror.h"
+#include "materials/mixmat.h"
+#include "rng.h"
+#include "samplers/halton.h"
+#include "sampling.h"
+#include "scene.h"
+#include "shapes/sphere.h"
+#include "textures/constant.h"
+
+using namespace pbrt;
+
+// Returns a directional tree trained on radiance that is concentrated
+// around a single direction, refined over a few passes.
+static DirectionalTree PeakedTree() {
+    DirectionalTree building, sampling;
+    Vector3f peak = Normalize(Vector3f(.3, -.4, .8));
+    RNG rng;
+    for (int pass = 0; pass < 4; ++pass) {
+        for (int i = 0; i < 20000; ++i) {
+            Vector3f w =
+                UniformSampleSphere({rng.UniformFloat(), rng.UniformFloat()});
+            Float radiance = std::pow(std::max((Float)0, Dot(w, peak)), 20);
+            building.Record(w, radiance / UniformSpherePdf());
+        }
+        sampling = building;
+        building.Refine(.01f, 20);
+    }
+    EXPECT_GT(sampling.NumNodes(), 10);
+    return sampling;
+}
+
+TEST(DirectionalTree, PdfIntegratesToOne) {
+    DirectionalTree tree = PeakedTree();
+    RNG rng;
+    const int n = 200000;
+    Float sum = 0;
+    for (int i = 0; i < n; ++i) {
+        Vector3f w =
+            UniformSampleSphere({rng.UniformFloat(), rng.UniformFloat()});
+        sum += tree.Pdf(w) / UniformSpherePdf();
+    }
+    EXPECT_NEAR(1, sum / n, .05);
+}
+
+TEST(DirectionalTree, SampleMatchesPdf) {
+    DirectionalTree tree = PeakedTree();
+    // If sampling follows the pdf, weighting samples by 1 / pdf gives an
+    // unbiased estimate of the area of the part of a cap around the peak
+    // where the pdf is nonzero; most samples should also land in the cap.
+    RNG rng;
+    const int n = 200000;
+    Vector3f peak = Normalize(Vector3f(.3, -.4, .8));
+    Float supportArea = 0;
+    for (int i = 0; i < n; ++i) {
+        Vector3f w =
+            UniformSampleSphere({rng.UniformFloat(), rng.UniformFloat()});
+        if (Dot(w, peak) > .9 && tree.Pdf(w) > 0)
+            supportArea += 1 / UniformSpherePdf();
+    }
+    supportArea /= n;
+    EXPECT_GT(supportArea, .9 * 2 * Pi * (1 - .9));
+
+    Float capArea = 0;
+    int inCap = 0;
+    for (int i = 0; i < n; ++i) {
+        Vector3f w = tree.Sample({rng.UniformFloat(), rng.UniformFloat()});
+        EXPECT_NEAR(1, w.Length(), 1e-3);
+        Float pdf = tree.Pdf(w);
+        ASSERT_GT(pdf, 0);
+        if (Dot(w, peak) > .9) {
+            capArea += 1 / pdf;
+            ++inCap;
+        }
+    }
+    EXPECT_NEAR(supportArea, capArea / n, .02 * supportArea);
+    EXPECT_GT(inCap, n / 2);
+}
+
+TEST(PathGuide, SpecularSurfaceMatchesAnalytic) {
+    Options options;
+    options.quiet = true;
+    pbrtInit(options);
+
+    // Inside a unit sphere with Le = 0.5 and a material that is half
+    // Kd = 0.5 matte and half Kr = 0.5 mirror, radiance is 1 everywhere.
+    // The guide must leave the mirror's delta lobe to the BSDF.
+    static Transform id;
+    std::shared_ptr<Shape> sphere = std::make_shared<Sphere>(
+        &id, &id, true /* reverse orientation */, 1, -1, 1, 360);
+    std::shared_ptr<Texture<Spectrum>> half =
+        std::make_shared<ConstantTexture<Spectrum>>(Spectrum(0.5));
+    std::shared_ptr<Texture<Float>> zero =
+        std::make_shared<ConstantTexture<Float>>(0.);
+    std::shared_ptr<Material> material = std::make_shared<MixMaterial>(
+        std::make_shared<MatteMaterial>(half, zero, nullptr),
+        std::make_shared<MirrorMaterial>(half, nullptr), half);
+    std::shared_ptr<AreaLight> areaLight = std::make_shared<DiffuseAreaLight>(
+        Transform(), nullptr, Spectrum(0.5), 1, sphere);
+    std::vector<std::shared_ptr<Light>> lights;
+    lights.push_back(areaLight);
+    std::vector<std::shared_ptr<Primitive>> prims;
+    prims.push_back(std::make_shared<GeometricPrimitive>(
+        sphere, material, areaLight, MediumInterface()));
+    Scene scene(std::make_shared<BVHAccel>(prims), lights);
+
+    Point2i resolution(10, 10);
+    AnimatedTransform identity(new Transform, 0, new Transform, 1);
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+    const char *filename = "test_guided.exr";
+    Film *film = new Film(resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                          std::move(filter), 1., filename, 1.);
+    std::shared_ptr<Camera> camera = std::make_shared<PerspectiveCamera>(
+        identity, Bounds2f(Point2f(-1, -1), Point2f(1, 1)), 0., 1., 0., 10.,
+        45, film, nullptr);
+    std::shared_ptr<Sampler> sampler = std::make_shared<HaltonSampler>(
+        256, Bounds2i(Point2i(0, 0), resolution));
+    {
+        PathIntegrator integrator(8, camera, sampler, film->croppedPixelBounds,
+                                  1, "spatial", false, "", false, 32768,
+                                  4 /* guiding passes */);
+        integrator.Render(scene);
+    }
+
+    Point2i res;
+    std::unique_ptr<RGBSpectrum[]> image = ReadImage(filename, &res);
+    ASSERT_TRUE(image.get() != nullptr);
+    Float sum = 0;
+    for (int i = 0; i < res.x * res.y; ++i)
+        for (int c = 0; c < 3; ++c) sum += image[i][c];
+    EXPECT_NEAR(1, sum / (3 * res.x * res.y), .02);
+    remove(filename);
+
+    pbrtCleanup();
+}
@@ -81,3 +81,25 @@ TEST(ImageIO, RoundTripPFM) { TestRoundTrip("out.pfm", false); }
 TEST(ImageIO, RoundTripTGA) { TestRoundTrip("out.tga", true); }
 
 TEST(ImageIO, RoundTripPNG) { TestRoundTrip("out.png", true); }
+
+TEST(ImageIO, AsyncWritePFM) {
+    Point2i res(16, 29);
+    for (int i = 0; i < 4; ++i) {
+        std::unique_ptr<Float[]> pixels(new Float[3 * res[0] * res[1]]);
+        for (int j = 0; j < 3 * res[0] * res[1]; ++j) pixels[j] = i + j;
+        WriteImageAsync("async.pfm", std::move(pixels), Bounds2i({0, 0}, res),
+                        res);
+    }
+    FlushImageWrites();
+
+    // Only the last image submitted should have ended up in the file.
+    Point2i readRes;
+    auto readPixels = ReadImage("async.pfm", &readRes);
+    ASSERT_TRUE(readPixels.get() != nullptr);
+    EXPECT_EQ(readRes, res);
+    for (int j = 0; j < res[0] * res[1]; ++j) {
+        Float rgb[3];
+        readPixels[j].ToRGB(rgb);
+        for (int c = 0; c < 3; ++c) EXPECT_EQ(3 + 3 * j + c, rgb[c]);
+    }
+}
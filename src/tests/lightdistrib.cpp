@@ -0,0 +1,138 @@
+
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+
+#include "accelerators/bvh.h"
+#include "lightdistrib.h"
+#include "lights/distant.h"
+#include "lights/point.h"
+#include "lights/spot.h"
+#include "materials/matte.h"
+#include "parallel.h"
+#include "rng.h"
+#include "scene.h"
+#include "shapes/sphere.h"
+#include "textures/constant.h"
+
+using namespace pbrt;
+
+// Returns a scene with a large sphere and many point and spot lights
+// scattered inside it, plus one distant light.
+static std::unique_ptr<Scene> ManyLightScene(int nLights) {
+    static Transform id;
+    std::shared_ptr<Shape> sphere = std::make_shared<Sphere>(
+        &id, &id, true /* reverse orientation */, 10, -10, 10, 360);
+    std::shared_ptr<Texture<Spectrum>> Kd =
+        std::make_shared<ConstantTexture<Spectrum>>(Spectrum(0.5));
+    std::shared_ptr<Texture<Float>> sigma =
+        std::make_shared<ConstantTexture<Float>>(0.);
+    std::shared_ptr<Material> material =
+        std::make_shared<MatteMaterial>(Kd, sigma, nullptr);
+    std::vector<std::shared_ptr<Primitive>> prims;
+    prims.push_back(std::make_shared<GeometricPrimitive>(
+        sphere, material, nullptr, MediumInterface()));
+    std::shared_ptr<BVHAccel> bvh = std::make_shared<BVHAccel>(prims);
+
+    RNG rng;
+    std::vector<std::shared_ptr<Light>> lights;
+    for (int i = 0; i < nLights; ++i) {
+        Transform xform =
+            Translate(Vector3f(-8 + 16 * rng.UniformFloat(),
+                               -8 + 16 * rng.UniformFloat(),
+                               -8 + 16 * rng.UniformFloat()));
+        Spectrum I(.1f + rng.UniformFloat());
+        if (i % 4 == 3)
+            lights.push_back(std::make_shared<SpotLight>(
+                xform * RotateX(360 * rng.UniformFloat()), MediumInterface(),
+                I, 30.f, 20.f));
+        else
+            lights.push_back(
+                std::make_shared<PointLight>(xform, MediumInterface(), I));
+    }
+    lights.push_back(std::make_shared<DistantLight>(
+        Transform(), Spectrum(1.f), Vector3f(0, 0, 1)));
+    return std::unique_ptr<Scene>(new Scene(bvh, lights));
+}
+
+TEST(LightTreeDistribution, PdfMatchesSample) {
+    ParallelInit();
+    std::unique_ptr<Scene> scene = ManyLightScene(1000);
+    LightTreeDistribution distrib(*scene);
+    RNG rng;
+    for (int i = 0; i < 20; ++i) {
+        Point3f p(-9 + 18 * rng.UniformFloat(), -9 + 18 * rng.UniformFloat(),
+                  -9 + 18 * rng.UniformFloat());
+        // Only lights that can't illuminate the point have zero
+        // probability; subtrees of such lights may take some of the
+        // probability, so the sum can be less than one
+        Float sum = 0;
+        Interaction intr(p, 0, MediumInterface());
+        for (size_t j = 0; j < scene->lights.size(); ++j) {
+            Float pdf = distrib.Pdf(p, j);
+            sum += pdf;
+            if (pdf == 0) {
+                Vector3f wi;
+                Float lightPdf;
+                VisibilityTester vis;
+                EXPECT_TRUE(scene->lights[j]
+                                ->Sample_Li(intr, Point2f(.5f, .5f), &wi,
+                                            &lightPdf, &vis)
+                                .IsBlack());
+            }
+        }
+        EXPECT_LE(sum, 1 + 1e-3f);
+        EXPECT_GT(sum, .5f);
+
+        // Sampled lights are returned with the probability Pdf() gives
+        for (int j = 0; j < 100; ++j) {
+            Float pdf;
+            int index = distrib.Sample(p, rng.UniformFloat(), &pdf);
+            if (index < 0) continue;
+            EXPECT_GT(pdf, 0);
+            EXPECT_NEAR(pdf, distrib.Pdf(p, index), 1e-4f * pdf);
+        }
+    }
+
+    // Lookup() returns a distribution over all lights
+    Point3f p(1, 2, 3);
+    const Distribution1D *lookup = distrib.Lookup(p);
+    ASSERT_TRUE(lookup != nullptr);
+    EXPECT_EQ(scene->lights.size(), (size_t)lookup->Count());
+    ParallelCleanup();
+}
+
+TEST(SpatialLightDistribution, CacheOutlivesScene) {
+    ParallelInit();
+    Point3f p(1, 2, 3);
+    std::shared_ptr<LightDistribution> first;
+    std::vector<Float> pdfs;
+    {
+        std::unique_ptr<Scene> scene = ManyLightScene(20);
+        first = CreateLightSampleDistribution("spatial", *scene, true, "key");
+        for (size_t j = 0; j < scene->lights.size(); ++j)
+            pdfs.push_back(first->Pdf(p, j));
+    }
+
+    // A later scene with the same key gets the same distribution, which
+    // doesn't refer to the scene it was built for
+    {
+        std::unique_ptr<Scene> scene = ManyLightScene(20);
+        std::shared_ptr<LightDistribution> cached =
+            CreateLightSampleDistribution("spatial", *scene, true, "key");
+        EXPECT_EQ(first, cached);
+        for (size_t j = 0; j < pdfs.size(); ++j)
+            EXPECT_EQ(pdfs[j], cached->Pdf(p, j));
+        EXPECT_EQ(pdfs.size(), (size_t)cached->Lookup(p)->Count());
+    }
+
+    // Once the cache is cleared, the same key computes a new one
+    ClearLightSampleDistributionCache();
+    {
+        std::unique_ptr<Scene> scene = ManyLightScene(20);
+        std::shared_ptr<LightDistribution> fresh =
+            CreateLightSampleDistribution("spatial", *scene, true, "key");
+        EXPECT_NE(first, fresh);
+    }
+    ClearLightSampleDistributionCache();
+    ParallelCleanup();
+}
@@ -0,0 +1,82 @@
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+
+#include "api.h"
+#include "accelerators/bvh.h"
+#include "cameras/perspective.h"
+#include "filters/box.h"
+#include "imageio.h"
+#include "integrators/sppm.h"
+#include "lights/point.h"
+#include "materials/matte.h"
+#include "scene.h"
+#include "shapes/sphere.h"
+#include "textures/constant.h"
+
+using namespace pbrt;
+
+// Renders the inside of a unit sphere with Kd = 0.5, lit by a point light
+// with I = Pi at its center, with SPPM; with global illumination the
+// radiance is 1 everywhere, half of it from the indirect light that SPPM
+// gathers from photons.  Returns the average of the image.
+static Float RenderSphere(bool usePhotonMap) {
+    static Transform id;
+    std::shared_ptr<Shape> sphere = std::make_shared<Sphere>(
+        &id, &id, true /* reverse orientation */, 1, -1, 1, 360);
+    std::shared_ptr<Texture<Spectrum>> Kd =
+        std::make_shared<ConstantTexture<Spectrum>>(Spectrum(0.5));
+    std::shared_ptr<Texture<Float>> sigma =
+        std::make_shared<ConstantTexture<Float>>(0.);
+    std::shared_ptr<Material> material =
+        std::make_shared<MatteMaterial>(Kd, sigma, nullptr);
+    std::vector<std::shared_ptr<Primitive>> prims;
+    prims.push_back(std::make_shared<GeometricPrimitive>(
+        sphere, material, nullptr, MediumInterface()));
+    std::vector<std::shared_ptr<Light>> lights;
+    lights.push_back(
+        std::make_shared<PointLight>(Transform(), nullptr, Spectrum(Pi)));
+    Scene scene(std::make_shared<BVHAccel>(prims), lights);
+
+    Point2i resolution(10, 10);
+    AnimatedTransform identity(new Transform, 0, new Transform, 1);
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+    const char *filename = "test_sppm.exr";
+    Film *film = new Film(resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                          std::move(filter), 1., filename, 1.);
+    std::shared_ptr<const Camera> camera = std::make_shared<PerspectiveCamera>(
+        identity, Bounds2f(Point2f(-1, -1), Point2f(1, 1)), 0., 1., 0., 10.,
+        45, film, nullptr);
+    {
+        // The progressive render traces as many photons in total as the
+        // stored map holds
+        SPPMIntegrator integrator(camera, 16 /* iterations */,
+                                  5000 /* photons per iteration */, 8, .05f,
+                                  1 << 30, usePhotonMap, "",
+                                  16 * 5000 /* stored photons */);
+        integrator.Render(scene);
+    }
+
+    Point2i res;
+    std::unique_ptr<RGBSpectrum[]> image = ReadImage(filename, &res);
+    EXPECT_TRUE(image.get() != nullptr);
+    if (!image) return 0;
+    Float sum = 0;
+    for (int i = 0; i < res.x * res.y; ++i)
+        for (int c = 0; c < 3; ++c) sum += image[i][c];
+    remove(filename);
+    return sum / (3 * res.x * res.y);
+}
+
+TEST(SPPM, StoredPhotonMapMatchesProgressive) {
+    Options options;
+    options.quiet = true;
+    pbrtInit(options);
+
+    Float progressive = RenderSphere(false);
+    Float stored = RenderSphere(true);
+    EXPECT_NEAR(1, progressive, .02);
+    EXPECT_NEAR(1, stored, .02);
+    EXPECT_NEAR(progressive, stored, .02);
+
+    pbrtCleanup();
+}
@@ -0,0 +1,163 @@
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+
+#include "api.h"
+#include "accelerators/bvh.h"
+#include "cameras/perspective.h"
+#include "filters/box.h"
+#include "imageio.h"
+#include "integrators/vpl.h"
+#include "materials/matte.h"
+#include "rng.h"
+#include "samplers/random.h"
+#include "scene.h"
+#include "shapes/disk.h"
+#include "textures/constant.h"
+#include <cstdio>
+
+using namespace pbrt;
+
+TEST(VPL, ReadFile) {
+    char filename[L_tmpnam];
+#ifdef __GNUG__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+#endif  // __GNUG__
+    std::tmpnam(filename);
+#ifdef __GNUG__
+#pragma GCC diagnostic pop
+#endif  // __GNUG__
+    FILE *f = fopen(filename, "w");
+    ASSERT_TRUE(f);
+    fprintf(f,
+            "nvpls 2\n"
+            "pos 4.6442 0 -1.963826\n"
+            "nor 0 0 2\n"
+            "col 0.5 0.25 0.125\n"
+            "scale 27.385206\n"
+            "pos -1 2 3\n"
+            "nor 1 0 0\n"
+            "col 1 1 1\n"
+            "scale 1\n");
+    ASSERT_EQ(0, fclose(f));
+
+    std::vector<VPL> vpls;
+    ASSERT_TRUE(ReadVPLFile(filename, &vpls));
+    ASSERT_EQ(2, vpls.size());
+    EXPECT_FLOAT_EQ(4.6442, vpls[0].p.x);
+    EXPECT_FLOAT_EQ(-1.963826, vpls[0].p.z);
+    EXPECT_EQ(Normal3f(0, 0, 1), vpls[0].n);
+    Float rgb[3];
+    vpls[0].I.ToRGB(rgb);
+    EXPECT_FLOAT_EQ(.5, rgb[0]);
+    EXPECT_FLOAT_EQ(.125, rgb[2]);
+    EXPECT_EQ(Point3f(-1, 2, 3), vpls[1].p);
+
+    // A truncated file is an error
+    f = fopen(filename, "w");
+    ASSERT_TRUE(f);
+    fprintf(f, "nvpls 2\npos 1 2 3\nnor 0 0 1\ncol 1 1 1\nscale 1\npos 0\n");
+    ASSERT_EQ(0, fclose(f));
+    std::vector<VPL> truncated;
+    EXPECT_FALSE(ReadVPLFile(filename, &truncated));
+    remove(filename);
+}
+
+// Renders a matte floor at z = 5, partly shadowed by a matte disk at
+// z = 4, lit only by VPLs between the disk and the camera at the origin,
+// and returns the image.  All of the VPLs are in front of every visible
+// surface, so every node of the light tree has a nonzero error bound.
+static std::vector<Float> RenderVPLs(const std::vector<VPL> &vpls,
+                                     bool lightcuts, Float rrThreshold,
+                                     int spp) {
+    static Transform id;
+    std::shared_ptr<Texture<Spectrum>> Kd =
+        std::make_shared<ConstantTexture<Spectrum>>(Spectrum(0.5));
+    std::shared_ptr<Texture<Float>> sigma =
+        std::make_shared<ConstantTexture<Float>>(0.);
+    std::shared_ptr<Material> material =
+        std::make_shared<MatteMaterial>(Kd, sigma, nullptr);
+    std::vector<std::shared_ptr<Primitive>> prims;
+    prims.push_back(std::make_shared<GeometricPrimitive>(
+        std::make_shared<Disk>(&id, &id, false, 5, 10, 0, 360), material,
+        nullptr, MediumInterface()));
+    prims.push_back(std::make_shared<GeometricPrimitive>(
+        std::make_shared<Disk>(&id, &id, false, 4, 1, 0, 360), material,
+        nullptr, MediumInterface()));
+    Scene scene(std::make_shared<BVHAccel>(prims),
+                std::vector<std::shared_ptr<Light>>());
+
+    Point2i resolution(16, 16);
+    AnimatedTransform identity(new Transform, 0, new Transform, 1);
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+    const char *filename = "test_vpl.exr";
+    Film *film = new Film(resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                          std::move(filter), 1., filename, 1.);
+    std::shared_ptr<const Camera> camera = std::make_shared<PerspectiveCamera>(
+        identity, Bounds2f(Point2f(-1, -1), Point2f(1, 1)), 0., 1., 0., 10.,
+        45, film, nullptr);
+    std::shared_ptr<Sampler> sampler = std::make_shared<RandomSampler>(spp);
+    {
+        VPLIntegrator integrator(
+            5, 0 /* light paths */, 1 /* sets */, 5, 10.f, rrThreshold,
+            lightcuts, 0.f /* cut error */, 1 << 20 /* max cut size */, vpls,
+            camera, sampler, film->GetSampleBounds());
+        integrator.Render(scene);
+    }
+
+    Point2i res;
+    std::unique_ptr<RGBSpectrum[]> image = ReadImage(filename, &res);
+    EXPECT_TRUE(image.get() != nullptr);
+    std::vector<Float> values;
+    if (!image) return values;
+    for (int i = 0; i < res.x * res.y; ++i) values.push_back(image[i].y());
+    remove(filename);
+    return values;
+}
+
+static Float Average(const std::vector<Float> &v) {
+    Float sum = 0;
+    for (Float x : v) sum += x;
+    return v.empty() ? 0 : sum / v.size();
+}
+
+TEST(VPL, EstimatorsMatchExactSum) {
+    Options options;
+    options.quiet = true;
+    pbrtInit(options);
+
+    RNG rng;
+    std::vector<VPL> vpls;
+    for (int i = 0; i < 200; ++i) {
+        Float rgb[3] = {rng.UniformFloat(), rng.UniformFloat(),
+                        rng.UniformFloat()};
+        VPL vpl;
+        vpl.p = Point3f(-3 + 6 * rng.UniformFloat(),
+                        -3 + 6 * rng.UniformFloat(),
+                        2.5f + rng.UniformFloat());
+        vpl.n = Normal3f(0, 0, 1);
+        vpl.pError = Vector3f(0, 0, 0);
+        vpl.I = Spectrum::FromRGB(rgb);
+        vpls.push_back(vpl);
+    }
+
+    // Without Russian roulette, EstimateAll() gives the exact sum over
+    // the VPLs, shadows included
+    std::vector<Float> exact = RenderVPLs(vpls, false, 0, 4);
+    ASSERT_EQ(16 * 16, exact.size());
+    Float exactAverage = Average(exact);
+    EXPECT_GT(exactAverage, .01);
+
+    // With no cut error allowed, the lightcut is made of all the leaves
+    std::vector<Float> cut = RenderVPLs(vpls, true, 0, 4);
+    ASSERT_EQ(exact.size(), cut.size());
+    for (size_t i = 0; i < exact.size(); ++i)
+        EXPECT_NEAR(exact[i], cut[i], 1e-4f * exact[i] + 1e-6f) << i;
+
+    // Russian roulette on the faint VPLs only adds noise
+    std::vector<Float> rr = RenderVPLs(vpls, false, .01f, 64);
+    ASSERT_EQ(exact.size(), rr.size());
+    EXPECT_NEAR(1, Average(rr) / exactAverage, .01);
+
+    pbrtCleanup();
+}